@@ -0,0 +1,131 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2025, Hongzhen Luo
+ */
+
+#include "internal.h"
+#include "disk.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+static struct option long_options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"size", required_argument, NULL, 's'},
+        {"rounds", required_argument, NULL, 'r'},
+        {0, 0, 0, 0}
+};
+
+struct numbfs_bench_cfg {
+        /* bytes of bitmap counted per round */
+        long long size;
+        int rounds;
+};
+
+static void numbfs_bench_usage(void)
+{
+        printf("Usage: numbfs_bench [OPTIONS]\n");
+        printf("Measure the throughput of the bitmap counting kernels.\n");
+        printf("\n");
+        printf("Gerneral options:\n");
+        printf(" --help|-h              display this help and exit\n");
+        printf(" --size=X|-s X          bitmap size in MiB, 64 by default\n");
+        printf(" --rounds=X|-r X        rounds per kernel, 16 by default\n");
+}
+
+static void numbfs_bench_parse_args(int argc, char **argv,
+                                    struct numbfs_bench_cfg *cfg)
+{
+        int opt;
+
+        while ((opt = getopt_long(argc, argv, "hs:r:", long_options, NULL)) != -1) {
+                switch (opt) {
+                case 'h':
+                        numbfs_bench_usage();
+                        exit(0);
+                case 's':
+                        cfg->size = atoll(optarg) << 20;
+                        if (cfg->size <= 0) {
+                                fprintf(stderr, "invalid bitmap size: %s\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'r':
+                        cfg->rounds = atoi(optarg);
+                        if (cfg->rounds <= 0) {
+                                fprintf(stderr, "invalid rounds: %s\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                default:
+                        numbfs_bench_usage();
+                        exit(1);
+                }
+        }
+}
+
+static double numbfs_bench_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+        struct numbfs_bench_cfg cfg = {
+                .size = 64 << 20,
+                .rounds = 16,
+        };
+        long long expect = -1, cnt;
+        double start, elapsed;
+        unsigned char *map;
+        long long pos;
+        int kernel, i;
+
+        numbfs_bench_parse_args(argc, argv, &cfg);
+
+        map = malloc(cfg.size);
+        if (!map) {
+                fprintf(stderr, "failed to allocate %lld bytes\n", cfg.size);
+                return 1;
+        }
+        srand(time(NULL));
+        for (pos = 0; pos < cfg.size; pos++)
+                map[pos] = rand();
+
+        printf("Bitmap counting, %lld MiB x %d rounds\n", cfg.size >> 20, cfg.rounds);
+        for (kernel = 0; kernel < NUMBFS_WEIGHT_MAX; kernel++) {
+                if (numbfs_bitmap_set_kernel(kernel) < 0) {
+                        printf("    %-20s not supported\n",
+                               numbfs_bitmap_kernel_name(kernel));
+                        continue;
+                }
+
+                /* warm up, and make sure all the kernels agree */
+                cnt = numbfs_bitmap_weight(map, cfg.size);
+                if (expect >= 0 && cnt != expect) {
+                        fprintf(stderr, "%s counted %lld bits, expected %lld\n",
+                                numbfs_bitmap_kernel_name(kernel), cnt, expect);
+                        free(map);
+                        return 1;
+                }
+                expect = cnt;
+
+                start = numbfs_bench_now();
+                for (i = 0; i < cfg.rounds; i++)
+                        cnt += numbfs_bitmap_weight(map, cfg.size);
+                elapsed = numbfs_bench_now() - start;
+                printf("    %-20s %8.2f GB/s\n", numbfs_bitmap_kernel_name(kernel),
+                       elapsed > 0 ? cfg.size * cfg.rounds / elapsed / 1e9 : 0);
+        }
+        printf("    default kernel:      %s\n",
+               numbfs_bitmap_kernel_name(numbfs_bitmap_set_kernel(-1)));
+
+        free(map);
+        return 0;
+}
@@ -0,0 +1,1803 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2025, Hongzhen Luo
+ */
+
+#include "check.h"
+#include "internal.h"
+#include "disk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#define NUMBFS_CHECK_REFS_MAX   0xFFFF
+/* where the repair reconnects the orphans, made by mkfs under the root */
+#define NUMBFS_LOSTFOUND        "lost+found"
+
+/* the counters of an inode, packed */
+struct numbfs_check_inode {
+        /* dirents pointing to a file, or subdirectories of a directory */
+        __u16 links;
+        /* the parent of a directory in the @reached bitmap */
+        __u16 parent;
+};
+
+/* a data block with more than one owner */
+struct numbfs_check_shared {
+        int blk;
+        int refs;
+};
+
+/* a live dirent, matched against the directory index */
+struct numbfs_check_dirent {
+        int pnid;
+        int slot;
+        int nid;
+        bool indexed;
+};
+
+struct numbfs_check_ctx {
+        struct numbfs_superblock_info *sbi;
+        struct numbfs_check_result *res;
+        int jobs;
+        /* bitmap bits set in the range scanned */
+        int used;
+        /* both bitmaps and the inode table, each read once */
+        char *ibitmap, *bbitmap;
+        struct numbfs_inode *itable;
+        int itable_blocks;
+        /* the counters of each inode, and the directories reached by the walk */
+        struct numbfs_check_inode *inodes;
+        char *reached;
+        /* inodes released by the repair */
+        char *dropped;
+        /* the lost+found directory under the root, -1 if there is none */
+        int lostfound;
+        /*
+         * the data zone is checked in windows of @window blocks, the block
+         * bitmap and the owners of [@lo, @hi) are in memory: a bit for the
+         * owned blocks, and another for the shared ones, counted in @shared
+         */
+        int window, lo, hi;
+        char *owned, *many;
+        struct numbfs_check_shared *shared;
+        int nr_shared;
+        /* references to the owned blocks, @shared is built from them */
+        int *extra;
+        int nr_extra, max_extra;
+        /* references to the later windows, one file per window */
+        FILE **spill;
+        /* block bitmap bits set, as found and once repaired */
+        int used_blocks, kept_blocks;
+        /* xattr blocks, which count their owners in the block header */
+        int *xblocks;
+        int nr_xblocks, max_xblocks;
+        struct numbfs_check_dirent *dents;
+        int nr_dents, max_dents;
+        /* blocks changed by the repair, sorted by block number */
+        struct numbfs_check_stage **stages;
+        int nr_stages, max_stages;
+};
+
+/* a block staged by the repair, with its original content */
+struct numbfs_check_stage {
+        /* first, so that the on-disk structures in them are aligned */
+        char old[BYTES_PER_BLOCK];
+        char buf[BYTES_PER_BLOCK];
+        int blkno;
+};
+
+/* scan [@start, @end) of the inodes or the data blocks */
+typedef int (*numbfs_check_fn)(struct numbfs_check_ctx *ctx, int start, int end);
+
+/*
+ * a worker has a copy of the context sharing the loaded tables, but
+ * with its own counters, problems and xattr blocks, merged at the end
+ */
+struct numbfs_check_worker {
+        pthread_t thread;
+        struct numbfs_check_ctx ctx;
+        struct numbfs_check_result res;
+        numbfs_check_fn fn;
+        int start, end;
+        int err;
+};
+
+static const char *numbfs_check_names[NUMBFS_CHECK_MAX] = {
+        [NUMBFS_CHECK_FREE_INODES]      = "free inodes",
+        [NUMBFS_CHECK_FREE_BLOCKS]      = "free blocks",
+        [NUMBFS_CHECK_IBITMAP]          = "inode bitmap",
+        [NUMBFS_CHECK_BBITMAP]          = "block bitmap",
+        [NUMBFS_CHECK_MODE]             = "mode",
+        [NUMBFS_CHECK_SIZE]             = "size",
+        [NUMBFS_CHECK_BLOCK]            = "block address",
+        [NUMBFS_CHECK_REFCOUNT]         = "refcount",
+        [NUMBFS_CHECK_DOT]              = "dot entry",
+        [NUMBFS_CHECK_DIRENT]           = "dirent",
+        [NUMBFS_CHECK_DTYPE]            = "dirent type",
+        [NUMBFS_CHECK_DIRLINK]          = "directory link",
+        [NUMBFS_CHECK_NLINK]            = "nlink",
+        [NUMBFS_CHECK_ORPHAN]           = "orphan",
+        [NUMBFS_CHECK_DINDEX]           = "directory index",
+};
+
+const char *numbfs_check_name(int type)
+{
+        if (type < 0 || type >= NUMBFS_CHECK_MAX)
+                return "unknown";
+        return numbfs_check_names[type];
+}
+
+int numbfs_check_describe(const struct numbfs_check_problem *p,
+                          char *buf, int size)
+{
+        switch (p->type) {
+        case NUMBFS_CHECK_FREE_INODES:
+        case NUMBFS_CHECK_FREE_BLOCKS:
+                return snprintf(buf, size, "superblock has %lld free %s, expected %lld",
+                                p->found, p->type == NUMBFS_CHECK_FREE_INODES ?
+                                "inodes" : "blocks", p->expect);
+        case NUMBFS_CHECK_IBITMAP:
+                return snprintf(buf, size, "inode@%d has bitmap bit %lld, expected %lld",
+                                p->nid, p->found, p->expect);
+        case NUMBFS_CHECK_BBITMAP:
+                return snprintf(buf, size, "block@%d has bitmap bit %lld, expected %lld",
+                                p->blk, p->found, p->expect);
+        case NUMBFS_CHECK_MODE:
+                return snprintf(buf, size, "inode@%d has unknown mode 0%llo",
+                                p->nid, p->found);
+        case NUMBFS_CHECK_SIZE:
+                if (p->blk < 0)
+                        return snprintf(buf, size, "inode@%d has invalid size %lld",
+                                        p->nid, p->found);
+                return snprintf(buf, size, "inode@%d maps block %d beyond its size %lld",
+                                p->nid, p->blk, p->found);
+        case NUMBFS_CHECK_BLOCK:
+                if (p->nid < 0)
+                        return snprintf(buf, size, "metadata block %lld is out of the data zone",
+                                        p->found);
+                return snprintf(buf, size, "inode@%d points to block %lld out of the data zone",
+                                p->nid, p->found);
+        case NUMBFS_CHECK_REFCOUNT:
+                if (p->found < 0)
+                        return snprintf(buf, size, "xattr block@%d has %lld owners and a header without the magic",
+                                        p->blk, p->expect);
+                return snprintf(buf, size, "block@%d has %lld owners, %lld recorded",
+                                p->blk, p->expect, p->found);
+        case NUMBFS_CHECK_DOT:
+                return snprintf(buf, size, "directory@%d has \"%s\" pointing to inode@%lld, expected inode@%lld",
+                                p->nid, p->blk ? ".." : ".", p->found, p->expect);
+        case NUMBFS_CHECK_DIRENT:
+                return snprintf(buf, size, "directory@%d has dirent %d pointing to free inode@%lld",
+                                p->nid, p->blk, p->found);
+        case NUMBFS_CHECK_DTYPE:
+                return snprintf(buf, size, "directory@%d has dirent %d of type %lld, expected %lld",
+                                p->nid, p->blk, p->found, p->expect);
+        case NUMBFS_CHECK_DIRLINK:
+                return snprintf(buf, size, "directory@%d is linked from directory@%lld and directory@%lld",
+                                p->nid, p->expect, p->found);
+        case NUMBFS_CHECK_NLINK:
+                return snprintf(buf, size, "inode@%d has link count %lld, expected %lld",
+                                p->nid, p->found, p->expect);
+        case NUMBFS_CHECK_ORPHAN:
+                return snprintf(buf, size, "inode@%d is allocated but not reachable from the root",
+                                p->nid);
+        case NUMBFS_CHECK_DINDEX:
+                if (p->found < 0)
+                        return snprintf(buf, size, "directory@%d has dirent %d missing from the index",
+                                        p->nid, p->blk);
+                if (p->expect < 0)
+                        return snprintf(buf, size, "directory@%d has an index entry of free slot %d",
+                                        p->nid, p->blk);
+                return snprintf(buf, size, "directory@%d has an index entry of slot %d pointing to inode@%lld, expected inode@%lld",
+                                p->nid, p->blk, p->found, p->expect);
+        }
+        return snprintf(buf, size, "unknown problem %d", p->type);
+}
+
+static void *numbfs_check_grow(void *array, int *max, int size)
+{
+        void *p;
+        int nr = *max ? *max * 2 : 64;
+
+        p = realloc(array, (size_t)nr * size);
+        if (p)
+                *max = nr;
+        return p;
+}
+
+static int numbfs_check_push(int **array, int *nr, int *max, int val)
+{
+        int *p;
+
+        if (*nr == *max) {
+                p = numbfs_check_grow(*array, max, sizeof(*p));
+                if (!p)
+                        return -ENOMEM;
+                *array = p;
+        }
+        (*array)[(*nr)++] = val;
+        return 0;
+}
+
+static int numbfs_check_report(struct numbfs_check_ctx *ctx, int type, int nid,
+                               int blk, long long expect, long long found)
+{
+        struct numbfs_check_result *res = ctx->res;
+        struct numbfs_check_problem *p;
+
+        if (res->nr_problems == res->max_problems) {
+                p = numbfs_check_grow(res->problems, &res->max_problems, sizeof(*p));
+                if (!p)
+                        return -ENOMEM;
+                res->problems = p;
+        }
+
+        p = &res->problems[res->nr_problems++];
+        p->type = type;
+        p->nid = nid;
+        p->blk = blk;
+        p->expect = expect;
+        p->found = found;
+        p->fixed = false;
+        return 0;
+}
+
+static inline bool numbfs_check_bit(const char *map, int nr)
+{
+        return map[nr / BITS_PER_BYTE] & (1 << (nr % BITS_PER_BYTE));
+}
+
+static inline void numbfs_check_mark(char *map, int nr, bool set)
+{
+        if (set)
+                map[nr / BITS_PER_BYTE] |= 1 << (nr % BITS_PER_BYTE);
+        else
+                map[nr / BITS_PER_BYTE] &= ~(1 << (nr % BITS_PER_BYTE));
+}
+
+static int numbfs_check_cmp_int(const void *a, const void *b)
+{
+        return *(const int*)a - *(const int*)b;
+}
+
+/* whether @nid is allocated and in the initialized part of the inode table */
+static bool numbfs_check_inode_used(struct numbfs_check_ctx *ctx, int nid)
+{
+        return nid >= 0 && nid < ctx->sbi->total_inodes &&
+               numbfs_check_bit(ctx->ibitmap, nid) &&
+               nid / (int)NUMBFS_NODES_PER_BLOCK < ctx->itable_blocks;
+}
+
+/* whether @mode is of an inode type the filesystem knows */
+static bool numbfs_check_mode_valid(int mode)
+{
+        return S_ISDIR(mode) || S_ISREG(mode) || S_ISLNK(mode) || S_ISCHR(mode) ||
+               S_ISBLK(mode) || S_ISFIFO(mode) || S_ISSOCK(mode);
+}
+
+/*
+ * own the block @blk of the window, the inode workers may share a bitmap
+ * byte so the bits are set atomically, and each worker keeps its extra
+ * references
+ */
+static int numbfs_check_own(struct numbfs_check_ctx *ctx, int blk)
+{
+        int nr = blk - ctx->lo;
+        char bit = 1 << (nr % BITS_PER_BYTE);
+
+        if (!(__atomic_fetch_or(&ctx->owned[nr / BITS_PER_BYTE], bit,
+                                __ATOMIC_RELAXED) & bit))
+                return 0;
+        __atomic_fetch_or(&ctx->many[nr / BITS_PER_BYTE], bit, __ATOMIC_RELAXED);
+        return numbfs_check_push(&ctx->extra, &ctx->nr_extra, &ctx->max_extra, blk);
+}
+
+/* count the owners of the shared blocks of the window from the extra references */
+static int numbfs_check_count(struct numbfs_check_ctx *ctx)
+{
+        int i;
+
+        free(ctx->shared);
+        ctx->nr_shared = 0;
+        ctx->shared = malloc(max(ctx->nr_extra, 1) * sizeof(*ctx->shared));
+        if (!ctx->shared)
+                return -ENOMEM;
+
+        if (ctx->nr_extra)
+                qsort(ctx->extra, ctx->nr_extra, sizeof(int), numbfs_check_cmp_int);
+        for (i = 0; i < ctx->nr_extra; i++) {
+                if (!ctx->nr_shared || ctx->shared[ctx->nr_shared - 1].blk != ctx->extra[i]) {
+                        ctx->shared[ctx->nr_shared].blk = ctx->extra[i];
+                        ctx->shared[ctx->nr_shared++].refs = 1;
+                }
+                ctx->shared[ctx->nr_shared - 1].refs++;
+        }
+        free(ctx->extra);
+        ctx->extra = NULL;
+        ctx->nr_extra = ctx->max_extra = 0;
+        return 0;
+}
+
+static struct numbfs_check_shared *numbfs_check_find_shared(struct numbfs_check_ctx *ctx,
+                                                            int blk)
+{
+        return bsearch(&blk, ctx->shared, ctx->nr_shared, sizeof(*ctx->shared),
+                       numbfs_check_cmp_int);
+}
+
+/* owners of the block @blk of the window, once counted */
+static int numbfs_check_refs(struct numbfs_check_ctx *ctx, int blk)
+{
+        struct numbfs_check_shared *s;
+
+        if (!numbfs_check_bit(ctx->owned, blk - ctx->lo))
+                return 0;
+        if (!numbfs_check_bit(ctx->many, blk - ctx->lo))
+                return 1;
+        s = numbfs_check_find_shared(ctx, blk);
+        return s ? min(s->refs, NUMBFS_CHECK_REFS_MAX) : 1;
+}
+
+/* drop an owner of the block @blk of the window */
+static void numbfs_check_unref(struct numbfs_check_ctx *ctx, int blk)
+{
+        struct numbfs_check_shared *s;
+        int nr = blk - ctx->lo;
+
+        if (!numbfs_check_bit(ctx->many, nr)) {
+                numbfs_check_mark(ctx->owned, nr, false);
+                return;
+        }
+        s = numbfs_check_find_shared(ctx, blk);
+        if (!s || s->refs >= NUMBFS_CHECK_REFS_MAX)
+                return;
+        if (--s->refs == 1)
+                numbfs_check_mark(ctx->many, nr, false);
+}
+
+/* take a reference of the data block @blk on behalf of @nid */
+static int numbfs_check_ref(struct numbfs_check_ctx *ctx, int nid, int blk)
+{
+        if (blk < 0 || blk >= ctx->sbi->data_blocks)
+                return numbfs_check_report(ctx, NUMBFS_CHECK_BLOCK, nid, -1, -1, blk);
+
+        if (blk >= ctx->lo && blk < ctx->hi)
+                return numbfs_check_own(ctx, blk);
+        /* counted when its window is checked, stdio locks the file */
+        if (fwrite(&blk, sizeof(blk), 1, ctx->spill[blk / ctx->window]) != 1)
+                return -EIO;
+        return 0;
+}
+
+static int numbfs_check_extent(struct numbfs_check_ctx *ctx, int start, int nr)
+{
+        int i, err;
+
+        for (i = 0; i < nr; i++) {
+                err = numbfs_check_ref(ctx, -1, start + i);
+                if (err)
+                        return err;
+        }
+        return 0;
+}
+
+/*
+ * memory of the tables sized by the inodes, and of a window of @window
+ * blocks; the dirents, the extra references and the xattr blocks, which
+ * grow with what the image holds, are not counted
+ */
+static long long numbfs_check_mem(struct numbfs_superblock_info *sbi, int window)
+{
+        long long mem;
+
+        mem = (long long)(sbi->inode_start - sbi->ibitmap_start) * BYTES_PER_BLOCK;
+        mem += (long long)(sbi->bbitmap_start - sbi->inode_start) * BYTES_PER_BLOCK;
+        /* the counters, the reached and dropped bitmaps and the walk stack */
+        mem += (long long)sbi->total_inodes * (sizeof(struct numbfs_check_inode) + sizeof(int));
+        mem += 2 * DIV_ROUND_UP(sbi->total_inodes, BITS_PER_BYTE);
+        /* the block bitmap, owned and shared bits */
+        return mem + 3LL * window / BITS_PER_BYTE;
+}
+
+long long numbfs_check_min_mem(struct numbfs_superblock_info *sbi)
+{
+        return numbfs_check_mem(sbi, NUMBFS_BLOCKS_PER_BLOCK);
+}
+
+/*
+ * allocate the tables, the windows as large as @max_mem allows, and load
+ * the inode bitmap; the inode table and the block bitmap are loaded by the
+ * workers scanning them
+ */
+static int numbfs_check_load_all(struct numbfs_check_ctx *ctx, long long max_mem)
+{
+        struct numbfs_superblock_info *sbi = ctx->sbi;
+        long long chunks;
+        int i, nr_windows;
+
+        ctx->itable_blocks = sbi->bbitmap_start - sbi->inode_start;
+        if (sbi->feature & NUMBFS_FEATURE_LAZY_ITABLE)
+                ctx->itable_blocks = min(ctx->itable_blocks, sbi->itable_init);
+
+        ctx->window = round_up(max(sbi->data_blocks, 1), (int)NUMBFS_BLOCKS_PER_BLOCK);
+        if (max_mem) {
+                if (max_mem < numbfs_check_min_mem(sbi))
+                        return -ENOMEM;
+                chunks = (max_mem - numbfs_check_mem(sbi, 0)) /
+                         (numbfs_check_min_mem(sbi) - numbfs_check_mem(sbi, 0));
+                if (chunks * NUMBFS_BLOCKS_PER_BLOCK < ctx->window)
+                        ctx->window = chunks * NUMBFS_BLOCKS_PER_BLOCK;
+        }
+        ctx->hi = min(ctx->window, sbi->data_blocks);
+
+        nr_windows = DIV_ROUND_UP(max(sbi->data_blocks, 1), ctx->window);
+        ctx->res->passes = nr_windows;
+        if (nr_windows > 1) {
+                ctx->spill = calloc(nr_windows, sizeof(*ctx->spill));
+                if (!ctx->spill)
+                        return -ENOMEM;
+                for (i = 1; i < nr_windows; i++) {
+                        ctx->spill[i] = tmpfile();
+                        if (!ctx->spill[i])
+                                return -errno;
+                }
+        }
+
+        ctx->ibitmap = malloc((size_t)(sbi->inode_start - sbi->ibitmap_start) *
+                              BYTES_PER_BLOCK);
+        ctx->bbitmap = malloc(ctx->window / BITS_PER_BYTE);
+        ctx->owned = calloc(ctx->window / BITS_PER_BYTE, 1);
+        ctx->many = calloc(ctx->window / BITS_PER_BYTE, 1);
+        ctx->itable = calloc((size_t)ctx->itable_blocks, BYTES_PER_BLOCK);
+        ctx->inodes = calloc(sbi->total_inodes, sizeof(*ctx->inodes));
+        ctx->reached = calloc(DIV_ROUND_UP(sbi->total_inodes, BITS_PER_BYTE), 1);
+        if (!ctx->ibitmap || !ctx->bbitmap || !ctx->owned || !ctx->many ||
+            (!ctx->itable && ctx->itable_blocks) || !ctx->inodes || !ctx->reached)
+                return -ENOMEM;
+
+        return numbfs_read_blocks(sbi, ctx->ibitmap, sbi->ibitmap_start,
+                                  sbi->inode_start - sbi->ibitmap_start);
+}
+
+/* count the owners of the window starting at @lo from its spilled references */
+static int numbfs_check_load_window(struct numbfs_check_ctx *ctx, int lo)
+{
+        FILE *fp = ctx->spill[lo / ctx->window];
+        int refs[1024];
+        int i, nr, err = 0;
+
+        ctx->lo = lo;
+        ctx->hi = min(lo + ctx->window, ctx->sbi->data_blocks);
+        memset(ctx->owned, 0, ctx->window / BITS_PER_BYTE);
+        memset(ctx->many, 0, ctx->window / BITS_PER_BYTE);
+
+        if (fflush(fp) || fseek(fp, 0, SEEK_SET))
+                return -errno;
+        while (!err && (nr = fread(refs, sizeof(*refs), ARRAY_SIZE(refs), fp)) > 0)
+                for (i = 0; !err && i < nr; i++)
+                        err = numbfs_check_own(ctx, refs[i]);
+        if (!err && ferror(fp))
+                err = -EIO;
+
+        /* the disk space is released right away */
+        fclose(fp);
+        ctx->spill[lo / ctx->window] = NULL;
+        return err;
+}
+
+static void *numbfs_check_worker_fn(void *arg)
+{
+        struct numbfs_check_worker *w = arg;
+
+        w->err = w->fn(&w->ctx, w->start, w->end);
+        return NULL;
+}
+
+/* append the results of @w to @ctx */
+static int numbfs_check_merge(struct numbfs_check_ctx *ctx,
+                              struct numbfs_check_worker *w, bool collect)
+{
+        struct numbfs_check_result *res = ctx->res;
+        struct numbfs_check_problem *p;
+        int i, err;
+
+        for (i = 0; i < w->res.nr_problems; i++) {
+                p = &w->res.problems[i];
+                err = numbfs_check_report(ctx, p->type, p->nid, p->blk,
+                                          p->expect, p->found);
+                if (err)
+                        return err;
+        }
+        for (i = 0; collect && i < w->ctx.nr_xblocks; i++) {
+                err = numbfs_check_push(&ctx->xblocks, &ctx->nr_xblocks,
+                                        &ctx->max_xblocks, w->ctx.xblocks[i]);
+                if (err)
+                        return err;
+        }
+        for (i = 0; collect && i < w->ctx.nr_extra; i++) {
+                err = numbfs_check_push(&ctx->extra, &ctx->nr_extra,
+                                        &ctx->max_extra, w->ctx.extra[i]);
+                if (err)
+                        return err;
+        }
+
+        res->dirs += w->res.dirs;
+        res->files += w->res.files;
+        res->symlinks += w->res.symlinks;
+        res->others += w->res.others;
+        res->blocks += w->res.blocks;
+        ctx->used += w->ctx.used;
+        return 0;
+}
+
+/*
+ * run @fn over [@start, @end) split into ranges aligned to @align, one per
+ * worker, the results are merged in range order so that they don't
+ * depend on the number of jobs; with @collect the workers take their own
+ * xattr blocks and extra references, otherwise they share the ones of
+ * @ctx read-only
+ */
+static int numbfs_check_parallel(struct numbfs_check_ctx *ctx, int start, int end,
+                                 int align, numbfs_check_fn fn, bool collect)
+{
+        struct numbfs_check_worker *workers, *w;
+        int i, per, nr, nr_workers, started, err = 0;
+
+        ctx->used = 0;
+        nr = end - start;
+        if (nr <= 0)
+                return 0;
+
+        per = round_up(DIV_ROUND_UP(nr, max(ctx->jobs, 1)), align);
+        nr_workers = DIV_ROUND_UP(nr, per);
+        workers = calloc(nr_workers, sizeof(*workers));
+        if (!workers)
+                return -ENOMEM;
+
+        for (i = 0; i < nr_workers; i++) {
+                w = &workers[i];
+                w->ctx = *ctx;
+                w->ctx.res = &w->res;
+                w->ctx.used = 0;
+                if (collect) {
+                        w->ctx.xblocks = w->ctx.extra = NULL;
+                        w->ctx.nr_xblocks = w->ctx.max_xblocks = 0;
+                        w->ctx.nr_extra = w->ctx.max_extra = 0;
+                }
+                w->fn = fn;
+                w->start = start + i * per;
+                w->end = min(end, w->start + per);
+        }
+
+        /* the first range is scanned by the calling thread */
+        for (started = 1; started < nr_workers; started++) {
+                w = &workers[started];
+                if (pthread_create(&w->thread, NULL, numbfs_check_worker_fn, w))
+                        break;
+        }
+        numbfs_check_worker_fn(&workers[0]);
+        /* the ranges left if we ran out of threads */
+        for (i = started; i < nr_workers; i++)
+                numbfs_check_worker_fn(&workers[i]);
+
+        for (i = 0; i < nr_workers; i++) {
+                w = &workers[i];
+                if (i && i < started)
+                        pthread_join(w->thread, NULL);
+                if (!err)
+                        err = w->err;
+                if (!err)
+                        err = numbfs_check_merge(ctx, w, collect);
+                numbfs_check_release(&w->res);
+                if (!collect)
+                        continue;
+                free(w->ctx.xblocks);
+                free(w->ctx.extra);
+        }
+        free(workers);
+        return err;
+}
+
+/*
+ * load the inode table blocks of the inodes [@start, @end), check the
+ * fields of the allocated ones and take their block references
+ */
+static int numbfs_check_inodes(struct numbfs_check_ctx *ctx, int start, int end)
+{
+        struct numbfs_superblock_info *sbi = ctx->sbi;
+        struct numbfs_check_result *res = ctx->res;
+        struct numbfs_inode *inode;
+        int nid, i, mode, size, blk, first, last, err;
+
+        first = start / NUMBFS_NODES_PER_BLOCK;
+        last = min((int)DIV_ROUND_UP(end, NUMBFS_NODES_PER_BLOCK), ctx->itable_blocks);
+        if (first < last) {
+                err = numbfs_read_blocks(sbi, (char*)ctx->itable + (size_t)first *
+                                         BYTES_PER_BLOCK, sbi->inode_start + first,
+                                         last - first);
+                if (err)
+                        return err;
+        }
+
+        for (nid = start; nid < end; nid++) {
+                if (!numbfs_check_bit(ctx->ibitmap, nid))
+                        continue;
+                ctx->used++;
+
+                /* an allocated inode must have an initialized table block */
+                if (!numbfs_check_inode_used(ctx, nid)) {
+                        err = numbfs_check_report(ctx, NUMBFS_CHECK_IBITMAP, nid, -1, 0, 1);
+                        if (err)
+                                return err;
+                        continue;
+                }
+
+                inode = &ctx->itable[nid];
+                mode = le32_to_cpu(inode->i_mode);
+                size = le32_to_cpu(inode->i_size);
+                if (S_ISDIR(mode)) {
+                        res->dirs++;
+                } else if (S_ISREG(mode)) {
+                        res->files++;
+                } else if (S_ISLNK(mode)) {
+                        res->symlinks++;
+                } else if (S_ISCHR(mode) || S_ISBLK(mode) || S_ISFIFO(mode) ||
+                           S_ISSOCK(mode)) {
+                        res->others++;
+                } else {
+                        err = numbfs_check_report(ctx, NUMBFS_CHECK_MODE, nid, -1, 0, mode);
+                        if (err)
+                                return err;
+                }
+
+                if (size < 0 || size > NUMBFS_NUM_DATA_ENTRY * BYTES_PER_BLOCK ||
+                    (S_ISDIR(mode) && (size % sizeof(struct numbfs_dirent) ||
+                                       size < 2 * (int)sizeof(struct numbfs_dirent)))) {
+                        err = numbfs_check_report(ctx, NUMBFS_CHECK_SIZE, nid, -1, 0, size);
+                        if (err)
+                                return err;
+                }
+
+                for (i = 0; i < NUMBFS_NUM_DATA_ENTRY; i++) {
+                        blk = le32_to_cpu(inode->i_data[i]);
+                        if (blk == NUMBFS_HOLE)
+                                continue;
+                        err = 0;
+                        if (i * BYTES_PER_BLOCK >= size)
+                                err = numbfs_check_report(ctx, NUMBFS_CHECK_SIZE,
+                                                          nid, i, 0, size);
+                        if (!err)
+                                err = numbfs_check_ref(ctx, nid, blk);
+                        if (err)
+                                return err;
+                }
+
+                /* the xattr block, which holds the timestamps without a table */
+                blk = le32_to_cpu(inode->i_xattr_start);
+                if (blk == NUMBFS_HOLE && (sbi->feature & NUMBFS_FEATURE_TSTABLE))
+                        continue;
+                err = numbfs_check_ref(ctx, nid, blk);
+                if (err)
+                        return err;
+                if (!(sbi->feature & NUMBFS_FEATURE_TSTABLE) ||
+                    blk < 0 || blk >= sbi->data_blocks)
+                        continue;
+
+                err = numbfs_check_push(&ctx->xblocks, &ctx->nr_xblocks,
+                                        &ctx->max_xblocks, blk);
+                if (err)
+                        return err;
+        }
+        return 0;
+}
+
+static int numbfs_check_add_dirent(struct numbfs_check_ctx *ctx, int pnid,
+                                   int slot, int nid)
+{
+        struct numbfs_check_dirent *d;
+
+        if (ctx->nr_dents == ctx->max_dents) {
+                d = numbfs_check_grow(ctx->dents, &ctx->max_dents, sizeof(*d));
+                if (!d)
+                        return -ENOMEM;
+                ctx->dents = d;
+        }
+
+        d = &ctx->dents[ctx->nr_dents++];
+        d->pnid = pnid;
+        d->slot = slot;
+        d->nid = nid;
+        d->indexed = false;
+        return 0;
+}
+
+/* check the dirents of the directory @nid, its subdirectories go to @stack */
+static int numbfs_check_dir(struct numbfs_check_ctx *ctx, int nid,
+                            int *stack, int *top)
+{
+        char buf[NUMBFS_NUM_DATA_ENTRY * BYTES_PER_BLOCK];
+        struct numbfs_inode *inode = &ctx->itable[nid];
+        struct numbfs_dirent *de = (struct numbfs_dirent*)buf;
+        int i, size, blk, ino, mode, expect, err = 0;
+
+        size = le32_to_cpu(inode->i_size);
+        size = max(min(size, (int)sizeof(buf)), 0);
+        memset(buf, 0, sizeof(buf));
+        for (i = 0; i < DIV_ROUND_UP(size, BYTES_PER_BLOCK); i++) {
+                blk = le32_to_cpu(inode->i_data[i]);
+                if (blk == NUMBFS_HOLE || blk < 0 || blk >= ctx->sbi->data_blocks)
+                        continue;
+                err = numbfs_read_block(ctx->sbi, buf + i * BYTES_PER_BLOCK,
+                                        numbfs_data_blk(ctx->sbi, blk));
+                if (err)
+                        return err;
+        }
+
+        for (i = 0; !err && i < size / (int)sizeof(*de); i++, de++) {
+                ino = le16_to_cpu(de->ino);
+
+                /* "." and ".." come first */
+                if (i < 2) {
+                        expect = i ? ctx->inodes[nid].parent : nid;
+                        /* the ".." of an orphan is rewritten when it is reconnected */
+                        if (i && expect == nid && nid != NUMBFS_ROOT_NID)
+                                continue;
+                        if (de->name_len != i + 1 || memcmp(de->name, "..", i + 1) ||
+                            ino != expect)
+                                err = numbfs_check_report(ctx, NUMBFS_CHECK_DOT, nid,
+                                                          i, expect, ino);
+                        continue;
+                }
+
+                /* a free slot */
+                if (!de->name_len)
+                        continue;
+
+                err = numbfs_check_add_dirent(ctx, nid, i, ino);
+                if (err)
+                        break;
+
+                if (!numbfs_check_inode_used(ctx, ino)) {
+                        err = numbfs_check_report(ctx, NUMBFS_CHECK_DIRENT, nid, i, -1, ino);
+                        continue;
+                }
+                mode = le32_to_cpu(ctx->itable[ino].i_mode);
+                if (!S_ISDIR(mode) && ctx->inodes[ino].links < NUMBFS_CHECK_REFS_MAX)
+                        ctx->inodes[ino].links++;
+                if (de->type != IFTODT(mode)) {
+                        err = numbfs_check_report(ctx, NUMBFS_CHECK_DTYPE, nid, i,
+                                                  IFTODT(mode), de->type);
+                        if (err)
+                                break;
+                }
+                if (!S_ISDIR(mode))
+                        continue;
+
+                if (ctx->inodes[nid].links < NUMBFS_CHECK_REFS_MAX)
+                        ctx->inodes[nid].links++;
+                if (numbfs_check_bit(ctx->reached, ino)) {
+                        err = numbfs_check_report(ctx, NUMBFS_CHECK_DIRLINK, ino, -1,
+                                                  ctx->inodes[ino].parent, nid);
+                        continue;
+                }
+                numbfs_check_mark(ctx->reached, ino, true);
+                ctx->inodes[ino].parent = nid;
+                stack[(*top)++] = ino;
+
+                if (nid == NUMBFS_ROOT_NID && de->name_len == strlen(NUMBFS_LOSTFOUND) &&
+                    !memcmp(de->name, NUMBFS_LOSTFOUND, de->name_len))
+                        ctx->lostfound = ino;
+        }
+        return err;
+}
+
+/* walk the subtree of the directory @nid, an orphan is its own @parent */
+static int numbfs_check_walk(struct numbfs_check_ctx *ctx, int nid, int parent,
+                             int *stack)
+{
+        int top = 0, err = 0;
+
+        numbfs_check_mark(ctx->reached, nid, true);
+        ctx->inodes[nid].parent = parent;
+        stack[top++] = nid;
+        while (!err && top)
+                err = numbfs_check_dir(ctx, stack[--top], stack, &top);
+        return err;
+}
+
+/* the inode the ".." of the directory @nid points to, -1 if it has none */
+static int numbfs_check_dotdot(struct numbfs_check_ctx *ctx, int nid, int *pnid)
+{
+        char buf[BYTES_PER_BLOCK];
+        struct numbfs_dirent *de = (struct numbfs_dirent*)buf;
+        int blk, err;
+
+        *pnid = -1;
+        blk = le32_to_cpu(ctx->itable[nid].i_data[0]);
+        if (blk == NUMBFS_HOLE || blk < 0 || blk >= ctx->sbi->data_blocks)
+                return 0;
+        err = numbfs_read_block(ctx->sbi, buf, numbfs_data_blk(ctx->sbi, blk));
+        if (err)
+                return err;
+        if (de[1].name_len == 2 && !memcmp(de[1].name, "..", 2))
+                *pnid = le16_to_cpu(de[1].ino);
+        return 0;
+}
+
+/* whether @nid is an allocated directory not reached yet */
+static bool numbfs_check_lost_dir(struct numbfs_check_ctx *ctx, int nid)
+{
+        return numbfs_check_inode_used(ctx, nid) && !numbfs_check_bit(ctx->reached, nid) &&
+               S_ISDIR(le32_to_cpu(ctx->itable[nid].i_mode));
+}
+
+/*
+ * walk the directory tree from the root, reading each directory once, then
+ * the subtrees of the directories not reached, which are reported as
+ * orphans: first the ones whose ".." isn't lost as well, and then those
+ * left, whose parents form a loop or don't link them
+ */
+static int numbfs_check_tree(struct numbfs_check_ctx *ctx)
+{
+        int *stack, nid, pnid, pass, err = 0;
+
+        if (!numbfs_check_inode_used(ctx, NUMBFS_ROOT_NID))
+                return numbfs_check_report(ctx, NUMBFS_CHECK_IBITMAP, NUMBFS_ROOT_NID,
+                                           -1, 1, 0);
+        if (!S_ISDIR(le32_to_cpu(ctx->itable[NUMBFS_ROOT_NID].i_mode)))
+                return numbfs_check_report(ctx, NUMBFS_CHECK_MODE, NUMBFS_ROOT_NID, -1,
+                                           S_IFDIR, le32_to_cpu(ctx->itable[NUMBFS_ROOT_NID].i_mode));
+
+        /* every directory is pushed once */
+        stack = malloc(ctx->sbi->total_inodes * sizeof(*stack));
+        if (!stack)
+                return -ENOMEM;
+
+        err = numbfs_check_walk(ctx, NUMBFS_ROOT_NID, NUMBFS_ROOT_NID, stack);
+        for (pass = 0; !err && pass < 2; pass++) {
+                for (nid = 0; !err && nid < ctx->sbi->total_inodes; nid++) {
+                        if (!numbfs_check_lost_dir(ctx, nid))
+                                continue;
+                        if (!pass) {
+                                err = numbfs_check_dotdot(ctx, nid, &pnid);
+                                if (err)
+                                        break;
+                                if (pnid != nid && pnid < ctx->sbi->total_inodes &&
+                                    numbfs_check_lost_dir(ctx, pnid))
+                                        continue;
+                        }
+                        err = numbfs_check_report(ctx, NUMBFS_CHECK_ORPHAN, nid, -1, 0, 0);
+                        if (!err)
+                                err = numbfs_check_walk(ctx, nid, nid, stack);
+                }
+        }
+
+        free(stack);
+        return err;
+}
+
+/* cross-check the link counts against the dirents found by the walk */
+static int numbfs_check_links(struct numbfs_check_ctx *ctx)
+{
+        struct numbfs_inode *inode;
+        int nid, mode, nlink, expect, err;
+
+        for (nid = 0; nid < ctx->sbi->total_inodes; nid++) {
+                if (!numbfs_check_inode_used(ctx, nid))
+                        continue;
+
+                /* the orphaned directories were reported by the walk */
+                inode = &ctx->itable[nid];
+                mode = le32_to_cpu(inode->i_mode);
+                nlink = le16_to_cpu(inode->i_nlink);
+                if (!S_ISDIR(mode) && !ctx->inodes[nid].links) {
+                        err = numbfs_check_report(ctx, NUMBFS_CHECK_ORPHAN, nid, -1, 0, 0);
+                        if (err)
+                                return err;
+                        continue;
+                }
+
+                /* a directory is linked by its own "." and each ".." of the subdirectories */
+                expect = ctx->inodes[nid].links + (S_ISDIR(mode) ? 2 : 0);
+                if (nlink != expect) {
+                        err = numbfs_check_report(ctx, NUMBFS_CHECK_NLINK, nid, -1,
+                                                  expect, nlink);
+                        if (err)
+                                return err;
+                }
+        }
+        return 0;
+}
+
+/*
+ * whether the owners of the data blocks are counted by the refcount table,
+ * a table out of the data zone has been reported on its own
+ */
+static bool numbfs_check_has_refcounts(struct numbfs_superblock_info *sbi)
+{
+        return (sbi->feature & NUMBFS_FEATURE_REFCOUNT) &&
+               sbi->refcount_start + DIV_ROUND_UP(sbi->data_blocks,
+                        (int)NUMBFS_REFCOUNTS_PER_BLOCK) <= sbi->data_blocks;
+}
+
+/* whether @blk counts its owners in an xattr header, xblocks sorted */
+static bool numbfs_check_is_xblock(struct numbfs_check_ctx *ctx, int blk)
+{
+        return ctx->nr_xblocks && bsearch(&blk, ctx->xblocks, ctx->nr_xblocks,
+                                          sizeof(int), numbfs_check_cmp_int);
+}
+
+static void numbfs_check_sort_xblocks(struct numbfs_check_ctx *ctx)
+{
+        int i, n = 0;
+
+        if (ctx->nr_xblocks)
+                qsort(ctx->xblocks, ctx->nr_xblocks, sizeof(int), numbfs_check_cmp_int);
+        for (i = 0; i < ctx->nr_xblocks; i++)
+                if (!n || ctx->xblocks[i] != ctx->xblocks[n - 1])
+                        ctx->xblocks[n++] = ctx->xblocks[i];
+        ctx->nr_xblocks = n;
+}
+
+/*
+ * the owners recorded by the headers of the shared xattr blocks of the
+ * window, -1 for a header without the magic, which is taken as one owner
+ */
+static int numbfs_check_xblocks(struct numbfs_check_ctx *ctx)
+{
+        struct numbfs_xattr_header *xh;
+        char buf[BYTES_PER_BLOCK];
+        int i, blk, refs, err;
+
+        for (i = 0; i < ctx->nr_xblocks; i++) {
+                blk = ctx->xblocks[i];
+                if (blk < ctx->lo || blk >= ctx->hi)
+                        continue;
+                err = numbfs_read_block(ctx->sbi, buf, numbfs_data_blk(ctx->sbi, blk));
+                if (err)
+                        return err;
+
+                xh = (struct numbfs_xattr_header*)buf;
+                refs = le32_to_cpu(xh->h_magic) == NUMBFS_XATTR_MAGIC ?
+                       (int)le32_to_cpu(xh->h_refcount) : -1;
+                if ((refs < 0 ? 1 : refs) != numbfs_check_refs(ctx, blk)) {
+                        err = numbfs_check_report(ctx, NUMBFS_CHECK_REFCOUNT, -1, blk,
+                                                  numbfs_check_refs(ctx, blk), refs);
+                        if (err)
+                                return err;
+                }
+        }
+        return 0;
+}
+
+/*
+ * load the block bitmap of the data blocks [@start, @end) of the window,
+ * and cross-check their references against it and the refcount table
+ */
+static int numbfs_check_blocks(struct numbfs_check_ctx *ctx, int start, int end)
+{
+        struct numbfs_superblock_info *sbi = ctx->sbi;
+        __le16 table[NUMBFS_REFCOUNTS_PER_BLOCK];
+        bool refcount = numbfs_check_has_refcounts(sbi);
+        int blk, bit, refs, recorded, first, err = 0;
+
+        first = start / NUMBFS_BLOCKS_PER_BLOCK;
+        err = numbfs_read_blocks(sbi, ctx->bbitmap + (size_t)(start - ctx->lo) / BITS_PER_BYTE,
+                                 sbi->bbitmap_start + first,
+                                 DIV_ROUND_UP(end, NUMBFS_BLOCKS_PER_BLOCK) - first);
+        if (err)
+                return err;
+
+        for (blk = start; !err && blk < end; blk++) {
+                if (refcount && blk % NUMBFS_REFCOUNTS_PER_BLOCK == 0) {
+                        err = numbfs_read_block(sbi, (char*)table,
+                                        numbfs_data_blk(sbi, sbi->refcount_start +
+                                                        blk / NUMBFS_REFCOUNTS_PER_BLOCK));
+                        if (err)
+                                break;
+                }
+
+                bit = numbfs_check_bit(ctx->bbitmap, blk - ctx->lo);
+                refs = numbfs_check_refs(ctx, blk);
+                ctx->used += bit;
+                if (refs)
+                        ctx->res->blocks++;
+                if (bit != !!refs) {
+                        err = numbfs_check_report(ctx, NUMBFS_CHECK_BBITMAP, -1, blk,
+                                                  !!refs, bit);
+                        if (err)
+                                break;
+                }
+
+                /* checked against their headers */
+                if (numbfs_check_is_xblock(ctx, blk))
+                        continue;
+
+                /* an entry of 0 is the only owner, or no owner for a free block */
+                recorded = 1;
+                if (refcount) {
+                        recorded = le16_to_cpu(table[blk % NUMBFS_REFCOUNTS_PER_BLOCK]);
+                        if (!recorded && refs)
+                                recorded = 1;
+                } else if (!refs) {
+                        recorded = 0;
+                }
+                if (recorded != refs)
+                        err = numbfs_check_report(ctx, NUMBFS_CHECK_REFCOUNT, -1, blk,
+                                                  refs, recorded);
+        }
+        return err;
+}
+
+static int numbfs_check_cmp_dirent(const void *a, const void *b)
+{
+        const struct numbfs_check_dirent *da = a, *db = b;
+
+        if (da->pnid != db->pnid)
+                return da->pnid - db->pnid;
+        return da->slot - db->slot;
+}
+
+/* the live dirent @slot of the directory @pnid, dents sorted */
+static struct numbfs_check_dirent *numbfs_check_find_dirent(struct numbfs_check_ctx *ctx,
+                                                            int pnid, int slot)
+{
+        struct numbfs_check_dirent key = {
+                .pnid = pnid,
+                .slot = slot,
+        };
+
+        if (!ctx->nr_dents)
+                return NULL;
+        return bsearch(&key, ctx->dents, ctx->nr_dents, sizeof(key),
+                       numbfs_check_cmp_dirent);
+}
+
+/* every live dirent but "." and ".." has exactly one index entry */
+static int numbfs_check_dindex(struct numbfs_check_ctx *ctx)
+{
+        struct numbfs_superblock_info *sbi = ctx->sbi;
+        struct numbfs_dindex_entry table[NUMBFS_DINDEX_PER_BLOCK];
+        struct numbfs_check_dirent key, *d;
+        int i, k, err;
+
+        if (!(sbi->feature & NUMBFS_FEATURE_DIR_INDEX) ||
+            sbi->dindex_start + sbi->dindex_blocks > sbi->data_blocks)
+                return 0;
+
+        if (ctx->nr_dents)
+                qsort(ctx->dents, ctx->nr_dents, sizeof(*ctx->dents), numbfs_check_cmp_dirent);
+        for (i = 0; i < sbi->dindex_blocks; i++) {
+                err = numbfs_read_block(sbi, (char*)table,
+                                        numbfs_data_blk(sbi, sbi->dindex_start + i));
+                if (err)
+                        return err;
+
+                for (k = 0; k < (int)NUMBFS_DINDEX_PER_BLOCK; k++) {
+                        if (table[k].d_state != NUMBFS_DINDEX_USED)
+                                continue;
+
+                        /* the directories not reached are reported as orphans */
+                        key.pnid = le16_to_cpu(table[k].d_pnid);
+                        key.slot = le16_to_cpu(table[k].d_slot);
+                        if (key.pnid >= sbi->total_inodes ||
+                            !numbfs_check_bit(ctx->reached, key.pnid))
+                                continue;
+                        d = numbfs_check_find_dirent(ctx, key.pnid, key.slot);
+                        if (d && !d->indexed && d->nid == le16_to_cpu(table[k].d_nid)) {
+                                d->indexed = true;
+                                continue;
+                        }
+
+                        err = numbfs_check_report(ctx, NUMBFS_CHECK_DINDEX, key.pnid,
+                                                  key.slot, d ? d->nid : -1,
+                                                  le16_to_cpu(table[k].d_nid));
+                        if (err)
+                                return err;
+                }
+        }
+
+        for (i = 0; i < ctx->nr_dents; i++) {
+                d = &ctx->dents[i];
+                if (d->indexed)
+                        continue;
+                err = numbfs_check_report(ctx, NUMBFS_CHECK_DINDEX, d->pnid, d->slot,
+                                          d->nid, -1);
+                if (err)
+                        return err;
+        }
+        return 0;
+}
+
+/*
+ * get the staged copy of the device block @blkno, which is taken from
+ * @src or read from the device the first time
+ */
+static char *numbfs_check_stage(struct numbfs_check_ctx *ctx, int blkno,
+                                const void *src)
+{
+        struct numbfs_check_stage *st, **stages;
+        int lo = 0, hi = ctx->nr_stages - 1, mid;
+
+        while (lo <= hi) {
+                mid = (lo + hi) / 2;
+                if (ctx->stages[mid]->blkno == blkno)
+                        return ctx->stages[mid]->buf;
+                if (ctx->stages[mid]->blkno < blkno)
+                        lo = mid + 1;
+                else
+                        hi = mid - 1;
+        }
+
+        if (ctx->nr_stages == ctx->max_stages) {
+                stages = numbfs_check_grow(ctx->stages, &ctx->max_stages,
+                                           sizeof(*stages));
+                if (!stages)
+                        return NULL;
+                ctx->stages = stages;
+        }
+        st = malloc(sizeof(*st));
+        if (!st)
+                return NULL;
+        st->blkno = blkno;
+        if (src)
+                memcpy(st->old, src, BYTES_PER_BLOCK);
+        else if (numbfs_read_block(ctx->sbi, st->old, blkno)) {
+                free(st);
+                return NULL;
+        }
+        memcpy(st->buf, st->old, BYTES_PER_BLOCK);
+
+        memmove(&ctx->stages[lo + 1], &ctx->stages[lo],
+                (ctx->nr_stages - lo) * sizeof(*ctx->stages));
+        ctx->stages[lo] = st;
+        ctx->nr_stages++;
+        return st->buf;
+}
+
+/* set bit @nr of @map loaded from the device blocks at @start, and stage it */
+static int numbfs_check_set_bit(struct numbfs_check_ctx *ctx, char *map,
+                                int start, int nr, bool set)
+{
+        int blk = nr / NUMBFS_BLOCKS_PER_BLOCK;
+        char *buf;
+
+        if (numbfs_check_bit(map, nr) == set)
+                return 0;
+
+        buf = numbfs_check_stage(ctx, start + blk, map + (size_t)blk * BYTES_PER_BLOCK);
+        if (!buf)
+                return -ENOMEM;
+        if (set) {
+                map[nr / BITS_PER_BYTE] |= 1 << (nr % BITS_PER_BYTE);
+                buf[numbfs_bmap_byte(nr)] |= 1 << numbfs_bmap_bit(nr);
+        } else {
+                map[nr / BITS_PER_BYTE] &= ~(1 << (nr % BITS_PER_BYTE));
+                buf[numbfs_bmap_byte(nr)] &= ~(1 << numbfs_bmap_bit(nr));
+        }
+        return 0;
+}
+
+/* the staged inode table slot of @nid */
+static struct numbfs_inode *numbfs_check_stage_inode(struct numbfs_check_ctx *ctx,
+                                                     int nid)
+{
+        int blk = nid / NUMBFS_NODES_PER_BLOCK;
+        char *buf;
+
+        buf = numbfs_check_stage(ctx, ctx->sbi->inode_start + blk,
+                                 (char*)ctx->itable + (size_t)blk * BYTES_PER_BLOCK);
+        if (!buf)
+                return NULL;
+        return (struct numbfs_inode*)buf + nid % NUMBFS_NODES_PER_BLOCK;
+}
+
+/* clear the dirent @slot of the directory @nid */
+static int numbfs_check_drop_dirent(struct numbfs_check_ctx *ctx, int nid, int slot)
+{
+        int per = BYTES_PER_BLOCK / sizeof(struct numbfs_dirent);
+        int blk = le32_to_cpu(ctx->itable[nid].i_data[slot / per]);
+        char *buf;
+
+        buf = numbfs_check_stage(ctx, numbfs_data_blk(ctx->sbi, blk), NULL);
+        if (!buf)
+                return -ENOMEM;
+        memset(buf + (slot % per) * sizeof(struct numbfs_dirent), 0,
+               sizeof(struct numbfs_dirent));
+        return 0;
+}
+
+/*
+ * release the blocks of the window owned by a dropped inode, the ones
+ * without an initialized inode table block own none
+ */
+static void numbfs_check_drop_inode(struct numbfs_check_ctx *ctx, int nid)
+{
+        struct numbfs_inode *inode;
+        int i, blk;
+
+        if (!numbfs_check_inode_used(ctx, nid))
+                return;
+        inode = &ctx->itable[nid];
+        for (i = 0; i <= NUMBFS_NUM_DATA_ENTRY; i++) {
+                blk = le32_to_cpu(i < NUMBFS_NUM_DATA_ENTRY ? inode->i_data[i] :
+                                                              inode->i_xattr_start);
+                if (blk >= ctx->lo && blk < ctx->hi)
+                        numbfs_check_unref(ctx, blk);
+        }
+}
+
+/*
+ * the inodes released by the repair: orphans of unknown type, and the ones
+ * allocated without an initialized inode table block, the other orphans
+ * are reconnected
+ */
+static int numbfs_check_find_drops(struct numbfs_check_ctx *ctx)
+{
+        struct numbfs_check_problem *p;
+        int i;
+
+        ctx->dropped = calloc(DIV_ROUND_UP(ctx->sbi->total_inodes, BITS_PER_BYTE), 1);
+        if (!ctx->dropped)
+                return -ENOMEM;
+
+        for (i = 0; i < ctx->res->nr_problems; i++) {
+                p = &ctx->res->problems[i];
+                if ((p->type == NUMBFS_CHECK_ORPHAN &&
+                     !numbfs_check_mode_valid(le32_to_cpu(ctx->itable[p->nid].i_mode))) ||
+                    (p->type == NUMBFS_CHECK_IBITMAP && !p->expect))
+                        numbfs_check_mark(ctx->dropped, p->nid, true);
+        }
+        return 0;
+}
+
+/*
+ * bring the refcount table and the shared xattr headers of the window to
+ * the block references
+ */
+static int numbfs_check_fix_refcounts(struct numbfs_check_ctx *ctx)
+{
+        struct numbfs_superblock_info *sbi = ctx->sbi;
+        struct numbfs_xattr_header *xh;
+        __le16 table[NUMBFS_REFCOUNTS_PER_BLOCK], *staged;
+        char buf[BYTES_PER_BLOCK];
+        int i, k, nr, blk, refs, err;
+
+        if (numbfs_check_has_refcounts(sbi)) {
+                for (i = ctx->lo / NUMBFS_REFCOUNTS_PER_BLOCK;
+                     i < DIV_ROUND_UP(ctx->hi, (int)NUMBFS_REFCOUNTS_PER_BLOCK); i++) {
+                        blk = numbfs_data_blk(sbi, sbi->refcount_start + i);
+                        err = numbfs_read_block(sbi, (char*)table, blk);
+                        if (err)
+                                return err;
+
+                        staged = NULL;
+                        for (k = 0; k < (int)NUMBFS_REFCOUNTS_PER_BLOCK; k++) {
+                                nr = i * NUMBFS_REFCOUNTS_PER_BLOCK + k;
+                                /* the xattr blocks count their owners in the header */
+                                if (nr >= ctx->hi || numbfs_check_is_xblock(ctx, nr))
+                                        continue;
+                                refs = numbfs_check_refs(ctx, nr);
+                                refs = refs > 1 ? refs : 0;
+                                if (le16_to_cpu(table[k]) == refs)
+                                        continue;
+                                if (!staged)
+                                        staged = (__le16*)numbfs_check_stage(ctx, blk, table);
+                                if (!staged)
+                                        return -ENOMEM;
+                                staged[k] = cpu_to_le16(refs);
+                        }
+                }
+        }
+
+        for (i = 0; i < ctx->nr_xblocks; i++) {
+                blk = ctx->xblocks[i];
+                if (blk < ctx->lo || blk >= ctx->hi)
+                        continue;
+                err = numbfs_read_block(sbi, buf, numbfs_data_blk(sbi, blk));
+                if (err)
+                        return err;
+
+                xh = (struct numbfs_xattr_header*)buf;
+                refs = numbfs_check_refs(ctx, blk);
+                if (!refs || le32_to_cpu(xh->h_magic) != NUMBFS_XATTR_MAGIC ||
+                    le32_to_cpu(xh->h_refcount) == (__u32)refs)
+                        continue;
+
+                xh = (struct numbfs_xattr_header*)numbfs_check_stage(ctx,
+                                        numbfs_data_blk(sbi, blk), buf);
+                if (!xh)
+                        return -ENOMEM;
+                xh->h_refcount = cpu_to_le32(refs);
+        }
+        return 0;
+}
+
+/* delete the index entries of free slots, dropped dirents and directories */
+static int numbfs_check_fix_dindex(struct numbfs_check_ctx *ctx)
+{
+        struct numbfs_superblock_info *sbi = ctx->sbi;
+        struct numbfs_dindex_entry table[NUMBFS_DINDEX_PER_BLOCK], *staged;
+        struct numbfs_check_dirent key, *d;
+        int i, k, blk, err;
+
+        if (!(sbi->feature & NUMBFS_FEATURE_DIR_INDEX) ||
+            sbi->dindex_start + sbi->dindex_blocks > sbi->data_blocks)
+                return 0;
+
+        for (i = 0; i < sbi->dindex_blocks; i++) {
+                blk = numbfs_data_blk(sbi, sbi->dindex_start + i);
+                err = numbfs_read_block(sbi, (char*)table, blk);
+                if (err)
+                        return err;
+
+                staged = NULL;
+                for (k = 0; k < (int)NUMBFS_DINDEX_PER_BLOCK; k++) {
+                        if (table[k].d_state != NUMBFS_DINDEX_USED)
+                                continue;
+
+                        key.pnid = le16_to_cpu(table[k].d_pnid);
+                        key.slot = le16_to_cpu(table[k].d_slot);
+                        if (key.pnid >= sbi->total_inodes ||
+                            (!numbfs_check_bit(ctx->dropped, key.pnid) &&
+                             !numbfs_check_bit(ctx->reached, key.pnid)))
+                                continue;
+                        if (!numbfs_check_bit(ctx->dropped, key.pnid)) {
+                                d = numbfs_check_find_dirent(ctx, key.pnid, key.slot);
+                                if (d && d->nid >= 0)
+                                        continue;
+                        }
+
+                        /* a deleted entry keeps the probes going */
+                        if (!staged)
+                                staged = (struct numbfs_dindex_entry*)
+                                         numbfs_check_stage(ctx, blk, table);
+                        if (!staged)
+                                return -ENOMEM;
+                        staged[k].d_state = NUMBFS_DINDEX_DELETED;
+                }
+        }
+        return 0;
+}
+
+/* the bits set in the first @nr bits of @map */
+static int numbfs_check_weight(const char *map, int nr)
+{
+        int cnt, i;
+
+        cnt = numbfs_bitmap_weight(map, nr / BITS_PER_BYTE);
+        for (i = round_down(nr, BITS_PER_BYTE); i < nr; i++)
+                cnt += numbfs_check_bit(map, i);
+        return cnt;
+}
+
+/*
+ * release the blocks of the window owned by the dropped inodes, then bring
+ * the block bitmap and the refcounts to the references left
+ */
+static int numbfs_check_fix_window(struct numbfs_check_ctx *ctx)
+{
+        struct numbfs_superblock_info *sbi = ctx->sbi;
+        struct numbfs_check_problem *p;
+        int i, nid, blk, err = 0;
+
+        for (nid = 0; nid < sbi->total_inodes; nid++)
+                if (numbfs_check_bit(ctx->dropped, nid))
+                        numbfs_check_drop_inode(ctx, nid);
+        /* the blocks back to the owners recorded once the dropped ones are gone */
+        for (i = 0; i < ctx->res->nr_problems; i++) {
+                p = &ctx->res->problems[i];
+                if (p->type == NUMBFS_CHECK_REFCOUNT && p->blk >= ctx->lo &&
+                    p->blk < ctx->hi &&
+                    numbfs_check_refs(ctx, p->blk) == (p->found < 0 ? 1 : p->found))
+                        p->fixed = true;
+        }
+        for (blk = ctx->lo; !err && blk < ctx->hi; blk++)
+                err = numbfs_check_set_bit(ctx, ctx->bbitmap,
+                                           sbi->bbitmap_start + ctx->lo / NUMBFS_BLOCKS_PER_BLOCK,
+                                           blk - ctx->lo, numbfs_check_refs(ctx, blk));
+        if (!err)
+                err = numbfs_check_fix_refcounts(ctx);
+        ctx->kept_blocks += numbfs_check_weight(ctx->bbitmap, ctx->hi - ctx->lo);
+        return err;
+}
+
+/* check the owners of the data blocks of the window at @lo, and fix them with @repair */
+static int numbfs_check_window(struct numbfs_check_ctx *ctx, int lo, bool repair)
+{
+        int err = 0;
+
+        if (lo)
+                err = numbfs_check_load_window(ctx, lo);
+        if (!err)
+                err = numbfs_check_count(ctx);
+        if (!err)
+                err = numbfs_check_xblocks(ctx);
+        /* the refcount table blocks are not split either */
+        if (!err)
+                err = numbfs_check_parallel(ctx, ctx->lo, ctx->hi,
+                                            NUMBFS_BLOCKS_PER_BLOCK, numbfs_check_blocks,
+                                            false);
+        ctx->used_blocks += ctx->used;
+        if (!err && repair)
+                err = numbfs_check_fix_window(ctx);
+        return err;
+}
+
+/* record the changed byte ranges of the staged blocks */
+static int numbfs_check_diff(struct numbfs_check_ctx *ctx)
+{
+        struct numbfs_check_result *res = ctx->res;
+        struct numbfs_check_stage *st;
+        struct numbfs_check_diff *d;
+        int i, off, end;
+
+        for (i = 0; i < ctx->nr_stages; i++) {
+                st = ctx->stages[i];
+                for (off = 0; off < BYTES_PER_BLOCK; off = end) {
+                        if (st->old[off] == st->buf[off]) {
+                                end = off + 1;
+                                continue;
+                        }
+                        for (end = off + 1; end < BYTES_PER_BLOCK &&
+                             st->old[end] != st->buf[end]; end++)
+                                ;
+
+                        if (res->nr_diffs == res->max_diffs) {
+                                d = numbfs_check_grow(res->diffs, &res->max_diffs,
+                                                      sizeof(*d));
+                                if (!d)
+                                        return -ENOMEM;
+                                res->diffs = d;
+                        }
+                        d = &res->diffs[res->nr_diffs++];
+                        d->blkno = st->blkno;
+                        d->off = off;
+                        d->len = end - off;
+                }
+        }
+        return 0;
+}
+
+/*
+ * write the staged blocks in block order, contiguous ones in one request,
+ * and the superblock once all the others are on the device
+ */
+static int numbfs_check_commit(struct numbfs_check_ctx *ctx)
+{
+        struct numbfs_superblock_info *sbi = ctx->sbi;
+        struct numbfs_check_stage *sb = NULL;
+        char *run;
+        int i, k, err = 0;
+
+        run = malloc((size_t)ctx->nr_stages * BYTES_PER_BLOCK);
+        if (!run)
+                return -ENOMEM;
+
+        for (i = 0; !err && i < ctx->nr_stages; i = k) {
+                if (ctx->stages[i]->blkno == NUMBFS_SUPER_OFFSET / BYTES_PER_BLOCK) {
+                        sb = ctx->stages[i];
+                        k = i + 1;
+                        continue;
+                }
+                for (k = i; k < ctx->nr_stages; k++) {
+                        if (k > i && ctx->stages[k]->blkno != ctx->stages[k - 1]->blkno + 1)
+                                break;
+                        memcpy(run + (size_t)(k - i) * BYTES_PER_BLOCK,
+                               ctx->stages[k]->buf, BYTES_PER_BLOCK);
+                }
+                err = numbfs_pwrite_full(sbi->fd, run, (long long)(k - i) * BYTES_PER_BLOCK,
+                                         (long long)ctx->stages[i]->blkno * BYTES_PER_BLOCK);
+        }
+        free(run);
+        if (!err && fsync(sbi->fd))
+                err = -errno;
+        if (!err && sb)
+                err = numbfs_pwrite_full(sbi->fd, sb->buf, BYTES_PER_BLOCK,
+                                         NUMBFS_SUPER_OFFSET);
+        if (!err && sb && fsync(sbi->fd))
+                err = -errno;
+
+        /* the caches may hold what has just been fixed */
+        numbfs_drop_caches(sbi);
+        return err;
+}
+
+/* an orphan that couldn't be reconnected is left as it is */
+static void numbfs_check_unfix(struct numbfs_check_ctx *ctx,
+                               struct numbfs_check_problem *p)
+{
+        p->fixed = false;
+        ctx->res->nr_fixed--;
+}
+
+/*
+ * link the orphans kept under lost+found as "#<nid>", once all the staged
+ * fixes are on the device, so that an interrupted repair leaves them
+ * orphaned for the next one; the dirent slots, the blocks and the index
+ * entries are taken through the library
+ */
+static int numbfs_check_reconnect(struct numbfs_check_ctx *ctx)
+{
+        struct numbfs_superblock_info *sbi = ctx->sbi;
+        struct numbfs_check_result *res = ctx->res;
+        struct numbfs_check_problem *p;
+        struct numbfs_inode_info lf, ni;
+        struct numbfs_dirent de;
+        char name[NUMBFS_MAX_PATH_LEN];
+        int i, len, nr = 0, err = 0;
+
+        if (ctx->lostfound < 0)
+                return 0;
+        lf.nid = ctx->lostfound;
+        err = numbfs_get_inode(sbi, &lf);
+        if (err)
+                return err;
+
+        for (i = 0; !err && i < res->nr_problems; i++) {
+                p = &res->problems[i];
+                if (p->type != NUMBFS_CHECK_ORPHAN || !p->fixed ||
+                    numbfs_check_bit(ctx->dropped, p->nid))
+                        continue;
+
+                ni.nid = p->nid;
+                err = numbfs_get_inode(sbi, &ni);
+                if (err)
+                        break;
+                len = snprintf(name, sizeof(name), "#%d", ni.nid);
+                err = numbfs_dir_add(&lf, name, len, ni.nid, IFTODT(ni.mode));
+                /* lost+found is full, or the name is taken */
+                if (err == -ENOSPC || err == -EEXIST) {
+                        numbfs_check_unfix(ctx, p);
+                        err = 0;
+                        continue;
+                }
+                if (err)
+                        break;
+                nr++;
+
+                if (!S_ISDIR(ni.mode)) {
+                        ni.nlink = 1;
+                        err = numbfs_dump_inode(&ni);
+                        continue;
+                }
+                memset(&de, 0, sizeof(de));
+                memcpy(de.name, "..", 2);
+                de.name_len = 2;
+                de.type = DT_DIR;
+                de.ino = cpu_to_le16(lf.nid);
+                err = numbfs_pwrite_inode_range(&ni, (char*)&de, sizeof(de), sizeof(de));
+                lf.nlink++;
+        }
+
+        if (!err && nr)
+                err = numbfs_dump_inode(&lf);
+        if (!err && nr)
+                err = numbfs_put_superblock(sbi);
+        return err;
+}
+
+/*
+ * fix the problems found, the data zone has been fixed window by window,
+ * the directories, the inodes and the counters are left
+ */
+static int numbfs_check_repair(struct numbfs_check_ctx *ctx, bool dry_run)
+{
+        struct numbfs_superblock_info *sbi = ctx->sbi;
+        struct numbfs_check_result *res = ctx->res;
+        struct numbfs_check_problem *p;
+        struct numbfs_check_dirent *d;
+        struct numbfs_super_block *sb;
+        struct numbfs_inode *inode;
+        int i, nid, free_inodes, free_blocks, err = 0;
+
+        if (ctx->nr_dents)
+                qsort(ctx->dents, ctx->nr_dents, sizeof(*ctx->dents), numbfs_check_cmp_dirent);
+
+        for (i = 0; !err && i < res->nr_problems; i++) {
+                p = &res->problems[i];
+                switch (p->type) {
+                case NUMBFS_CHECK_DIRENT:
+                        err = numbfs_check_drop_dirent(ctx, p->nid, p->blk);
+                        /* no index entry should be left for it */
+                        d = numbfs_check_find_dirent(ctx, p->nid, p->blk);
+                        if (d)
+                                d->nid = -1;
+                        p->fixed = true;
+                        break;
+                case NUMBFS_CHECK_NLINK:
+                        inode = numbfs_check_stage_inode(ctx, p->nid);
+                        if (!inode) {
+                                err = -ENOMEM;
+                                break;
+                        }
+                        inode->i_nlink = cpu_to_le16(p->expect);
+                        p->fixed = true;
+                        break;
+                case NUMBFS_CHECK_ORPHAN:
+                        /* freed if of unknown type, or linked under lost+found */
+                        p->fixed = numbfs_check_bit(ctx->dropped, p->nid) ||
+                                   ctx->lostfound >= 0;
+                        break;
+                case NUMBFS_CHECK_IBITMAP:
+                        /* allocated without an initialized inode table block */
+                        p->fixed = !p->expect;
+                        break;
+                case NUMBFS_CHECK_DINDEX:
+                        /*
+                         * entries of free slots and dropped dirents are deleted,
+                         * missing ones are not rebuilt
+                         */
+                        d = numbfs_check_find_dirent(ctx, p->nid, p->blk);
+                        p->fixed = p->expect < 0 || (d && d->nid < 0);
+                        break;
+                case NUMBFS_CHECK_BBITMAP:
+                case NUMBFS_CHECK_FREE_INODES:
+                case NUMBFS_CHECK_FREE_BLOCKS:
+                        p->fixed = true;
+                        break;
+                case NUMBFS_CHECK_REFCOUNT:
+                        /*
+                         * a header without the magic can't be trusted, and a
+                         * block shared without the refcount table is left
+                         */
+                        if (p->fixed)
+                                break;
+                        if (numbfs_check_is_xblock(ctx, p->blk))
+                                p->fixed = p->found >= 0;
+                        else
+                                p->fixed = numbfs_check_has_refcounts(sbi) &&
+                                           p->expect <= NUMBFS_REFCOUNT_MAX;
+                        break;
+                case NUMBFS_CHECK_MODE:
+                case NUMBFS_CHECK_SIZE:
+                case NUMBFS_CHECK_BLOCK:
+                        /* gone with a dropped inode */
+                        p->fixed = p->nid >= 0 && numbfs_check_bit(ctx->dropped, p->nid);
+                        break;
+                }
+                if (p->fixed)
+                        res->nr_fixed++;
+        }
+
+        for (nid = 0; !err && nid < sbi->total_inodes; nid++)
+                if (numbfs_check_bit(ctx->dropped, nid))
+                        err = numbfs_check_set_bit(ctx, ctx->ibitmap, sbi->ibitmap_start,
+                                                   nid, false);
+        if (!err)
+                err = numbfs_check_fix_dindex(ctx);
+        if (err)
+                return err;
+
+        free_inodes = sbi->total_inodes - numbfs_check_weight(ctx->ibitmap, sbi->total_inodes);
+        free_blocks = sbi->data_blocks - ctx->kept_blocks;
+        if (free_inodes != sbi->free_inodes || free_blocks != sbi->free_blocks) {
+                sb = (struct numbfs_super_block*)numbfs_check_stage(ctx,
+                                        NUMBFS_SUPER_OFFSET / BYTES_PER_BLOCK, NULL);
+                if (!sb)
+                        return -ENOMEM;
+                sb->s_free_inodes = cpu_to_le32(free_inodes);
+                sb->s_free_blocks = cpu_to_le32(free_blocks);
+        }
+
+        err = numbfs_check_diff(ctx);
+        if (err || dry_run)
+                return err;
+        if (!ctx->nr_stages)
+                return numbfs_check_reconnect(ctx);
+
+        sbi->free_inodes = free_inodes;
+        sbi->free_blocks = free_blocks;
+        err = numbfs_check_commit(ctx);
+        if (!err)
+                err = numbfs_check_reconnect(ctx);
+        return err;
+}
+
+/**
+ * The checker loads both bitmaps and the inode table in large sequential
+ * reads, walks the directory tree from the root reading every directory
+ * once, and builds in-memory reference counts of the inodes and the data
+ * blocks. These are then cross-checked against the bitmaps, the superblock
+ * counters, the link counts, the refcount table, the headers of the shared
+ * xattr blocks and the directory index, each read once as well.
+ *
+ * The inode table and the block bitmap are loaded and scanned in ranges
+ * by @cfg->jobs threads, the directory tree is walked by one.
+ *
+ * The owners of the data blocks take two bits per block, and the exact
+ * count only for the shared ones. If they don't fit in @cfg->max_mem with
+ * the inode tables, the data zone is checked in windows: the references to
+ * the first window are counted while scanning the inode table, the others
+ * are spilled to a temporary file per window and counted in a later pass.
+ */
+int numbfs_check(struct numbfs_superblock_info *sbi,
+                 const struct numbfs_check_cfg *cfg,
+                 struct numbfs_check_result *res)
+{
+        struct numbfs_check_ctx ctx;
+        bool repair = cfg && cfg->repair;
+        int i, lo, err;
+
+        memset(res, 0, sizeof(*res));
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.sbi = sbi;
+        ctx.res = res;
+        ctx.jobs = cfg ? cfg->jobs : 1;
+        ctx.lostfound = -1;
+
+        err = numbfs_check_load_all(&ctx, cfg ? cfg->max_mem : 0);
+        if (!err)
+                err = numbfs_check_parallel(&ctx, 0, sbi->total_inodes,
+                                            NUMBFS_NODES_PER_BLOCK, numbfs_check_inodes,
+                                            true);
+        if (!err && sbi->free_inodes != sbi->total_inodes - ctx.used)
+                err = numbfs_check_report(&ctx, NUMBFS_CHECK_FREE_INODES, -1, -1,
+                                          sbi->total_inodes - ctx.used, sbi->free_inodes);
+
+        /* the metadata tables living in the data zone */
+        if (!err && (sbi->feature & NUMBFS_FEATURE_REFCOUNT))
+                err = numbfs_check_extent(&ctx, sbi->refcount_start,
+                                DIV_ROUND_UP(sbi->data_blocks, NUMBFS_REFCOUNTS_PER_BLOCK));
+        if (!err && (sbi->feature & NUMBFS_FEATURE_DIR_INDEX))
+                err = numbfs_check_extent(&ctx, sbi->dindex_start, sbi->dindex_blocks);
+        if (!err && (sbi->feature & NUMBFS_FEATURE_TSTABLE))
+                err = numbfs_check_extent(&ctx, sbi->tstable_start,
+                                DIV_ROUND_UP(sbi->total_inodes, NUMBFS_TIMESTAMPS_PER_BLOCK));
+
+        if (!err)
+                err = numbfs_check_tree(&ctx);
+        if (!err)
+                err = numbfs_check_links(&ctx);
+        /* the inodes released by the repair give up their blocks in each window */
+        if (!err && repair)
+                err = numbfs_check_find_drops(&ctx);
+        numbfs_check_sort_xblocks(&ctx);
+        for (lo = 0; !err && lo < sbi->data_blocks; lo += ctx.window)
+                err = numbfs_check_window(&ctx, lo, repair);
+        if (!err && sbi->free_blocks != sbi->data_blocks - ctx.used_blocks)
+                err = numbfs_check_report(&ctx, NUMBFS_CHECK_FREE_BLOCKS, -1, -1,
+                                          sbi->data_blocks - ctx.used_blocks, sbi->free_blocks);
+        if (!err)
+                err = numbfs_check_dindex(&ctx);
+        if (!err && repair && res->nr_problems)
+                err = numbfs_check_repair(&ctx, cfg->dry_run);
+
+        free(ctx.ibitmap);
+        free(ctx.bbitmap);
+        free(ctx.itable);
+        free(ctx.inodes);
+        free(ctx.reached);
+        free(ctx.dropped);
+        free(ctx.owned);
+        free(ctx.many);
+        free(ctx.shared);
+        free(ctx.extra);
+        for (i = 0; ctx.spill && i < res->passes; i++)
+                if (ctx.spill[i])
+                        fclose(ctx.spill[i]);
+        free(ctx.spill);
+        free(ctx.xblocks);
+        free(ctx.dents);
+        for (i = 0; i < ctx.nr_stages; i++)
+                free(ctx.stages[i]);
+        free(ctx.stages);
+        if (err)
+                numbfs_check_release(res);
+        return err;
+}
+
+void numbfs_check_release(struct numbfs_check_result *res)
+{
+        free(res->problems);
+        res->problems = NULL;
+        res->nr_problems = res->max_problems = 0;
+        free(res->diffs);
+        res->diffs = NULL;
+        res->nr_diffs = res->max_diffs = 0;
+}
@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2025, Hongzhen Luo
+ */
+
+#ifndef __NUMBFS_CHECK_H
+#define __NUMBFS_CHECK_H
+
+#include "internal.h"
+
+/* kinds of inconsistencies */
+enum {
+        NUMBFS_CHECK_FREE_INODES,       /* superblock free inode count */
+        NUMBFS_CHECK_FREE_BLOCKS,       /* superblock free block count */
+        NUMBFS_CHECK_IBITMAP,           /* inode bitmap bit */
+        NUMBFS_CHECK_BBITMAP,           /* block bitmap bit */
+        NUMBFS_CHECK_MODE,              /* unknown inode type */
+        NUMBFS_CHECK_SIZE,              /* i_size out of range or below a mapped block */
+        NUMBFS_CHECK_BLOCK,             /* block address out of the data zone */
+        NUMBFS_CHECK_REFCOUNT,          /* owners of a block, found -1 for a bad xattr header */
+        NUMBFS_CHECK_DOT,               /* "." or ".." of a directory */
+        NUMBFS_CHECK_DIRENT,            /* dirent pointing to a free inode */
+        NUMBFS_CHECK_DTYPE,             /* dirent type differs from the inode type */
+        NUMBFS_CHECK_DIRLINK,           /* directory with more than one parent */
+        NUMBFS_CHECK_NLINK,             /* inode link count */
+        NUMBFS_CHECK_ORPHAN,            /* allocated inode not reachable from the root */
+        NUMBFS_CHECK_DINDEX,            /* directory index entry */
+        NUMBFS_CHECK_MAX,
+};
+
+/*
+ * one inconsistency, @nid and @blk are -1 if not relevant; for dirents
+ * @nid is the directory and @blk the dirent slot
+ */
+struct numbfs_check_problem {
+        int type;
+        int nid;
+        int blk;
+        long long expect;
+        long long found;
+        /* repaired, or would be with a dry run */
+        bool fixed;
+};
+
+/* a byte range of block @blkno rewritten by the repair */
+struct numbfs_check_diff {
+        int blkno;
+        int off;
+        int len;
+};
+
+struct numbfs_check_result {
+        struct numbfs_check_problem *problems;
+        int nr_problems, max_problems;
+        /* allocated inodes by type, and referenced data blocks */
+        int dirs, files, symlinks, others;
+        int blocks;
+        /* passes over the data zone, more than one to fit in cfg->max_mem */
+        int passes;
+        /* with cfg->repair, the problems fixed and the bytes changed */
+        int nr_fixed;
+        struct numbfs_check_diff *diffs;
+        int nr_diffs, max_diffs;
+};
+
+struct numbfs_check_cfg {
+        /* threads scanning the inode table and the block bitmap */
+        int jobs;
+        /* fix the problems found, only compute the changes with @dry_run */
+        bool repair;
+        bool dry_run;
+        /* bytes for the tables sized by the filesystem, 0 for no limit */
+        long long max_mem;
+};
+
+/*
+ * Check the whole filesystem, all the problems found are put in @res,
+ * which should be released by numbfs_check_release(). @cfg may be NULL
+ * for the defaults.
+ *
+ * The repair fixes the bitmaps, the superblock counters, the refcounts,
+ * the link counts, and drops dangling dirents. A block shared on an image
+ * without the refcount table is left as it is. All the changes are staged
+ * in memory and written at the end in block order, the superblock last.
+ *
+ * Orphaned inodes of unknown type are freed with their blocks, the others
+ * are linked under lost+found as "#<nid>" once the staged changes are
+ * written, and left orphaned without a lost+found. These links are not
+ * in @res->diffs.
+ *
+ * With cfg->max_mem, the data zone is checked in as many passes as needed
+ * to keep the tables within it, spilling block references to temporary
+ * files. The problems found, the blocks staged by the repair, a record per
+ * live dirent for the directory index check, and the references to the
+ * shared data blocks and xattr blocks come on top of it: they grow with
+ * the directory tree and the sharing, not with the size of the image.
+ */
+int numbfs_check(struct numbfs_superblock_info *sbi,
+                 const struct numbfs_check_cfg *cfg,
+                 struct numbfs_check_result *res);
+void numbfs_check_release(struct numbfs_check_result *res);
+
+/* the smallest cfg->max_mem the check runs with, -ENOMEM below it */
+long long numbfs_check_min_mem(struct numbfs_superblock_info *sbi);
+
+/* a short name of the problem type, and a line describing @p */
+const char *numbfs_check_name(int type);
+int numbfs_check_describe(const struct numbfs_check_problem *p,
+                          char *buf, int size);
+
+#endif
@@ -0,0 +1,480 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2025, Hongzhen Luo
+ */
+
+#include "internal.h"
+#include "disk.h"
+#include <getopt.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+static struct option long_options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"dry-run", no_argument, NULL, 'n'},
+        {0, 0, 0, 0}
+};
+
+struct numbfs_dedup_cfg {
+        int jobs;
+        bool dry_run;
+        char *dev;
+};
+
+/* a reference from i_data[idx] of inode@nid to a data block */
+struct numbfs_dedup_ref {
+        int nid;
+        int idx;
+        int blk;
+};
+
+/* a distinct data block and the hash of its content */
+struct numbfs_dedup_blk {
+        unsigned long long hash;
+        int blk;
+        /* the number of references, keepers count their new owners too */
+        int refs;
+        /* the block with the same content to share, or -1 */
+        int keeper;
+};
+
+/* hash the blocks in [start, end) */
+struct numbfs_dedup_worker {
+        pthread_t thread;
+        struct numbfs_superblock_info *sbi;
+        struct numbfs_dedup_blk *blks;
+        int start;
+        int end;
+        int err;
+};
+
+static void numbfs_dedup_help(void)
+{
+        printf(
+                "Usage: [OPTIONS] TARGET\n"
+                "Share the data blocks with identical content.\n"
+                "\n"
+                "Gerneral options:\n"
+                " --help                display this help information and exit\n"
+                " --jobs|-j=#           number of hashing threads (default: online cpus)\n"
+                " --dry-run|-n          only report the duplicate blocks\n"
+        );
+}
+
+static void numbfs_dedup_parse_args(int argc, char **argv, struct numbfs_dedup_cfg *cfg)
+{
+        int opt;
+
+        while ((opt = getopt_long(argc, argv, "j:hn", long_options, NULL)) != -1) {
+                switch(opt) {
+                        case 'h':
+                                numbfs_dedup_help();
+                                exit(0);
+                        case 'j':
+                                cfg->jobs = atoi(optarg);
+                                if (cfg->jobs <= 0) {
+                                        fprintf(stderr, "invalid jobs: %s\n", optarg);
+                                        exit(1);
+                                }
+                                break;
+                        case 'n':
+                                cfg->dry_run = true;
+                                break;
+                        default:
+                                fprintf(stderr, "Unknown option: %s\n\n", argv[optind - 1]);
+                                numbfs_dedup_help();
+                                exit(1);
+                }
+        }
+
+        if (optind >= argc) {
+                fprintf(stderr, "missing block device!\n");
+                exit(1);
+        }
+
+        cfg->dev = strdup(argv[optind++]);
+        if (!cfg->dev) {
+                fprintf(stderr, "failed to get block device path\n");
+                exit(1);
+        }
+}
+
+static int numbfs_dedup_cmp_ref(const void *a, const void *b)
+{
+        const struct numbfs_dedup_ref *ra = a, *rb = b;
+
+        return ra->blk - rb->blk;
+}
+
+static int numbfs_dedup_cmp_nid(const void *a, const void *b)
+{
+        const struct numbfs_dedup_ref *ra = a, *rb = b;
+
+        if (ra->nid != rb->nid)
+                return ra->nid - rb->nid;
+        return ra->idx - rb->idx;
+}
+
+static int numbfs_dedup_cmp_hash(const void *a, const void *b)
+{
+        const struct numbfs_dedup_blk *ba = a, *bb = b;
+
+        if (ba->hash != bb->hash)
+                return ba->hash < bb->hash ? -1 : 1;
+        return ba->blk - bb->blk;
+}
+
+static int numbfs_dedup_cmp_blk(const void *a, const void *b)
+{
+        const struct numbfs_dedup_blk *ba = a, *bb = b;
+
+        return ba->blk - bb->blk;
+}
+
+/* collect the i_data references of all the allocated inodes */
+static int numbfs_dedup_collect(struct numbfs_superblock_info *sbi,
+                                struct numbfs_dedup_ref **refs, int *nr,
+                                int *nr_inodes)
+{
+        struct numbfs_inode_info ni;
+        char buf[BYTES_PER_BLOCK];
+        int err, nid, i, cap = 0;
+
+        *refs = NULL;
+        *nr = 0;
+        *nr_inodes = 0;
+        for (nid = 0; nid < sbi->total_inodes; nid++) {
+                if (nid % NUMBFS_BLOCKS_PER_BLOCK == 0) {
+                        err = numbfs_read_block(sbi, buf,
+                                        numbfs_bmap_blk(sbi->ibitmap_start, nid));
+                        if (err)
+                                return err;
+                }
+
+                if (!(buf[numbfs_bmap_byte(nid)] & (1 << numbfs_bmap_bit(nid))))
+                        continue;
+
+                ni.nid = nid;
+                ni.sbi = sbi;
+                err = numbfs_get_inode(sbi, &ni);
+                if (err)
+                        return err;
+
+                (*nr_inodes)++;
+                for (i = 0; i < NUMBFS_NUM_DATA_ENTRY; i++) {
+                        if (ni.data[i] == NUMBFS_HOLE)
+                                continue;
+
+                        if (*nr == cap) {
+                                struct numbfs_dedup_ref *tmp;
+
+                                cap = cap ? cap * 2 : 1024;
+                                tmp = realloc(*refs, cap * sizeof(**refs));
+                                if (!tmp)
+                                        return -ENOMEM;
+                                *refs = tmp;
+                        }
+                        (*refs)[*nr].nid = nid;
+                        (*refs)[*nr].idx = i;
+                        (*refs)[*nr].blk = ni.data[i];
+                        (*nr)++;
+                }
+        }
+        return 0;
+}
+
+static void *numbfs_dedup_hash_worker(void *arg)
+{
+        struct numbfs_dedup_worker *w = arg;
+        char buf[BYTES_PER_BLOCK];
+        int i;
+
+        for (i = w->start; i < w->end; i++) {
+                w->err = numbfs_read_block(w->sbi, buf,
+                                numbfs_data_blk(w->sbi, w->blks[i].blk));
+                if (w->err)
+                        break;
+                w->blks[i].hash = numbfs_hash(NUMBFS_HASH_SEED, buf, BYTES_PER_BLOCK);
+        }
+        return NULL;
+}
+
+/* hash the distinct blocks in parallel */
+static int numbfs_dedup_hash(struct numbfs_superblock_info *sbi,
+                             struct numbfs_dedup_blk *blks, int nr, int jobs)
+{
+        struct numbfs_dedup_worker *workers;
+        int i, err = 0, chunk;
+
+        jobs = max(min(jobs, nr), 1);
+        workers = calloc(jobs, sizeof(*workers));
+        if (!workers)
+                return -ENOMEM;
+
+        chunk = DIV_ROUND_UP(nr, jobs);
+        for (i = 0; i < jobs; i++) {
+                workers[i].sbi = sbi;
+                workers[i].blks = blks;
+                workers[i].start = min(i * chunk, nr);
+                workers[i].end = min((i + 1) * chunk, nr);
+                if (pthread_create(&workers[i].thread, NULL,
+                                   numbfs_dedup_hash_worker, &workers[i])) {
+                        jobs = i;
+                        err = -EAGAIN;
+                        break;
+                }
+        }
+
+        for (i = 0; i < jobs; i++) {
+                pthread_join(workers[i].thread, NULL);
+                if (workers[i].err)
+                        err = workers[i].err;
+        }
+        free(workers);
+        return err;
+}
+
+/*
+ * find the keeper of each block within the runs of equal hashes, the
+ * content is compared byte by byte to rule out hash collisions; a block
+ * with no keeper left that can take all its references becomes one
+ */
+static int numbfs_dedup_match(struct numbfs_superblock_info *sbi,
+                              struct numbfs_dedup_blk *blks, int nr, int *dups)
+{
+        char cur[BYTES_PER_BLOCK], cand[BYTES_PER_BLOCK];
+        int i, j, k, err;
+
+        *dups = 0;
+        qsort(blks, nr, sizeof(*blks), numbfs_dedup_cmp_hash);
+        for (i = 0; i < nr; i = j) {
+                for (j = i + 1; j < nr && blks[j].hash == blks[i].hash; j++) {
+                        err = numbfs_read_block(sbi, cur, numbfs_data_blk(sbi, blks[j].blk));
+                        if (err)
+                                return err;
+
+                        for (k = i; k < j; k++) {
+                                if (blks[k].keeper >= 0 ||
+                                    blks[k].refs + blks[j].refs > NUMBFS_REFCOUNT_MAX)
+                                        continue;
+
+                                err = numbfs_read_block(sbi, cand,
+                                                numbfs_data_blk(sbi, blks[k].blk));
+                                if (err)
+                                        return err;
+
+                                if (!memcmp(cur, cand, BYTES_PER_BLOCK)) {
+                                        blks[j].keeper = blks[k].blk;
+                                        blks[k].refs += blks[j].refs;
+                                        (*dups)++;
+                                        break;
+                                }
+                        }
+                }
+        }
+        qsort(blks, nr, sizeof(*blks), numbfs_dedup_cmp_blk);
+        return 0;
+}
+
+/* redirect the references to the duplicate blocks to their keepers */
+static int numbfs_dedup_apply(struct numbfs_superblock_info *sbi,
+                              struct numbfs_dedup_ref *refs, int nr,
+                              int *shares, int *frees, int nr_moved)
+{
+        struct numbfs_inode_info ni;
+        int i, err;
+
+        /* the keepers get their new owners before anyone drops a reference */
+        err = numbfs_share_blocks(sbi, shares, nr_moved);
+        if (err) {
+                fprintf(stderr, "error: failed to update block refcounts\n");
+                return err;
+        }
+
+        /* @refs are sorted by nid, each inode is written once */
+        ni.nid = -1;
+        for (i = 0; i < nr; i++) {
+                if (refs[i].nid != ni.nid) {
+                        if (ni.nid >= 0) {
+                                err = numbfs_dump_inode(&ni);
+                                if (err)
+                                        return err;
+                        }
+
+                        ni.nid = refs[i].nid;
+                        ni.sbi = sbi;
+                        err = numbfs_get_inode(sbi, &ni);
+                        if (err)
+                                return err;
+                }
+                ni.data[refs[i].idx] = refs[i].blk;
+        }
+        if (ni.nid >= 0) {
+                err = numbfs_dump_inode(&ni);
+                if (err)
+                        return err;
+        }
+
+        err = numbfs_free_blocks(sbi, frees, nr_moved);
+        if (err) {
+                fprintf(stderr, "error: failed to release duplicate blocks\n");
+                return err;
+        }
+        return numbfs_put_superblock(sbi);
+}
+
+static int numbfs_dedup(struct numbfs_superblock_info *sbi,
+                        struct numbfs_dedup_cfg *cfg)
+{
+        struct numbfs_dedup_ref *refs, *moved = NULL;
+        struct numbfs_dedup_blk *blks = NULL, key, *found;
+        int *shares = NULL, *frees = NULL;
+        int nr_refs, nr_inodes, nr_blks = 0, nr_moved = 0, dups;
+        int free_blocks, i, err;
+
+        err = numbfs_dedup_collect(sbi, &refs, &nr_refs, &nr_inodes);
+        if (err) {
+                fprintf(stderr, "error: failed to scan the inodes\n");
+                goto exit;
+        }
+
+        /* distinct blocks, a block may already be shared */
+        qsort(refs, nr_refs, sizeof(*refs), numbfs_dedup_cmp_ref);
+        blks = malloc(max(nr_refs, 1) * sizeof(*blks));
+        if (!blks) {
+                err = -ENOMEM;
+                goto exit;
+        }
+        for (i = 0; i < nr_refs; i++) {
+                if (i && refs[i].blk == refs[i - 1].blk) {
+                        blks[nr_blks - 1].refs++;
+                        continue;
+                }
+                blks[nr_blks].blk = refs[i].blk;
+                blks[nr_blks].refs = 1;
+                blks[nr_blks].keeper = -1;
+                nr_blks++;
+        }
+
+        err = numbfs_dedup_hash(sbi, blks, nr_blks, cfg->jobs);
+        if (err) {
+                fprintf(stderr, "error: failed to hash the data blocks\n");
+                goto exit;
+        }
+
+        err = numbfs_dedup_match(sbi, blks, nr_blks, &dups);
+        if (err)
+                goto exit;
+
+        shares = malloc(max(nr_refs, 1) * sizeof(int));
+        frees = malloc(max(nr_refs, 1) * sizeof(int));
+        moved = malloc(max(nr_refs, 1) * sizeof(*moved));
+        if (!shares || !frees || !moved) {
+                err = -ENOMEM;
+                goto exit;
+        }
+
+        for (i = 0; i < nr_refs; i++) {
+                key.blk = refs[i].blk;
+                found = bsearch(&key, blks, nr_blks, sizeof(*blks),
+                                numbfs_dedup_cmp_blk);
+                BUG_ON(!found);
+                if (found->keeper < 0)
+                        continue;
+
+                frees[nr_moved] = refs[i].blk;
+                shares[nr_moved] = found->keeper;
+                moved[nr_moved] = refs[i];
+                moved[nr_moved].blk = found->keeper;
+                nr_moved++;
+        }
+
+        printf("Deduplication Information\n");
+        printf("    inodes scanned:             %d\n", nr_inodes);
+        printf("    data blocks scanned:        %d\n", nr_blks);
+        printf("    duplicate blocks:           %d\n", dups);
+        printf("    redirected references:      %d\n", nr_moved);
+
+        if (cfg->dry_run || !nr_moved) {
+                printf("    reclaimable space:          %d KiB\n",
+                        dups * BYTES_PER_BLOCK / 1024);
+                goto exit;
+        }
+
+        free_blocks = sbi->free_blocks;
+        if (!(sbi->feature & NUMBFS_FEATURE_REFCOUNT)) {
+                err = numbfs_enable_refcount(sbi);
+                if (err) {
+                        fprintf(stderr, "error: failed to enable block refcount\n");
+                        goto exit;
+                }
+                err = numbfs_put_superblock(sbi);
+                if (err)
+                        goto exit;
+                printf("    refcount table blocks:      %d\n",
+                        free_blocks - sbi->free_blocks);
+                free_blocks = sbi->free_blocks;
+        }
+
+        qsort(moved, nr_moved, sizeof(*moved), numbfs_dedup_cmp_nid);
+        err = numbfs_dedup_apply(sbi, moved, nr_moved, shares, frees, nr_moved);
+        if (err) {
+                /* the refcount table and the freed blocks are on disk */
+                numbfs_put_superblock(sbi);
+                goto exit;
+        }
+
+        printf("    reclaimed space:            %d KiB\n",
+                (sbi->free_blocks - free_blocks) * BYTES_PER_BLOCK / 1024);
+exit:
+        free(moved);
+        free(frees);
+        free(shares);
+        free(blks);
+        free(refs);
+        return err;
+}
+
+int main(int argc, char **argv)
+{
+        struct numbfs_dedup_cfg cfg = {
+                .jobs = max((int)sysconf(_SC_NPROCESSORS_ONLN), 1),
+                .dry_run = false,
+                .dev = NULL
+        };
+        struct numbfs_superblock_info sbi;
+        int fd, err;
+
+        numbfs_dedup_parse_args(argc, argv, &cfg);
+
+        fd = open(cfg.dev, cfg.dry_run ? O_RDONLY : O_RDWR);
+        if (fd < 0) {
+                fprintf(stderr, "failed to open %s\n", cfg.dev);
+                err = -errno;
+                goto exit;
+        }
+
+        err = numbfs_get_superblock(&sbi, fd);
+        if (err) {
+                fprintf(stderr, "failed to read superblock\n");
+                goto exit;
+        }
+
+        err = numbfs_dedup(&sbi, &cfg);
+exit:
+        if (fd >= 0)
+                close(fd);
+        free(cfg.dev);
+        if (err) {
+                fprintf(stderr, "Error occured in dedup, err: %d\n", err);
+                exit(1);
+        }
+        return 0;
+}
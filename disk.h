@@ -20,6 +20,12 @@
 /* root inode number */
 #define NUMBFS_ROOT_NID	0
 
+/* feature bits */
+#define NUMBFS_FEATURE_REFCOUNT	0x00000001 /* data blocks may be shared */
+#define NUMBFS_FEATURE_DIR_INDEX	0x00000002 /* hashed directory index */
+#define NUMBFS_FEATURE_TSTABLE	0x00000004 /* packed timestamp table */
+#define NUMBFS_FEATURE_LAZY_ITABLE	0x00000008 /* inode table initialized on demand */
+
 #define NUMBFS_NUM_DATA_ENTRY	10
 #define NUMBFS_MAX_PATH_LEN	60
 #define NUMBFS_MAX_ATTR 32
@@ -45,8 +51,17 @@ struct numbfs_super_block {
 	__le32 s_data_blocks;
 	/* num of free data blocks */
 	__le32 s_free_blocks;
+	/* data block addr of the block refcount table */
+	__le32 s_refcount_start;
+	/* data block addr and num of blocks of the directory index */
+	__le32 s_dindex_start;
+	__le32 s_dindex_blocks;
+	/* data block addr of the timestamp table */
+	__le32 s_tstable_start;
+	/* num of initialized inode table blocks, with a lazy inode table */
+	__le32 s_itable_init;
 	/* reserved */
-	__u8 s_reserved[88];
+	__u8 s_reserved[68];
 };
 
 /* 64-byte on-disk numbfs inode */
@@ -81,6 +96,40 @@ struct numbfs_timestamps {
 	__u8 reserved[8];
 };
 
+#define NUMBFS_TIMESTAMPS_PER_BLOCK \
+	(BYTES_PER_BLOCK / sizeof(struct numbfs_timestamps))
+
+/*
+ * The block refcount table holds one entry per data block, 0 means the
+ * block is not shared and is owned by its only user, otherwise it is the
+ * number of owners.
+ */
+#define NUMBFS_REFCOUNTS_PER_BLOCK	(BYTES_PER_BLOCK / sizeof(__le16))
+#define NUMBFS_REFCOUNT_MAX		0xFFFF
+
+/*
+ * The directory index is a filesystem-wide hash table keyed by the hash
+ * of (parent nid, name), a bucket is one block and full buckets overflow
+ * into the following ones. "." and ".." are not indexed.
+ */
+#define NUMBFS_DINDEX_FREE	0 /* never used, ends a probe */
+#define NUMBFS_DINDEX_USED	1
+#define NUMBFS_DINDEX_DELETED	2
+
+/* 16-byte on-disk directory index entry */
+struct numbfs_dindex_entry {
+	__le64 d_hash;
+	__le16 d_pnid;
+	__le16 d_nid;
+	/* dirent slot in the parent directory */
+	__le16 d_slot;
+	__u8 d_state;
+	__u8 d_reserved;
+};
+
+#define NUMBFS_DINDEX_PER_BLOCK \
+	(BYTES_PER_BLOCK / sizeof(struct numbfs_dindex_entry))
+
 /* xattr name indexes */
 #define NUMBFS_XATTR_INDEX_USER              1
 #define NUMBFS_XATTR_INDEX_TRUSTED           2
@@ -98,6 +147,21 @@ struct numbfs_xattr_entry {
 	__u8 e_value[NUMBFS_XATTR_MAXVALUE];
 };
 
+/*
+ * With NUMBFS_FEATURE_TSTABLE, the timestamps of an xattr block are
+ * replaced by this header, inodes with the same xattrs share one block.
+ */
+struct numbfs_xattr_header {
+	__le32 h_magic;
+	/* number of inodes using this block */
+	__le32 h_refcount;
+	/* hash of the entries */
+	__le64 h_hash;
+	__u8 h_reserved[16];
+};
+
+#define NUMBFS_XATTR_MAGIC	0x58415452 /* "XATR" */
+
 #define NUMBFS_XATTR_MAX_ENTRY \
 	((BYTES_PER_BLOCK - sizeof(struct numbfs_timestamps)) / sizeof(struct numbfs_xattr_entry))
 #define NUMBFS_XATTR_ENTRY_START	(sizeof(struct numbfs_timestamps))
@@ -109,6 +173,9 @@ static inline void numbfs_check_ondisk(void)
 	NUMBFS_BUILD_BUG_ON(sizeof(struct numbfs_inode) != 64);
 	NUMBFS_BUILD_BUG_ON(sizeof(struct numbfs_dirent) != 64);
 	NUMBFS_BUILD_BUG_ON(sizeof(struct numbfs_timestamps) != 32);
+	NUMBFS_BUILD_BUG_ON(sizeof(struct numbfs_xattr_header) !=
+			    sizeof(struct numbfs_timestamps));
+	NUMBFS_BUILD_BUG_ON(sizeof(struct numbfs_dindex_entry) != 16);
 }
 
 #endif
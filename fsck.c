@@ -5,6 +5,7 @@
 
 #include "internal.h"
 #include "disk.h"
+#include "check.h"
 #include <getopt.h>
 #include <unistd.h>
 #include <stdbool.h>
@@ -15,19 +16,37 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <pthread.h>
 
 static struct option long_options[] = {
         {"help", no_argument, NULL, 'h'},
         {"inodes", no_argument, NULL, 'i'},
         {"blocks", no_argument, NULL, 'b'},
         {"nid", required_argument, NULL, 'n'},
+        {"path", required_argument, NULL, 'p'},
+        {"compact", optional_argument, NULL, 'c'},
+        {"check", no_argument, NULL, 'C'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"repair", no_argument, NULL, 'r'},
+        {"dry-run", no_argument, NULL, 'N'},
+        {"format", required_argument, NULL, 1},
+        {"max-mem", required_argument, NULL, 2},
         {0, 0, 0, 0}
 };
 
 struct numbfs_fsck_cfg {
         bool show_inodes;
         bool show_blocks;
+        bool compact;
+        bool compact_sort;
+        bool check;
+        bool repair;
+        bool dry_run;
+        bool json;
+        int jobs;
+        long long max_mem;
         int nid;
+        char *path;
         char *dev;
 };
 
@@ -42,14 +61,31 @@ static void numbfs_fsck_help(void)
                 " --inodes|-i           display inode usage\n"
                 " --blocks|-b           display block usage\n"
                 " --nid=X               display the inode information of inode@nid\n"
+                " --path=X              display the inode information of the file at path X\n"
+                " --compact[=sort]      compact all directories, optionally sort the entries\n"
+                "                       by inode number\n"
+                " --check|-C            check the consistency of the whole filesystem\n"
+                " --repair|-r           check and fix the problems found, all the changes are\n"
+                "                       written together at the end; orphaned inodes are\n"
+                "                       linked under lost+found, and freed with their data\n"
+                "                       if their type is unknown\n"
+                " --dry-run|-N          check and show what --repair would change\n"
+                " --format=X            output format, text (default) or json\n"
+                " --max-mem=X           memory budget of the check, xxx K, xxx M or xxx G,\n"
+                "                       the data zone is checked in several passes if needed;\n"
+                "                       the records of the live dirents and of the shared\n"
+                "                       blocks are outside of it\n"
+                " --jobs|-j=#           number of threads scanning the bitmaps and the inode\n"
+                "                       table, the number of online CPUs by default\n"
         );
 }
 
 static void numbfs_fsck_parse_args(int argc, char **argv, struct numbfs_fsck_cfg *cfg)
 {
+        char unit;
         int opt;
 
-        while ((opt = getopt_long(argc, argv, "n:hib", long_options, NULL)) != -1) {
+        while ((opt = getopt_long(argc, argv, "n:p:hibCj:rN", long_options, NULL)) != -1) {
                 switch(opt) {
                         case 'h':
                                 numbfs_fsck_help();
@@ -63,6 +99,57 @@ static void numbfs_fsck_parse_args(int argc, char **argv, struct numbfs_fsck_cfg
                         case 'n':
                                 cfg->nid = atoi(optarg);
                                 break;
+                        case 'p':
+                                cfg->path = optarg;
+                                break;
+                        case 'C':
+                                cfg->check = true;
+                                break;
+                        case 'r':
+                                cfg->check = cfg->repair = true;
+                                break;
+                        case 'N':
+                                cfg->check = cfg->repair = cfg->dry_run = true;
+                                break;
+                        case 1:
+                                if (!strcmp(optarg, "json")) {
+                                        cfg->json = true;
+                                } else if (strcmp(optarg, "text")) {
+                                        fprintf(stderr, "invalid format: %s\n", optarg);
+                                        exit(1);
+                                }
+                                break;
+                        case 2:
+                                unit = 0;
+                                if (sscanf(optarg, "%lld%c", &cfg->max_mem, &unit) < 1 ||
+                                    cfg->max_mem <= 0) {
+                                        fprintf(stderr, "invalid memory budget: %s\n", optarg);
+                                        exit(1);
+                                }
+                                if (unit == 'k' || unit == 'K')
+                                        cfg->max_mem <<= 10;
+                                else if (unit == 'm' || unit == 'M')
+                                        cfg->max_mem <<= 20;
+                                else if (unit == 'g' || unit == 'G')
+                                        cfg->max_mem <<= 30;
+                                break;
+                        case 'j':
+                                cfg->jobs = atoi(optarg);
+                                if (cfg->jobs <= 0) {
+                                        fprintf(stderr, "invalid jobs: %s\n", optarg);
+                                        exit(1);
+                                }
+                                break;
+                        case 'c':
+                                cfg->compact = true;
+                                if (!optarg)
+                                        break;
+                                if (strcmp(optarg, "sort")) {
+                                        fprintf(stderr, "invalid compact mode: %s\n", optarg);
+                                        exit(1);
+                                }
+                                cfg->compact_sort = true;
+                                break;
                         default:
                                 fprintf(stderr, "Unknown option: %s\n\n", argv[optind - 1]);
                                 numbfs_fsck_help();
@@ -82,24 +169,255 @@ static void numbfs_fsck_parse_args(int argc, char **argv, struct numbfs_fsck_cfg
         }
 }
 
-static int count_bit(__u8 byte)
+/* blocks of a bitmap read and counted at a time */
+#define NUMBFS_FSCK_CHUNK       2048
+
+/* counts the set bits of a range of bitmap blocks */
+struct numbfs_fsck_counter {
+        pthread_t thread;
+        struct numbfs_superblock_info *sbi;
+        int start, nr;
+        long long cnt;
+        int err;
+};
+
+static void *numbfs_fsck_count(void *arg)
+{
+        struct numbfs_fsck_counter *c = arg;
+        int start = c->start, nr = c->nr, len;
+        char *buf;
+
+        buf = malloc((size_t)min(nr, NUMBFS_FSCK_CHUNK) * BYTES_PER_BLOCK);
+        if (!buf) {
+                c->err = -ENOMEM;
+                return NULL;
+        }
+
+        for (; nr > 0; start += len, nr -= len) {
+                len = min(nr, NUMBFS_FSCK_CHUNK);
+                c->err = numbfs_read_blocks(c->sbi, buf, start, len);
+                if (c->err)
+                        break;
+                c->cnt += numbfs_bitmap_weight(buf, (long long)len * BYTES_PER_BLOCK);
+        }
+        free(buf);
+        return NULL;
+}
+
+/* count the set bits in the bitmap blocks [@start, @start + @nr) with @jobs threads */
+static int numbfs_fsck_used(struct numbfs_superblock_info *sbi, int start,
+                            int nr, int jobs, long long *cnt)
+{
+        struct numbfs_fsck_counter *counters;
+        int i, per, nr_counters, err = 0;
+
+        *cnt = 0;
+        if (nr <= 0)
+                return 0;
+
+        per = DIV_ROUND_UP(nr, jobs);
+        nr_counters = DIV_ROUND_UP(nr, per);
+        counters = calloc(nr_counters, sizeof(*counters));
+        if (!counters)
+                return -ENOMEM;
+
+        for (i = 0; i < nr_counters; i++) {
+                counters[i].sbi = sbi;
+                counters[i].start = start + i * per;
+                counters[i].nr = min(nr - i * per, per);
+                /* count it here if no thread can be created */
+                if (!i || pthread_create(&counters[i].thread, NULL,
+                                         numbfs_fsck_count, &counters[i])) {
+                        counters[i].thread = 0;
+                        numbfs_fsck_count(&counters[i]);
+                }
+        }
+
+        for (i = 0; i < nr_counters; i++) {
+                if (counters[i].thread)
+                        pthread_join(counters[i].thread, NULL);
+                if (!err)
+                        err = counters[i].err;
+                *cnt += counters[i].cnt;
+        }
+        free(counters);
+        return err;
+}
+
+/*
+ * The output is either aligned text or a JSON document. The JSON is
+ * written as it goes, keeping only the nesting state, so the memory used
+ * doesn't depend on the size of the filesystem.
+ */
+#define NUMBFS_JSON_MAX_DEPTH   8
+
+static struct {
+        bool enabled;
+        int depth;
+        /* a member has been written at this level */
+        bool more[NUMBFS_JSON_MAX_DEPTH];
+        /* '}' or ']' closing this level */
+        char end[NUMBFS_JSON_MAX_DEPTH];
+} json;
+
+/* start a member of the current object, or an element if @key is NULL */
+static void numbfs_json_key(const char *key)
+{
+        if (json.depth) {
+                printf("%s\n%*s", json.more[json.depth - 1] ? "," : "",
+                       json.depth * 2, "");
+                json.more[json.depth - 1] = true;
+        }
+        if (key)
+                printf("\"%s\": ", key);
+}
+
+/* the length of the UTF-8 sequence at @s, 0 if it isn't a valid one */
+static int numbfs_json_utf8(const unsigned char *s, int len)
+{
+        unsigned int cp;
+        int i, n;
+
+        if (s[0] < 0x80)
+                return 1;
+
+        if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+                n = 2;
+                cp = s[0] & 0x1f;
+        } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+                n = 3;
+                cp = s[0] & 0x0f;
+        } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+                n = 4;
+                cp = s[0] & 0x07;
+        } else {
+                return 0;
+        }
+        if (n > len)
+                return 0;
+
+        for (i = 1; i < n; i++) {
+                if ((s[i] & 0xc0) != 0x80)
+                        return 0;
+                cp = cp << 6 | (s[i] & 0x3f);
+        }
+
+        /* overlong forms, surrogates and beyond the last code point */
+        if ((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000) ||
+            (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+                return 0;
+        return n;
+}
+
+/* all the @len bytes of @str, those that aren't valid UTF-8 as Latin-1 */
+static void numbfs_json_string(const char *key, const char *str, int len)
+{
+        const unsigned char *s = (const unsigned char*)str;
+        int i, n;
+
+        numbfs_json_key(key);
+        putchar('"');
+        for (i = 0; i < len; i += n) {
+                n = numbfs_json_utf8(s + i, len - i);
+                if (s[i] == '"' || s[i] == '\\') {
+                        printf("\\%c", s[i]);
+                } else if (s[i] < 0x20 || !n) {
+                        printf("\\u%04x", s[i]);
+                        n = 1;
+                } else {
+                        fwrite(s + i, 1, n, stdout);
+                }
+        }
+        putchar('"');
+}
+
+static void numbfs_json_int(const char *key, long long val)
+{
+        numbfs_json_key(key);
+        printf("%lld", val);
+}
+
+static void numbfs_json_bool(const char *key, bool val)
+{
+        numbfs_json_key(key);
+        printf("%s", val ? "true" : "false");
+}
+
+/* open an object with '{' or an array with '[' */
+static void numbfs_json_open(const char *key, char c)
+{
+        numbfs_json_key(key);
+        putchar(c);
+        BUG_ON(json.depth >= NUMBFS_JSON_MAX_DEPTH);
+        json.end[json.depth] = c == '{' ? '}' : ']';
+        json.more[json.depth++] = false;
+}
+
+static void numbfs_json_close(void)
+{
+        json.depth--;
+        if (json.more[json.depth])
+                printf("\n%*s", json.depth * 2, "");
+        putchar(json.end[json.depth]);
+        if (!json.depth)
+                putchar('\n');
+}
+
+/* a section of the report, an object in JSON */
+static void numbfs_out_section(const char *title, const char *key)
+{
+        if (json.enabled) {
+                numbfs_json_open(key, '{');
+                return;
+        }
+        if (strcmp(key, "superblock"))
+                printf("================================\n");
+        printf("%s\n", title);
+}
+
+static void numbfs_out_section_end(void)
 {
-        int ret = 0, i;
+        if (json.enabled)
+                numbfs_json_close();
+}
+
+/* an aligned "label: value" line of text, or a JSON member */
+static void numbfs_out_int(const char *label, const char *key, long long val)
+{
+        char buf[64];
 
-        for (i = 0; i < 8; i ++) {
-                ret += (byte & 1);
-                byte >>= 1;
+        if (json.enabled) {
+                numbfs_json_int(key, val);
+                return;
         }
-        return ret;
+        snprintf(buf, sizeof(buf), "%s:", label);
+        printf("    %-28s%lld\n", buf, val);
 }
 
-static int numbfs_fsck_used(char *buf)
+static void numbfs_out_str(const char *label, const char *key, const char *val)
 {
-        int i, ret = 0;
+        char buf[64];
 
-        for (i = 0; i < BYTES_PER_BLOCK; i++)
-                ret += count_bit(buf[i]);
-        return ret;
+        if (json.enabled) {
+                numbfs_json_string(key, val, strlen(val));
+                return;
+        }
+        snprintf(buf, sizeof(buf), "%s:", label);
+        printf("    %-28s%s\n", buf, val);
+}
+
+/* a percentage of @total, the count itself in JSON */
+static void numbfs_out_usage(const char *label, const char *key, long long cnt,
+                             long long total)
+{
+        char buf[64];
+
+        if (json.enabled) {
+                numbfs_json_int(key, cnt);
+                return;
+        }
+        snprintf(buf, sizeof(buf), "%s:", label);
+        printf("    %-28s%.2f%%\n", buf, 100.0 * cnt / total);
 }
 
 static inline char *numbfs_dir_type(int type)
@@ -124,8 +442,7 @@ static void numbfs_dump_xattrs(struct numbfs_inode_info *ni)
 {
         char buf[BYTES_PER_BLOCK];
         struct numbfs_xattr_entry *xe;
-        char name[NUMBFS_XATTR_MAXNAME], value[NUMBFS_XATTR_MAXVALUE];
-        int err, i, j;
+        int err, i;
 
 
         if (!ni->xattr_count)
@@ -137,30 +454,99 @@ static void numbfs_dump_xattrs(struct numbfs_inode_info *ni)
                 return;
         }
 
-        printf("    -------\n");
-        printf("    xattrs (count: %d)\n", ni->xattr_count);
+        if (json.enabled) {
+                numbfs_json_open("xattrs", '[');
+        } else {
+                printf("    -------\n");
+                printf("    xattrs (count: %d)\n", ni->xattr_count);
+        }
         xe = (struct numbfs_xattr_entry*)(buf + NUMBFS_XATTR_ENTRY_START);
         for (i = 0; i < (int)NUMBFS_XATTR_MAX_ENTRY; i++, xe++) {
-                int front;
-
                 if (!xe->e_valid)
                         continue;
 
-                memset(name, 0, sizeof(name));
-                memset(value, 0, sizeof(value));
+                if (json.enabled) {
+                        numbfs_json_open(NULL, '{');
+                        numbfs_json_int("type", xe->e_type);
+                        numbfs_json_string("name", (char*)xe->e_name,
+                                           min((int)xe->e_nlen, NUMBFS_XATTR_MAXNAME));
+                        numbfs_json_string("value", (char*)xe->e_value,
+                                           min((int)xe->e_vlen, NUMBFS_XATTR_MAXVALUE));
+                        numbfs_json_close();
+                        continue;
+                }
+
+                /* a name or value may take the whole field, without a NUL */
+                printf("        type: %02d, name: %-*.*s, value: %-*.*s\n", xe->e_type,
+                       NUMBFS_XATTR_MAXNAME - 1, min((int)xe->e_nlen, NUMBFS_XATTR_MAXNAME),
+                       (char*)xe->e_name,
+                       NUMBFS_XATTR_MAXVALUE - 1, min((int)xe->e_vlen, NUMBFS_XATTR_MAXVALUE),
+                       (char*)xe->e_value);
+        }
+        if (json.enabled)
+                numbfs_json_close();
+        else
+                printf("    -------\n");
+}
+
+/* show the physical layout and the holes of the inode */
+static void numbfs_fsck_show_layout(struct numbfs_inode_info *ni)
+{
+        struct numbfs_map maps[NUMBFS_NUM_DATA_ENTRY];
+        int nr, i, blocks = 0, pos, end;
+
+        nr = numbfs_inode_fiemap(ni, 0, maps, NUMBFS_NUM_DATA_ENTRY);
+        if (nr < 0) {
+                fprintf(stderr, "error: failed to get the inode mappings\n");
+                return;
+        }
 
-                front = NUMBFS_XATTR_MAXNAME - xe->e_nlen - 1;
-                for (j = 0; j < front; j++)
-                        name[j + xe->e_nlen] = ' ';
-                memcpy(name, xe->e_name, xe->e_nlen);
+        for (i = 0; i < nr; i++)
+                blocks += maps[i].len;
 
-                front = NUMBFS_XATTR_MAXVALUE - xe->e_vlen - 1;
-                for (j = 0; j < front; j++)
-                        value[j + xe->e_vlen] =  ' ';
-                memcpy(value, xe->e_value, xe->e_vlen);
-                printf("        type: %02d, name: %s, value: %s\n", xe->e_type, name, value);
+        numbfs_out_int("data blocks", "data_blocks", blocks);
+        numbfs_out_int("data fragments", "data_fragments", nr);
+        if (json.enabled) {
+                numbfs_json_open("layout", '[');
+        } else {
+                printf("\n");
+                printf("    DATA LAYOUT\n");
         }
-        printf("    -------\n");
+        for (i = 0; i < nr; i++) {
+                if (!json.enabled) {
+                        printf("       LOGICAL: %05d, PHYSICAL: %08d, LENGTH: %03d%s\n",
+                                maps[i].lblk, maps[i].pblk, maps[i].len,
+                                maps[i].flags & NUMBFS_MAP_LAST ? ", LAST" : "");
+                        continue;
+                }
+                numbfs_json_open(NULL, '{');
+                numbfs_json_int("logical", maps[i].lblk);
+                numbfs_json_int("physical", maps[i].pblk);
+                numbfs_json_int("length", maps[i].len);
+                numbfs_json_bool("last", maps[i].flags & NUMBFS_MAP_LAST);
+                numbfs_json_close();
+        }
+        if (json.enabled) {
+                numbfs_json_close();
+                numbfs_json_open("holes", '[');
+        }
+
+        for (pos = numbfs_seek_hole(ni, 0); pos >= 0 && pos < ni->size;
+             pos = numbfs_seek_hole(ni, end)) {
+                end = numbfs_seek_data(ni, pos);
+                if (end < 0)
+                        end = ni->size;
+                if (!json.enabled) {
+                        printf("       HOLE: [%d, %d)\n", pos, end);
+                        continue;
+                }
+                numbfs_json_open(NULL, '{');
+                numbfs_json_int("start", pos);
+                numbfs_json_int("end", end);
+                numbfs_json_close();
+        }
+        if (json.enabled)
+                numbfs_json_close();
 }
 
 /* show the inode information at @nid */
@@ -169,9 +555,10 @@ static int numbfs_fsck_show_inode(struct numbfs_superblock_info *sbi,
 {
         struct numbfs_inode_info *ni;
         struct numbfs_dirent *dir;
+        struct numbfs_readdir_ctx ctx;
         char buf[BYTES_PER_BLOCK];
         struct numbfs_timestamps nt;
-        int err, i;
+        int err;
 
 
         ni = malloc(sizeof(*ni));
@@ -186,71 +573,236 @@ static int numbfs_fsck_show_inode(struct numbfs_superblock_info *sbi,
                 goto exit;
         }
 
-        err = numbfs_read_block(sbi, buf, numbfs_data_blk(sbi, ni->xattr_start));
+        err = numbfs_get_timestamps(ni, &nt);
         if (err) {
-                fprintf(stderr, "error: failed to read xattr block\n");
+                fprintf(stderr, "error: failed to read the timestamps\n");
                 goto exit;
         }
 
-        nt = *(struct numbfs_timestamps*)buf;
-
-        printf("================================\n");
-        printf("Inode Information\n");
-        printf("    inode number:               %d\n", nid);
+        numbfs_out_section("Inode Information", "inode");
+        numbfs_out_int("inode number", "nid", nid);
         if (S_ISDIR(ni->mode))
-                printf("    inode type:                 DIR\n");
+                numbfs_out_str("inode type", "type", "DIR");
         else if (S_ISLNK(ni->mode))
-                printf("    inode type:                 SYMLINK\n");
+                numbfs_out_str("inode type", "type", "SYMLINK");
         else
-                printf("    inode type:                 REGULAR FILE\n");
-        printf("    link count:                 %d\n", ni->nlink);
-        printf("    inode uid:                  %d\n", ni->uid);
-        printf("    inode gid:                  %d\n", ni->gid);
-        numbfs_time_to_date(buf, le64_to_cpu(nt.t_atime));
-        printf("    inode atime:                %s\n", buf);
-        numbfs_time_to_date(buf, le64_to_cpu(nt.t_mtime));
-        printf("    inode mtime:                %s\n", buf);
-        numbfs_time_to_date(buf, le64_to_cpu(nt.t_ctime));
-        printf("    inode ctime:                %s\n", buf);
-        printf("    inode size:                 %d\n", ni->size);
+                numbfs_out_str("inode type", "type", "REGULAR FILE");
+        numbfs_out_int("link count", "nlink", ni->nlink);
+        numbfs_out_int("inode uid", "uid", ni->uid);
+        numbfs_out_int("inode gid", "gid", ni->gid);
+        if (json.enabled) {
+                /* seconds since the epoch */
+                numbfs_json_int("atime", le64_to_cpu(nt.t_atime));
+                numbfs_json_int("mtime", le64_to_cpu(nt.t_mtime));
+                numbfs_json_int("ctime", le64_to_cpu(nt.t_ctime));
+        } else {
+                numbfs_time_to_date(buf, le64_to_cpu(nt.t_atime));
+                numbfs_out_str("inode atime", "atime", buf);
+                numbfs_time_to_date(buf, le64_to_cpu(nt.t_mtime));
+                numbfs_out_str("inode mtime", "mtime", buf);
+                numbfs_time_to_date(buf, le64_to_cpu(nt.t_ctime));
+                numbfs_out_str("inode ctime", "ctime", buf);
+        }
+        numbfs_out_int("inode size", "size", ni->size);
+        numbfs_fsck_show_layout(ni);
         numbfs_dump_xattrs(ni);
-        printf("\n");
+        if (!json.enabled)
+                printf("\n");
 
         if (S_ISDIR(ni->mode)) {
-                printf("    DIR CONTENT\n");
-                for (i = 0; i < ni->size; i += sizeof(struct numbfs_dirent)) {
-                        if (i % BYTES_PER_BLOCK == 0) {
-                                err = numbfs_pread_inode(ni, buf, i, BYTES_PER_BLOCK);
-                                if (err) {
-                                        fprintf(stderr, "error: failed to read block@%d of inode@%d\n",
-                                                i / BYTES_PER_BLOCK, nid);
-                                        goto exit;
-                                }
+                err = numbfs_opendir(&ctx, ni, 0);
+                if (err) {
+                        fprintf(stderr, "error: failed to read the content of inode@%d\n", nid);
+                        goto exit;
+                }
+                if (json.enabled)
+                        numbfs_json_open("entries", '[');
+                else
+                        printf("    DIR CONTENT\n");
+                while (numbfs_readdir(&ctx, &dir, NULL)) {
+                        if (!json.enabled) {
+                                printf("       INODE: %05d, TYPE: %s, NAMELEN: %02d NAME: %s\n",
+                                        le16_to_cpu(dir->ino), numbfs_dir_type(dir->type),
+                                        dir->name_len, dir->name);
+                                continue;
                         }
-                        dir = (struct numbfs_dirent*)&buf[i % BYTES_PER_BLOCK];
-                        printf("       INODE: %05d, TYPE: %s, NAMELEN: %02d NAME: %s\n",
-                                le16_to_cpu(dir->ino), numbfs_dir_type(dir->type),dir->name_len, dir->name);
+                        numbfs_json_open(NULL, '{');
+                        numbfs_json_int("nid", le16_to_cpu(dir->ino));
+                        numbfs_json_int("type", dir->type);
+                        numbfs_json_string("name", dir->name,
+                                           min((int)dir->name_len, NUMBFS_MAX_PATH_LEN));
+                        numbfs_json_close();
                 }
+                if (json.enabled)
+                        numbfs_json_close();
+                numbfs_closedir(&ctx);
         }
+        numbfs_out_section_end();
 
 exit:
         free(ni);
         return err;
 }
 
+/* compact every allocated directory */
+static int numbfs_fsck_compact(struct numbfs_superblock_info *sbi, bool sort)
+{
+        struct numbfs_inode_info ni;
+        char buf[BYTES_PER_BLOCK];
+        int err, nid, cnt = 0, free_blocks = sbi->free_blocks;
+
+        for (nid = 0; nid < sbi->total_inodes; nid++) {
+                if (nid % NUMBFS_BLOCKS_PER_BLOCK == 0) {
+                        err = numbfs_read_block(sbi, buf,
+                                        numbfs_bmap_blk(sbi->ibitmap_start, nid));
+                        if (err)
+                                return err;
+                }
+
+                if (!(buf[numbfs_bmap_byte(nid)] & (1 << numbfs_bmap_bit(nid))))
+                        continue;
+
+                ni.nid = nid;
+                ni.sbi = sbi;
+                err = numbfs_get_inode(sbi, &ni);
+                if (err)
+                        return err;
+                if (!S_ISDIR(ni.mode))
+                        continue;
+
+                err = numbfs_dir_compact(&ni, sort);
+                if (err) {
+                        fprintf(stderr, "error: failed to compact directory@%d\n", nid);
+                        return err;
+                }
+                cnt++;
+        }
+
+        err = numbfs_put_superblock(sbi);
+        if (err)
+                return err;
+
+        numbfs_out_section("Directory Compaction", "compaction");
+        numbfs_out_int("directories compacted", "directories", cnt);
+        numbfs_out_int("blocks released", "blocks_released", sbi->free_blocks - free_blocks);
+        numbfs_out_section_end();
+        return 0;
+}
+
+/* check the whole filesystem, report every problem found */
+static int numbfs_fsck_check(struct numbfs_superblock_info *sbi,
+                             struct numbfs_fsck_cfg *cfg)
+{
+        struct numbfs_check_cfg check_cfg = {
+                .jobs = cfg->jobs,
+                .repair = cfg->repair,
+                .dry_run = cfg->dry_run,
+                .max_mem = cfg->max_mem,
+        };
+        struct numbfs_check_result res;
+        struct numbfs_check_problem *p;
+        struct numbfs_check_diff *d;
+        char buf[BYTES_PER_BLOCK];
+        int i, err;
+
+        if (cfg->max_mem && cfg->max_mem < numbfs_check_min_mem(sbi)) {
+                fprintf(stderr, "error: the check needs at least %lld KiB\n",
+                        DIV_ROUND_UP(numbfs_check_min_mem(sbi), 1024));
+                return -ENOMEM;
+        }
+
+        err = numbfs_check(sbi, &check_cfg, &res);
+        if (err) {
+                fprintf(stderr, "error: failed to check the filesystem\n");
+                return err;
+        }
+
+        numbfs_out_section("Consistency Check", "check");
+        numbfs_out_int("directories", "directories", res.dirs);
+        numbfs_out_int("regular files", "files", res.files);
+        numbfs_out_int("symlinks", "symlinks", res.symlinks);
+        numbfs_out_int("other inodes", "others", res.others);
+        numbfs_out_int("referenced blocks", "blocks", res.blocks);
+        if (cfg->max_mem)
+                numbfs_out_int("data zone passes", "passes", res.passes);
+        numbfs_out_int("problems found", "nr_problems", res.nr_problems);
+        if (json.enabled)
+                numbfs_json_open("problems", '[');
+        for (i = 0; i < res.nr_problems; i++) {
+                p = &res.problems[i];
+                numbfs_check_describe(p, buf, sizeof(buf));
+                if (!json.enabled) {
+                        printf("       [%s] %s%s\n", numbfs_check_name(p->type), buf,
+                               !p->fixed ? "" : cfg->dry_run ? " (would fix)" : " (fixed)");
+                        continue;
+                }
+                numbfs_json_open(NULL, '{');
+                numbfs_json_string("type", numbfs_check_name(p->type),
+                                   strlen(numbfs_check_name(p->type)));
+                numbfs_json_int("nid", p->nid);
+                numbfs_json_int("blk", p->blk);
+                numbfs_json_int("expect", p->expect);
+                numbfs_json_int("found", p->found);
+                numbfs_json_bool("fixed", p->fixed);
+                numbfs_json_string("description", buf, strlen(buf));
+                numbfs_json_close();
+        }
+        if (json.enabled)
+                numbfs_json_close();
+
+        if (cfg->repair && !cfg->dry_run) {
+                numbfs_out_int("problems fixed", "nr_fixed", res.nr_fixed);
+                numbfs_out_int("byte ranges written", "nr_diffs", res.nr_diffs);
+        } else if (cfg->dry_run) {
+                numbfs_out_int("problems to fix", "nr_fixed", res.nr_fixed);
+                numbfs_out_int("byte ranges to write", "nr_diffs", res.nr_diffs);
+                if (json.enabled)
+                        numbfs_json_open("diffs", '[');
+                for (i = 0; i < res.nr_diffs; i++) {
+                        d = &res.diffs[i];
+                        if (!json.enabled) {
+                                printf("       block@%d: %d bytes at offset %d\n",
+                                       d->blkno, d->len, d->off);
+                                continue;
+                        }
+                        numbfs_json_open(NULL, '{');
+                        numbfs_json_int("blkno", d->blkno);
+                        numbfs_json_int("offset", d->off);
+                        numbfs_json_int("length", d->len);
+                        numbfs_json_close();
+                }
+                if (json.enabled)
+                        numbfs_json_close();
+        }
+        numbfs_out_section_end();
+
+        err = res.nr_problems > (cfg->dry_run ? 0 : res.nr_fixed) ? -EUCLEAN : 0;
+        numbfs_check_release(&res);
+        return err;
+}
+
 static int numbfs_fsck(int argc, char **argv)
 {
         struct numbfs_fsck_cfg cfg = {
                 .show_inodes = 0,
                 .show_blocks = 0,
+                .compact = 0,
+                .compact_sort = 0,
+                .check = 0,
+                .repair = 0,
+                .dry_run = 0,
+                .json = 0,
+                .jobs = max((int)sysconf(_SC_NPROCESSORS_ONLN), 1),
                 .nid = -1,
+                .path = NULL,
                 .dev = NULL
         };
         struct numbfs_superblock_info sbi;
-        char buf[BYTES_PER_BLOCK];
-        int fd, err, cnt, i;
+        long long cnt;
+        int fd, err;
 
         numbfs_fsck_parse_args(argc, argv, &cfg);
+        json.enabled = cfg.json;
 
         fd = open(cfg.dev, O_RDWR, 0644);
         if (fd < 0)
@@ -262,46 +814,74 @@ static int numbfs_fsck(int argc, char **argv)
                 goto exit;
         }
 
-        printf("Superblock Information\n");
-        printf("    inode bitmap start:         %d\n", sbi.ibitmap_start);
-        printf("    inode zone start:           %d\n", sbi.inode_start);
-        printf("    block bitmap start:         %d\n", sbi.bbitmap_start);
-        printf("    data zone start:            %d\n", sbi.data_start);
-        printf("    free inodes:                %d\n", sbi.free_inodes);
-        printf("    total inodes:               %d\n", sbi.total_inodes);
-        printf("    total free blocks:          %d\n", sbi.free_blocks);
-        printf("    total data blocks:          %d\n", sbi.data_blocks);
+        if (json.enabled)
+                numbfs_json_open(NULL, '{');
+        numbfs_out_section("Superblock Information", "superblock");
+        if (json.enabled)
+                numbfs_json_int("feature", sbi.feature);
+        numbfs_out_int("inode bitmap start", "ibitmap_start", sbi.ibitmap_start);
+        numbfs_out_int("inode zone start", "inode_start", sbi.inode_start);
+        numbfs_out_int("block bitmap start", "bbitmap_start", sbi.bbitmap_start);
+        numbfs_out_int("data zone start", "data_start", sbi.data_start);
+        if (sbi.feature & NUMBFS_FEATURE_TSTABLE)
+                numbfs_out_int("timestamp table start", "tstable_start", sbi.tstable_start);
+        if (sbi.feature & NUMBFS_FEATURE_LAZY_ITABLE) {
+                if (json.enabled) {
+                        numbfs_json_int("itable_init", sbi.itable_init);
+                        numbfs_json_int("itable_blocks", sbi.bbitmap_start - sbi.inode_start);
+                } else {
+                        printf("    inode table initialized:    %d/%d blocks\n", sbi.itable_init,
+                               sbi.bbitmap_start - sbi.inode_start);
+                }
+        }
+        numbfs_out_int("free inodes", "free_inodes", sbi.free_inodes);
+        numbfs_out_int("total inodes", "total_inodes", sbi.total_inodes);
+        numbfs_out_int("total free blocks", "free_blocks", sbi.free_blocks);
+        numbfs_out_int("total data blocks", "data_blocks", sbi.data_blocks);
 
         if (cfg.show_inodes) {
-                cnt = 0;
-                for (i = sbi.ibitmap_start; i < sbi.inode_start; i++) {
-                        err = pread(fd, buf, BYTES_PER_BLOCK, i * BYTES_PER_BLOCK);
-                        if (err != BYTES_PER_BLOCK) {
-                                fprintf(stderr, "failed to read block@%d\n", i);
-                                err = -EIO;
-                                goto exit;
-                        }
-
-                        cnt += numbfs_fsck_used(buf);
-                }
-                BUG_ON(cnt != sbi.total_inodes - sbi.free_inodes);
-                printf("    inodes usage:               %.2f%%\n", 100.0 * cnt / sbi.total_inodes);
+                err = numbfs_fsck_used(&sbi, sbi.ibitmap_start,
+                                       sbi.inode_start - sbi.ibitmap_start, cfg.jobs, &cnt);
+                if (err)
+                        goto exit;
+                if (cnt != sbi.total_inodes - sbi.free_inodes)
+                        fprintf(stderr, "warning: %lld inodes in use in the bitmap, %d in the superblock, try --repair\n",
+                                cnt, sbi.total_inodes - sbi.free_inodes);
+                numbfs_out_usage("inodes usage", "used_inodes", cnt, sbi.total_inodes);
         }
 
         if (cfg.show_blocks) {
-                cnt = 0;
-                for (i = sbi.bbitmap_start; i < sbi.data_start; i++) {
-                        err = pread(fd, buf, BYTES_PER_BLOCK, i * BYTES_PER_BLOCK);
-                        if (err != BYTES_PER_BLOCK) {
-                                fprintf(stderr, "failed to read block@%d\n", i);
-                                err = -EIO;
-                                goto exit;
-                        }
+                err = numbfs_fsck_used(&sbi, sbi.bbitmap_start,
+                                       sbi.data_start - sbi.bbitmap_start, cfg.jobs, &cnt);
+                if (err)
+                        goto exit;
+                if (cnt != sbi.data_blocks - sbi.free_blocks)
+                        fprintf(stderr, "warning: %lld blocks in use in the bitmap, %d in the superblock, try --repair\n",
+                                cnt, sbi.data_blocks - sbi.free_blocks);
+                numbfs_out_usage("blocks usage", "used_blocks", cnt, sbi.data_blocks);
+        }
+        numbfs_out_section_end();
 
-                        cnt += numbfs_fsck_used(buf);
+        if (cfg.check) {
+                err = numbfs_fsck_check(&sbi, &cfg);
+                if (err)
+                        goto exit;
+        }
+
+        if (cfg.compact) {
+                err = numbfs_fsck_compact(&sbi, cfg.compact_sort);
+                if (err) {
+                        fprintf(stderr, "error: failed to compact directories\n");
+                        goto exit;
+                }
+        }
+
+        if (cfg.path) {
+                err = numbfs_lookup_path(&sbi, cfg.path, &cfg.nid);
+                if (err) {
+                        fprintf(stderr, "error: failed to resolve path %s\n", cfg.path);
+                        goto exit;
                 }
-                BUG_ON(cnt != sbi.data_blocks - sbi.free_blocks);
-                printf("    blocks usage:               %.2f%%\n", 100.0 * cnt / sbi.data_blocks);
         }
 
         if (cfg.nid >= 0) {
@@ -314,6 +894,10 @@ static int numbfs_fsck(int argc, char **argv)
 
         err = 0;
 exit:
+        /* keep the document well-formed if we bail out in the middle */
+        while (json.depth)
+                numbfs_json_close();
+        numbfs_drop_caches(&sbi);
         close(fd);
         free(cfg.dev);
         return err;
@@ -9,6 +9,9 @@
 #include "disk.h"
 #include <stdbool.h>
 
+struct numbfs_lru;
+struct numbfs_stage;
+
 struct numbfs_superblock_info {
         int fd;
         int feature;
@@ -20,11 +23,26 @@ struct numbfs_superblock_info {
         int inode_start;
         int bbitmap_start;
         int data_start;
+        int refcount_start;
+        int dindex_start;
+        int dindex_blocks;
+        int tstable_start;
+        int itable_init;
 
         long long size;
+        /* punch holes instead of writing zero blocks to an image file */
+        bool sparse;
+
+        /* in-memory caches, created on demand */
+        struct numbfs_lru *dcache;
+        struct numbfs_lru *pcache;
+        struct numbfs_lru *xcache;
+        /* the block writes held in memory, NULL if they go to the device */
+        struct numbfs_stage *stage;
 };
 
-/* TODO: xattr support */
+struct numbfs_xattr_info;
+
 struct numbfs_inode_info {
         /* in */
         struct numbfs_superblock_info *sbi;
@@ -39,6 +57,9 @@ struct numbfs_inode_info {
         int data[NUMBFS_NUM_DATA_ENTRY];
         int xattr_start;
         int xattr_count;
+
+        /* staged xattr changes, written by numbfs_xattr_flush() */
+        struct numbfs_xattr_info *xattrs;
 };
 
 #define NUMBFS_BLOCKS_PER_BLOCK (BYTES_PER_BLOCK * BITS_PER_BYTE)
@@ -80,16 +101,59 @@ int numbfs_read_block(struct numbfs_superblock_info *sbi,
 int numbfs_write_block(struct numbfs_superblock_info *sbi,
                        char buf[BYTES_PER_BLOCK], int blkno);
 
-/* read the on=disk superblock */
+/*
+ * hold the block writes in memory, where the reads find them, until
+ * numbfs_stage_flush() writes them once in block order and stops staging
+ */
+int numbfs_stage_begin(struct numbfs_superblock_info *sbi);
+int numbfs_stage_flush(struct numbfs_superblock_info *sbi);
+
+/* write all of @buf, retrying short writes */
+int numbfs_pwrite_full(int fd, const char *buf, long long len, long long off);
+/* read the device blocks [@start, @start + @nr) into @buf */
+int numbfs_read_blocks(struct numbfs_superblock_info *sbi, void *buf,
+                       int start, int nr);
+/* zero/discard the device blocks [@start, @start + @nr) */
+int numbfs_zero_blocks(struct numbfs_superblock_info *sbi, int start, int nr);
+int numbfs_discard_blocks(struct numbfs_superblock_info *sbi, int start, int nr);
+
+/* read/write the on=disk superblock */
 int numbfs_get_superblock(struct numbfs_superblock_info *sbi, int fd);
+int numbfs_put_superblock(struct numbfs_superblock_info *sbi);
+
+/* kernels counting the set bits of a bitmap, NUMBFS_WEIGHT_GENERIC always works */
+enum {
+        NUMBFS_WEIGHT_GENERIC,
+        NUMBFS_WEIGHT_POPCNT,
+        NUMBFS_WEIGHT_AVX2,
+        NUMBFS_WEIGHT_AVX512,
+        NUMBFS_WEIGHT_MAX,
+};
+
+/* the set bits in the @len bytes of @map, with the fastest kernel by default */
+long long numbfs_bitmap_weight(const void *map, long long len);
+/* force a kernel, or pick the fastest one the CPU supports if @kernel < 0 */
+int numbfs_bitmap_set_kernel(int kernel);
+bool numbfs_bitmap_kernel_supported(int kernel);
+const char *numbfs_bitmap_kernel_name(int kernel);
 
 /* data block management */
 int numbfs_alloc_block(struct numbfs_superblock_info *sbi, int *blkno);
 int numbfs_free_block(struct numbfs_superblock_info *sbi, int blkno);
+int numbfs_free_blocks(struct numbfs_superblock_info *sbi, int *blknos, int nr);
+/* alloc @len contiguous data blocks */
+int numbfs_alloc_extent(struct numbfs_superblock_info *sbi, int len, int *start);
+
+/* block sharing, only available with NUMBFS_FEATURE_REFCOUNT */
+int numbfs_enable_refcount(struct numbfs_superblock_info *sbi);
+int numbfs_get_refcount(struct numbfs_superblock_info *sbi, int blkno);
+int numbfs_share_blocks(struct numbfs_superblock_info *sbi, int *blknos, int nr);
 
 /* get inode information according inode number*/
 int numbfs_get_inode(struct numbfs_superblock_info *sbi,
                      struct numbfs_inode_info *ni);
+/* write the inode info back to the inode table */
+int numbfs_dump_inode(struct numbfs_inode_info *ni);
 /* logical block number to physical block address translation */
 int numbfs_inode_blkaddr(struct numbfs_inode_info *ni,
                          int pos, bool alloc, bool extent);
@@ -100,10 +164,114 @@ int numbfs_pwrite_inode(struct numbfs_inode_info *ni,
 int numbfs_pread_inode(struct numbfs_inode_info *ni,
                        char buf[BYTES_PER_BLOCK], int offset, int len);
 
+/* read/write an arbitrary byte range in inode's address space */
+int numbfs_pwrite_inode_range(struct numbfs_inode_info *ni,
+                              char *buf, int offset, int len);
+int numbfs_pread_inode_range(struct numbfs_inode_info *ni,
+                             char *buf, int offset, int len);
+
+/* shrink/extend the inode, or deallocate a range inside it */
+int numbfs_truncate_inode(struct numbfs_inode_info *ni, int size);
+int numbfs_punch_hole(struct numbfs_inode_info *ni, int offset, int len);
+
+/* mapping flags */
+#define NUMBFS_MAP_LAST         0x1     /* the last mapping of the inode */
+
+/* a run of physically contiguous blocks in inode's address space */
+struct numbfs_map {
+        int lblk;       /* logical block number */
+        int pblk;       /* physical block address in the device */
+        int len;        /* number of blocks */
+        int flags;
+};
+
+/* get the mappings from logical block @lblk, return the count of mappings */
+int numbfs_inode_fiemap(struct numbfs_inode_info *ni, int lblk,
+                        struct numbfs_map *maps, int count);
+/* SEEK_DATA/SEEK_HOLE, return the found offset or -ENXIO */
+int numbfs_seek_data(struct numbfs_inode_info *ni, int offset);
+int numbfs_seek_hole(struct numbfs_inode_info *ni, int offset);
+
 int numbfs_alloc_inode(struct numbfs_superblock_info *sbi, int *nid);
 int numbfs_free_inode(struct numbfs_superblock_info *sbi, int nid);
 
 /* make an empty dir */
 int numbfs_empty_dir(struct numbfs_superblock_info *sbi, int pnid);
+/* make an empty inode of @mode with one link */
+int numbfs_empty_inode(struct numbfs_superblock_info *sbi, int mode);
+
+/*
+ * directory entry operations, @type is the DT_* type of the dirent. They
+ * don't touch the link counts, which are up to the callers.
+ */
+int numbfs_dir_lookup(struct numbfs_inode_info *dir, const char *name,
+                      int len, int *nid, int *type);
+int numbfs_dir_add(struct numbfs_inode_info *dir, const char *name,
+                   int len, int nid, int type);
+int numbfs_dir_remove(struct numbfs_inode_info *dir, const char *name,
+                      int len);
+
+/* rewrite @dir densely, @sort orders the entries by inode number */
+int numbfs_dir_compact(struct numbfs_inode_info *dir, bool sort);
+
+/* readdir flags */
+#define NUMBFS_READDIR_SORT     0x1     /* return the entries in inode order */
+#define NUMBFS_READDIR_PLUS     0x2     /* read the inodes of the entries too */
+
+/* a snapshot of a directory iterated by numbfs_readdir() */
+struct numbfs_readdir_ctx {
+        struct numbfs_inode_info *dir;
+        struct numbfs_dirent *dents;            /* the live entries */
+        struct numbfs_inode_info *inodes;       /* NUMBFS_READDIR_PLUS only */
+        int count;
+        int pos;
+        int flags;
+};
+
+int numbfs_opendir(struct numbfs_readdir_ctx *ctx,
+                   struct numbfs_inode_info *dir, int flags);
+/* return 1 and the next entry, or 0 at the end of the directory */
+int numbfs_readdir(struct numbfs_readdir_ctx *ctx, struct numbfs_dirent **de,
+                   struct numbfs_inode_info **ni);
+void numbfs_closedir(struct numbfs_readdir_ctx *ctx);
+
+/* resolve the absolute @path from the root directory */
+int numbfs_lookup_path(struct numbfs_superblock_info *sbi, const char *path,
+                       int *nid);
+
+/* release the in-memory caches of @sbi */
+void numbfs_drop_caches(struct numbfs_superblock_info *sbi);
+
+/*
+ * extended attributes of type NUMBFS_XATTR_INDEX_*, the changes are staged
+ * in memory until numbfs_xattr_flush(), which writes the block once
+ */
+#define NUMBFS_XATTR_CREATE     0x1     /* fail if the xattr exists */
+#define NUMBFS_XATTR_REPLACE    0x2     /* fail if the xattr doesn't exist */
+
+int numbfs_getxattr(struct numbfs_inode_info *ni, int type, const char *name,
+                    void *value, int size);
+int numbfs_setxattr(struct numbfs_inode_info *ni, int type, const char *name,
+                    const void *value, int size, int flags);
+int numbfs_removexattr(struct numbfs_inode_info *ni, int type, const char *name);
+int numbfs_listxattr(struct numbfs_inode_info *ni, char *list, int size);
+int numbfs_xattr_flush(struct numbfs_inode_info *ni);
+
+/* timestamp table, only available with NUMBFS_FEATURE_TSTABLE */
+int numbfs_enable_tstable(struct numbfs_superblock_info *sbi);
+/* read/write the timestamps of @ni, wherever they live */
+int numbfs_get_timestamps(struct numbfs_inode_info *ni,
+                          struct numbfs_timestamps *nt);
+int numbfs_set_timestamps(struct numbfs_inode_info *ni,
+                          const struct numbfs_timestamps *nt);
+
+/* hashed directory index, only available with NUMBFS_FEATURE_DIR_INDEX */
+int numbfs_enable_dindex(struct numbfs_superblock_info *sbi, int nblocks);
+int numbfs_dindex_lookup(struct numbfs_inode_info *dir, const char *name,
+                         int len, int *nid, int *pos, int *type);
+int numbfs_dindex_insert(struct numbfs_inode_info *dir, const char *name,
+                         int len, int nid, int pos);
+int numbfs_dindex_delete(struct numbfs_inode_info *dir, const char *name,
+                         int len);
 
 #endif
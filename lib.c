@@ -3,6 +3,7 @@
  * Copyright (C) 2025, Hongzhen Luo
  */
 
+#define _GNU_SOURCE
 #include "internal.h"
 #include "utils.h"
 #include <stdio.h>
@@ -10,19 +11,257 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
 #include <time.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#define NUMBFS_HAVE_X86_POPCNT
+#include <immintrin.h>
+#endif
 
 #define DOT             "."
 #define DOTDOT          ".."
 #define DOTLEN          strlen(DOT)
 #define DOTDOTLEN       strlen(DOTDOT)
 
+/* max number of entries in the dentry cache and the path cache */
+#define NUMBFS_DCACHE_MAX       8192
+#define NUMBFS_PCACHE_MAX       1024
+#define NUMBFS_XCACHE_MAX       1024
+
+/* bytes per write when zeroes have to be written out */
+#define NUMBFS_ZERO_CHUNK       (4 << 20)
+/* bytes per request when reading a run of blocks */
+#define NUMBFS_READ_CHUNK       (1 << 20)
+#define NUMBFS_LRU_BUCKETS      1024
+
+/* a cached (key, name) -> val mapping */
+struct numbfs_lru_node {
+        struct numbfs_lru_node *hnext;
+        /* the most recently used node is the first */
+        struct numbfs_lru_node *prev, *next;
+        unsigned long long hash;
+        int key;
+        int len;
+        int val[3];
+        char name[];
+};
+
+struct numbfs_lru {
+        struct numbfs_lru_node *buckets[NUMBFS_LRU_BUCKETS];
+        struct numbfs_lru_node *first, *last;
+        int count;
+        int max;
+};
+
+/* blocks written while staging, hashed by the block number */
+#define NUMBFS_STAGE_BUCKETS    4096
+
+struct numbfs_stage_node {
+        struct numbfs_stage_node *hnext;
+        int blkno;
+        char buf[BYTES_PER_BLOCK];
+};
+
+struct numbfs_stage {
+        struct numbfs_stage_node *buckets[NUMBFS_STAGE_BUCKETS];
+        int count;
+};
+
+static struct numbfs_stage_node **numbfs_stage_slot(struct numbfs_stage *stage,
+                                                    int blkno)
+{
+        struct numbfs_stage_node **pp = &stage->buckets[blkno % NUMBFS_STAGE_BUCKETS];
+
+        while (*pp && (*pp)->blkno != blkno)
+                pp = &(*pp)->hnext;
+        return pp;
+}
+
+/* the staged content of @blkno, NULL if the device has the latest one */
+static char *numbfs_stage_find(struct numbfs_superblock_info *sbi, int blkno)
+{
+        struct numbfs_stage_node *node;
+
+        if (!sbi->stage)
+                return NULL;
+        node = *numbfs_stage_slot(sbi->stage, blkno);
+        return node ? node->buf : NULL;
+}
+
+static int numbfs_stage_block(struct numbfs_superblock_info *sbi,
+                              const char *buf, int blkno)
+{
+        struct numbfs_stage_node **pp = numbfs_stage_slot(sbi->stage, blkno);
+
+        if (!*pp) {
+                *pp = malloc(sizeof(**pp));
+                if (!*pp)
+                        return -ENOMEM;
+                (*pp)->hnext = NULL;
+                (*pp)->blkno = blkno;
+                sbi->stage->count++;
+        }
+        memcpy((*pp)->buf, buf, BYTES_PER_BLOCK);
+        return 0;
+}
+
+/* copy the staged blocks in [@start, @start + @nr) over @buf read from the device */
+static void numbfs_stage_overlay(struct numbfs_superblock_info *sbi, char *buf,
+                                 int start, int nr)
+{
+        char *staged;
+        int i;
+
+        if (!sbi->stage || !sbi->stage->count)
+                return;
+        for (i = 0; i < nr; i++) {
+                staged = numbfs_stage_find(sbi, start + i);
+                if (staged)
+                        memcpy(buf + (size_t)i * BYTES_PER_BLOCK, staged,
+                               BYTES_PER_BLOCK);
+        }
+}
+
+/* forget the staged blocks in [@start, @start + @nr), the device is rewritten */
+static void numbfs_stage_drop(struct numbfs_superblock_info *sbi, int start, int nr)
+{
+        struct numbfs_stage_node **pp, *node;
+        int i;
+
+        if (!sbi->stage || !sbi->stage->count)
+                return;
+        if (nr < NUMBFS_STAGE_BUCKETS) {
+                for (i = start; i < start + nr; i++) {
+                        pp = numbfs_stage_slot(sbi->stage, i);
+                        if (!*pp)
+                                continue;
+                        node = *pp;
+                        *pp = node->hnext;
+                        free(node);
+                        sbi->stage->count--;
+                }
+                return;
+        }
+
+        for (i = 0; i < NUMBFS_STAGE_BUCKETS; i++) {
+                for (pp = &sbi->stage->buckets[i]; *pp; ) {
+                        node = *pp;
+                        if (node->blkno < start || node->blkno >= start + nr) {
+                                pp = &node->hnext;
+                                continue;
+                        }
+                        *pp = node->hnext;
+                        free(node);
+                        sbi->stage->count--;
+                }
+        }
+}
+
+int numbfs_stage_begin(struct numbfs_superblock_info *sbi)
+{
+        if (sbi->stage)
+                return -EBUSY;
+        sbi->stage = calloc(1, sizeof(*sbi->stage));
+        return sbi->stage ? 0 : -ENOMEM;
+}
+
+static int numbfs_stage_cmp(const void *a, const void *b)
+{
+        const struct numbfs_stage_node *x = *(struct numbfs_stage_node * const *)a;
+        const struct numbfs_stage_node *y = *(struct numbfs_stage_node * const *)b;
+
+        return (x->blkno > y->blkno) - (x->blkno < y->blkno);
+}
+
+static bool numbfs_block_zeroed(const char buf[BYTES_PER_BLOCK])
+{
+        return !buf[0] && !memcmp(buf, buf + 1, BYTES_PER_BLOCK - 1);
+}
+
+/*
+ * write the staged blocks in block order, contiguous ones in one request,
+ * and the superblock once all the others are on the device
+ */
+int numbfs_stage_flush(struct numbfs_superblock_info *sbi)
+{
+        struct numbfs_stage *stage = sbi->stage;
+        struct numbfs_stage_node **nodes, *node, *sb = NULL;
+        int i, k, nr = 0, err = 0;
+        char *run;
+
+        if (!stage)
+                return 0;
+        /* from now on the writes go to the device */
+        sbi->stage = NULL;
+
+        nodes = malloc((size_t)max(stage->count, 1) * sizeof(*nodes));
+        run = malloc(NUMBFS_ZERO_CHUNK);
+        if (!nodes || !run)
+                err = -ENOMEM;
+
+        for (i = 0; i < NUMBFS_STAGE_BUCKETS; i++)
+                for (node = stage->buckets[i]; node; node = node->hnext)
+                        if (nodes)
+                                nodes[nr++] = node;
+        if (!err)
+                qsort(nodes, nr, sizeof(*nodes), numbfs_stage_cmp);
+
+        for (i = 0; !err && i < nr; i = k) {
+                if (nodes[i]->blkno == NUMBFS_SUPER_OFFSET / BYTES_PER_BLOCK) {
+                        sb = nodes[i];
+                        k = i + 1;
+                        continue;
+                }
+                /* a sparse image punches the zeroed blocks */
+                if (sbi->sparse && numbfs_block_zeroed(nodes[i]->buf)) {
+                        err = numbfs_write_block(sbi, nodes[i]->buf, nodes[i]->blkno);
+                        k = i + 1;
+                        continue;
+                }
+                for (k = i; k < nr; k++) {
+                        if (k > i && (nodes[k]->blkno != nodes[k - 1]->blkno + 1 ||
+                                      (k - i) * BYTES_PER_BLOCK == NUMBFS_ZERO_CHUNK ||
+                                      (sbi->sparse && numbfs_block_zeroed(nodes[k]->buf))))
+                                break;
+                        memcpy(run + (size_t)(k - i) * BYTES_PER_BLOCK,
+                               nodes[k]->buf, BYTES_PER_BLOCK);
+                }
+                err = numbfs_pwrite_full(sbi->fd, run, (long long)(k - i) * BYTES_PER_BLOCK,
+                                         (long long)nodes[i]->blkno * BYTES_PER_BLOCK);
+        }
+        if (!err && sb && fsync(sbi->fd))
+                err = -errno;
+        if (!err && sb)
+                err = numbfs_write_block(sbi, sb->buf, sb->blkno);
+
+        for (i = 0; i < NUMBFS_STAGE_BUCKETS; i++) {
+                while ((node = stage->buckets[i])) {
+                        stage->buckets[i] = node->hnext;
+                        free(node);
+                }
+        }
+        free(stage);
+        free(nodes);
+        free(run);
+        return err;
+}
+
 int numbfs_read_block(struct numbfs_superblock_info *sbi,
                       char buf[BYTES_PER_BLOCK], int blkno)
 {
+        char *staged = numbfs_stage_find(sbi, blkno);
         int ret;
 
+        if (staged) {
+                memcpy(buf, staged, BYTES_PER_BLOCK);
+                return 0;
+        }
+
         ret = pread(sbi->fd, buf, BYTES_PER_BLOCK, blkno * BYTES_PER_BLOCK);
         if (ret != BYTES_PER_BLOCK) {
                 fprintf(stderr, "failed to read block@%d\n", blkno);
@@ -36,6 +275,15 @@ int numbfs_write_block(struct numbfs_superblock_info *sbi,
 {
         int ret;
 
+        if (sbi->stage)
+                return numbfs_stage_block(sbi, buf, blkno);
+
+        /* a hole reads as zeroes, only fall back to writing them */
+        if (sbi->sparse && numbfs_block_zeroed(buf) &&
+            !fallocate(sbi->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                       (long long)blkno * BYTES_PER_BLOCK, BYTES_PER_BLOCK))
+                return 0;
+
         ret = pwrite(sbi->fd, buf, BYTES_PER_BLOCK, blkno * BYTES_PER_BLOCK);
         if (ret != BYTES_PER_BLOCK) {
                 fprintf(stderr, "failed to write block@%d\n", blkno);
@@ -44,6 +292,116 @@ int numbfs_write_block(struct numbfs_superblock_info *sbi,
         return 0;
 }
 
+/* write the whole @len bytes of @buf at @off */
+int numbfs_pwrite_full(int fd, const char *buf, long long len, long long off)
+{
+        ssize_t ret;
+
+        while (len > 0) {
+                ret = pwrite(fd, buf, len, off);
+                if (ret <= 0) {
+                        if (ret < 0 && errno == EINTR)
+                                continue;
+                        fprintf(stderr, "failed to write [%lld, %lld)\n", off, off + len);
+                        return -EIO;
+                }
+                buf += ret;
+                off += ret;
+                len -= ret;
+        }
+        return 0;
+}
+
+/* read the device blocks [@start, @start + @nr) in large requests */
+int numbfs_read_blocks(struct numbfs_superblock_info *sbi, void *buf,
+                       int start, int nr)
+{
+        long long off = (long long)start * BYTES_PER_BLOCK;
+        long long len = (long long)nr * BYTES_PER_BLOCK;
+        char *p = buf;
+        ssize_t ret;
+
+        while (len > 0) {
+                ret = pread(sbi->fd, p, min(len, (long long)NUMBFS_READ_CHUNK), off);
+                if (ret <= 0) {
+                        if (ret < 0 && errno == EINTR)
+                                continue;
+                        fprintf(stderr, "failed to read blocks [%d, %d)\n",
+                                start, start + nr);
+                        return -EIO;
+                }
+                p += ret;
+                off += ret;
+                len -= ret;
+        }
+        numbfs_stage_overlay(sbi, buf, start, nr);
+        return 0;
+}
+
+/**
+ * zero the device blocks [@start, @start + @nr), the device or the host
+ * filesystem does it if it can, otherwise zeroes are written in large chunks.
+ * A sparse image gets a hole rather than allocated zero extents.
+ */
+int numbfs_zero_blocks(struct numbfs_superblock_info *sbi, int start, int nr)
+{
+        long long off = (long long)start * BYTES_PER_BLOCK;
+        long long len = (long long)nr * BYTES_PER_BLOCK, cur;
+        unsigned long long range[2] = {off, len};
+        struct stat st;
+        char *buf;
+        int err = 0;
+
+        if (nr <= 0)
+                return 0;
+
+        numbfs_stage_drop(sbi, start, nr);
+        if (fstat(sbi->fd, &st))
+                return -errno;
+
+        if (S_ISBLK(st.st_mode)) {
+                if (!ioctl(sbi->fd, BLKZEROOUT, range))
+                        return 0;
+        } else if (S_ISREG(st.st_mode)) {
+                if (!sbi->sparse &&
+                    !fallocate(sbi->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, off, len))
+                        return 0;
+                if (!fallocate(sbi->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len))
+                        return 0;
+        }
+
+        buf = calloc(1, NUMBFS_ZERO_CHUNK);
+        if (!buf)
+                return -ENOMEM;
+
+        for (; len > 0 && !err; off += cur, len -= cur) {
+                cur = len < NUMBFS_ZERO_CHUNK ? len : NUMBFS_ZERO_CHUNK;
+                err = numbfs_pwrite_full(sbi->fd, buf, cur, off);
+        }
+        free(buf);
+        return err;
+}
+
+/* tell the device the blocks [@start, @start + @nr) are unused */
+int numbfs_discard_blocks(struct numbfs_superblock_info *sbi, int start, int nr)
+{
+        long long off = (long long)start * BYTES_PER_BLOCK;
+        long long len = (long long)nr * BYTES_PER_BLOCK;
+        unsigned long long range[2] = {off, len};
+        struct stat st;
+
+        numbfs_stage_drop(sbi, start, nr);
+        if (fstat(sbi->fd, &st))
+                return -errno;
+
+        if (S_ISBLK(st.st_mode))
+                return ioctl(sbi->fd, BLKDISCARD, range) ? -errno : 0;
+        if (S_ISREG(st.st_mode))
+                return fallocate(sbi->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                 off, len) ? -errno : 0;
+        return -EOPNOTSUPP;
+}
+
 /* get the superblock info from device@fd */
 int numbfs_get_superblock(struct numbfs_superblock_info *sbi, int fd)
 {
@@ -52,6 +410,11 @@ int numbfs_get_superblock(struct numbfs_superblock_info *sbi, int fd)
         int err;
 
         sbi->fd = fd;
+        sbi->sparse = false;
+        sbi->dcache = NULL;
+        sbi->pcache = NULL;
+        sbi->xcache = NULL;
+        sbi->stage = NULL;
 
         err = numbfs_read_block(sbi, buf, NUMBFS_SUPER_OFFSET / BYTES_PER_BLOCK);
         if (err)
@@ -72,9 +435,173 @@ int numbfs_get_superblock(struct numbfs_superblock_info *sbi, int fd)
         sbi->data_blocks        = le32_to_cpu(sb->s_data_blocks);
         sbi->free_blocks        = le32_to_cpu(sb->s_free_blocks);
         sbi->feature            = le32_to_cpu(sb->s_feature);
+        sbi->refcount_start     = le32_to_cpu(sb->s_refcount_start);
+        sbi->dindex_start       = le32_to_cpu(sb->s_dindex_start);
+        sbi->dindex_blocks      = le32_to_cpu(sb->s_dindex_blocks);
+        sbi->tstable_start      = le32_to_cpu(sb->s_tstable_start);
+        sbi->itable_init        = le32_to_cpu(sb->s_itable_init);
         return 0;
 }
 
+/* write the superblock info back to the device */
+int numbfs_put_superblock(struct numbfs_superblock_info *sbi)
+{
+        struct numbfs_super_block *sb;
+        char buf[BYTES_PER_BLOCK];
+
+        memset(buf, 0, BYTES_PER_BLOCK);
+        sb                      = (struct numbfs_super_block*)buf;
+        sb->s_magic             = cpu_to_le32(NUMBFS_MAGIC);
+        sb->s_feature           = cpu_to_le32(sbi->feature);
+        sb->s_ibitmap_start     = cpu_to_le32(sbi->ibitmap_start);
+        sb->s_inode_start       = cpu_to_le32(sbi->inode_start);
+        sb->s_bbitmap_start     = cpu_to_le32(sbi->bbitmap_start);
+        sb->s_data_start        = cpu_to_le32(sbi->data_start);
+        sb->s_total_inodes      = cpu_to_le32(sbi->total_inodes);
+        sb->s_free_inodes       = cpu_to_le32(sbi->free_inodes);
+        sb->s_data_blocks       = cpu_to_le32(sbi->data_blocks);
+        sb->s_free_blocks       = cpu_to_le32(sbi->free_blocks);
+        sb->s_refcount_start    = cpu_to_le32(sbi->refcount_start);
+        sb->s_dindex_start      = cpu_to_le32(sbi->dindex_start);
+        sb->s_dindex_blocks     = cpu_to_le32(sbi->dindex_blocks);
+        sb->s_tstable_start     = cpu_to_le32(sbi->tstable_start);
+        sb->s_itable_init       = cpu_to_le32(sbi->itable_init);
+
+        return numbfs_write_block(sbi, buf, NUMBFS_SUPER_OFFSET / BYTES_PER_BLOCK);
+}
+
+static long long numbfs_weight_generic(const unsigned char *p, long long len)
+{
+        long long ret = 0, i;
+        __u64 word;
+
+        for (i = 0; i + 8 <= len; i += 8) {
+                memcpy(&word, p + i, sizeof(word));
+                ret += __builtin_popcountll(word);
+        }
+        for (; i < len; i++)
+                ret += __builtin_popcount(p[i]);
+        return ret;
+}
+
+#ifdef NUMBFS_HAVE_X86_POPCNT
+/* the same loop, but __builtin_popcountll becomes one POPCNT instruction */
+__attribute__((target("popcnt")))
+static long long numbfs_weight_popcnt(const unsigned char *p, long long len)
+{
+        long long ret = 0, i;
+        __u64 word;
+
+        for (i = 0; i + 8 <= len; i += 8) {
+                memcpy(&word, p + i, sizeof(word));
+                ret += __builtin_popcountll(word);
+        }
+        for (; i < len; i++)
+                ret += __builtin_popcount(p[i]);
+        return ret;
+}
+
+/* count the nibbles with a 16-entry table lookup, and sum the bytes by SAD */
+__attribute__((target("avx2,popcnt")))
+static long long numbfs_weight_avx2(const unsigned char *p, long long len)
+{
+        const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                             1, 2, 2, 3, 2, 3, 3, 4,
+                                             0, 1, 1, 2, 1, 2, 2, 3,
+                                             1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i mask = _mm256_set1_epi8(0x0f);
+        const __m256i zero = _mm256_setzero_si256();
+        __m256i acc = zero, v, lo, hi;
+        long long i;
+
+        for (i = 0; i + 32 <= len; i += 32) {
+                v = _mm256_loadu_si256((const __m256i *)(p + i));
+                lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask));
+                hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(
+                                         _mm256_srli_epi16(v, 4), mask));
+                acc = _mm256_add_epi64(acc, _mm256_sad_epu8(
+                                       _mm256_add_epi8(lo, hi), zero));
+        }
+        return _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+               _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3) +
+               numbfs_weight_popcnt(p + i, len - i);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static long long numbfs_weight_avx512(const unsigned char *p, long long len)
+{
+        __m512i acc = _mm512_setzero_si512();
+        long long i;
+
+        for (i = 0; i + 64 <= len; i += 64)
+                acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(
+                                       _mm512_loadu_si512(p + i)));
+        return _mm512_reduce_add_epi64(acc) +
+               numbfs_weight_popcnt(p + i, len - i);
+}
+#endif
+
+static const struct {
+        const char *name;
+        long long (*weight)(const unsigned char *p, long long len);
+} numbfs_weight_kernels[NUMBFS_WEIGHT_MAX] = {
+        [NUMBFS_WEIGHT_GENERIC] = {"generic", numbfs_weight_generic},
+#ifdef NUMBFS_HAVE_X86_POPCNT
+        [NUMBFS_WEIGHT_POPCNT]  = {"popcnt", numbfs_weight_popcnt},
+        [NUMBFS_WEIGHT_AVX2]    = {"avx2", numbfs_weight_avx2},
+        [NUMBFS_WEIGHT_AVX512]  = {"avx512-vpopcntdq", numbfs_weight_avx512},
+#endif
+};
+
+/* the kernel in use, picked on the first call */
+static int numbfs_weight_kernel = -1;
+
+bool numbfs_bitmap_kernel_supported(int kernel)
+{
+        if (kernel < 0 || kernel >= NUMBFS_WEIGHT_MAX ||
+            !numbfs_weight_kernels[kernel].weight)
+                return false;
+#ifdef NUMBFS_HAVE_X86_POPCNT
+        __builtin_cpu_init();
+        if (kernel == NUMBFS_WEIGHT_POPCNT)
+                return __builtin_cpu_supports("popcnt");
+        if (kernel == NUMBFS_WEIGHT_AVX2)
+                return __builtin_cpu_supports("avx2");
+        if (kernel == NUMBFS_WEIGHT_AVX512)
+                return __builtin_cpu_supports("avx512f") &&
+                       __builtin_cpu_supports("avx512vpopcntdq");
+#endif
+        return true;
+}
+
+const char *numbfs_bitmap_kernel_name(int kernel)
+{
+        if (kernel < 0 || kernel >= NUMBFS_WEIGHT_MAX ||
+            !numbfs_weight_kernels[kernel].name)
+                return "unknown";
+        return numbfs_weight_kernels[kernel].name;
+}
+
+int numbfs_bitmap_set_kernel(int kernel)
+{
+        if (kernel < 0) {
+                for (kernel = NUMBFS_WEIGHT_MAX - 1; kernel > 0; kernel--)
+                        if (numbfs_bitmap_kernel_supported(kernel))
+                                break;
+        } else if (!numbfs_bitmap_kernel_supported(kernel)) {
+                return -EOPNOTSUPP;
+        }
+        numbfs_weight_kernel = kernel;
+        return kernel;
+}
+
+long long numbfs_bitmap_weight(const void *map, long long len)
+{
+        if (numbfs_weight_kernel < 0)
+                numbfs_bitmap_set_kernel(-1);
+        return numbfs_weight_kernels[numbfs_weight_kernel].weight(map, len);
+}
+
 static int numbfs_bitmap_alloc(struct numbfs_superblock_info *sbi, int startblk,
                                int total, int *res, int *status)
 {
@@ -136,108 +663,452 @@ static int numbfs_bitmap_free(struct numbfs_superblock_info *sbi, int startblk,
         return 0;
 }
 
-/* free a data block */
+/* free a data block, a shared block only loses one owner */
 int numbfs_free_block(struct numbfs_superblock_info *sbi, int blkno)
 {
         if (blkno >= sbi->data_blocks)
                 return -EINVAL;
 
+        if (sbi->feature & NUMBFS_FEATURE_REFCOUNT)
+                return numbfs_free_blocks(sbi, &blkno, 1);
+
         return numbfs_bitmap_free(sbi, sbi->bbitmap_start,
                                   blkno, &sbi->free_blocks);
 }
 
-/* get the inode info at @ni->nid */
-int numbfs_get_inode(struct numbfs_superblock_info *sbi,
-                     struct numbfs_inode_info *ni)
+/* alloc @len contiguous data blocks, the first one is returned in @start */
+int numbfs_alloc_extent(struct numbfs_superblock_info *sbi, int len, int *start)
 {
-        struct numbfs_inode *inode;
         char buf[BYTES_PER_BLOCK];
-        int err, i;
+        int err, i, run = 0, byte, bit;
 
-        err = numbfs_read_block(sbi, buf, numbfs_inode_blk(sbi, ni->nid));
-        if (err)
-                return err;
+        if (len <= 0)
+                return -EINVAL;
+        if (sbi->free_blocks < len)
+                return -ENOMEM;
 
-        inode = ((struct numbfs_inode*)buf) + (ni->nid % NUMBFS_NODES_PER_BLOCK);
-        ni->sbi = sbi;
-        ni->mode   = le32_to_cpu(inode->i_mode);
-        ni->nlink  = le16_to_cpu(inode->i_nlink);
-        ni->uid    = le16_to_cpu(inode->i_uid);
-        ni->gid    = le16_to_cpu(inode->i_gid);
-        ni->size   = le32_to_cpu(inode->i_size);
-        for (i = 0; i < NUMBFS_NUM_DATA_ENTRY; i++)
-                ni->data[i] = le32_to_cpu(inode->i_data[i]);
-        ni->xattr_start = le32_to_cpu(inode->i_xattr_start);
-        ni->xattr_count = inode->i_xattr_count;
+        for (i = 0; i < sbi->data_blocks && run < len; i++) {
+                if (i % NUMBFS_BLOCKS_PER_BLOCK == 0) {
+                        err = numbfs_read_block(sbi, buf,
+                                        numbfs_bmap_blk(sbi->bbitmap_start, i));
+                        if (err)
+                                return err;
+                }
+
+                byte = numbfs_bmap_byte(i);
+                bit = numbfs_bmap_bit(i);
+                run = buf[byte] & (1 << bit) ? 0 : run + 1;
+        }
+
+        if (run < len)
+                return -ENOSPC;
+
+        *start = i - len;
+        for (i = *start; i < *start + len; i++) {
+                if (i == *start || i % NUMBFS_BLOCKS_PER_BLOCK == 0) {
+                        err = numbfs_read_block(sbi, buf,
+                                        numbfs_bmap_blk(sbi->bbitmap_start, i));
+                        if (err)
+                                return err;
+                }
+
+                byte = numbfs_bmap_byte(i);
+                bit = numbfs_bmap_bit(i);
+                buf[byte] |= (1 << bit);
+
+                if (i == *start + len - 1 || (i + 1) % NUMBFS_BLOCKS_PER_BLOCK == 0) {
+                        err = numbfs_write_block(sbi, buf,
+                                        numbfs_bmap_blk(sbi->bbitmap_start, i));
+                        if (err)
+                                return err;
+                }
+        }
+        sbi->free_blocks -= len;
+        return 0;
+}
+
+static int numbfs_cmp_int(const void *a, const void *b)
+{
+        return *(const int*)a - *(const int*)b;
+}
+
+/* free all the bits in @frees, each bitmap block is read and written once */
+static int numbfs_bitmap_free_batch(struct numbfs_superblock_info *sbi,
+                                    int startblk, int *frees, int nr,
+                                    int *status)
+{
+        char buf[BYTES_PER_BLOCK];
+        int err, i, byte, bit;
 
+        qsort(frees, nr, sizeof(int), numbfs_cmp_int);
+        for (i = 0; i < nr; i++) {
+                if (!i || numbfs_bmap_blk(startblk, frees[i]) !=
+                          numbfs_bmap_blk(startblk, frees[i - 1])) {
+                        err = numbfs_read_block(sbi, buf,
+                                        numbfs_bmap_blk(startblk, frees[i]));
+                        if (err)
+                                return err;
+                }
+
+                byte = numbfs_bmap_byte(frees[i]);
+                bit = numbfs_bmap_bit(frees[i]);
+                BUG_ON(!(buf[byte] & (1 << bit)));
+                buf[byte] &= ~(1 << bit);
+                *status += 1;
+
+                if (i == nr - 1 || numbfs_bmap_blk(startblk, frees[i]) !=
+                                   numbfs_bmap_blk(startblk, frees[i + 1])) {
+                        err = numbfs_write_block(sbi, buf,
+                                        numbfs_bmap_blk(startblk, frees[i]));
+                        if (err)
+                                return err;
+                }
+        }
         return 0;
 }
 
+/* the device block holding the refcount entry of @blkno */
+static int numbfs_refcount_blk(struct numbfs_superblock_info *sbi, int blkno)
+{
+        return numbfs_data_blk(sbi, sbi->refcount_start +
+                                    blkno / NUMBFS_REFCOUNTS_PER_BLOCK);
+}
+
 /*
- * get the block that contains pos-th byte in the address space;
- * if there is a hole, then alloc a block
+ * add @delta to the refcounts of the sorted blocks in @blknos, every table
+ * block is read and written once; on put (@delta < 0) the blocks that
+ * are still owned by others are removed from @blknos, a get that would
+ * overflow a refcount leaves the table as it was
  */
-int numbfs_inode_blkaddr(struct numbfs_inode_info *inode, int pos, bool alloc, bool extent)
+static int numbfs_refcount_update(struct numbfs_superblock_info *sbi,
+                                  int *blknos, int *nr, int delta)
 {
-        int blkno, err;
+        __le16 buf[NUMBFS_REFCOUNTS_PER_BLOCK];
+        int err, i, cnt, ref, left = 0;
+        bool dirty = false;
 
-        if (extent) {
-                fprintf(stderr, "error: extent feature currently is not supported!\n");
-                return -ENOTSUP;
-        }
+        for (i = 0; i < *nr; i++) {
+                int blk = numbfs_refcount_blk(sbi, blknos[i]);
 
-        if ((pos / BYTES_PER_BLOCK) >= NUMBFS_NUM_DATA_ENTRY) {
-                fprintf(stderr, "error: pos@%d is out of range!\n", pos);
-                return -E2BIG;
-        }
+                if (!i || blk != numbfs_refcount_blk(sbi, blknos[i - 1])) {
+                        err = numbfs_read_block(sbi, (char*)buf, blk);
+                        if (err)
+                                return err;
+                }
 
-        if (alloc && inode->data[pos / BYTES_PER_BLOCK] == NUMBFS_HOLE) {
-                char buf[BYTES_PER_BLOCK];
+                cnt = le16_to_cpu(buf[blknos[i] % NUMBFS_REFCOUNTS_PER_BLOCK]);
+                ref = (cnt ? cnt : 1) + delta;
+                if (ref > NUMBFS_REFCOUNT_MAX) {
+                        /* take back the table blocks already written */
+                        while (i > 0 && numbfs_refcount_blk(sbi, blknos[i - 1]) == blk)
+                                i--;
+                        if (i)
+                                numbfs_refcount_update(sbi, blknos, &i, -delta);
+                        return -EMLINK;
+                }
 
-                err = numbfs_alloc_block(inode->sbi, &blkno);
-                if (err) {
-                        fprintf(stderr, "failed to alloc data block\n");
-                        return err;
+                if (ref <= 0) {
+                        /* the last owner, release it from the bitmap */
+                        blknos[left++] = blknos[i];
+                } else {
+                        buf[blknos[i] % NUMBFS_REFCOUNTS_PER_BLOCK] =
+                                        cpu_to_le16(ref > 1 ? ref : 0);
+                        dirty = true;
                 }
 
-                memset(buf, 0, BYTES_PER_BLOCK);
-                err = numbfs_write_block(inode->sbi, buf,
-                                numbfs_data_blk(inode->sbi, blkno));
+                if (dirty && (i == *nr - 1 ||
+                              blk != numbfs_refcount_blk(sbi, blknos[i + 1]))) {
+                        err = numbfs_write_block(sbi, (char*)buf, blk);
+                        if (err)
+                                return err;
+                        dirty = false;
+                }
+        }
+
+        if (delta < 0)
+                *nr = left;
+        return 0;
+}
+
+/* free a batch of data blocks, note that @blknos will be sorted */
+int numbfs_free_blocks(struct numbfs_superblock_info *sbi, int *blknos, int nr)
+{
+        int i, err;
+
+        for (i = 0; i < nr; i++)
+                if (blknos[i] < 0 || blknos[i] >= sbi->data_blocks)
+                        return -EINVAL;
+
+        if (sbi->feature & NUMBFS_FEATURE_REFCOUNT) {
+                qsort(blknos, nr, sizeof(int), numbfs_cmp_int);
+                err = numbfs_refcount_update(sbi, blknos, &nr, -1);
                 if (err)
                         return err;
-
-                inode->data[pos / BYTES_PER_BLOCK] = blkno;
         }
 
-        return inode->data[pos / BYTES_PER_BLOCK];
+        return numbfs_bitmap_free_batch(sbi, sbi->bbitmap_start, blknos, nr,
+                                        &sbi->free_blocks);
 }
 
-static int numbfs_dump_inode(struct numbfs_inode_info *ni)
+/* add one more owner to each block in @blknos, note that it will be sorted */
+int numbfs_share_blocks(struct numbfs_superblock_info *sbi, int *blknos, int nr)
 {
-        struct numbfs_superblock_info *sbi = ni->sbi;
-        struct numbfs_inode *inode;
-        char meta[BYTES_PER_BLOCK];
-        int nid = ni->nid;
-        int i, err;
+        int i;
 
-        err = numbfs_read_block(sbi, meta, numbfs_inode_blk(sbi, nid));
+        if (!(sbi->feature & NUMBFS_FEATURE_REFCOUNT))
+                return -EOPNOTSUPP;
+
+        for (i = 0; i < nr; i++)
+                if (blknos[i] < 0 || blknos[i] >= sbi->data_blocks)
+                        return -EINVAL;
+
+        qsort(blknos, nr, sizeof(int), numbfs_cmp_int);
+        return numbfs_refcount_update(sbi, blknos, &nr, 1);
+}
+
+/* get the number of owners of the allocated block @blkno */
+int numbfs_get_refcount(struct numbfs_superblock_info *sbi, int blkno)
+{
+        __le16 buf[NUMBFS_REFCOUNTS_PER_BLOCK];
+        int err, cnt;
+
+        if (blkno < 0 || blkno >= sbi->data_blocks)
+                return -EINVAL;
+
+        if (!(sbi->feature & NUMBFS_FEATURE_REFCOUNT))
+                return 1;
+
+        err = numbfs_read_block(sbi, (char*)buf, numbfs_refcount_blk(sbi, blkno));
         if (err)
                 return err;
 
-        inode = ((struct numbfs_inode*)meta) + (nid % NUMBFS_NODES_PER_BLOCK);
-        inode->i_ino    = cpu_to_le16(ni->nid);
-        inode->i_mode   = cpu_to_le32(ni->mode);
-        inode->i_nlink  = cpu_to_le16(ni->nlink);
-        inode->i_uid    = cpu_to_le16(ni->uid);
-        inode->i_gid    = cpu_to_le16(ni->gid);
-        inode->i_size   = cpu_to_le32(ni->size);
-        for (i = 0; i < NUMBFS_NUM_DATA_ENTRY; i++)
-                inode->i_data[i] = cpu_to_le32(ni->data[i]);
-        inode->i_xattr_start = cpu_to_le32(ni->xattr_start);
+        cnt = le16_to_cpu(buf[blkno % NUMBFS_REFCOUNTS_PER_BLOCK]);
+        return cnt ? cnt : 1;
+}
 
-        err = numbfs_write_block(sbi, meta, numbfs_inode_blk(sbi, nid));
-        if (err) {
-                fprintf(stderr, "error: failed to dump inode@%d\n", nid);
+/* alloc @len contiguous data blocks filled with zeros */
+static int numbfs_alloc_zeroed_extent(struct numbfs_superblock_info *sbi,
+                                      int len, int *start)
+{
+        int err;
+
+        err = numbfs_alloc_extent(sbi, len, start);
+        if (err)
+                return err;
+
+        return numbfs_zero_blocks(sbi, numbfs_data_blk(sbi, *start), len);
+}
+
+/* set up the block refcount table, the superblock should be written later */
+int numbfs_enable_refcount(struct numbfs_superblock_info *sbi)
+{
+        int err, start, nr;
+
+        if (sbi->feature & NUMBFS_FEATURE_REFCOUNT)
+                return 0;
+
+        nr = DIV_ROUND_UP(sbi->data_blocks, NUMBFS_REFCOUNTS_PER_BLOCK);
+        err = numbfs_alloc_zeroed_extent(sbi, nr, &start);
+        if (err) {
+                fprintf(stderr, "failed to alloc %d blocks for refcount table\n", nr);
+                return err;
+        }
+
+        sbi->refcount_start = start;
+        sbi->feature |= NUMBFS_FEATURE_REFCOUNT;
+        return 0;
+}
+
+/* an inode table block of unused inodes */
+static void numbfs_itable_template(char buf[BYTES_PER_BLOCK])
+{
+        struct numbfs_inode *inode = (struct numbfs_inode*)buf;
+        int i, k;
+
+        memset(buf, 0, BYTES_PER_BLOCK);
+        for (i = 0; i < (int)NUMBFS_NODES_PER_BLOCK; i++)
+                for (k = 0; k < NUMBFS_NUM_DATA_ENTRY; k++)
+                        inode[i].i_data[k] = cpu_to_le32(NUMBFS_HOLE);
+}
+
+/* whether the inode table block of @nid has been initialized */
+static bool numbfs_itable_ready(struct numbfs_superblock_info *sbi, int nid)
+{
+        return !(sbi->feature & NUMBFS_FEATURE_LAZY_ITABLE) ||
+               nid / (int)NUMBFS_NODES_PER_BLOCK < sbi->itable_init;
+}
+
+/*
+ * initialize the lazy inode table up to the block of @nid, the high-water
+ * mark goes to the superblock with numbfs_put_superblock()
+ */
+static int numbfs_itable_init(struct numbfs_superblock_info *sbi, int nid)
+{
+        char buf[BYTES_PER_BLOCK];
+        int err, last = nid / NUMBFS_NODES_PER_BLOCK;
+
+        if (numbfs_itable_ready(sbi, nid))
+                return 0;
+
+        numbfs_itable_template(buf);
+        for (; sbi->itable_init <= last; sbi->itable_init++) {
+                err = numbfs_write_block(sbi, buf, sbi->inode_start + sbi->itable_init);
+                if (err)
+                        return err;
+        }
+        return 0;
+}
+
+/* fill @ni from the on-disk @inode */
+static void numbfs_decode_inode(struct numbfs_inode_info *ni,
+                                struct numbfs_inode *inode)
+{
+        int i;
+
+        ni->mode   = le32_to_cpu(inode->i_mode);
+        ni->nlink  = le16_to_cpu(inode->i_nlink);
+        ni->uid    = le16_to_cpu(inode->i_uid);
+        ni->gid    = le16_to_cpu(inode->i_gid);
+        ni->size   = le32_to_cpu(inode->i_size);
+        for (i = 0; i < NUMBFS_NUM_DATA_ENTRY; i++)
+                ni->data[i] = le32_to_cpu(inode->i_data[i]);
+        ni->xattr_start = le32_to_cpu(inode->i_xattr_start);
+        ni->xattr_count = inode->i_xattr_count;
+        ni->xattrs = NULL;
+}
+
+/* get the inode info at @ni->nid */
+int numbfs_get_inode(struct numbfs_superblock_info *sbi,
+                     struct numbfs_inode_info *ni)
+{
+        struct numbfs_inode *inode;
+        char buf[BYTES_PER_BLOCK];
+        int err;
+
+        /* an unused inode beyond the initialized table */
+        if (!numbfs_itable_ready(sbi, ni->nid)) {
+                numbfs_itable_template(buf);
+        } else {
+                err = numbfs_read_block(sbi, buf, numbfs_inode_blk(sbi, ni->nid));
+                if (err)
+                        return err;
+        }
+
+        inode = ((struct numbfs_inode*)buf) + (ni->nid % NUMBFS_NODES_PER_BLOCK);
+        ni->sbi = sbi;
+        numbfs_decode_inode(ni, inode);
+        return 0;
+}
+
+/* give the logical block @lblk a private copy if it is shared */
+static int numbfs_inode_cow(struct numbfs_inode_info *ni, int lblk)
+{
+        char buf[BYTES_PER_BLOCK];
+        int ref, err, blkno;
+
+        ref = numbfs_get_refcount(ni->sbi, ni->data[lblk]);
+        if (ref < 0)
+                return ref;
+        if (ref == 1)
+                return 0;
+
+        err = numbfs_read_block(ni->sbi, buf, numbfs_data_blk(ni->sbi, ni->data[lblk]));
+        if (err)
+                return err;
+
+        err = numbfs_alloc_block(ni->sbi, &blkno);
+        if (err) {
+                fprintf(stderr, "failed to alloc data block\n");
+                return err;
+        }
+
+        err = numbfs_write_block(ni->sbi, buf, numbfs_data_blk(ni->sbi, blkno));
+        if (err)
+                return err;
+
+        err = numbfs_free_block(ni->sbi, ni->data[lblk]);
+        if (err)
+                return err;
+
+        ni->data[lblk] = blkno;
+        return 0;
+}
+
+/*
+ * get the block that contains pos-th byte in the address space;
+ * if there is a hole, then alloc a block, if the block is shared,
+ * then copy it to a new block
+ */
+int numbfs_inode_blkaddr(struct numbfs_inode_info *inode, int pos, bool alloc, bool extent)
+{
+        int blkno, err;
+
+        if (extent) {
+                fprintf(stderr, "error: extent feature currently is not supported!\n");
+                return -ENOTSUP;
+        }
+
+        if ((pos / BYTES_PER_BLOCK) >= NUMBFS_NUM_DATA_ENTRY) {
+                fprintf(stderr, "error: pos@%d is out of range!\n", pos);
+                return -E2BIG;
+        }
+
+        if (alloc && inode->data[pos / BYTES_PER_BLOCK] == NUMBFS_HOLE) {
+                char buf[BYTES_PER_BLOCK];
+
+                err = numbfs_alloc_block(inode->sbi, &blkno);
+                if (err) {
+                        fprintf(stderr, "failed to alloc data block\n");
+                        return err;
+                }
+
+                memset(buf, 0, BYTES_PER_BLOCK);
+                err = numbfs_write_block(inode->sbi, buf,
+                                numbfs_data_blk(inode->sbi, blkno));
+                if (err)
+                        return err;
+
+                inode->data[pos / BYTES_PER_BLOCK] = blkno;
+        } else if (alloc) {
+                err = numbfs_inode_cow(inode, pos / BYTES_PER_BLOCK);
+                if (err)
+                        return err;
+        }
+
+        return inode->data[pos / BYTES_PER_BLOCK];
+}
+
+int numbfs_dump_inode(struct numbfs_inode_info *ni)
+{
+        struct numbfs_superblock_info *sbi = ni->sbi;
+        struct numbfs_inode *inode;
+        char meta[BYTES_PER_BLOCK];
+        int nid = ni->nid;
+        int i, err;
+
+        err = numbfs_itable_init(sbi, nid);
+        if (err)
+                return err;
+
+        err = numbfs_read_block(sbi, meta, numbfs_inode_blk(sbi, nid));
+        if (err)
+                return err;
+
+        inode = ((struct numbfs_inode*)meta) + (nid % NUMBFS_NODES_PER_BLOCK);
+        inode->i_ino    = cpu_to_le16(ni->nid);
+        inode->i_mode   = cpu_to_le32(ni->mode);
+        inode->i_nlink  = cpu_to_le16(ni->nlink);
+        inode->i_uid    = cpu_to_le16(ni->uid);
+        inode->i_gid    = cpu_to_le16(ni->gid);
+        inode->i_size   = cpu_to_le32(ni->size);
+        for (i = 0; i < NUMBFS_NUM_DATA_ENTRY; i++)
+                inode->i_data[i] = cpu_to_le32(ni->data[i]);
+        inode->i_xattr_start = cpu_to_le32(ni->xattr_start);
+        inode->i_xattr_count = ni->xattr_count;
+
+        err = numbfs_write_block(sbi, meta, numbfs_inode_blk(sbi, nid));
+        if (err) {
+                fprintf(stderr, "error: failed to dump inode@%d\n", nid);
                 return -EIO;
         }
 
@@ -330,74 +1201,583 @@ int numbfs_pread_inode(struct numbfs_inode_info *ni,
         return 0;
 }
 
-/* get a empty inode */
-int numbfs_alloc_inode(struct numbfs_superblock_info *sbi, int *nid)
+/*
+ * transfer the mapped blocks of a range, merging physically adjacent
+ * blocks into one vectored request; holes in @blks are skipped
+ */
+static int numbfs_inode_rw_blocks(struct numbfs_inode_info *ni, int *blks,
+                                  struct iovec *iov, int nr, bool write)
 {
-        if (!sbi->free_inodes)
-                return -ENOMEM;
+        struct numbfs_superblock_info *sbi = ni->sbi;
+        int i, j, k, cnt, err;
+        ssize_t ret;
+        off_t pos;
+
+        for (i = 0; i < nr; i = j) {
+                j = i + 1;
+                if (blks[i] == NUMBFS_HOLE)
+                        continue;
+
+                while (j < nr && blks[j] == blks[j - 1] + 1)
+                        j++;
+
+                cnt = j - i;
+                if (write && sbi->stage) {
+                        for (k = i; k < j; k++) {
+                                err = numbfs_stage_block(sbi, iov[k].iov_base,
+                                                numbfs_data_blk(sbi, blks[k]));
+                                if (err)
+                                        return err;
+                        }
+                        continue;
+                }
 
-        return numbfs_bitmap_alloc(sbi, sbi->ibitmap_start,
-                                   sbi->total_inodes, nid, &sbi->free_inodes);
+                pos = (off_t)numbfs_data_blk(sbi, blks[i]) * BYTES_PER_BLOCK;
+                if (write)
+                        ret = pwritev(sbi->fd, iov + i, cnt, pos);
+                else
+                        ret = preadv(sbi->fd, iov + i, cnt, pos);
+                if (ret != cnt * BYTES_PER_BLOCK) {
+                        fprintf(stderr, "failed to %s block@[%d, %d]\n",
+                                write ? "write" : "read",
+                                numbfs_data_blk(sbi, blks[i]),
+                                numbfs_data_blk(sbi, blks[j - 1]));
+                        return -EIO;
+                }
+                if (!write)
+                        for (k = i; k < j; k++)
+                                numbfs_stage_overlay(sbi, iov[k].iov_base,
+                                                numbfs_data_blk(sbi, blks[k]), 1);
+        }
+        return 0;
 }
 
-int numbfs_free_inode(struct numbfs_superblock_info *sbi, int nid)
+/*
+ * set up the iovecs of the logical blocks [@start, @start + @nr) for a
+ * transfer of @buf at @offset; the partially covered head and tail blocks
+ * go through the bounce buffers @bounce[0] and @bounce[1]
+ */
+static void numbfs_inode_setup_iov(struct iovec *iov, char *buf, int offset,
+                                   int len, int start, int nr,
+                                   char bounce[2][BYTES_PER_BLOCK],
+                                   bool *partial)
 {
-        if (nid >= sbi->total_inodes)
-                return -EINVAL;
+        int i;
 
-        return numbfs_bitmap_free(sbi, sbi->ibitmap_start, nid,
-                                  &sbi->free_inodes);
+        for (i = 0; i < nr; i++) {
+                iov[i].iov_base = buf + (long)(start + i) * BYTES_PER_BLOCK - offset;
+                iov[i].iov_len = BYTES_PER_BLOCK;
+        }
+
+        partial[0] = offset % BYTES_PER_BLOCK ||
+                     (nr == 1 && (offset + len) % BYTES_PER_BLOCK);
+        partial[1] = nr > 1 && (offset + len) % BYTES_PER_BLOCK;
+        if (partial[0])
+                iov[0].iov_base = bounce[0];
+        if (partial[1])
+                iov[nr - 1].iov_base = bounce[1];
 }
 
-static int numbfs_update_timestaps(struct numbfs_inode_info *inode,
-                                   long time)
+/* copy the bytes of the partial head and tail blocks from/to @buf */
+static void numbfs_inode_copy_bounce(char *buf, int offset, int len,
+                                     int start, int nr,
+                                     char bounce[2][BYTES_PER_BLOCK],
+                                     bool *partial, bool write)
 {
-        struct numbfs_superblock_info *sbi = inode->sbi;
-        struct numbfs_timestamps *nt;
-        char buf[BYTES_PER_BLOCK];
-        int err, blk;
+        int off, cnt;
+
+        if (partial[0]) {
+                off = offset % BYTES_PER_BLOCK;
+                cnt = min(len, BYTES_PER_BLOCK - off);
+                if (write)
+                        memcpy(bounce[0] + off, buf, cnt);
+                else
+                        memcpy(buf, bounce[0] + off, cnt);
+        }
 
-        err = numbfs_alloc_block(inode->sbi, &blk);
-        if (err)
-                return err;
+        if (partial[1]) {
+                off = (start + nr - 1) * BYTES_PER_BLOCK - offset;
+                cnt = offset + len - (start + nr - 1) * BYTES_PER_BLOCK;
+                if (write)
+                        memcpy(bounce[1], buf + off, cnt);
+                else
+                        memcpy(buf + off, bounce[1], cnt);
+        }
+}
 
-        memset(buf, 0, sizeof(buf));
-        nt = (struct numbfs_timestamps*)buf;
-        nt->t_atime = time;
-        nt->t_mtime = time;
-        nt->t_ctime = time;
+/**
+ * write @len bytes of @buf at @offset in the inode's address space
+ * @buf: the content
+ * @offset: the position in the file's address space
+ * @len: write length, may cross block boundaries
+ *
+ * The whole range is mapped once, holes and shared blocks are redirected
+ * to new blocks without being zero-filled, only the partial head/tail
+ * blocks are read back, and the inode is dumped once at the end.
+ */
+int numbfs_pwrite_inode_range(struct numbfs_inode_info *ni,
+                              char *buf, int offset, int len)
+{
+        struct iovec iov[NUMBFS_NUM_DATA_ENTRY];
+        char bounce[2][BYTES_PER_BLOCK];
+        int blks[NUMBFS_NUM_DATA_ENTRY];
+        int srcs[NUMBFS_NUM_DATA_ENTRY];
+        int shared[NUMBFS_NUM_DATA_ENTRY];
+        int allocated[NUMBFS_NUM_DATA_ENTRY];
+        bool partial[2];
+        int start, nr, nr_shared = 0, nr_allocated = 0, size, i, err;
+
+        if (offset < 0 || len < 0)
+                return -EINVAL;
+        if (!len)
+                return 0;
 
-        err = numbfs_write_block(sbi, buf, numbfs_data_blk(sbi, blk));
+        start = offset / BYTES_PER_BLOCK;
+        nr = DIV_ROUND_UP(offset + len, BYTES_PER_BLOCK) - start;
+        if (start + nr > NUMBFS_NUM_DATA_ENTRY) {
+                fprintf(stderr, "error: range [%d, %d) is out of range!\n",
+                        offset, offset + len);
+                return -E2BIG;
+        }
+        for (i = 0; i < nr; i++)
+                srcs[i] = ni->data[start + i];
+
+        /*
+         * @srcs is where the current content lives, holes and shared
+         * blocks are redirected to newly allocated blocks
+         */
+        for (i = 0; i < nr; i++) {
+                if (srcs[i] != NUMBFS_HOLE) {
+                        err = numbfs_get_refcount(ni->sbi, srcs[i]);
+                        if (err < 0)
+                                goto out_free;
+                        if (err == 1) {
+                                blks[i] = srcs[i];
+                                continue;
+                        }
+                        shared[nr_shared++] = srcs[i];
+                }
+
+                err = numbfs_alloc_block(ni->sbi, &blks[i]);
+                if (err) {
+                        fprintf(stderr, "failed to alloc data block\n");
+                        goto out_free;
+                }
+                allocated[nr_allocated++] = blks[i];
+                ni->data[start + i] = blks[i];
+        }
+
+        numbfs_inode_setup_iov(iov, buf, offset, len, start, nr, bounce, partial);
+        for (i = 0; i < 2; i++) {
+                int idx = i ? nr - 1 : 0;
+
+                if (!partial[i])
+                        continue;
+                if (srcs[idx] == NUMBFS_HOLE) {
+                        memset(bounce[i], 0, BYTES_PER_BLOCK);
+                        continue;
+                }
+                err = numbfs_read_block(ni->sbi, bounce[i],
+                                        numbfs_data_blk(ni->sbi, srcs[idx]));
+                if (err)
+                        goto out_free;
+        }
+        numbfs_inode_copy_bounce(buf, offset, len, start, nr, bounce, partial, true);
+
+        err = numbfs_inode_rw_blocks(ni, blks, iov, nr, true);
         if (err)
-                return err;
+                goto out_free;
 
-        inode->xattr_start = blk;
-        return 0;
+        /* extend the inode size with holes */
+        size = ni->size;
+        ni->size = max(ni->size, offset + len);
+        err = numbfs_dump_inode(ni);
+        if (err) {
+                ni->size = size;
+                goto out_free;
+        }
+        if (!nr_shared)
+                return 0;
+
+        /* drop the references to the shared blocks we copied away from */
+        return numbfs_free_blocks(ni->sbi, shared, nr_shared);
+
+out_free:
+        /* the blocks allocated here are not attached to the inode yet */
+        for (i = 0; i < nr; i++)
+                ni->data[start + i] = srcs[i];
+        if (nr_allocated)
+                numbfs_free_blocks(ni->sbi, allocated, nr_allocated);
+        return err;
 }
 
-int numbfs_empty_dir(struct numbfs_superblock_info *sbi, int pnid)
+/* read @len bytes at @offset in the inode's address space into @buf */
+int numbfs_pread_inode_range(struct numbfs_inode_info *ni,
+                             char *buf, int offset, int len)
 {
-        struct numbfs_inode_info inode;
-        struct numbfs_dirent *dir;
-        char buf[BYTES_PER_BLOCK];
-        int nid, err, i;
+        struct iovec iov[NUMBFS_NUM_DATA_ENTRY];
+        char bounce[2][BYTES_PER_BLOCK];
+        int blks[NUMBFS_NUM_DATA_ENTRY];
+        bool partial[2];
+        int start, nr, i, err;
 
-        err = numbfs_alloc_inode(sbi, &nid);
+        if (offset < 0 || len < 0)
+                return -EINVAL;
+        if (!len)
+                return 0;
+
+        start = offset / BYTES_PER_BLOCK;
+        nr = DIV_ROUND_UP(offset + len, BYTES_PER_BLOCK) - start;
+        if (start + nr > NUMBFS_NUM_DATA_ENTRY) {
+                fprintf(stderr, "error: range [%d, %d) is out of range!\n",
+                        offset, offset + len);
+                return -E2BIG;
+        }
+
+        numbfs_inode_setup_iov(iov, buf, offset, len, start, nr, bounce, partial);
+        for (i = 0; i < nr; i++) {
+                /* the blocks beyond i_size are read as holes */
+                if ((start + i) * BYTES_PER_BLOCK >= ni->size)
+                        blks[i] = NUMBFS_HOLE;
+                else
+                        blks[i] = ni->data[start + i];
+
+                if (blks[i] == NUMBFS_HOLE)
+                        memset(iov[i].iov_base, 0, BYTES_PER_BLOCK);
+        }
+
+        err = numbfs_inode_rw_blocks(ni, blks, iov, nr, false);
         if (err)
                 return err;
 
-        memset(&inode, 0, sizeof(struct numbfs_inode_info));
-        inode.nid = nid;
-        inode.sbi = sbi;
-        inode.mode = S_IFDIR | 0755;
-        inode.nlink = 2;
-        inode.uid = (__uint16_t)getuid();
-        inode.gid = (__uint16_t)getgid();
-        inode.size = 0;
-        for (i = 0; i < NUMBFS_NUM_DATA_ENTRY; i++)
-                inode.data[i] = NUMBFS_HOLE;
+        numbfs_inode_copy_bounce(buf, offset, len, start, nr, bounce, partial, false);
+        return 0;
+}
 
-        dir = (struct numbfs_dirent*)buf;
+/* whether the logical block @lblk within i_size is mapped */
+static bool numbfs_inode_mapped(struct numbfs_inode_info *ni, int lblk)
+{
+        return lblk < NUMBFS_NUM_DATA_ENTRY &&
+               lblk < DIV_ROUND_UP(ni->size, BYTES_PER_BLOCK) &&
+               ni->data[lblk] != NUMBFS_HOLE;
+}
+
+/**
+ * fill @maps with the runs of physically contiguous blocks in the
+ * inode's address space, starting from logical block @lblk
+ * @count: the capacity of @maps
+ *
+ * Holes are not reported. Returns the number of filled mappings.
+ */
+int numbfs_inode_fiemap(struct numbfs_inode_info *ni, int lblk,
+                        struct numbfs_map *maps, int count)
+{
+        int end = min(DIV_ROUND_UP(ni->size, BYTES_PER_BLOCK),
+                      NUMBFS_NUM_DATA_ENTRY);
+        int i, nr = 0;
+
+        if (lblk < 0 || count < 0)
+                return -EINVAL;
+
+        for (i = lblk; i < end && nr < count; i++) {
+                if (!numbfs_inode_mapped(ni, i))
+                        continue;
+
+                if (nr && maps[nr - 1].lblk + maps[nr - 1].len == i &&
+                    maps[nr - 1].pblk + maps[nr - 1].len ==
+                    numbfs_data_blk(ni->sbi, ni->data[i])) {
+                        maps[nr - 1].len++;
+                        continue;
+                }
+
+                maps[nr].lblk = i;
+                maps[nr].pblk = numbfs_data_blk(ni->sbi, ni->data[i]);
+                maps[nr].len = 1;
+                maps[nr].flags = 0;
+                nr++;
+        }
+
+        /* no data after the last mapping */
+        if (nr) {
+                for (i = maps[nr - 1].lblk + maps[nr - 1].len; i < end; i++)
+                        if (numbfs_inode_mapped(ni, i))
+                                break;
+                if (i >= end)
+                        maps[nr - 1].flags |= NUMBFS_MAP_LAST;
+        }
+        return nr;
+}
+
+/* get the first data offset at or after @offset */
+int numbfs_seek_data(struct numbfs_inode_info *ni, int offset)
+{
+        int i;
+
+        if (offset < 0 || offset >= ni->size)
+                return -ENXIO;
+
+        for (i = offset / BYTES_PER_BLOCK; i * BYTES_PER_BLOCK < ni->size; i++)
+                if (numbfs_inode_mapped(ni, i))
+                        return max(offset, i * BYTES_PER_BLOCK);
+        return -ENXIO;
+}
+
+/* get the first hole offset at or after @offset, EOF is an implicit hole */
+int numbfs_seek_hole(struct numbfs_inode_info *ni, int offset)
+{
+        int i;
+
+        if (offset < 0 || offset >= ni->size)
+                return -ENXIO;
+
+        for (i = offset / BYTES_PER_BLOCK; i * BYTES_PER_BLOCK < ni->size; i++)
+                if (!numbfs_inode_mapped(ni, i))
+                        return max(offset, i * BYTES_PER_BLOCK);
+        return ni->size;
+}
+
+/*
+ * zero the bytes [@from, @to) of the logical block @lblk if it is mapped,
+ * a shared block is copied first
+ */
+static int numbfs_inode_zero_partial(struct numbfs_inode_info *ni, int lblk,
+                                     int from, int to)
+{
+        char buf[BYTES_PER_BLOCK];
+        int blk = ni->data[lblk];
+        int err;
+
+        if (from >= to || blk == NUMBFS_HOLE)
+                return 0;
+
+        err = numbfs_inode_cow(ni, lblk);
+        if (err)
+                return err;
+
+        err = numbfs_read_block(ni->sbi, buf, numbfs_data_blk(ni->sbi, ni->data[lblk]));
+        if (err)
+                return err;
+
+        memset(buf + from, 0, to - from);
+        err = numbfs_write_block(ni->sbi, buf, numbfs_data_blk(ni->sbi, ni->data[lblk]));
+        if (err || ni->data[lblk] == blk)
+                return err;
+        return numbfs_dump_inode(ni);
+}
+
+/*
+ * unmap the logical blocks [@start, @end) and release them together
+ * once the inode is dumped
+ */
+static int numbfs_inode_release(struct numbfs_inode_info *ni, int start, int end)
+{
+        int frees[NUMBFS_NUM_DATA_ENTRY];
+        int i, nr = 0, err;
+
+        for (i = start; i < end; i++) {
+                if (ni->data[i] == NUMBFS_HOLE)
+                        continue;
+                frees[nr++] = ni->data[i];
+                ni->data[i] = NUMBFS_HOLE;
+        }
+
+        err = numbfs_dump_inode(ni);
+        if (err || !nr)
+                return err;
+
+        return numbfs_free_blocks(ni->sbi, frees, nr);
+}
+
+/**
+ * change the size of the inode to @size
+ *
+ * The blocks beyond the new EOF are released with one batched bitmap
+ * update, the tail of the new last block is zeroed so that a later
+ * extension reads zeros, and the inode is written once.
+ */
+int numbfs_truncate_inode(struct numbfs_inode_info *ni, int size)
+{
+        int lblk = size / BYTES_PER_BLOCK;
+        int err;
+
+        if (size < 0)
+                return -EINVAL;
+        if (size > NUMBFS_NUM_DATA_ENTRY * BYTES_PER_BLOCK)
+                return -E2BIG;
+
+        if (size < ni->size && size % BYTES_PER_BLOCK) {
+                err = numbfs_inode_zero_partial(ni, lblk, size % BYTES_PER_BLOCK,
+                                BYTES_PER_BLOCK);
+                if (err)
+                        return err;
+        }
+
+        ni->size = size;
+        return numbfs_inode_release(ni, DIV_ROUND_UP(size, BYTES_PER_BLOCK),
+                                    NUMBFS_NUM_DATA_ENTRY);
+}
+
+/**
+ * deallocate the range [@offset, @offset + @len) without changing i_size
+ *
+ * The fully covered blocks become holes and are released with one
+ * batched bitmap update, the partially covered ones are zeroed.
+ */
+int numbfs_punch_hole(struct numbfs_inode_info *ni, int offset, int len)
+{
+        int end, start_blk, end_blk, err;
+
+        if (offset < 0 || len < 0)
+                return -EINVAL;
+
+        end = min(offset + len, ni->size);
+        if (offset >= end)
+                return 0;
+
+        start_blk = DIV_ROUND_UP(offset, BYTES_PER_BLOCK);
+        end_blk = end / BYTES_PER_BLOCK;
+        if (end == ni->size)
+                end_blk = DIV_ROUND_UP(end, BYTES_PER_BLOCK);
+
+        if (start_blk > end_blk) {
+                /* the range is inside one block */
+                return numbfs_inode_zero_partial(ni, offset / BYTES_PER_BLOCK,
+                                offset % BYTES_PER_BLOCK,
+                                (end - 1) % BYTES_PER_BLOCK + 1);
+        }
+
+        if (offset % BYTES_PER_BLOCK) {
+                err = numbfs_inode_zero_partial(ni, offset / BYTES_PER_BLOCK,
+                                offset % BYTES_PER_BLOCK, BYTES_PER_BLOCK);
+                if (err)
+                        return err;
+        }
+
+        if (end_blk * BYTES_PER_BLOCK < end) {
+                err = numbfs_inode_zero_partial(ni, end_blk, 0,
+                                end % BYTES_PER_BLOCK);
+                if (err)
+                        return err;
+        }
+
+        return numbfs_inode_release(ni, start_blk, end_blk);
+}
+
+/* get a empty inode */
+int numbfs_alloc_inode(struct numbfs_superblock_info *sbi, int *nid)
+{
+        int err;
+
+        if (!sbi->free_inodes)
+                return -ENOMEM;
+
+        err = numbfs_bitmap_alloc(sbi, sbi->ibitmap_start,
+                                  sbi->total_inodes, nid, &sbi->free_inodes);
+        if (err)
+                return err;
+
+        return numbfs_itable_init(sbi, *nid);
+}
+
+int numbfs_free_inode(struct numbfs_superblock_info *sbi, int nid)
+{
+        if (nid >= sbi->total_inodes)
+                return -EINVAL;
+
+        return numbfs_bitmap_free(sbi, sbi->ibitmap_start, nid,
+                                  &sbi->free_inodes);
+}
+
+static int numbfs_update_timestaps(struct numbfs_inode_info *inode,
+                                   long time)
+{
+        struct numbfs_superblock_info *sbi = inode->sbi;
+        struct numbfs_timestamps *nt;
+        char buf[BYTES_PER_BLOCK];
+        int err, blk;
+
+        /* no xattr block until the first xattr is set */
+        if (sbi->feature & NUMBFS_FEATURE_TSTABLE) {
+                memset(buf, 0, sizeof(buf));
+                nt = (struct numbfs_timestamps*)buf;
+                nt->t_atime = cpu_to_le64(time);
+                nt->t_mtime = cpu_to_le64(time);
+                nt->t_ctime = cpu_to_le64(time);
+                inode->xattr_start = NUMBFS_HOLE;
+                return numbfs_set_timestamps(inode, nt);
+        }
+
+        err = numbfs_alloc_block(inode->sbi, &blk);
+        if (err)
+                return err;
+
+        memset(buf, 0, sizeof(buf));
+        nt = (struct numbfs_timestamps*)buf;
+        nt->t_atime = time;
+        nt->t_mtime = time;
+        nt->t_ctime = time;
+
+        err = numbfs_write_block(sbi, buf, numbfs_data_blk(sbi, blk));
+        if (err)
+                return err;
+
+        inode->xattr_start = blk;
+        return 0;
+}
+
+/* make an empty inode of @mode with one link, return its nid */
+int numbfs_empty_inode(struct numbfs_superblock_info *sbi, int mode)
+{
+        struct numbfs_inode_info inode;
+        int nid, err, i;
+
+        err = numbfs_alloc_inode(sbi, &nid);
+        if (err)
+                return err;
+
+        memset(&inode, 0, sizeof(struct numbfs_inode_info));
+        inode.nid = nid;
+        inode.sbi = sbi;
+        inode.mode = mode;
+        inode.nlink = 1;
+        inode.uid = (__uint16_t)getuid();
+        inode.gid = (__uint16_t)getgid();
+        for (i = 0; i < NUMBFS_NUM_DATA_ENTRY; i++)
+                inode.data[i] = NUMBFS_HOLE;
+
+        err = numbfs_update_timestaps(&inode, (long)time(NULL));
+        if (err)
+                return err;
+
+        err = numbfs_dump_inode(&inode);
+        if (err)
+                return err;
+        return nid;
+}
+
+int numbfs_empty_dir(struct numbfs_superblock_info *sbi, int pnid)
+{
+        struct numbfs_inode_info inode;
+        struct numbfs_dirent *dir;
+        char buf[BYTES_PER_BLOCK];
+        int nid, err, i;
+
+        err = numbfs_alloc_inode(sbi, &nid);
+        if (err)
+                return err;
+
+        memset(&inode, 0, sizeof(struct numbfs_inode_info));
+        inode.nid = nid;
+        inode.sbi = sbi;
+        inode.mode = S_IFDIR | 0755;
+        inode.nlink = 2;
+        inode.uid = (__uint16_t)getuid();
+        inode.gid = (__uint16_t)getgid();
+        inode.size = 0;
+        for (i = 0; i < NUMBFS_NUM_DATA_ENTRY; i++)
+                inode.data[i] = NUMBFS_HOLE;
+
+        dir = (struct numbfs_dirent*)buf;
         memcpy(dir->name, DOT, DOTLEN);
         dir->name[DOTLEN] = '\0';
         dir->name_len = DOTLEN;
@@ -423,3 +1803,1434 @@ int numbfs_empty_dir(struct numbfs_superblock_info *sbi, int pnid)
                 return err;
         return nid;
 }
+
+/* set up an empty directory index of @nblocks buckets */
+int numbfs_enable_dindex(struct numbfs_superblock_info *sbi, int nblocks)
+{
+        int err, start;
+
+        if (sbi->feature & NUMBFS_FEATURE_DIR_INDEX)
+                return 0;
+
+        if (nblocks <= 0)
+                return -EINVAL;
+
+        err = numbfs_alloc_zeroed_extent(sbi, nblocks, &start);
+        if (err) {
+                fprintf(stderr, "failed to alloc %d blocks for directory index\n", nblocks);
+                return err;
+        }
+
+        sbi->dindex_start = start;
+        sbi->dindex_blocks = nblocks;
+        sbi->feature |= NUMBFS_FEATURE_DIR_INDEX;
+        return 0;
+}
+
+static unsigned long long numbfs_dindex_hash(int pnid, const char *name, int len)
+{
+        __le16 key = cpu_to_le16(pnid);
+
+        return numbfs_hash(numbfs_hash(NUMBFS_HASH_SEED, &key, sizeof(key)),
+                           name, len);
+}
+
+/* whether the dirent at @slot of @dir is @name pointing to @nid */
+static int numbfs_dindex_verify(struct numbfs_inode_info *dir, int slot,
+                                const char *name, int len, int nid, int *type)
+{
+        struct numbfs_dirent de;
+        int err;
+
+        err = numbfs_pread_inode_range(dir, (char*)&de,
+                        slot * sizeof(struct numbfs_dirent), sizeof(de));
+        if (err)
+                return err;
+
+        if (type)
+                *type = de.type;
+        return de.name_len == len && !memcmp(de.name, name, len) &&
+               le16_to_cpu(de.ino) == nid;
+}
+
+/*
+ * find the index entry of @name in @dir, the bucket holding it is left in
+ * @buf and its block addr in @blk. The probe stops at the first bucket
+ * that still has a never-used entry.
+ */
+static int numbfs_dindex_find(struct numbfs_inode_info *dir, const char *name,
+                              int len, struct numbfs_dindex_entry *buf,
+                              int *blk, int *type)
+{
+        struct numbfs_superblock_info *sbi = dir->sbi;
+        unsigned long long hash = numbfs_dindex_hash(dir->nid, name, len);
+        struct numbfs_dindex_entry *de;
+        int i, j, err;
+        bool end;
+
+        if (!(sbi->feature & NUMBFS_FEATURE_DIR_INDEX))
+                return -EOPNOTSUPP;
+
+        for (i = 0; i < sbi->dindex_blocks; i++) {
+                *blk = numbfs_data_blk(sbi, sbi->dindex_start +
+                                (hash + i) % sbi->dindex_blocks);
+                err = numbfs_read_block(sbi, (char*)buf, *blk);
+                if (err)
+                        return err;
+
+                end = false;
+                for (j = 0; j < (int)NUMBFS_DINDEX_PER_BLOCK; j++) {
+                        de = &buf[j];
+                        if (de->d_state == NUMBFS_DINDEX_FREE)
+                                end = true;
+                        if (de->d_state != NUMBFS_DINDEX_USED ||
+                            le64_to_cpu(de->d_hash) != hash ||
+                            le16_to_cpu(de->d_pnid) != dir->nid)
+                                continue;
+
+                        err = numbfs_dindex_verify(dir, le16_to_cpu(de->d_slot),
+                                                   name, len, le16_to_cpu(de->d_nid),
+                                                   type);
+                        if (err < 0)
+                                return err;
+                        if (err)
+                                return j;
+                }
+                if (end)
+                        break;
+        }
+        return -ENOENT;
+}
+
+/*
+ * look up @name in @dir, the dirent is at byte @pos of the directory,
+ * @type is optional
+ */
+int numbfs_dindex_lookup(struct numbfs_inode_info *dir, const char *name,
+                         int len, int *nid, int *pos, int *type)
+{
+        struct numbfs_dindex_entry buf[NUMBFS_DINDEX_PER_BLOCK];
+        int idx, blk;
+
+        idx = numbfs_dindex_find(dir, name, len, buf, &blk, type);
+        if (idx < 0)
+                return idx;
+
+        *nid = le16_to_cpu(buf[idx].d_nid);
+        *pos = le16_to_cpu(buf[idx].d_slot) * sizeof(struct numbfs_dirent);
+        return 0;
+}
+
+/* index the dirent of @name at byte @pos of @dir, which must not be indexed */
+int numbfs_dindex_insert(struct numbfs_inode_info *dir, const char *name,
+                         int len, int nid, int pos)
+{
+        struct numbfs_superblock_info *sbi = dir->sbi;
+        struct numbfs_dindex_entry buf[NUMBFS_DINDEX_PER_BLOCK];
+        unsigned long long hash = numbfs_dindex_hash(dir->nid, name, len);
+        int i, j, err, blk;
+
+        if (!(sbi->feature & NUMBFS_FEATURE_DIR_INDEX))
+                return -EOPNOTSUPP;
+
+        for (i = 0; i < sbi->dindex_blocks; i++) {
+                blk = numbfs_data_blk(sbi, sbi->dindex_start +
+                                (hash + i) % sbi->dindex_blocks);
+                err = numbfs_read_block(sbi, (char*)buf, blk);
+                if (err)
+                        return err;
+
+                for (j = 0; j < (int)NUMBFS_DINDEX_PER_BLOCK; j++) {
+                        if (buf[j].d_state == NUMBFS_DINDEX_USED)
+                                continue;
+
+                        buf[j].d_hash = cpu_to_le64(hash);
+                        buf[j].d_pnid = cpu_to_le16(dir->nid);
+                        buf[j].d_nid = cpu_to_le16(nid);
+                        buf[j].d_slot = cpu_to_le16(pos / sizeof(struct numbfs_dirent));
+                        buf[j].d_state = NUMBFS_DINDEX_USED;
+                        return numbfs_write_block(sbi, (char*)buf, blk);
+                }
+        }
+        return -ENOSPC;
+}
+
+/* drop the index entry of @name in @dir, call it before clearing the dirent */
+int numbfs_dindex_delete(struct numbfs_inode_info *dir, const char *name,
+                         int len)
+{
+        struct numbfs_dindex_entry buf[NUMBFS_DINDEX_PER_BLOCK];
+        int idx, blk;
+
+        idx = numbfs_dindex_find(dir, name, len, buf, &blk, NULL);
+        if (idx < 0)
+                return idx;
+
+        buf[idx].d_state = NUMBFS_DINDEX_DELETED;
+        return numbfs_write_block(dir->sbi, (char*)buf, blk);
+}
+
+static struct numbfs_lru *numbfs_lru_create(int max)
+{
+        struct numbfs_lru *lru = calloc(1, sizeof(*lru));
+
+        if (lru)
+                lru->max = max;
+        return lru;
+}
+
+static void numbfs_lru_unlink(struct numbfs_lru *lru, struct numbfs_lru_node *node)
+{
+        if (node->prev)
+                node->prev->next = node->next;
+        else
+                lru->first = node->next;
+        if (node->next)
+                node->next->prev = node->prev;
+        else
+                lru->last = node->prev;
+}
+
+static void numbfs_lru_push(struct numbfs_lru *lru, struct numbfs_lru_node *node)
+{
+        node->prev = NULL;
+        node->next = lru->first;
+        if (lru->first)
+                lru->first->prev = node;
+        else
+                lru->last = node;
+        lru->first = node;
+}
+
+static unsigned long long numbfs_lru_hash(int key, const char *name, int len)
+{
+        return numbfs_hash(numbfs_hash(NUMBFS_HASH_SEED, &key, sizeof(key)),
+                           name, len);
+}
+
+/* the pointer that links to the node of (@key, @name) in its bucket */
+static struct numbfs_lru_node **numbfs_lru_slot(struct numbfs_lru *lru, int key,
+                                                const char *name, int len)
+{
+        unsigned long long hash = numbfs_lru_hash(key, name, len);
+        struct numbfs_lru_node **pp = &lru->buckets[hash % NUMBFS_LRU_BUCKETS];
+
+        for (; *pp; pp = &(*pp)->hnext)
+                if ((*pp)->hash == hash && (*pp)->key == key &&
+                    (*pp)->len == len && !memcmp((*pp)->name, name, len))
+                        break;
+        return pp;
+}
+
+static void numbfs_lru_remove(struct numbfs_lru *lru, struct numbfs_lru_node **pp)
+{
+        struct numbfs_lru_node *node = *pp;
+
+        *pp = node->hnext;
+        numbfs_lru_unlink(lru, node);
+        lru->count--;
+        free(node);
+}
+
+/* get the node of (@key, @name) and mark it as the most recently used */
+static struct numbfs_lru_node *numbfs_lru_get(struct numbfs_lru *lru, int key,
+                                              const char *name, int len)
+{
+        struct numbfs_lru_node *node;
+
+        if (!lru)
+                return NULL;
+
+        node = *numbfs_lru_slot(lru, key, name, len);
+        if (node) {
+                numbfs_lru_unlink(lru, node);
+                numbfs_lru_push(lru, node);
+        }
+        return node;
+}
+
+/* add or update (@key, @name), the least recently used one is evicted */
+static void numbfs_lru_set(struct numbfs_lru *lru, int key, const char *name,
+                           int len, int v0, int v1, int v2)
+{
+        struct numbfs_lru_node **pp, *node;
+
+        if (!lru)
+                return;
+
+        pp = numbfs_lru_slot(lru, key, name, len);
+        node = *pp;
+        if (node) {
+                numbfs_lru_unlink(lru, node);
+        } else {
+                if (lru->count >= lru->max) {
+                        struct numbfs_lru_node *victim = lru->last;
+
+                        numbfs_lru_remove(lru, numbfs_lru_slot(lru, victim->key,
+                                          victim->name, victim->len));
+                        pp = numbfs_lru_slot(lru, key, name, len);
+                }
+
+                /* a failed allocation only costs a cache miss */
+                node = malloc(sizeof(*node) + len);
+                if (!node)
+                        return;
+                node->hash = numbfs_lru_hash(key, name, len);
+                node->key = key;
+                node->len = len;
+                memcpy(node->name, name, len);
+                node->hnext = NULL;
+                *pp = node;
+                lru->count++;
+        }
+        node->val[0] = v0;
+        node->val[1] = v1;
+        node->val[2] = v2;
+        numbfs_lru_push(lru, node);
+}
+
+static void numbfs_lru_del(struct numbfs_lru *lru, int key, const char *name,
+                           int len)
+{
+        struct numbfs_lru_node **pp;
+
+        if (!lru)
+                return;
+
+        pp = numbfs_lru_slot(lru, key, name, len);
+        if (*pp)
+                numbfs_lru_remove(lru, pp);
+}
+
+static void numbfs_lru_destroy(struct numbfs_lru *lru)
+{
+        struct numbfs_lru_node *node, *next;
+
+        if (!lru)
+                return;
+
+        for (node = lru->first; node; node = next) {
+                next = node->next;
+                free(node);
+        }
+        free(lru);
+}
+
+void numbfs_drop_caches(struct numbfs_superblock_info *sbi)
+{
+        numbfs_lru_destroy(sbi->dcache);
+        numbfs_lru_destroy(sbi->pcache);
+        numbfs_lru_destroy(sbi->xcache);
+        sbi->dcache = NULL;
+        sbi->pcache = NULL;
+        sbi->xcache = NULL;
+}
+
+/*
+ * The dentry cache maps (parent nid, name) to (nid, type, pos), a negative
+ * dentry has nid -1. The node with an empty name of a directory caches its
+ * first free dirent slot, -1 means the directory has none.
+ */
+static struct numbfs_lru *numbfs_dcache(struct numbfs_superblock_info *sbi)
+{
+        if (!sbi->dcache)
+                sbi->dcache = numbfs_lru_create(NUMBFS_DCACHE_MAX);
+        return sbi->dcache;
+}
+
+static bool numbfs_is_dot(const char *name, int len)
+{
+        return (len == 1 && name[0] == '.') ||
+               (len == 2 && name[0] == '.' && name[1] == '.');
+}
+
+/* scan all the dirents of @dir for @name, caching every entry on the way */
+static int numbfs_dir_scan(struct numbfs_inode_info *dir, const char *name,
+                           int len, int *nid, int *type, int *pos,
+                           int *free_pos)
+{
+        struct numbfs_lru *dcache = numbfs_dcache(dir->sbi);
+        char buf[NUMBFS_NUM_DATA_ENTRY * BYTES_PER_BLOCK];
+        struct numbfs_dirent *de = (struct numbfs_dirent*)buf;
+        int i, err, ret = -ENOENT;
+
+        *free_pos = -1;
+        err = numbfs_pread_inode_range(dir, buf, 0, dir->size);
+        if (err)
+                return err;
+
+        for (i = 0; i < dir->size / (int)sizeof(*de); i++, de++) {
+                if (!de->name_len) {
+                        if (*free_pos < 0)
+                                *free_pos = i * sizeof(*de);
+                        continue;
+                }
+
+                numbfs_lru_set(dcache, dir->nid, de->name, de->name_len,
+                               le16_to_cpu(de->ino), de->type, i * sizeof(*de));
+                if (de->name_len == len && !memcmp(de->name, name, len)) {
+                        *nid = le16_to_cpu(de->ino);
+                        *type = de->type;
+                        *pos = i * sizeof(*de);
+                        ret = 0;
+                }
+        }
+
+        numbfs_lru_set(dcache, dir->nid, "", 0, *free_pos, 0, 0);
+        return ret;
+}
+
+/* look up @name in @dir, @pos is the byte offset of its dirent */
+static int numbfs_dir_find(struct numbfs_inode_info *dir, const char *name,
+                           int len, int *nid, int *type, int *pos)
+{
+        struct numbfs_lru *dcache = numbfs_dcache(dir->sbi);
+        struct numbfs_lru_node *dn;
+        int err, free_pos;
+
+        if (len <= 0 || len >= NUMBFS_MAX_PATH_LEN)
+                return -ENAMETOOLONG;
+
+        dn = numbfs_lru_get(dcache, dir->nid, name, len);
+        if (dn) {
+                if (dn->val[0] < 0)
+                        return -ENOENT;
+                *nid = dn->val[0];
+                *type = dn->val[1];
+                *pos = dn->val[2];
+                return 0;
+        }
+
+        if ((dir->sbi->feature & NUMBFS_FEATURE_DIR_INDEX) &&
+            !numbfs_is_dot(name, len))
+                err = numbfs_dindex_lookup(dir, name, len, nid, pos, type);
+        else
+                err = numbfs_dir_scan(dir, name, len, nid, type, pos, &free_pos);
+
+        if (!err)
+                numbfs_lru_set(dcache, dir->nid, name, len, *nid, *type, *pos);
+        else if (err == -ENOENT)
+                numbfs_lru_set(dcache, dir->nid, name, len, -1, 0, 0);
+        return err;
+}
+
+/* look up @name in @dir */
+int numbfs_dir_lookup(struct numbfs_inode_info *dir, const char *name,
+                      int len, int *nid, int *type)
+{
+        int pos;
+
+        return numbfs_dir_find(dir, name, len, nid, type, &pos);
+}
+
+/* get a free dirent slot of @dir, reusing the slot of a removed entry */
+static int numbfs_dir_free_slot(struct numbfs_inode_info *dir, int *pos)
+{
+        struct numbfs_lru *dcache = numbfs_dcache(dir->sbi);
+        struct numbfs_lru_node *dn;
+        int nid, type, free_pos, err;
+
+        dn = numbfs_lru_get(dcache, dir->nid, "", 0);
+        if (dn) {
+                free_pos = dn->val[0];
+        } else {
+                /* nothing matches an empty name, the scan only finds the free slot */
+                err = numbfs_dir_scan(dir, "", 0, &nid, &type, pos, &free_pos);
+                if (err != -ENOENT)
+                        return err ? err : -EIO;
+        }
+
+        /* no free slot, append to the directory */
+        if (free_pos < 0) {
+                *pos = dir->size;
+                return 0;
+        }
+
+        /* the next free slot is unknown until the next scan */
+        *pos = free_pos;
+        numbfs_lru_del(dcache, dir->nid, "", 0);
+        return 0;
+}
+
+/* add a dirent of @name pointing to @nid in @dir */
+int numbfs_dir_add(struct numbfs_inode_info *dir, const char *name,
+                   int len, int nid, int type)
+{
+        struct numbfs_dirent de;
+        int err, pos, tmp;
+
+        if (len <= 0 || len >= NUMBFS_MAX_PATH_LEN)
+                return -ENAMETOOLONG;
+
+        err = numbfs_dir_find(dir, name, len, &tmp, &tmp, &pos);
+        if (!err)
+                return -EEXIST;
+        if (err != -ENOENT)
+                return err;
+
+        err = numbfs_dir_free_slot(dir, &pos);
+        if (err)
+                return err;
+
+        if (pos + (int)sizeof(de) > NUMBFS_NUM_DATA_ENTRY * BYTES_PER_BLOCK)
+                return -ENOSPC;
+
+        memset(&de, 0, sizeof(de));
+        memcpy(de.name, name, len);
+        de.name_len = len;
+        de.ino = cpu_to_le16(nid);
+        de.type = type;
+        err = numbfs_pwrite_inode_range(dir, (char*)&de, pos, sizeof(de));
+        if (err)
+                return err;
+
+        if (dir->sbi->feature & NUMBFS_FEATURE_DIR_INDEX) {
+                err = numbfs_dindex_insert(dir, name, len, nid, pos);
+                if (err)
+                        return err;
+        }
+
+        numbfs_lru_set(dir->sbi->dcache, dir->nid, name, len, nid, type, pos);
+        return 0;
+}
+
+/* remove the dirent of @name in @dir, its slot will be reused */
+int numbfs_dir_remove(struct numbfs_inode_info *dir, const char *name,
+                      int len)
+{
+        struct numbfs_lru_node *dn;
+        struct numbfs_dirent de;
+        int err, pos, nid, type;
+
+        if (numbfs_is_dot(name, len))
+                return -EINVAL;
+
+        err = numbfs_dir_find(dir, name, len, &nid, &type, &pos);
+        if (err)
+                return err;
+
+        if (dir->sbi->feature & NUMBFS_FEATURE_DIR_INDEX) {
+                err = numbfs_dindex_delete(dir, name, len);
+                if (err)
+                        return err;
+        }
+
+        memset(&de, 0, sizeof(de));
+        err = numbfs_pwrite_inode_range(dir, (char*)&de, pos, sizeof(de));
+        if (err)
+                return err;
+
+        numbfs_lru_set(dir->sbi->dcache, dir->nid, name, len, -1, 0, 0);
+        dn = numbfs_lru_get(dir->sbi->dcache, dir->nid, "", 0);
+        if (dn && (dn->val[0] < 0 || pos < dn->val[0]))
+                dn->val[0] = pos;
+
+        /* any cached path may go through the removed entry */
+        numbfs_lru_destroy(dir->sbi->pcache);
+        dir->sbi->pcache = NULL;
+        return 0;
+}
+
+static int numbfs_cmp_dirent_ino(const void *a, const void *b)
+{
+        const struct numbfs_dirent *da = a, *db = b;
+
+        return le16_to_cpu(da->ino) - le16_to_cpu(db->ino);
+}
+
+/**
+ * drop the free slots of @dir and release its trailing blocks
+ * @sort: order the entries (except "." and "..") by inode number, so that
+ *        a walk of the directory reads the inode table in order
+ */
+int numbfs_dir_compact(struct numbfs_inode_info *dir, bool sort)
+{
+        struct numbfs_lru *dcache = dir->sbi->dcache;
+        char old[NUMBFS_NUM_DATA_ENTRY * BYTES_PER_BLOCK];
+        char new[NUMBFS_NUM_DATA_ENTRY * BYTES_PER_BLOCK];
+        struct numbfs_dirent *od = (struct numbfs_dirent*)old;
+        struct numbfs_dirent *nd = (struct numbfs_dirent*)new;
+        bool index = dir->sbi->feature & NUMBFS_FEATURE_DIR_INDEX;
+        int i, j, nr, err, size;
+
+        err = numbfs_pread_inode_range(dir, old, 0, dir->size);
+        if (err)
+                return err;
+
+        /* "." and ".." always stay in the first two slots */
+        nr = dir->size / sizeof(struct numbfs_dirent);
+        for (i = 0, j = 0; i < nr; i++)
+                if (i < 2 || od[i].name_len)
+                        nd[j++] = od[i];
+        if (sort && j > 2)
+                qsort(nd + 2, j - 2, sizeof(*nd), numbfs_cmp_dirent_ino);
+
+        size = j * sizeof(struct numbfs_dirent);
+        if (size == dir->size && !memcmp(old, new, size))
+                return 0;
+
+        /* the index entries are verified against the dirents, drop them first */
+        for (i = 2; index && i < nr; i++) {
+                if (!od[i].name_len)
+                        continue;
+                err = numbfs_dindex_delete(dir, od[i].name, od[i].name_len);
+                if (err)
+                        return err;
+        }
+
+        err = numbfs_pwrite_inode_range(dir, new, 0, size);
+        if (err)
+                return err;
+
+        err = numbfs_truncate_inode(dir, size);
+        if (err)
+                return err;
+
+        for (i = 2; i < j; i++) {
+                if (index) {
+                        err = numbfs_dindex_insert(dir, nd[i].name, nd[i].name_len,
+                                        le16_to_cpu(nd[i].ino), i * sizeof(*nd));
+                        if (err)
+                                return err;
+                }
+                numbfs_lru_set(dcache, dir->nid, nd[i].name, nd[i].name_len,
+                               le16_to_cpu(nd[i].ino), nd[i].type, i * sizeof(*nd));
+        }
+
+        /* the directory is dense now */
+        numbfs_lru_set(dcache, dir->nid, "", 0, -1, 0, 0);
+        return 0;
+}
+
+/* the inode table blocks read in one request by readdirplus */
+#define NUMBFS_READDIR_RA       8
+
+struct numbfs_readdir_ref {
+        int nid;
+        int idx;
+};
+
+static int numbfs_cmp_readdir_ref(const void *a, const void *b)
+{
+        const struct numbfs_readdir_ref *ra = a, *rb = b;
+
+        return ra->nid - rb->nid;
+}
+
+/*
+ * read the inodes of all the entries in inode order, so that the inode
+ * table is read sequentially, in windows of up to NUMBFS_READDIR_RA blocks;
+ * the unused inodes beyond a lazy inode table come from the template
+ */
+static int numbfs_readdir_prefetch(struct numbfs_readdir_ctx *ctx)
+{
+        struct numbfs_superblock_info *sbi = ctx->dir->sbi;
+        char ra[NUMBFS_READDIR_RA * BYTES_PER_BLOCK], tmpl[BYTES_PER_BLOCK];
+        struct numbfs_readdir_ref *refs;
+        struct numbfs_inode_info *ni;
+        int i, j, blk, start = -1, len = 0, ret, err = 0;
+
+        refs = malloc(ctx->count * sizeof(*refs));
+        if (!refs)
+                return -ENOMEM;
+
+        for (i = 0; i < ctx->count; i++) {
+                refs[i].nid = le16_to_cpu(ctx->dents[i].ino);
+                refs[i].idx = i;
+                if (refs[i].nid >= sbi->total_inodes) {
+                        fprintf(stderr, "[corrupted] dirent@%d of inode@%d points to inode@%d\n",
+                                i, ctx->dir->nid, refs[i].nid);
+                        free(refs);
+                        return -EFSCORRUPTED;
+                }
+        }
+        qsort(refs, ctx->count, sizeof(*refs), numbfs_cmp_readdir_ref);
+        numbfs_itable_template(tmpl);
+
+        for (i = 0; i < ctx->count; i++) {
+                ni = &ctx->inodes[refs[i].idx];
+                ni->sbi = sbi;
+                ni->nid = refs[i].nid;
+                if (!numbfs_itable_ready(sbi, ni->nid)) {
+                        numbfs_decode_inode(ni, (struct numbfs_inode*)tmpl +
+                                        ni->nid % NUMBFS_NODES_PER_BLOCK);
+                        continue;
+                }
+
+                blk = numbfs_inode_blk(sbi, refs[i].nid);
+                if (blk < start || blk >= start + len) {
+                        /* cover the following entries as far as the window allows */
+                        start = blk;
+                        len = 1;
+                        for (j = i + 1; j < ctx->count; j++) {
+                                if (!numbfs_itable_ready(sbi, refs[j].nid))
+                                        break;
+                                blk = numbfs_inode_blk(sbi, refs[j].nid);
+                                if (blk >= start + NUMBFS_READDIR_RA)
+                                        break;
+                                len = blk - start + 1;
+                        }
+
+                        ret = pread(sbi->fd, ra, len * BYTES_PER_BLOCK,
+                                    (off_t)start * BYTES_PER_BLOCK);
+                        if (ret != len * BYTES_PER_BLOCK) {
+                                fprintf(stderr, "failed to read inode blocks@[%d, %d)\n",
+                                        start, start + len);
+                                err = -EIO;
+                                break;
+                        }
+                        numbfs_stage_overlay(sbi, ra, start, len);
+                }
+
+                numbfs_decode_inode(ni, (struct numbfs_inode*)ra +
+                                (numbfs_inode_blk(sbi, ni->nid) - start) *
+                                NUMBFS_NODES_PER_BLOCK +
+                                ni->nid % NUMBFS_NODES_PER_BLOCK);
+        }
+
+        free(refs);
+        return err;
+}
+
+/**
+ * take a snapshot of @dir for numbfs_readdir(), the whole directory is read
+ * in one request and the free slots are skipped
+ * @flags: NUMBFS_READDIR_SORT returns the entries (except "." and "..") in
+ *         inode order, NUMBFS_READDIR_PLUS also reads the inode of each
+ *         entry
+ */
+int numbfs_opendir(struct numbfs_readdir_ctx *ctx,
+                   struct numbfs_inode_info *dir, int flags)
+{
+        int i, nr, err;
+
+        memset(ctx, 0, sizeof(*ctx));
+        ctx->dir = dir;
+        ctx->flags = flags;
+
+        if (!S_ISDIR(dir->mode))
+                return -ENOTDIR;
+
+        ctx->dents = malloc(dir->size);
+        if (!ctx->dents && dir->size)
+                return -ENOMEM;
+
+        err = numbfs_pread_inode_range(dir, (char*)ctx->dents, 0, dir->size);
+        if (err)
+                goto out;
+
+        nr = dir->size / sizeof(struct numbfs_dirent);
+        for (i = 0; i < nr; i++)
+                if (ctx->dents[i].name_len)
+                        ctx->dents[ctx->count++] = ctx->dents[i];
+
+        if ((flags & NUMBFS_READDIR_SORT) && ctx->count > 2)
+                qsort(ctx->dents + 2, ctx->count - 2, sizeof(*ctx->dents),
+                      numbfs_cmp_dirent_ino);
+
+        if ((flags & NUMBFS_READDIR_PLUS) && ctx->count) {
+                ctx->inodes = malloc(ctx->count * sizeof(*ctx->inodes));
+                if (!ctx->inodes) {
+                        err = -ENOMEM;
+                        goto out;
+                }
+                err = numbfs_readdir_prefetch(ctx);
+        }
+
+out:
+        if (err)
+                numbfs_closedir(ctx);
+        return err;
+}
+
+int numbfs_readdir(struct numbfs_readdir_ctx *ctx, struct numbfs_dirent **de,
+                   struct numbfs_inode_info **ni)
+{
+        if (ctx->pos >= ctx->count)
+                return 0;
+
+        *de = &ctx->dents[ctx->pos];
+        if (ni)
+                *ni = ctx->inodes ? &ctx->inodes[ctx->pos] : NULL;
+        ctx->pos++;
+        return 1;
+}
+
+void numbfs_closedir(struct numbfs_readdir_ctx *ctx)
+{
+        free(ctx->dents);
+        free(ctx->inodes);
+        ctx->dents = NULL;
+        ctx->inodes = NULL;
+        ctx->count = ctx->pos = 0;
+}
+
+/*
+ * The path cache maps a normalized path prefix like "a/b" to its nid, a
+ * probe of the whole path skips the walk, otherwise the walk starts from
+ * the longest cached prefix.
+ */
+int numbfs_lookup_path(struct numbfs_superblock_info *sbi, const char *path,
+                       int *nid)
+{
+        struct numbfs_inode_info dir;
+        struct numbfs_lru_node *pn;
+        const char *comp, *end;
+        char *key;
+        int len = 0, done, i, cur, type, err;
+
+        key = malloc(strlen(path) + 1);
+        if (!key)
+                return -ENOMEM;
+
+        /* drop the empty and "." components */
+        for (comp = path; *comp; comp = end) {
+                while (*comp == '/')
+                        comp++;
+                for (end = comp; *end && *end != '/'; end++)
+                        ;
+                if (end == comp || (end - comp == 1 && *comp == '.'))
+                        continue;
+                if (len)
+                        key[len++] = '/';
+                memcpy(key + len, comp, end - comp);
+                len += end - comp;
+        }
+
+        if (!sbi->pcache)
+                sbi->pcache = numbfs_lru_create(NUMBFS_PCACHE_MAX);
+
+        /* the longest cached prefix */
+        cur = NUMBFS_ROOT_NID;
+        for (done = len; done > 0; ) {
+                pn = numbfs_lru_get(sbi->pcache, 0, key, done);
+                if (pn) {
+                        cur = pn->val[0];
+                        break;
+                }
+                while (done > 0 && key[done - 1] != '/')
+                        done--;
+                if (done)
+                        done--;
+        }
+
+        for (err = 0; done < len; done = i) {
+                if (done)
+                        done++;
+                for (i = done; i < len && key[i] != '/'; i++)
+                        ;
+
+                dir.sbi = sbi;
+                dir.nid = cur;
+                err = numbfs_get_inode(sbi, &dir);
+                if (err)
+                        break;
+                if (!S_ISDIR(dir.mode)) {
+                        err = -ENOTDIR;
+                        break;
+                }
+
+                err = numbfs_dir_lookup(&dir, key + done, i - done, &cur, &type);
+                if (err)
+                        break;
+                numbfs_lru_set(sbi->pcache, 0, key, i, cur, 0, 0);
+        }
+
+        free(key);
+        if (!err)
+                *nid = cur;
+        return err;
+}
+
+/* in-memory copy of an xattr block, indexed by the hash of type and name */
+#define NUMBFS_XATTR_BUCKETS    16
+
+struct numbfs_xattr_info {
+        char buf[BYTES_PER_BLOCK];
+        /* the first slot of each bucket and the next slot in the chain */
+        signed char head[NUMBFS_XATTR_BUCKETS];
+        signed char next[NUMBFS_XATTR_MAX_ENTRY];
+        /* xattr count and block of the on-disk inode */
+        int count;
+        int start;
+        bool dirty;
+};
+
+static const char *numbfs_xattr_prefix[] = {
+        [NUMBFS_XATTR_INDEX_USER]       = "user.",
+        [NUMBFS_XATTR_INDEX_TRUSTED]    = "trusted.",
+};
+
+static int numbfs_xattr_bucket(int type, const char *name, int len)
+{
+        unsigned char t = type;
+
+        return numbfs_hash(numbfs_hash(NUMBFS_HASH_SEED, &t, 1),
+                           name, len) % NUMBFS_XATTR_BUCKETS;
+}
+
+static struct numbfs_xattr_entry *numbfs_xattr_slot(struct numbfs_xattr_info *xi,
+                                                     int i)
+{
+        return (struct numbfs_xattr_entry*)(xi->buf + NUMBFS_XATTR_ENTRY_START) + i;
+}
+
+static void numbfs_xattr_link(struct numbfs_xattr_info *xi, int i)
+{
+        struct numbfs_xattr_entry *xe = numbfs_xattr_slot(xi, i);
+        int b = numbfs_xattr_bucket(xe->e_type, (char*)xe->e_name, xe->e_nlen);
+
+        xi->next[i] = xi->head[b];
+        xi->head[b] = i;
+}
+
+/*
+ * The xattr cache maps the hash of the entries of a shared xattr block to
+ * its block address, candidates are verified against the block.
+ */
+static struct numbfs_lru *numbfs_xcache(struct numbfs_superblock_info *sbi)
+{
+        if (!sbi->xcache)
+                sbi->xcache = numbfs_lru_create(NUMBFS_XCACHE_MAX);
+        return sbi->xcache;
+}
+
+static unsigned long long numbfs_xattr_hash(const char *buf)
+{
+        return numbfs_hash(NUMBFS_HASH_SEED, buf + NUMBFS_XATTR_ENTRY_START,
+                           BYTES_PER_BLOCK - NUMBFS_XATTR_ENTRY_START);
+}
+
+/* the used entries first, in the order of type and name */
+static int numbfs_cmp_xattr(const void *a, const void *b)
+{
+        const struct numbfs_xattr_entry *xa = a, *xb = b;
+
+        if (xa->e_valid != xb->e_valid)
+                return xb->e_valid - xa->e_valid;
+        if (xa->e_type != xb->e_type)
+                return xa->e_type - xb->e_type;
+        if (xa->e_nlen != xb->e_nlen)
+                return xa->e_nlen - xb->e_nlen;
+        return memcmp(xa->e_name, xb->e_name, xa->e_nlen);
+}
+
+/* blocks written before the header was introduced have one user */
+static int numbfs_xattr_refcount(struct numbfs_xattr_header *xh)
+{
+        if (le32_to_cpu(xh->h_magic) != NUMBFS_XATTR_MAGIC)
+                return 1;
+        return le32_to_cpu(xh->h_refcount);
+}
+
+/* drop a reference of the xattr block @blk, free it with the last one */
+static int numbfs_xattr_put_block(struct numbfs_superblock_info *sbi, int blk)
+{
+        struct numbfs_xattr_header *xh;
+        struct numbfs_lru_node *node;
+        char buf[BYTES_PER_BLOCK];
+        unsigned long long hash;
+        int err, refs;
+
+        err = numbfs_read_block(sbi, buf, numbfs_data_blk(sbi, blk));
+        if (err)
+                return err;
+
+        xh = (struct numbfs_xattr_header*)buf;
+        refs = numbfs_xattr_refcount(xh);
+        if (refs > 1) {
+                xh->h_refcount = cpu_to_le32(refs - 1);
+                return numbfs_write_block(sbi, buf, numbfs_data_blk(sbi, blk));
+        }
+
+        hash = le64_to_cpu(xh->h_hash);
+        node = numbfs_lru_get(sbi->xcache, 0, (char*)&hash, sizeof(hash));
+        if (node && node->val[0] == blk)
+                numbfs_lru_del(sbi->xcache, 0, (char*)&hash, sizeof(hash));
+        return numbfs_free_blocks(sbi, &blk, 1);
+}
+
+/* take a reference of a block other than @self holding the entries of @buf */
+static int numbfs_xattr_get_shared(struct numbfs_superblock_info *sbi,
+                                   const char *buf, unsigned long long hash,
+                                   int self, int *blk)
+{
+        struct numbfs_xattr_header *xh;
+        struct numbfs_lru_node *node;
+        char cand[BYTES_PER_BLOCK];
+        int err;
+
+        node = numbfs_lru_get(sbi->xcache, 0, (char*)&hash, sizeof(hash));
+        if (!node || node->val[0] == self)
+                return -ENOENT;
+
+        *blk = node->val[0];
+        err = numbfs_read_block(sbi, cand, numbfs_data_blk(sbi, *blk));
+        if (err)
+                return err;
+
+        xh = (struct numbfs_xattr_header*)cand;
+        if (le32_to_cpu(xh->h_magic) != NUMBFS_XATTR_MAGIC ||
+            le64_to_cpu(xh->h_hash) != hash ||
+            memcmp(cand + NUMBFS_XATTR_ENTRY_START, buf + NUMBFS_XATTR_ENTRY_START,
+                   BYTES_PER_BLOCK - NUMBFS_XATTR_ENTRY_START)) {
+                numbfs_lru_del(sbi->xcache, 0, (char*)&hash, sizeof(hash));
+                return -ENOENT;
+        }
+
+        xh->h_refcount = cpu_to_le32(le32_to_cpu(xh->h_refcount) + 1);
+        return numbfs_write_block(sbi, cand, numbfs_data_blk(sbi, *blk));
+}
+
+/*
+ * write the xattrs of @ni to a block shared with the other inodes having
+ * the same xattrs, the block in use is only rewritten in place if no
+ * other inode uses it
+ */
+static int numbfs_xattr_commit_shared(struct numbfs_inode_info *ni)
+{
+        struct numbfs_superblock_info *sbi = ni->sbi;
+        struct numbfs_xattr_info *xi = ni->xattrs;
+        struct numbfs_xattr_header *xh = (struct numbfs_xattr_header*)xi->buf;
+        char buf[BYTES_PER_BLOCK];
+        unsigned long long hash;
+        int err, blk, start = ni->xattr_start;
+
+        if (!ni->xattr_count) {
+                ni->xattr_start = NUMBFS_HOLE;
+                return start == NUMBFS_HOLE ? 0 : numbfs_xattr_put_block(sbi, start);
+        }
+
+        /* the same xattr set always has the same bytes */
+        qsort(xi->buf + NUMBFS_XATTR_ENTRY_START, NUMBFS_XATTR_MAX_ENTRY,
+              sizeof(struct numbfs_xattr_entry), numbfs_cmp_xattr);
+        hash = numbfs_xattr_hash(xi->buf);
+
+        numbfs_xcache(sbi);
+        err = numbfs_xattr_get_shared(sbi, xi->buf, hash, start, &blk);
+        if (!err) {
+                ni->xattr_start = blk;
+                return start == NUMBFS_HOLE ? 0 : numbfs_xattr_put_block(sbi, start);
+        } else if (err != -ENOENT) {
+                return err;
+        }
+
+        blk = start;
+        if (start != NUMBFS_HOLE) {
+                err = numbfs_read_block(sbi, buf, numbfs_data_blk(sbi, start));
+                if (err)
+                        return err;
+                /* copy on write */
+                if (numbfs_xattr_refcount((struct numbfs_xattr_header*)buf) > 1)
+                        blk = NUMBFS_HOLE;
+        }
+
+        if (blk == NUMBFS_HOLE) {
+                err = numbfs_alloc_block(sbi, &blk);
+                if (err)
+                        return err;
+        }
+
+        memset(xh, 0, sizeof(*xh));
+        xh->h_magic = cpu_to_le32(NUMBFS_XATTR_MAGIC);
+        xh->h_refcount = cpu_to_le32(1);
+        xh->h_hash = cpu_to_le64(hash);
+        err = numbfs_write_block(sbi, xi->buf, numbfs_data_blk(sbi, blk));
+        if (err)
+                return err;
+
+        numbfs_lru_set(sbi->xcache, 0, (char*)&hash, sizeof(hash), blk, 0, 0);
+        ni->xattr_start = blk;
+        if (start != NUMBFS_HOLE && start != blk)
+                return numbfs_xattr_put_block(sbi, start);
+        return 0;
+}
+
+/* read the xattr block of @ni and build the index, once */
+static int numbfs_xattr_load(struct numbfs_inode_info *ni,
+                             struct numbfs_xattr_info **xip)
+{
+        struct numbfs_xattr_info *xi = ni->xattrs;
+        struct numbfs_xattr_header *xh;
+        unsigned long long hash;
+        int i, err;
+
+        if (xi) {
+                *xip = xi;
+                return 0;
+        }
+
+        xi = malloc(sizeof(*xi));
+        if (!xi)
+                return -ENOMEM;
+
+        /* the block is allocated on flush */
+        if (ni->xattr_start == NUMBFS_HOLE) {
+                memset(xi->buf, 0, sizeof(xi->buf));
+                err = 0;
+        } else {
+                err = numbfs_read_block(ni->sbi, xi->buf,
+                                        numbfs_data_blk(ni->sbi, ni->xattr_start));
+        }
+        if (err) {
+                free(xi);
+                return err;
+        }
+
+        xh = (struct numbfs_xattr_header*)xi->buf;
+        if (ni->xattr_start != NUMBFS_HOLE &&
+            (ni->sbi->feature & NUMBFS_FEATURE_TSTABLE) &&
+            le32_to_cpu(xh->h_magic) == NUMBFS_XATTR_MAGIC) {
+                hash = le64_to_cpu(xh->h_hash);
+                numbfs_lru_set(numbfs_xcache(ni->sbi), 0, (char*)&hash,
+                               sizeof(hash), ni->xattr_start, 0, 0);
+        }
+
+        memset(xi->head, -1, sizeof(xi->head));
+        for (i = 0; i < (int)NUMBFS_XATTR_MAX_ENTRY; i++)
+                if (numbfs_xattr_slot(xi, i)->e_valid)
+                        numbfs_xattr_link(xi, i);
+        xi->count = ni->xattr_count;
+        xi->start = ni->xattr_start;
+        xi->dirty = false;
+
+        ni->xattrs = xi;
+        *xip = xi;
+        return 0;
+}
+
+/* return the slot of the xattr, or -1 if not found, @prev gets its predecessor */
+static int numbfs_xattr_find(struct numbfs_xattr_info *xi, int type,
+                             const char *name, int len, int *prev)
+{
+        struct numbfs_xattr_entry *xe;
+        int i, p = -1;
+
+        for (i = xi->head[numbfs_xattr_bucket(type, name, len)]; i >= 0;
+             p = i, i = xi->next[i]) {
+                xe = numbfs_xattr_slot(xi, i);
+                if (xe->e_type == type && xe->e_nlen == len &&
+                    !memcmp(xe->e_name, name, len))
+                        break;
+        }
+
+        if (prev)
+                *prev = p;
+        return i;
+}
+
+/* whether @type is the index of a known name prefix */
+static bool numbfs_xattr_type_valid(int type)
+{
+        return type >= 0 && type < (int)ARRAY_SIZE(numbfs_xattr_prefix) &&
+               numbfs_xattr_prefix[type];
+}
+
+static int numbfs_xattr_check(int type, const char *name)
+{
+        int len = strlen(name);
+
+        if (!numbfs_xattr_type_valid(type))
+                return -EOPNOTSUPP;
+        if (!len || len > NUMBFS_XATTR_MAXNAME)
+                return -ERANGE;
+        return len;
+}
+
+int numbfs_getxattr(struct numbfs_inode_info *ni, int type, const char *name,
+                    void *value, int size)
+{
+        struct numbfs_xattr_info *xi;
+        struct numbfs_xattr_entry *xe;
+        int i, len, err;
+
+        len = numbfs_xattr_check(type, name);
+        if (len < 0)
+                return len;
+
+        err = numbfs_xattr_load(ni, &xi);
+        if (err)
+                return err;
+
+        i = numbfs_xattr_find(xi, type, name, len, NULL);
+        if (i < 0)
+                return -ENODATA;
+
+        xe = numbfs_xattr_slot(xi, i);
+        if (!size)
+                return xe->e_vlen;
+        if (size < xe->e_vlen)
+                return -ERANGE;
+        memcpy(value, xe->e_value, xe->e_vlen);
+        return xe->e_vlen;
+}
+
+int numbfs_setxattr(struct numbfs_inode_info *ni, int type, const char *name,
+                    const void *value, int size, int flags)
+{
+        struct numbfs_xattr_info *xi;
+        struct numbfs_xattr_entry *xe;
+        int i, len, err;
+
+        len = numbfs_xattr_check(type, name);
+        if (len < 0)
+                return len;
+        if (size < 0 || size > NUMBFS_XATTR_MAXVALUE)
+                return -ERANGE;
+
+        err = numbfs_xattr_load(ni, &xi);
+        if (err)
+                return err;
+
+        i = numbfs_xattr_find(xi, type, name, len, NULL);
+        if (i >= 0 && (flags & NUMBFS_XATTR_CREATE))
+                return -EEXIST;
+        if (i < 0 && (flags & NUMBFS_XATTR_REPLACE))
+                return -ENODATA;
+
+        if (i < 0) {
+                for (i = 0; i < (int)NUMBFS_XATTR_MAX_ENTRY; i++)
+                        if (!numbfs_xattr_slot(xi, i)->e_valid)
+                                break;
+                if (i == (int)NUMBFS_XATTR_MAX_ENTRY)
+                        return -ENOSPC;
+
+                xe = numbfs_xattr_slot(xi, i);
+                memset(xe, 0, sizeof(*xe));
+                xe->e_valid = 1;
+                xe->e_type = type;
+                xe->e_nlen = len;
+                memcpy(xe->e_name, name, len);
+                numbfs_xattr_link(xi, i);
+                ni->xattr_count++;
+        }
+
+        xe = numbfs_xattr_slot(xi, i);
+        memset(xe->e_value, 0, sizeof(xe->e_value));
+        memcpy(xe->e_value, value, size);
+        xe->e_vlen = size;
+        xi->dirty = true;
+        return 0;
+}
+
+int numbfs_removexattr(struct numbfs_inode_info *ni, int type, const char *name)
+{
+        struct numbfs_xattr_info *xi;
+        int i, prev, len, err;
+
+        len = numbfs_xattr_check(type, name);
+        if (len < 0)
+                return len;
+
+        err = numbfs_xattr_load(ni, &xi);
+        if (err)
+                return err;
+
+        i = numbfs_xattr_find(xi, type, name, len, &prev);
+        if (i < 0)
+                return -ENODATA;
+
+        if (prev < 0)
+                xi->head[numbfs_xattr_bucket(type, name, len)] = xi->next[i];
+        else
+                xi->next[prev] = xi->next[i];
+        memset(numbfs_xattr_slot(xi, i), 0, sizeof(struct numbfs_xattr_entry));
+        ni->xattr_count--;
+        xi->dirty = true;
+        return 0;
+}
+
+/* the names are "<prefix><name>\0" like listxattr(2), return the total size */
+int numbfs_listxattr(struct numbfs_inode_info *ni, char *list, int size)
+{
+        struct numbfs_xattr_info *xi;
+        struct numbfs_xattr_entry *xe;
+        const char *prefix;
+        int i, plen, total = 0, err;
+
+        err = numbfs_xattr_load(ni, &xi);
+        if (err)
+                return err;
+
+        for (i = 0; i < (int)NUMBFS_XATTR_MAX_ENTRY; i++) {
+                xe = numbfs_xattr_slot(xi, i);
+                if (!xe->e_valid)
+                        continue;
+
+                if (!numbfs_xattr_type_valid(xe->e_type) ||
+                    xe->e_nlen > NUMBFS_XATTR_MAXNAME) {
+                        fprintf(stderr, "[corrupted] xattr slot %d of inode@%d, type %d, name length %d\n",
+                                i, ni->nid, xe->e_type, xe->e_nlen);
+                        return -EFSCORRUPTED;
+                }
+
+                prefix = numbfs_xattr_prefix[xe->e_type];
+                plen = strlen(prefix);
+                if (size) {
+                        if (total + plen + xe->e_nlen + 1 > size)
+                                return -ERANGE;
+                        memcpy(list + total, prefix, plen);
+                        memcpy(list + total + plen, xe->e_name, xe->e_nlen);
+                        list[total + plen + xe->e_nlen] = '\0';
+                }
+                total += plen + xe->e_nlen + 1;
+        }
+        return total;
+}
+
+/* write the staged xattr changes of @ni back and drop the in-memory copy */
+int numbfs_xattr_flush(struct numbfs_inode_info *ni)
+{
+        struct numbfs_xattr_info *xi = ni->xattrs;
+        int err = 0;
+
+        if (!xi)
+                return 0;
+
+        /* with the timestamp table, the xattr block only holds xattrs */
+        if (xi->dirty && (ni->sbi->feature & NUMBFS_FEATURE_TSTABLE))
+                err = numbfs_xattr_commit_shared(ni);
+        else if (xi->dirty)
+                err = numbfs_write_block(ni->sbi, xi->buf,
+                                         numbfs_data_blk(ni->sbi, ni->xattr_start));
+        if (!err && (ni->xattr_count != xi->count ||
+                     ni->xattr_start != xi->start))
+                err = numbfs_dump_inode(ni);
+
+        free(xi);
+        ni->xattrs = NULL;
+        return err;
+}
+
+static int numbfs_tstable_blk(struct numbfs_superblock_info *sbi, int nid)
+{
+        return numbfs_data_blk(sbi, sbi->tstable_start +
+                               nid / NUMBFS_TIMESTAMPS_PER_BLOCK);
+}
+
+/**
+ * set up the timestamp table, the records of the inodes in use are copied
+ * from their xattr blocks, one table block at a time; the xattr blocks
+ * without any xattr are released
+ */
+int numbfs_enable_tstable(struct numbfs_superblock_info *sbi)
+{
+        struct numbfs_timestamps table[NUMBFS_TIMESTAMPS_PER_BLOCK];
+        struct numbfs_inode_info ni;
+        char bmap[BYTES_PER_BLOCK], buf[BYTES_PER_BLOCK];
+        int err, nid, start, nr;
+        bool dirty = false;
+
+        if (sbi->feature & NUMBFS_FEATURE_TSTABLE)
+                return 0;
+
+        nr = DIV_ROUND_UP(sbi->total_inodes, NUMBFS_TIMESTAMPS_PER_BLOCK);
+        err = numbfs_alloc_zeroed_extent(sbi, nr, &start);
+        if (err) {
+                fprintf(stderr, "failed to alloc %d blocks for timestamp table\n", nr);
+                return err;
+        }
+        sbi->tstable_start = start;
+
+        memset(table, 0, sizeof(table));
+        for (nid = 0; nid < sbi->total_inodes; nid++) {
+                if (nid % NUMBFS_BLOCKS_PER_BLOCK == 0) {
+                        err = numbfs_read_block(sbi, bmap,
+                                        numbfs_bmap_blk(sbi->ibitmap_start, nid));
+                        if (err)
+                                return err;
+                }
+
+                ni.nid = nid;
+                ni.xattr_start = NUMBFS_HOLE;
+                if (bmap[numbfs_bmap_byte(nid)] & (1 << numbfs_bmap_bit(nid))) {
+                        err = numbfs_get_inode(sbi, &ni);
+                        if (err)
+                                return err;
+                }
+
+                if (ni.xattr_start != NUMBFS_HOLE) {
+                        err = numbfs_read_block(sbi, buf,
+                                        numbfs_data_blk(sbi, ni.xattr_start));
+                        if (err)
+                                return err;
+                        table[nid % NUMBFS_TIMESTAMPS_PER_BLOCK] =
+                                        *(struct numbfs_timestamps*)buf;
+                        dirty = true;
+
+                        /* the block only held the timestamps */
+                        if (!ni.xattr_count) {
+                                err = numbfs_free_block(sbi, ni.xattr_start);
+                                if (err)
+                                        return err;
+                                ni.xattr_start = NUMBFS_HOLE;
+                                err = numbfs_dump_inode(&ni);
+                                if (err)
+                                        return err;
+                        }
+                }
+
+                if ((nid + 1) % NUMBFS_TIMESTAMPS_PER_BLOCK &&
+                    nid + 1 < sbi->total_inodes)
+                        continue;
+                if (dirty) {
+                        err = numbfs_write_block(sbi, (char*)table,
+                                                 numbfs_tstable_blk(sbi, nid));
+                        if (err)
+                                return err;
+                        memset(table, 0, sizeof(table));
+                        dirty = false;
+                }
+        }
+
+        sbi->feature |= NUMBFS_FEATURE_TSTABLE;
+        return 0;
+}
+
+int numbfs_get_timestamps(struct numbfs_inode_info *ni,
+                          struct numbfs_timestamps *nt)
+{
+        struct numbfs_superblock_info *sbi = ni->sbi;
+        char buf[BYTES_PER_BLOCK];
+        int err;
+
+        if (!(sbi->feature & NUMBFS_FEATURE_TSTABLE)) {
+                err = numbfs_read_block(sbi, buf, numbfs_data_blk(sbi, ni->xattr_start));
+                if (!err)
+                        *nt = *(struct numbfs_timestamps*)buf;
+                return err;
+        }
+
+        err = numbfs_read_block(sbi, buf, numbfs_tstable_blk(sbi, ni->nid));
+        if (!err)
+                *nt = ((struct numbfs_timestamps*)buf)[ni->nid % NUMBFS_TIMESTAMPS_PER_BLOCK];
+        return err;
+}
+
+int numbfs_set_timestamps(struct numbfs_inode_info *ni,
+                          const struct numbfs_timestamps *nt)
+{
+        struct numbfs_superblock_info *sbi = ni->sbi;
+        char buf[BYTES_PER_BLOCK];
+        int err, blk;
+
+        if (sbi->feature & NUMBFS_FEATURE_TSTABLE) {
+                blk = numbfs_tstable_blk(sbi, ni->nid);
+                err = numbfs_read_block(sbi, buf, blk);
+                if (err)
+                        return err;
+                ((struct numbfs_timestamps*)buf)[ni->nid % NUMBFS_TIMESTAMPS_PER_BLOCK] = *nt;
+                return numbfs_write_block(sbi, buf, blk);
+        }
+
+        /* keep the staged xattr block in sync */
+        if (ni->xattrs)
+                memcpy(ni->xattrs->buf, nt, sizeof(*nt));
+
+        blk = numbfs_data_blk(sbi, ni->xattr_start);
+        err = numbfs_read_block(sbi, buf, blk);
+        if (err)
+                return err;
+        memcpy(buf, nt, sizeof(*nt));
+        return numbfs_write_block(sbi, buf, blk);
+}
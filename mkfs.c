@@ -6,6 +6,7 @@
 #include "internal.h"
 #include "numbfs_config.h"
 #include "disk.h"
+#include "populate.h"
 #include <getopt.h>
 #include <errno.h>
 #include <stdio.h>
@@ -16,14 +17,50 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
-
-#define NUMBFS_DEFAULT_INODES 4096
+#include <pthread.h>
+#include <time.h>
+
+#define NUMBFS_MIN_INODES       64
+/* the inode number of a dirent is 16 bits */
+#define NUMBFS_MAX_INODES       65536
+
+/* the bytes-per-inode ratios of the usage types */
+static const struct {
+        const char *name;
+        int bytes_per_inode;
+} numbfs_usage_types[] = {
+        {"default", 4096},
+        /* a full data block and an xattr block per inode */
+        {"small-files", 2 * BYTES_PER_BLOCK},
+        /* every inode can hold a file of the maximum size */
+        {"large-files", NUMBFS_NUM_DATA_ENTRY * BYTES_PER_BLOCK},
+};
 
 static struct numbfs_superblock_info sbi;
+static bool dir_index;
+static bool ts_table;
+static bool discard;
+static bool lazy_itable;
+static bool sparse;
+static char *root_dir;
+static char *archive;
+static int jobs;
+static int bytes_per_inode;
+static bool num_inodes;
 
 static struct option log_options[] = {
         {"help", no_argument, NULL, 'h'},
         {"num_inodes", required_argument, NULL, 2},
+        {"dir-index", no_argument, NULL, 3},
+        {"ts-table", no_argument, NULL, 4},
+        {"discard", no_argument, NULL, 5},
+        {"lazy-itable", no_argument, NULL, 6},
+        {"root-dir", required_argument, NULL, 7},
+        {"archive", required_argument, NULL, 8},
+        {"bytes-per-inode", required_argument, NULL, 9},
+        {"usage-type", required_argument, NULL, 'T'},
+        {"sparse", no_argument, NULL, 10},
+        {"jobs", required_argument, NULL, 'j'},
         {"size", required_argument, NULL, 's'},
         {0, 0, 0, 0}
 };
@@ -36,8 +73,23 @@ static void numbfs_help_info(void)
                 "\n"
                 "Gerneral options:\n"
                 " --help                display this help information and exit\n"
-                " --num_inodes=#        specify the number of inodes (default: 4096)\n"
+                " --num_inodes=#        specify the number of inodes (default: derived from\n"
+                "                       the image size and the bytes-per-inode ratio)\n"
+                " --bytes-per-inode=#   create an inode for every # bytes of the image\n"
+                " --usage-type|-T=X     the bytes-per-inode ratio of usage type X:\n"
+                "                       default (4096), small-files (1024) or large-files (5120)\n"
                 " --size=#{M,K,G}       spacify the filesystem image size\n"
+                " --dir-index           enable the hashed directory index\n"
+                " --ts-table            keep the inode timestamps in a packed table\n"
+                " --discard             discard the whole device before formatting\n"
+                " --lazy-itable         initialize the inode table on first use\n"
+                " --sparse              only write the non-zero blocks of an image file,\n"
+                "                       implies --lazy-itable\n"
+                " --root-dir=X          copy the host directory tree at X into the image\n"
+                " --archive=X           create the entries of the tar or cpio newc archive X,\n"
+                "                       \"-\" reads the archive from stdin\n"
+                " --jobs|-j=#           number of worker threads for the layout writer and\n"
+                "                       --root-dir (default: online cpus)\n"
         );
 }
 
@@ -77,7 +129,7 @@ static int numbfs_parse_args(int argc, char **argv)
         char *img_path, unit;
         long long size;
 
-        while ((opt = getopt_long(argc, argv, "s:h", log_options, NULL)) != -1) {
+        while ((opt = getopt_long(argc, argv, "s:hj:T:", log_options, NULL)) != -1) {
                 switch(opt) {
                         case 'h':
                                 numbfs_help_info();
@@ -90,6 +142,53 @@ static int numbfs_parse_args(int argc, char **argv)
                                 }
                                 sbi.total_inodes = val;
                                 sbi.free_inodes = sbi.total_inodes - NUMBFS_ROOT_NID;
+                                num_inodes = true;
+                                break;
+                        case 3:
+                                dir_index = true;
+                                break;
+                        case 4:
+                                ts_table = true;
+                                break;
+                        case 5:
+                                discard = true;
+                                break;
+                        case 6:
+                                lazy_itable = true;
+                                break;
+                        case 10:
+                                sparse = true;
+                                lazy_itable = true;
+                                break;
+                        case 7:
+                                root_dir = optarg;
+                                break;
+                        case 8:
+                                archive = optarg;
+                                break;
+                        case 9:
+                                bytes_per_inode = atoi(optarg);
+                                if (bytes_per_inode < (int)sizeof(struct numbfs_inode)) {
+                                        fprintf(stderr, "Error: invalid bytes-per-inode: %s\n", optarg);
+                                        return -EINVAL;
+                                }
+                                break;
+                        case 'T':
+                                for (val = 0; val < (int)ARRAY_SIZE(numbfs_usage_types); val++)
+                                        if (!strcmp(optarg, numbfs_usage_types[val].name))
+                                                break;
+                                if (val == (int)ARRAY_SIZE(numbfs_usage_types)) {
+                                        fprintf(stderr, "Error: invalid usage-type: %s\n", optarg);
+                                        return -EINVAL;
+                                }
+                                bytes_per_inode = numbfs_usage_types[val].bytes_per_inode;
+                                break;
+                        case 'j':
+                                jobs = atoi(optarg);
+                                if (jobs <= 0) {
+                                        fprintf(stderr, "Error: invalid jobs: %s\n", optarg);
+                                        return -EINVAL;
+                                }
                                 break;
                         case 's':
                                 if (sscanf(optarg, "%lld%c", &size, &unit) < 1)  {
@@ -112,6 +211,11 @@ static int numbfs_parse_args(int argc, char **argv)
                 }
         }
 
+        if (root_dir && archive) {
+                fprintf(stderr, "Error: --root-dir and --archive are exclusive\n");
+                return -EINVAL;
+        }
+
         if (optind >= argc) {
                 fprintf(stderr, "miss block device path!\n");
                 exit(1);
@@ -131,9 +235,9 @@ static int numbfs_parse_args(int argc, char **argv)
 static void numbfs_init_config(void)
 {
         sbi.fd = -1;
-        sbi.total_inodes = NUMBFS_DEFAULT_INODES;
-        sbi.free_inodes = sbi.total_inodes - NUMBFS_ROOT_NID;
         sbi.size = -1;
+        bytes_per_inode = numbfs_usage_types[0].bytes_per_inode;
+        jobs = max((int)sysconf(_SC_NPROCESSORS_ONLN), 1);
 }
 
 static int numbfs_mkdir_lostfound(void)
@@ -141,8 +245,6 @@ static int numbfs_mkdir_lostfound(void)
 #define LOSTFOUND       "lost+found"
 #define LOSTFOUNDLEN    strlen(LOSTFOUND)
         struct numbfs_inode_info ni;
-        struct numbfs_dirent *dir;
-        char buf[BYTES_PER_BLOCK];
         int nid;
         int err;
 
@@ -156,13 +258,13 @@ static int numbfs_mkdir_lostfound(void)
         if (err)
                 return err;
 
-        dir = (struct numbfs_dirent*)buf;
-        memcpy(dir->name, LOSTFOUND, LOSTFOUNDLEN);
-        dir->name[LOSTFOUNDLEN] = '\0';
-        dir->name_len = LOSTFOUNDLEN;
-        dir->ino = nid;
-        dir->type = DT_DIR;
-        err = numbfs_pwrite_inode(&ni, buf, ni.size, sizeof(*dir));
+        err = numbfs_dir_add(&ni, LOSTFOUND, LOSTFOUNDLEN, nid, DT_DIR);
+        if (err)
+                return err;
+
+        /* the ".." of lost+found */
+        ni.nlink++;
+        err = numbfs_dump_inode(&ni);
         if (err)
                 return err;
 #undef  LOSTFOUND
@@ -170,16 +272,199 @@ static int numbfs_mkdir_lostfound(void)
         return 0;
 }
 
+/* bytes of metadata written per request, and per layout job */
+#define NUMBFS_MKFS_CHUNK       (4 << 20)
+#define NUMBFS_MKFS_CHUNK_BLKS  (NUMBFS_MKFS_CHUNK / BYTES_PER_BLOCK)
+
+/* a region of metadata blocks written by one worker */
+struct numbfs_mkfs_region {
+        int start, nr;
+        /* zeroed bitmap blocks, or inode table blocks from the template */
+        bool itable;
+};
+
+struct numbfs_mkfs_layout {
+        struct numbfs_mkfs_region *regions;
+        int nr_regions;
+        /* the next region to write */
+        int next;
+        /* a chunk of unused inodes */
+        char *template;
+        long long bytes;
+};
+
+struct numbfs_mkfs_worker {
+        pthread_t thread;
+        struct numbfs_mkfs_layout *layout;
+        int err;
+};
+
+/* split the blocks [@start, @start + @nr) into chunk sized regions */
+static int numbfs_mkfs_add_regions(struct numbfs_mkfs_layout *layout,
+                                   int start, int nr, bool itable)
+{
+        struct numbfs_mkfs_region *r;
+        int cur, max = layout->nr_regions + DIV_ROUND_UP(nr, NUMBFS_MKFS_CHUNK_BLKS);
+
+        r = realloc(layout->regions, max * sizeof(*r));
+        if (!r)
+                return -ENOMEM;
+        layout->regions = r;
+
+        for (; nr > 0; start += cur, nr -= cur) {
+                cur = min(nr, NUMBFS_MKFS_CHUNK_BLKS);
+                r = &layout->regions[layout->nr_regions++];
+                r->start = start;
+                r->nr = cur;
+                r->itable = itable;
+                layout->bytes += (long long)cur * BYTES_PER_BLOCK;
+        }
+        return 0;
+}
+
+static void *numbfs_mkfs_writer(void *arg)
+{
+        struct numbfs_mkfs_worker *w = arg;
+        struct numbfs_mkfs_layout *layout = w->layout;
+        struct numbfs_mkfs_region *r;
+        int idx;
+
+        while (!w->err) {
+                idx = __atomic_fetch_add(&layout->next, 1, __ATOMIC_RELAXED);
+                if (idx >= layout->nr_regions)
+                        break;
+                r = &layout->regions[idx];
+
+                if (r->itable)
+                        w->err = numbfs_pwrite_full(sbi.fd, layout->template,
+                                        (long long)r->nr * BYTES_PER_BLOCK,
+                                        (long long)r->start * BYTES_PER_BLOCK);
+                else
+                        w->err = numbfs_zero_blocks(&sbi, r->start, r->nr);
+        }
+        return NULL;
+}
+
+/**
+ * Write the bitmaps and the inode table. Both are split into regions of
+ * NUMBFS_MKFS_CHUNK bytes that a pool of @jobs workers writes in parallel;
+ * the inode table is written from a template, without reading it back.
+ */
+static int numbfs_mkfs_layout(int bitmap_end)
+{
+        struct numbfs_mkfs_layout layout;
+        struct numbfs_mkfs_worker *workers;
+        struct numbfs_inode *inode;
+        struct timespec start, end;
+        int i, k, nr_jobs, err;
+        double secs;
+
+        memset(&layout, 0, sizeof(layout));
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        /* clear all the bits of both bitmaps */
+        err = numbfs_mkfs_add_regions(&layout, sbi.ibitmap_start,
+                                      sbi.inode_start - sbi.ibitmap_start, false);
+        if (!err)
+                err = numbfs_mkfs_add_regions(&layout, sbi.bbitmap_start,
+                                              bitmap_end - sbi.bbitmap_start, false);
+        /* the inode table blocks are written as the inodes get allocated */
+        if (!err && !lazy_itable)
+                err = numbfs_mkfs_add_regions(&layout, sbi.inode_start,
+                                              sbi.bbitmap_start - sbi.inode_start, true);
+        if (err)
+                goto out;
+
+        layout.template = calloc(1, NUMBFS_MKFS_CHUNK);
+        if (!layout.template) {
+                err = -ENOMEM;
+                goto out;
+        }
+
+        /* all the data array set to NUMBFS_HOLE */
+        inode = (struct numbfs_inode*)layout.template;
+        for (i = 0; i < (int)(NUMBFS_MKFS_CHUNK / sizeof(*inode)); i++)
+                for (k = 0; k < NUMBFS_NUM_DATA_ENTRY; k++)
+                        inode[i].i_data[k] = cpu_to_le32(NUMBFS_HOLE);
+
+        nr_jobs = max(min(jobs, layout.nr_regions), 1);
+        workers = calloc(nr_jobs, sizeof(*workers));
+        if (!workers) {
+                err = -ENOMEM;
+                goto out;
+        }
+
+        for (i = 0; i < nr_jobs; i++) {
+                workers[i].layout = &layout;
+                if (pthread_create(&workers[i].thread, NULL,
+                                   numbfs_mkfs_writer, &workers[i])) {
+                        nr_jobs = i;
+                        err = -EAGAIN;
+                        break;
+                }
+        }
+
+        for (i = 0; i < nr_jobs; i++) {
+                pthread_join(workers[i].thread, NULL);
+                if (workers[i].err)
+                        err = workers[i].err;
+        }
+        free(workers);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (!err)
+                printf("Layout written: %lld KiB by %d threads, %.2f MB/s\n",
+                       layout.bytes >> 10, nr_jobs,
+                       secs > 0 ? layout.bytes / secs / (1 << 20) : 0);
+out:
+        if (err)
+                fprintf(stderr, "failed to write the bitmaps and the inode table\n");
+        free(layout.template);
+        free(layout.regions);
+        return err;
+}
+
+/*
+ * Derive the inode count from the image size unless --num_inodes is given,
+ * and make room for every entry of the --root-dir tree.
+ */
+static int numbfs_mkfs_size_inodes(void)
+{
+        long long nr, need = 0;
+
+        if (num_inodes)
+                return 0;
+
+        nr = sbi.size / bytes_per_inode;
+        if (root_dir) {
+                need = numbfs_populate_count(root_dir);
+                if (need < 0)
+                        return need;
+                /* the root directory and lost+found */
+                need += 2;
+                if (need > NUMBFS_MAX_INODES) {
+                        fprintf(stderr, "error: %s needs %lld inodes, at most %d are supported\n",
+                                root_dir, need, NUMBFS_MAX_INODES);
+                        return -ENOSPC;
+                }
+                nr = max(nr, round_up(need, BITS_PER_BYTE));
+        }
+
+        nr = min(max(round_down(nr, BITS_PER_BYTE), NUMBFS_MIN_INODES), NUMBFS_MAX_INODES);
+        sbi.total_inodes = nr;
+        sbi.free_inodes = sbi.total_inodes - NUMBFS_ROOT_NID;
+        return 0;
+}
+
 /*
  * The disk layout:
  * | reserved | superblock | inode bitmap | inodes | block bitmap | data |
  */
 static int numbfs_mkfs(void)
 {
-        int i, err, total_blocks, remain;
-        struct numbfs_super_block *sb;
-        char buf[BYTES_PER_BLOCK];
-        off_t start, end;
+        int err, total_blocks, remain, fd;
+        off_t end;
         struct stat st;
         long long dev_size;
 
@@ -201,6 +486,22 @@ static int numbfs_mkfs(void)
         }
 
 
+        if (sparse) {
+                if (!S_ISREG(st.st_mode)) {
+                        fprintf(stderr, "error: --sparse needs a regular file\n");
+                        return -EINVAL;
+                }
+                /* grow the image file to the required size as a hole */
+                if (sbi.size > dev_size) {
+                        if (ftruncate(sbi.fd, sbi.size)) {
+                                fprintf(stderr, "fail to extend the image file\n");
+                                return -errno;
+                        }
+                        dev_size = sbi.size;
+                }
+                sbi.sparse = true;
+        }
+
         if (sbi.size == -1) {
                 sbi.size = dev_size;
         } else {
@@ -216,6 +517,10 @@ static int numbfs_mkfs(void)
                 }
         }
 
+        err = numbfs_mkfs_size_inodes();
+        if (err)
+                return err;
+
         if (sbi.size <=  2 * BYTES_PER_BLOCK + round_up(sbi.total_inodes * 64, BYTES_PER_BLOCK) + 3) {
                 fprintf(stderr, "device too small, should be at least %d Bytes\n",
                                 2 * BYTES_PER_BLOCK + round_up(sbi.total_inodes * 64, BYTES_PER_BLOCK) + 3);
@@ -240,39 +545,25 @@ static int numbfs_mkfs(void)
                         DIV_ROUND_UP(DIV_ROUND_UP(remain, BITS_PER_BYTE), BYTES_PER_BLOCK);
         sbi.free_blocks = sbi.data_blocks;
 
-        start = 2;
         end = sbi.bbitmap_start +
                         DIV_ROUND_UP(DIV_ROUND_UP(sbi.data_blocks, BITS_PER_BYTE), BYTES_PER_BLOCK);
-        memset(buf, 0, sizeof(buf));
-        /* clear all the bits in range [start, end] */
-        for (i = start; i < end; i++) {
-                err = pwrite(sbi.fd, buf, BYTES_PER_BLOCK, i * BYTES_PER_BLOCK);
-                if (err != BYTES_PER_BLOCK) {
-                        fprintf(stderr, "failed to write to block@[%d, %d]\n", i, i + 1);
-                        return -EIO;
-                }
-        }
-
-        /* set all the data array to NUMBFS_HOLE */
-        for (i = sbi.inode_start; i < sbi.bbitmap_start; i++) {
-                int j, k;
-                struct numbfs_inode *inode;
 
-                err = numbfs_read_block(&sbi, buf, i);
+        /* a sparse image starts as one hole, so the old content goes away */
+        if (discard || sparse) {
+                err = numbfs_discard_blocks(&sbi, 0, total_blocks);
                 if (err)
-                        return err;
-
-                for (j = 0; j < (int)NUMBFS_NODES_PER_BLOCK; j++) {
-                        inode = ((struct numbfs_inode*)buf) + j;
-                        for (k = 0; k < NUMBFS_NUM_DATA_ENTRY; k++)
-                                inode->i_data[k] = cpu_to_le32(NUMBFS_HOLE);
-                }
+                        fprintf(stderr, "warning: failed to discard the device, err: %d\n", err);
+        }
 
-                err = numbfs_write_block(&sbi, buf, i);
-                if (err)
-                        return err;
+        if (lazy_itable) {
+                sbi.feature |= NUMBFS_FEATURE_LAZY_ITABLE;
+                sbi.itable_init = 0;
         }
 
+        err = numbfs_mkfs_layout(end);
+        if (err)
+                return err;
+
         /* data zone start block addr */
         sbi.data_start = end;
 
@@ -285,6 +576,20 @@ static int numbfs_mkfs(void)
         printf("    num_free_blocks: %d\n", sbi.free_blocks);
 #endif
 
+        /* room for two index entries per inode */
+        if (dir_index) {
+                err = numbfs_enable_dindex(&sbi, DIV_ROUND_UP(sbi.total_inodes * 2,
+                                           NUMBFS_DINDEX_PER_BLOCK));
+                if (err)
+                        return err;
+        }
+
+        if (ts_table) {
+                err = numbfs_enable_tstable(&sbi);
+                if (err)
+                        return err;
+        }
+
         /* create the root inode */
         err = numbfs_empty_dir(&sbi, NUMBFS_ROOT_NID);
         if (err != NUMBFS_ROOT_NID) {
@@ -296,24 +601,35 @@ static int numbfs_mkfs(void)
         if (err)
                 return err;
 
-        memset(buf, 0, BYTES_PER_BLOCK);
-        sb                      = (struct numbfs_super_block*)buf;
-        sb->s_magic             = NUMBFS_MAGIC;
-        sb->s_feature           = cpu_to_le32(0);
-        sb->s_ibitmap_start     = cpu_to_le32(sbi.ibitmap_start);
-        sb->s_inode_start       = cpu_to_le32(sbi.inode_start);
-        sb->s_bbitmap_start     = cpu_to_le32(sbi.bbitmap_start);
-        sb->s_data_start        = cpu_to_le32(sbi.data_start);
-        sb->s_total_inodes      = cpu_to_le32(sbi.total_inodes);
-        sb->s_free_inodes       = cpu_to_le32(sbi.free_inodes);
-        sb->s_data_blocks       = cpu_to_le32(sbi.data_blocks);
-        sb->s_free_blocks       = cpu_to_le32(sbi.free_blocks);
-
-        return numbfs_write_block(&sbi, buf, NUMBFS_SUPER_OFFSET / BYTES_PER_BLOCK);
+        if (root_dir) {
+                err = numbfs_populate_dir(&sbi, root_dir, jobs);
+                if (err)
+                        return err;
+        }
+
+        if (archive) {
+                fd = strcmp(archive, "-") ? open(archive, O_RDONLY) : STDIN_FILENO;
+                if (fd < 0) {
+                        fprintf(stderr, "failed to open %s\n", archive);
+                        return -errno;
+                }
+                err = numbfs_populate_archive(&sbi, fd);
+                if (fd != STDIN_FILENO)
+                        close(fd);
+                if (err)
+                        return err;
+        }
+
+        err = numbfs_put_superblock(&sbi);
+        if (!err && sparse && !fstat(sbi.fd, &st))
+                printf("Sparse image: %lld KiB allocated of %lld KiB\n",
+                       (long long)st.st_blocks / 2, sbi.size >> 10);
+        return err;
 }
 
 static void numbfs_cleanup(void)
 {
+        numbfs_drop_caches(&sbi);
         if (sbi.fd >= 0)
                 close(sbi.fd);
 }
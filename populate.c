@@ -0,0 +1,1334 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2025, Hongzhen Luo
+ */
+
+#include "populate.h"
+#include "internal.h"
+#include "disk.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <pthread.h>
+
+#define NUMBFS_MAX_FILE_SIZE    (NUMBFS_NUM_DATA_ENTRY * BYTES_PER_BLOCK)
+
+/* a regular file whose data is copied by the reader pool */
+struct numbfs_populate_file {
+        char *path;
+        int size;
+        int data[NUMBFS_NUM_DATA_ENTRY];
+};
+
+/* a host inode with more than one link */
+struct numbfs_populate_link {
+        dev_t dev;
+        ino_t ino;
+        int nid;
+};
+
+struct numbfs_populate_ctx {
+        struct numbfs_superblock_info *sbi;
+        struct numbfs_populate_file *files;
+        int nr_files, max_files;
+        struct numbfs_populate_link *links;
+        int nr_links, max_links;
+        int nr_dirs;
+        /* the next file of the reader pool */
+        int next;
+        long long bytes;
+};
+
+struct numbfs_populate_worker {
+        pthread_t thread;
+        struct numbfs_populate_ctx *ctx;
+        int err;
+};
+
+static bool numbfs_is_dir(const char *path)
+{
+        struct stat st;
+
+        return !lstat(path, &st) && S_ISDIR(st.st_mode);
+}
+
+static void *numbfs_populate_grow(void *array, int *max, int size)
+{
+        void *p;
+        int nr = *max ? *max * 2 : 64;
+
+        p = realloc(array, (size_t)nr * size);
+        if (p)
+                *max = nr;
+        return p;
+}
+
+/* copy the "user." and "trusted." xattrs that fit in an xattr entry */
+static int numbfs_populate_xattrs(struct numbfs_inode_info *ni, const char *path)
+{
+        char names[BYTES_PER_BLOCK * 2], value[NUMBFS_XATTR_MAXVALUE];
+        const char *name;
+        ssize_t len, vlen;
+        int type, err;
+
+        len = llistxattr(path, names, sizeof(names));
+        if (len < 0)
+                return errno == ENOTSUP ? 0 : -errno;
+
+        for (name = names; name < names + len; name += strlen(name) + 1) {
+                if (!strncmp(name, "user.", 5)) {
+                        type = NUMBFS_XATTR_INDEX_USER;
+                } else if (!strncmp(name, "trusted.", 8)) {
+                        type = NUMBFS_XATTR_INDEX_TRUSTED;
+                } else {
+                        continue;
+                }
+
+                vlen = lgetxattr(path, name, value, sizeof(value));
+                if (vlen < 0) {
+                        fprintf(stderr, "warning: skip xattr %s of %s\n", name, path);
+                        continue;
+                }
+
+                err = numbfs_setxattr(ni, type, strchr(name, '.') + 1, value, vlen, 0);
+                if (err == -ERANGE || err == -ENOSPC) {
+                        fprintf(stderr, "warning: skip xattr %s of %s\n", name, path);
+                        continue;
+                }
+                if (err)
+                        return err;
+        }
+        return numbfs_xattr_flush(ni);
+}
+
+static int numbfs_populate_set_attrs(struct numbfs_inode_info *ni, int mode,
+                                     int uid, int gid, long long atime,
+                                     long long mtime, long long ctime)
+{
+        struct numbfs_timestamps nt;
+        int err;
+
+        ni->mode = mode;
+        ni->uid = (__uint16_t)uid;
+        ni->gid = (__uint16_t)gid;
+        err = numbfs_dump_inode(ni);
+        if (err)
+                return err;
+
+        memset(&nt, 0, sizeof(nt));
+        nt.t_atime = cpu_to_le64(atime);
+        nt.t_mtime = cpu_to_le64(mtime);
+        nt.t_ctime = cpu_to_le64(ctime);
+        return numbfs_set_timestamps(ni, &nt);
+}
+
+/* take the owner, permission, timestamps and xattrs of the host file */
+static int numbfs_populate_attrs(struct numbfs_inode_info *ni, const char *path,
+                                 struct stat *st)
+{
+        int err;
+
+        err = numbfs_populate_set_attrs(ni, st->st_mode, st->st_uid, st->st_gid,
+                                        st->st_atime, st->st_mtime, st->st_ctime);
+        if (err)
+                return err;
+
+        return numbfs_populate_xattrs(ni, path);
+}
+
+/* allocate the blocks of @size bytes for the empty @ni, contiguous if possible */
+static int numbfs_populate_alloc(struct numbfs_inode_info *ni, int size)
+{
+        int i, err, start, nr = DIV_ROUND_UP(size, BYTES_PER_BLOCK);
+
+        err = numbfs_alloc_extent(ni->sbi, nr, &start);
+        for (i = 0; i < nr; i++) {
+                if (!err) {
+                        ni->data[i] = start + i;
+                        continue;
+                }
+                err = numbfs_alloc_block(ni->sbi, &ni->data[i]);
+                if (err)
+                        return err;
+        }
+        ni->size = size;
+        return numbfs_dump_inode(ni);
+}
+
+/* write @size bytes of @buf to the blocks @data, one write per contiguous run */
+static int numbfs_populate_write(struct numbfs_superblock_info *sbi,
+                                 const char *buf, int size, const int *data)
+{
+        int i, run, err;
+
+        for (i = 0; i * BYTES_PER_BLOCK < size; i += run) {
+                for (run = 1; (i + run) * BYTES_PER_BLOCK < size &&
+                     data[i + run] == data[i] + run; run++)
+                        ;
+                err = numbfs_pwrite_full(sbi->fd, buf + i * BYTES_PER_BLOCK,
+                                         (long long)run * BYTES_PER_BLOCK,
+                                         (long long)numbfs_data_blk(sbi, data[i]) *
+                                         BYTES_PER_BLOCK);
+                if (err)
+                        return err;
+        }
+        return 0;
+}
+
+/* map the data of a regular file, the reader pool fills it later */
+static int numbfs_populate_data(struct numbfs_populate_ctx *ctx,
+                                struct numbfs_inode_info *ni, const char *path,
+                                struct stat *st)
+{
+        struct numbfs_populate_file *file;
+        int err;
+
+        if (st->st_size > NUMBFS_MAX_FILE_SIZE) {
+                fprintf(stderr, "error: %s is larger than %d bytes\n", path,
+                        NUMBFS_MAX_FILE_SIZE);
+                return -EFBIG;
+        }
+
+        if (!st->st_size)
+                return 0;
+
+        err = numbfs_populate_alloc(ni, st->st_size);
+        if (err)
+                return err;
+
+        if (ctx->nr_files == ctx->max_files) {
+                file = numbfs_populate_grow(ctx->files, &ctx->max_files, sizeof(*file));
+                if (!file)
+                        return -ENOMEM;
+                ctx->files = file;
+        }
+
+        file = &ctx->files[ctx->nr_files];
+        file->path = strdup(path);
+        if (!file->path)
+                return -ENOMEM;
+        file->size = ni->size;
+        memcpy(file->data, ni->data, sizeof(file->data));
+        ctx->nr_files++;
+        ctx->bytes += ni->size;
+        return 0;
+}
+
+static int numbfs_populate_symlink(struct numbfs_inode_info *ni, const char *path)
+{
+        char target[NUMBFS_MAX_FILE_SIZE];
+        ssize_t len;
+
+        len = readlink(path, target, sizeof(target));
+        if (len < 0)
+                return -errno;
+        return numbfs_pwrite_inode_range(ni, target, 0, len);
+}
+
+static struct numbfs_populate_link *
+numbfs_populate_find_link(struct numbfs_populate_ctx *ctx, struct stat *st)
+{
+        int i;
+
+        for (i = 0; i < ctx->nr_links; i++)
+                if (ctx->links[i].dev == st->st_dev && ctx->links[i].ino == st->st_ino)
+                        return &ctx->links[i];
+        return NULL;
+}
+
+static int numbfs_populate_add_link(struct numbfs_populate_ctx *ctx,
+                                    struct stat *st, int nid)
+{
+        struct numbfs_populate_link *link;
+
+        if (ctx->nr_links == ctx->max_links) {
+                link = numbfs_populate_grow(ctx->links, &ctx->max_links, sizeof(*link));
+                if (!link)
+                        return -ENOMEM;
+                ctx->links = link;
+        }
+
+        link = &ctx->links[ctx->nr_links++];
+        link->dev = st->st_dev;
+        link->ino = st->st_ino;
+        link->nid = nid;
+        return 0;
+}
+
+/* create a non-directory inode for the host file at @path */
+static int numbfs_populate_file(struct numbfs_populate_ctx *ctx,
+                                struct numbfs_inode_info *dir, const char *name,
+                                const char *path, struct stat *st)
+{
+        struct numbfs_populate_link *link;
+        struct numbfs_inode_info ni;
+        int nid, err = 0;
+
+        /* another name of a file already copied */
+        link = st->st_nlink > 1 ? numbfs_populate_find_link(ctx, st) : NULL;
+        if (link) {
+                err = numbfs_dir_add(dir, name, strlen(name), link->nid,
+                                     IFTODT(st->st_mode));
+                if (err)
+                        return err;
+
+                ni.nid = link->nid;
+                err = numbfs_get_inode(ctx->sbi, &ni);
+                if (err)
+                        return err;
+                ni.nlink++;
+                return numbfs_dump_inode(&ni);
+        }
+
+        nid = numbfs_empty_inode(ctx->sbi, st->st_mode);
+        if (nid < 0)
+                return nid;
+
+        ni.nid = nid;
+        err = numbfs_get_inode(ctx->sbi, &ni);
+        if (err)
+                return err;
+
+        if (S_ISREG(st->st_mode))
+                err = numbfs_populate_data(ctx, &ni, path, st);
+        else if (S_ISLNK(st->st_mode))
+                err = numbfs_populate_symlink(&ni, path);
+        if (err)
+                return err;
+
+        err = numbfs_dir_add(dir, name, strlen(name), nid, IFTODT(st->st_mode));
+        if (err)
+                return err;
+
+        err = numbfs_populate_attrs(&ni, path, st);
+        if (err)
+                return err;
+
+        if (st->st_nlink > 1)
+                return numbfs_populate_add_link(ctx, st, nid);
+        return 0;
+}
+
+/* look up the subdirectory @name of @dir, create it if it does not exist */
+static int numbfs_populate_mkdir(struct numbfs_inode_info *dir, const char *name,
+                                 int len, struct numbfs_inode_info *sub)
+{
+        int err, nid, type;
+
+        /* merge into an existing directory, e.g. lost+found */
+        err = numbfs_dir_lookup(dir, name, len, &nid, &type);
+        if (!err && type != DT_DIR)
+                return -EEXIST;
+        if (err == -ENOENT) {
+                nid = numbfs_empty_dir(dir->sbi, dir->nid);
+                if (nid < 0)
+                        return nid;
+                err = numbfs_dir_add(dir, name, len, nid, DT_DIR);
+                if (err)
+                        return err;
+                /* the ".." of the new directory */
+                dir->nlink++;
+                err = numbfs_dump_inode(dir);
+        }
+        if (err)
+                return err;
+
+        sub->nid = nid;
+        return numbfs_get_inode(dir->sbi, sub);
+}
+
+/* copy the entries of the host directory @path into @dir */
+static int numbfs_populate_walk(struct numbfs_populate_ctx *ctx,
+                                struct numbfs_inode_info *dir, const char *path)
+{
+        struct numbfs_inode_info sub;
+        struct dirent *de;
+        struct stat st;
+        char *child;
+        DIR *d;
+        int err = 0;
+
+        d = opendir(path);
+        if (!d) {
+                fprintf(stderr, "error: failed to open %s\n", path);
+                return -errno;
+        }
+
+        while (!err && (de = readdir(d))) {
+                if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                        continue;
+
+                child = malloc(strlen(path) + strlen(de->d_name) + 2);
+                if (!child) {
+                        err = -ENOMEM;
+                        break;
+                }
+                sprintf(child, "%s/%s", path, de->d_name);
+
+                if (lstat(child, &st)) {
+                        fprintf(stderr, "error: failed to stat %s\n", child);
+                        err = -errno;
+                } else if (!S_ISDIR(st.st_mode)) {
+                        err = numbfs_populate_file(ctx, dir, de->d_name, child, &st);
+                } else {
+                        err = numbfs_populate_mkdir(dir, de->d_name,
+                                                    strlen(de->d_name), &sub);
+                        if (!err)
+                                err = numbfs_populate_attrs(&sub, child, &st);
+                        if (!err)
+                                err = numbfs_populate_walk(ctx, &sub, child);
+                        ctx->nr_dirs++;
+                }
+
+                if (err)
+                        fprintf(stderr, "error: failed to copy %s: %s\n", child,
+                                strerror(-err));
+                free(child);
+        }
+
+        closedir(d);
+        return err;
+}
+
+/* count the entries below the host directory @path */
+static int numbfs_populate_scan(const char *path, long long *count)
+{
+        struct dirent *de;
+        char *child;
+        DIR *d;
+        int err = 0;
+
+        d = opendir(path);
+        if (!d) {
+                fprintf(stderr, "error: failed to open %s\n", path);
+                return -errno;
+        }
+
+        while (!err && (de = readdir(d))) {
+                if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                        continue;
+
+                (*count)++;
+                if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN)
+                        continue;
+
+                child = malloc(strlen(path) + strlen(de->d_name) + 2);
+                if (!child) {
+                        err = -ENOMEM;
+                        break;
+                }
+                sprintf(child, "%s/%s", path, de->d_name);
+                if (de->d_type == DT_DIR || numbfs_is_dir(child))
+                        err = numbfs_populate_scan(child, count);
+                free(child);
+        }
+
+        closedir(d);
+        return err;
+}
+
+/* copy the data of the host files, the blocks are already allocated */
+static void *numbfs_populate_reader(void *arg)
+{
+        struct numbfs_populate_worker *w = arg;
+        struct numbfs_populate_ctx *ctx = w->ctx;
+        struct numbfs_populate_file *file;
+        char buf[NUMBFS_MAX_FILE_SIZE];
+        int idx, fd, done;
+        ssize_t ret = 0;
+
+        while (!w->err) {
+                idx = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED);
+                if (idx >= ctx->nr_files)
+                        break;
+                file = &ctx->files[idx];
+
+                fd = open(file->path, O_RDONLY);
+                if (fd < 0) {
+                        fprintf(stderr, "error: failed to open %s\n", file->path);
+                        w->err = -errno;
+                        break;
+                }
+
+                /* a file shrunk since the walk reads as zeroes */
+                memset(buf, 0, sizeof(buf));
+                for (done = 0; done < file->size; done += ret) {
+                        ret = pread(fd, buf + done, file->size - done, done);
+                        if (ret <= 0)
+                                break;
+                }
+                close(fd);
+                if (ret < 0) {
+                        fprintf(stderr, "error: failed to read %s\n", file->path);
+                        w->err = -EIO;
+                        break;
+                }
+
+                w->err = numbfs_populate_write(ctx->sbi, buf, file->size, file->data);
+        }
+        return NULL;
+}
+
+static int numbfs_populate_read(struct numbfs_populate_ctx *ctx, int jobs)
+{
+        struct numbfs_populate_worker *workers;
+        int i, err = 0;
+
+        jobs = max(min(jobs, ctx->nr_files), 1);
+        workers = calloc(jobs, sizeof(*workers));
+        if (!workers)
+                return -ENOMEM;
+
+        for (i = 0; i < jobs; i++) {
+                workers[i].ctx = ctx;
+                if (pthread_create(&workers[i].thread, NULL,
+                                   numbfs_populate_reader, &workers[i])) {
+                        jobs = i;
+                        err = -EAGAIN;
+                        break;
+                }
+        }
+
+        for (i = 0; i < jobs; i++) {
+                pthread_join(workers[i].thread, NULL);
+                if (workers[i].err)
+                        err = workers[i].err;
+        }
+
+        free(workers);
+        return err;
+}
+
+/* an upper bound of the inodes needed by the tree, each hard link counts */
+long long numbfs_populate_count(const char *root)
+{
+        long long count = 0;
+        struct stat st;
+        int err;
+
+        if (stat(root, &st) || !S_ISDIR(st.st_mode)) {
+                fprintf(stderr, "error: %s is not a directory\n", root);
+                return -ENOTDIR;
+        }
+
+        err = numbfs_populate_scan(root, &count);
+        return err ? err : count;
+}
+
+/**
+ * The tree is copied in two passes: the walk creates all the inodes and
+ * dirents and allocates the data blocks of each file contiguously, then
+ * a pool of @jobs readers copies the file data straight into the image.
+ * The bitmaps, the inode table and the directory blocks are staged in
+ * memory meanwhile, and written once at the end.
+ */
+int numbfs_populate_dir(struct numbfs_superblock_info *sbi, const char *root,
+                        int jobs)
+{
+        struct numbfs_populate_ctx ctx;
+        struct numbfs_inode_info ni;
+        struct timespec start, end;
+        struct stat st;
+        double secs;
+        int i, err, flush;
+
+        if (stat(root, &st) || !S_ISDIR(st.st_mode)) {
+                fprintf(stderr, "error: %s is not a directory\n", root);
+                return -ENOTDIR;
+        }
+
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.sbi = sbi;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        err = numbfs_stage_begin(sbi);
+        if (err)
+                return err;
+
+        ni.nid = NUMBFS_ROOT_NID;
+        err = numbfs_get_inode(sbi, &ni);
+        if (!err)
+                err = numbfs_populate_attrs(&ni, root, &st);
+        if (!err)
+                err = numbfs_populate_walk(&ctx, &ni, root);
+        if (!err)
+                err = numbfs_populate_read(&ctx, jobs);
+        flush = numbfs_stage_flush(sbi);
+        if (!err)
+                err = flush;
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (!err) {
+                printf("Populated from %s\n", root);
+                printf("    directories:                %d\n", ctx.nr_dirs);
+                printf("    regular files:              %d\n", ctx.nr_files);
+                printf("    data bytes:                 %lld\n", ctx.bytes);
+                printf("    throughput:                 %.2f MB/s\n",
+                       secs > 0 ? ctx.bytes / secs / (1 << 20) : 0);
+        }
+
+        for (i = 0; i < ctx.nr_files; i++)
+                free(ctx.files[i].path);
+        free(ctx.files);
+        free(ctx.links);
+        return err;
+}
+
+/* entries in flight between the decoder, the creator and the writer */
+#define NUMBFS_ARCHIVE_SLOTS    64
+#define NUMBFS_ARCHIVE_BUFSIZE  (64 * 1024)
+/* largest pax extended header accepted, it is held in memory whole */
+#define NUMBFS_PAX_MAX          (64 * 1024)
+
+enum {
+        NUMBFS_ARCHIVE_TAR,
+        NUMBFS_ARCHIVE_CPIO,
+};
+
+struct numbfs_archive_entry {
+        char path[PATH_MAX];
+        /* the symlink target or the hard link source */
+        char target[PATH_MAX];
+        int mode, uid, gid, size;
+        long long mtime;
+        bool hardlink;
+        /* cpio only, the links of an inode share @ino */
+        unsigned long ino;
+        int nlink;
+        /* the blocks allocated by the creator, filled by the writer */
+        int data[NUMBFS_NUM_DATA_ENTRY];
+        char buf[NUMBFS_MAX_FILE_SIZE];
+};
+
+struct numbfs_archive_ctx {
+        struct numbfs_populate_ctx pctx;
+        struct numbfs_archive_entry *entries;
+        int fd, format;
+        /* decoded, created and written entries */
+        unsigned int head, meta, tail;
+        bool eof, created;
+        int err;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        /* the buffered input of the decoder */
+        char *in;
+        int pos, len;
+};
+
+/* fill the input buffer with at least @want bytes, or up to the end of file */
+static int numbfs_archive_fill(struct numbfs_archive_ctx *ctx, int want)
+{
+        ssize_t ret;
+
+        if (ctx->pos) {
+                memmove(ctx->in, ctx->in + ctx->pos, ctx->len - ctx->pos);
+                ctx->len -= ctx->pos;
+                ctx->pos = 0;
+        }
+
+        while (ctx->len < want) {
+                ret = read(ctx->fd, ctx->in + ctx->len,
+                           NUMBFS_ARCHIVE_BUFSIZE - ctx->len);
+                if (ret < 0 && errno == EINTR)
+                        continue;
+                if (ret < 0)
+                        return -errno;
+                if (!ret)
+                        break;
+                ctx->len += ret;
+        }
+        return ctx->len;
+}
+
+/* read @len bytes of the archive into @buf, or skip them if @buf is NULL */
+static int numbfs_archive_read(struct numbfs_archive_ctx *ctx, void *buf, long long len)
+{
+        int n, ret;
+
+        while (len > 0) {
+                if (ctx->pos == ctx->len) {
+                        ctx->pos = ctx->len = 0;
+                        ret = numbfs_archive_fill(ctx, 1);
+                        if (ret < 0)
+                                return ret;
+                        if (!ret) {
+                                fprintf(stderr, "error: unexpected end of archive\n");
+                                return -EIO;
+                        }
+                }
+
+                n = min((long long)(ctx->len - ctx->pos), len);
+                if (buf) {
+                        memcpy(buf, ctx->in + ctx->pos, n);
+                        buf = (char *)buf + n;
+                }
+                ctx->pos += n;
+                len -= n;
+        }
+        return 0;
+}
+
+/* the data of an entry, at most one numbfs file */
+static int numbfs_archive_data(struct numbfs_archive_ctx *ctx,
+                               struct numbfs_archive_entry *e, long long size,
+                               int align)
+{
+        int err;
+
+        if (size < 0)
+                return -EINVAL;
+        if (size > NUMBFS_MAX_FILE_SIZE) {
+                fprintf(stderr, "error: %s is larger than %d bytes\n", e->path,
+                        NUMBFS_MAX_FILE_SIZE);
+                return -EFBIG;
+        }
+
+        e->size = size;
+        err = numbfs_archive_read(ctx, e->buf, size);
+        if (err)
+                return err;
+        return numbfs_archive_read(ctx, NULL, round_up(size, align) - size);
+}
+
+/*
+ * an octal field, or a base-256 one if the high bit of the first byte is
+ * set; -1 for a negative base-256 value or one that doesn't fit
+ */
+static long long numbfs_tar_number(const char *p, int len)
+{
+        long long val = 0;
+        int i = 0;
+
+        if (*p & 0x80) {
+                if (*p & 0x40)
+                        return -1;
+                for (val = *p & 0x3f, i = 1; i < len; i++) {
+                        if (val > LLONG_MAX >> 8)
+                                return -1;
+                        val = (val << 8) | (unsigned char)p[i];
+                }
+                return val;
+        }
+
+        while (i < len && (p[i] == ' ' || !p[i]))
+                i++;
+        for (; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+                val = (val << 3) | (p[i] - '0');
+        return val;
+}
+
+static bool numbfs_tar_checksum(const unsigned char *hdr)
+{
+        long long sum = 0;
+        int i;
+
+        for (i = 0; i < BYTES_PER_BLOCK; i++)
+                sum += (i >= 148 && i < 156) ? ' ' : hdr[i];
+        return sum == numbfs_tar_number((const char *)hdr + 148, 8);
+}
+
+/* take the "path" and "linkpath" records of a pax extended header */
+static int numbfs_tar_pax(struct numbfs_archive_ctx *ctx, long long size,
+                          char *path, char *target)
+{
+        char *buf, *rec, *key, *val, *end;
+        long long len;
+        int err;
+
+        if (size < 0 || size > NUMBFS_PAX_MAX) {
+                fprintf(stderr, "error: pax extended header of %lld bytes is too large\n", size);
+                return -EINVAL;
+        }
+
+        buf = malloc(size + 1);
+        if (!buf)
+                return -ENOMEM;
+        err = numbfs_archive_read(ctx, buf, size);
+        if (!err)
+                err = numbfs_archive_read(ctx, NULL, round_up(size, BYTES_PER_BLOCK) - size);
+        if (err)
+                goto out;
+        buf[size] = '\0';
+
+        /* "<len> <key>=<value>\n", where <len> covers the whole record */
+        for (rec = buf; rec < buf + size; rec += len) {
+                len = strtoll(rec, &key, 10);
+                if (len < 3 || rec + len > buf + size || *key != ' ') {
+                        err = -EINVAL;
+                        break;
+                }
+                key++;
+                end = rec + len - 1;
+                if (key >= end || *end != '\n') {
+                        err = -EINVAL;
+                        break;
+                }
+                val = memchr(key, '=', end - key);
+                if (!val)
+                        continue;
+                *val++ = '\0';
+                *end = '\0';
+
+                if (end - val >= PATH_MAX) {
+                        err = -ENAMETOOLONG;
+                        break;
+                }
+                if (!strcmp(key, "path"))
+                        strcpy(path, val);
+                else if (!strcmp(key, "linkpath"))
+                        strcpy(target, val);
+        }
+out:
+        free(buf);
+        return err;
+}
+
+/* decode the next tar entry into @e, return 1 at the end of the archive */
+static int numbfs_tar_next(struct numbfs_archive_ctx *ctx, struct numbfs_archive_entry *e)
+{
+        unsigned char hdr[BYTES_PER_BLOCK];
+        char path[PATH_MAX], target[PATH_MAX];
+        long long size;
+        int i, err;
+
+        path[0] = target[0] = '\0';
+        while (1) {
+                err = numbfs_archive_read(ctx, hdr, sizeof(hdr));
+                if (err)
+                        return err;
+
+                for (i = 0; i < BYTES_PER_BLOCK && !hdr[i]; i++)
+                        ;
+                if (i == BYTES_PER_BLOCK)
+                        return 1;
+                if (!numbfs_tar_checksum(hdr)) {
+                        fprintf(stderr, "error: bad tar header checksum\n");
+                        return -EINVAL;
+                }
+
+                size = numbfs_tar_number((char *)hdr + 124, 12);
+                if (size < 0) {
+                        fprintf(stderr, "error: bad tar entry size\n");
+                        return -EINVAL;
+                }
+                switch (hdr[156]) {
+                case 'L':
+                case 'K':
+                        /* GNU long name or long link name of the next entry */
+                        if (size >= PATH_MAX)
+                                return -ENAMETOOLONG;
+                        err = numbfs_archive_read(ctx, hdr[156] == 'L' ? path : target, size);
+                        if (!err)
+                                err = numbfs_archive_read(ctx, NULL,
+                                        round_up(size, BYTES_PER_BLOCK) - size);
+                        if (err)
+                                return err;
+                        (hdr[156] == 'L' ? path : target)[size] = '\0';
+                        continue;
+                case 'x':
+                        err = numbfs_tar_pax(ctx, size, path, target);
+                        if (err)
+                                return err;
+                        continue;
+                case 'g':
+                        err = numbfs_archive_read(ctx, NULL, round_up(size, BYTES_PER_BLOCK));
+                        if (err)
+                                return err;
+                        continue;
+                }
+                break;
+        }
+
+        if (path[0]) {
+                strcpy(e->path, path);
+        } else if (hdr[345] && !memcmp(hdr + 257, "ustar", 5)) {
+                /* the ustar prefix */
+                snprintf(e->path, sizeof(e->path), "%.155s/%.100s", hdr + 345, hdr);
+        } else {
+                snprintf(e->path, sizeof(e->path), "%.100s", hdr);
+        }
+        if (target[0])
+                strcpy(e->target, target);
+        else
+                snprintf(e->target, sizeof(e->target), "%.100s", hdr + 157);
+
+        e->mode = numbfs_tar_number((char *)hdr + 100, 8) & 07777;
+        e->uid = numbfs_tar_number((char *)hdr + 108, 8);
+        e->gid = numbfs_tar_number((char *)hdr + 116, 8);
+        e->mtime = numbfs_tar_number((char *)hdr + 136, 12);
+        e->hardlink = false;
+        e->ino = 0;
+        e->nlink = 1;
+        e->size = 0;
+
+        switch (hdr[156]) {
+        case '0':
+        case '\0':
+        case '7':
+                e->mode |= S_IFREG;
+                return numbfs_archive_data(ctx, e, size, BYTES_PER_BLOCK);
+        case '1':
+                e->mode |= S_IFREG;
+                e->hardlink = true;
+                break;
+        case '2':
+                e->mode |= S_IFLNK;
+                break;
+        case '3':
+                e->mode |= S_IFCHR;
+                break;
+        case '4':
+                e->mode |= S_IFBLK;
+                break;
+        case '5':
+                e->mode |= S_IFDIR;
+                break;
+        case '6':
+                e->mode |= S_IFIFO;
+                break;
+        default:
+                fprintf(stderr, "warning: skip %s of tar type %c\n", e->path, hdr[156]);
+                e->mode = 0;
+                break;
+        }
+        return numbfs_archive_read(ctx, NULL, round_up(size, BYTES_PER_BLOCK));
+}
+
+static unsigned long numbfs_cpio_number(const char *p)
+{
+        char field[9];
+
+        memcpy(field, p, 8);
+        field[8] = '\0';
+        return strtoul(field, NULL, 16);
+}
+
+/* decode the next cpio newc entry into @e, return 1 at the end of the archive */
+static int numbfs_cpio_next(struct numbfs_archive_ctx *ctx, struct numbfs_archive_entry *e)
+{
+        char hdr[110];
+        int namesize, err;
+        long long size;
+
+        err = numbfs_archive_read(ctx, hdr, sizeof(hdr));
+        if (err)
+                return err;
+        if (memcmp(hdr, "07070", 5) || (hdr[5] != '1' && hdr[5] != '2')) {
+                fprintf(stderr, "error: bad cpio header magic\n");
+                return -EINVAL;
+        }
+
+        e->ino = numbfs_cpio_number(hdr + 6);
+        e->mode = numbfs_cpio_number(hdr + 14);
+        e->uid = numbfs_cpio_number(hdr + 22);
+        e->gid = numbfs_cpio_number(hdr + 30);
+        e->nlink = numbfs_cpio_number(hdr + 38);
+        e->mtime = numbfs_cpio_number(hdr + 46);
+        size = numbfs_cpio_number(hdr + 54);
+        namesize = numbfs_cpio_number(hdr + 94);
+        e->hardlink = false;
+        e->target[0] = '\0';
+        e->size = 0;
+
+        if (namesize <= 0 || namesize > PATH_MAX)
+                return -ENAMETOOLONG;
+        err = numbfs_archive_read(ctx, e->path, namesize);
+        if (!err)
+                err = numbfs_archive_read(ctx, NULL,
+                                round_up(sizeof(hdr) + namesize, 4) - sizeof(hdr) - namesize);
+        if (err)
+                return err;
+        e->path[namesize - 1] = '\0';
+        if (!strcmp(e->path, "TRAILER!!!"))
+                return 1;
+
+        if (S_ISLNK(e->mode)) {
+                if (size >= PATH_MAX)
+                        return -ENAMETOOLONG;
+                err = numbfs_archive_read(ctx, e->target, size);
+                if (!err)
+                        err = numbfs_archive_read(ctx, NULL, round_up(size, 4) - size);
+                e->target[size] = '\0';
+                return err;
+        }
+        if (S_ISREG(e->mode))
+                return numbfs_archive_data(ctx, e, size, 4);
+        return numbfs_archive_read(ctx, NULL, round_up(size, 4));
+}
+
+static void numbfs_archive_fail(struct numbfs_archive_ctx *ctx, int err)
+{
+        pthread_mutex_lock(&ctx->lock);
+        if (!ctx->err)
+                ctx->err = err;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+}
+
+/* the first stage, decode the entries into free slots */
+static void *numbfs_archive_decoder(void *arg)
+{
+        struct numbfs_archive_ctx *ctx = arg;
+        struct numbfs_archive_entry *e;
+        int ret;
+
+        while (1) {
+                pthread_mutex_lock(&ctx->lock);
+                while (ctx->head - ctx->tail == NUMBFS_ARCHIVE_SLOTS && !ctx->err)
+                        pthread_cond_wait(&ctx->cond, &ctx->lock);
+                ret = ctx->err;
+                pthread_mutex_unlock(&ctx->lock);
+                if (ret)
+                        return NULL;
+
+                e = &ctx->entries[ctx->head % NUMBFS_ARCHIVE_SLOTS];
+                ret = ctx->format == NUMBFS_ARCHIVE_TAR ? numbfs_tar_next(ctx, e) :
+                                                          numbfs_cpio_next(ctx, e);
+                if (ret < 0) {
+                        numbfs_archive_fail(ctx, ret);
+                        return NULL;
+                }
+
+                pthread_mutex_lock(&ctx->lock);
+                if (ret)
+                        ctx->eof = true;
+                else
+                        ctx->head++;
+                pthread_cond_broadcast(&ctx->cond);
+                pthread_mutex_unlock(&ctx->lock);
+                if (ret)
+                        break;
+        }
+
+        /* drain the padding, so that the producer does not get SIGPIPE */
+        ctx->pos = ctx->len = 0;
+        while (numbfs_archive_fill(ctx, NUMBFS_ARCHIVE_BUFSIZE) == NUMBFS_ARCHIVE_BUFSIZE)
+                ctx->pos = ctx->len = 0;
+        return NULL;
+}
+
+/* the third stage, write the data of the created entries */
+static void *numbfs_archive_writer(void *arg)
+{
+        struct numbfs_archive_ctx *ctx = arg;
+        struct numbfs_archive_entry *e;
+        int err;
+
+        while (1) {
+                pthread_mutex_lock(&ctx->lock);
+                while (ctx->tail == ctx->meta && !ctx->created && !ctx->err)
+                        pthread_cond_wait(&ctx->cond, &ctx->lock);
+                if (ctx->err || ctx->tail == ctx->meta) {
+                        pthread_mutex_unlock(&ctx->lock);
+                        return NULL;
+                }
+                pthread_mutex_unlock(&ctx->lock);
+
+                e = &ctx->entries[ctx->tail % NUMBFS_ARCHIVE_SLOTS];
+                if (S_ISREG(e->mode) && e->size) {
+                        err = numbfs_populate_write(ctx->pctx.sbi, e->buf,
+                                                    e->size, e->data);
+                        if (err) {
+                                numbfs_archive_fail(ctx, err);
+                                return NULL;
+                        }
+                }
+
+                pthread_mutex_lock(&ctx->lock);
+                ctx->tail++;
+                pthread_cond_broadcast(&ctx->cond);
+                pthread_mutex_unlock(&ctx->lock);
+        }
+}
+
+/* the directory of @path, its missing ancestors are created with mode 0755 */
+static int numbfs_archive_mkdirs(struct numbfs_archive_ctx *ctx, char *path,
+                                 struct numbfs_inode_info *dir)
+{
+        struct numbfs_inode_info parent;
+        char *slash;
+        int err, nid;
+
+        err = numbfs_lookup_path(ctx->pctx.sbi, path, &nid);
+        if (!err) {
+                dir->nid = nid;
+                err = numbfs_get_inode(ctx->pctx.sbi, dir);
+                if (!err && !S_ISDIR(dir->mode))
+                        err = -ENOTDIR;
+                return err;
+        }
+        if (err != -ENOENT)
+                return err;
+
+        slash = strrchr(path, '/');
+        if (slash) {
+                *slash = '\0';
+                err = numbfs_archive_mkdirs(ctx, path, &parent);
+                *slash = '/';
+        } else {
+                parent.nid = NUMBFS_ROOT_NID;
+                err = numbfs_get_inode(ctx->pctx.sbi, &parent);
+        }
+        if (err)
+                return err;
+
+        path = slash ? slash + 1 : path;
+        err = numbfs_populate_mkdir(&parent, path, strlen(path), dir);
+        if (!err)
+                ctx->pctx.nr_dirs++;
+        return err;
+}
+
+static int numbfs_archive_link(struct numbfs_archive_ctx *ctx,
+                               struct numbfs_archive_entry *e,
+                               struct numbfs_inode_info *dir, const char *name,
+                               int nid)
+{
+        struct numbfs_inode_info ni;
+        int err;
+
+        ni.nid = nid;
+        err = numbfs_get_inode(ctx->pctx.sbi, &ni);
+        if (err)
+                return err;
+        if (S_ISDIR(ni.mode))
+                return -EPERM;
+
+        err = numbfs_dir_add(dir, name, strlen(name), nid, IFTODT(ni.mode));
+        if (err)
+                return err;
+        ni.nlink++;
+
+        /* cpio stores the data of a hard linked inode with its last name */
+        if (e->size && !ni.size) {
+                err = numbfs_populate_alloc(&ni, e->size);
+                if (err)
+                        return err;
+                memcpy(e->data, ni.data, sizeof(e->data));
+                ctx->pctx.bytes += e->size;
+        } else {
+                e->size = 0;
+        }
+        return numbfs_dump_inode(&ni);
+}
+
+/* the second stage, create the inode and allocate the blocks of @e */
+static int numbfs_archive_create(struct numbfs_archive_ctx *ctx,
+                                 struct numbfs_archive_entry *e)
+{
+        struct numbfs_superblock_info *sbi = ctx->pctx.sbi;
+        struct numbfs_populate_link *link;
+        struct numbfs_inode_info dir, ni;
+        struct stat st;
+        char *path = e->path, *name;
+        int err, nid, len;
+
+        /* relative to the root, "./a/b/" is "a/b" */
+        while (*path == '/' || (path[0] == '.' && (path[1] == '/' || !path[1])))
+                path++;
+        len = strlen(path);
+        while (len && path[len - 1] == '/')
+                path[--len] = '\0';
+
+        if (!e->mode)
+                return 0;
+
+        if (!len) {
+                if (!S_ISDIR(e->mode))
+                        return -EEXIST;
+                ni.nid = NUMBFS_ROOT_NID;
+                err = numbfs_get_inode(sbi, &ni);
+                return err ? err : numbfs_populate_set_attrs(&ni, e->mode, e->uid,
+                                        e->gid, e->mtime, e->mtime, e->mtime);
+        }
+
+        name = strrchr(path, '/');
+        if (name) {
+                *name++ = '\0';
+                err = numbfs_archive_mkdirs(ctx, path, &dir);
+                name[-1] = '/';
+        } else {
+                name = path;
+                dir.nid = NUMBFS_ROOT_NID;
+                err = numbfs_get_inode(sbi, &dir);
+        }
+        if (err)
+                return err;
+
+        if (S_ISDIR(e->mode)) {
+                err = numbfs_populate_mkdir(&dir, name, strlen(name), &ni);
+                if (!err)
+                        ctx->pctx.nr_dirs++;
+                return err ? err : numbfs_populate_set_attrs(&ni, e->mode, e->uid,
+                                        e->gid, e->mtime, e->mtime, e->mtime);
+        }
+
+        if (e->hardlink) {
+                err = numbfs_lookup_path(sbi, e->target, &nid);
+                return err ? err : numbfs_archive_link(ctx, e, &dir, name, nid);
+        }
+
+        /* the cpio links of an inode share its number */
+        memset(&st, 0, sizeof(st));
+        st.st_ino = e->ino;
+        link = e->nlink > 1 && e->ino ? numbfs_populate_find_link(&ctx->pctx, &st) : NULL;
+        if (link)
+                return numbfs_archive_link(ctx, e, &dir, name, link->nid);
+
+        nid = numbfs_empty_inode(sbi, e->mode);
+        if (nid < 0)
+                return nid;
+        ni.nid = nid;
+        err = numbfs_get_inode(sbi, &ni);
+        if (err)
+                return err;
+
+        if (S_ISREG(e->mode) && e->size) {
+                err = numbfs_populate_alloc(&ni, e->size);
+                memcpy(e->data, ni.data, sizeof(e->data));
+                ctx->pctx.bytes += e->size;
+        } else if (S_ISLNK(e->mode)) {
+                err = numbfs_pwrite_inode_range(&ni, e->target, 0, strlen(e->target));
+        }
+        if (err)
+                return err;
+
+        err = numbfs_dir_add(&dir, name, strlen(name), nid, IFTODT(e->mode));
+        if (!err)
+                err = numbfs_populate_set_attrs(&ni, e->mode, e->uid, e->gid,
+                                                e->mtime, e->mtime, e->mtime);
+        if (err)
+                return err;
+
+        if (S_ISREG(e->mode))
+                ctx->pctx.nr_files++;
+        if (e->nlink > 1 && e->ino)
+                return numbfs_populate_add_link(&ctx->pctx, &st, nid);
+        return 0;
+}
+
+/**
+ * The archive is ingested in a single pass by a three-stage pipeline over
+ * a ring of NUMBFS_ARCHIVE_SLOTS entries: a decoder thread parses the
+ * stream, this thread creates the inodes, dirents and contiguous data
+ * blocks through lib.c, and a writer thread copies the data of the
+ * created entries into the image. The ring bounds the memory used for
+ * file data; the metadata is staged and written once at the end.
+ */
+int numbfs_populate_archive(struct numbfs_superblock_info *sbi, int fd)
+{
+        struct numbfs_archive_ctx ctx;
+        struct numbfs_archive_entry *e;
+        pthread_t decoder, writer;
+        struct timespec start, end;
+        double secs;
+        int err, flush;
+
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.pctx.sbi = sbi;
+        ctx.fd = fd;
+        ctx.in = malloc(NUMBFS_ARCHIVE_BUFSIZE);
+        ctx.entries = malloc(NUMBFS_ARCHIVE_SLOTS * sizeof(*ctx.entries));
+        if (!ctx.in || !ctx.entries) {
+                err = -ENOMEM;
+                goto out;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        err = numbfs_archive_fill(&ctx, BYTES_PER_BLOCK);
+        if (err < 0)
+                goto out;
+        if (err >= 6 && !memcmp(ctx.in, "07070", 5) &&
+            (ctx.in[5] == '1' || ctx.in[5] == '2')) {
+                ctx.format = NUMBFS_ARCHIVE_CPIO;
+        } else if (err >= BYTES_PER_BLOCK && !memcmp(ctx.in + 257, "ustar", 5)) {
+                ctx.format = NUMBFS_ARCHIVE_TAR;
+        } else {
+                fprintf(stderr, "error: unknown archive format, expect tar or cpio newc\n");
+                err = -EINVAL;
+                goto out;
+        }
+
+        /* only this thread touches the metadata, the writer copies file data */
+        err = numbfs_stage_begin(sbi);
+        if (err)
+                goto out;
+
+        pthread_mutex_init(&ctx.lock, NULL);
+        pthread_cond_init(&ctx.cond, NULL);
+        if (pthread_create(&decoder, NULL, numbfs_archive_decoder, &ctx)) {
+                err = -EAGAIN;
+                goto out_cond;
+        }
+        if (pthread_create(&writer, NULL, numbfs_archive_writer, &ctx)) {
+                numbfs_archive_fail(&ctx, -EAGAIN);
+                pthread_join(decoder, NULL);
+                err = -EAGAIN;
+                goto out_cond;
+        }
+
+        while (1) {
+                pthread_mutex_lock(&ctx.lock);
+                while (ctx.meta == ctx.head && !ctx.eof && !ctx.err)
+                        pthread_cond_wait(&ctx.cond, &ctx.lock);
+                if (ctx.err || ctx.meta == ctx.head) {
+                        ctx.created = true;
+                        pthread_cond_broadcast(&ctx.cond);
+                        pthread_mutex_unlock(&ctx.lock);
+                        break;
+                }
+                pthread_mutex_unlock(&ctx.lock);
+
+                e = &ctx.entries[ctx.meta % NUMBFS_ARCHIVE_SLOTS];
+                err = numbfs_archive_create(&ctx, e);
+                if (err) {
+                        fprintf(stderr, "error: failed to create %s: %s\n", e->path,
+                                strerror(-err));
+                        numbfs_archive_fail(&ctx, err);
+                        continue;
+                }
+
+                pthread_mutex_lock(&ctx.lock);
+                ctx.meta++;
+                pthread_cond_broadcast(&ctx.cond);
+                pthread_mutex_unlock(&ctx.lock);
+        }
+
+        pthread_join(decoder, NULL);
+        pthread_join(writer, NULL);
+        flush = numbfs_stage_flush(sbi);
+        err = ctx.err ? ctx.err : flush;
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (!err) {
+                printf("Populated from %s archive\n",
+                       ctx.format == NUMBFS_ARCHIVE_TAR ? "tar" : "cpio");
+                printf("    directories:                %d\n", ctx.pctx.nr_dirs);
+                printf("    regular files:              %d\n", ctx.pctx.nr_files);
+                printf("    data bytes:                 %lld\n", ctx.pctx.bytes);
+                printf("    throughput:                 %.2f MB/s\n",
+                       secs > 0 ? ctx.pctx.bytes / secs / (1 << 20) : 0);
+        }
+out_cond:
+        pthread_cond_destroy(&ctx.cond);
+        pthread_mutex_destroy(&ctx.lock);
+        /* a no-op unless a thread failed to start */
+        flush = numbfs_stage_flush(sbi);
+        if (!err)
+                err = flush;
+out:
+        free(ctx.pctx.links);
+        free(ctx.entries);
+        free(ctx.in);
+        return err;
+}
@@ -0,0 +1,21 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2025, Hongzhen Luo
+ */
+
+#ifndef __NUMBFS_POPULATE_H
+#define __NUMBFS_POPULATE_H
+
+#include "internal.h"
+
+/* an upper bound of the inodes needed to copy the host directory tree at @root */
+long long numbfs_populate_count(const char *root);
+
+/* copy the host directory tree at @root into the root directory of the image */
+int numbfs_populate_dir(struct numbfs_superblock_info *sbi, const char *root,
+                        int jobs);
+
+/* create the entries of the tar or cpio newc stream read from @fd */
+int numbfs_populate_archive(struct numbfs_superblock_info *sbi, int fd);
+
+#endif
@@ -1,17 +1,25 @@
 #include "internal.h"
 #include "disk.h"
 #include "utils.h"
+#include "populate.h"
+#include "check.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #define FILE_SIZE (10 * 1024 * 1024) // 10MB
 #define TEST_NUM_INODES 4096
 
 struct numbfs_superblock_info sbi;
+/* the tools, given on the command line */
+static const char *mkfs_tool, *fsck_tool;
 
 static void init_sbi(int fd)
 {
@@ -137,6 +145,95 @@ static void test_byte_rw(void)
 #undef TEST_BLK
 }
 
+static void test_range_rw(void)
+{
+        struct numbfs_inode_info ni;
+        char wbuf[BYTES_PER_BLOCK * NUMBFS_NUM_DATA_ENTRY];
+        char rbuf[BYTES_PER_BLOCK * NUMBFS_NUM_DATA_ENTRY];
+        int *blks;
+        int i, nr;
+#define TEST_OFF        300
+#define TEST_LEN        (BYTES_PER_BLOCK * 5 - 100)
+
+        ni.sbi = &sbi;
+        ni.nid = TEST_NUM_INODES / 4;
+        assert(!numbfs_get_inode(&sbi, &ni));
+
+        for (i = 0; i < (int)sizeof(wbuf); i++)
+                wbuf[i] = i % 251 + 1;
+
+        /* cross-block write with partial head and tail blocks */
+        assert(!numbfs_pwrite_inode_range(&ni, wbuf, TEST_OFF, TEST_LEN));
+        assert(ni.size == TEST_OFF + TEST_LEN);
+        for (i = 1; i < DIV_ROUND_UP(TEST_OFF + TEST_LEN, BYTES_PER_BLOCK); i++)
+                assert(ni.data[i] == ni.data[i - 1] + 1);
+
+        memset(rbuf, 0xff, sizeof(rbuf));
+        assert(!numbfs_pread_inode_range(&ni, rbuf, 0, sizeof(rbuf)));
+        for (i = 0; i < TEST_OFF; i++)
+                assert(rbuf[i] == 0);
+        assert(!memcmp(rbuf + TEST_OFF, wbuf, TEST_LEN));
+        for (i = TEST_OFF + TEST_LEN; i < (int)sizeof(rbuf); i++)
+                assert(rbuf[i] == 0);
+
+        /* overwrite inside one block, the rest must be preserved */
+        assert(!numbfs_pwrite_inode_range(&ni, wbuf, BYTES_PER_BLOCK + 7, 10));
+        assert(!numbfs_pread_inode_range(&ni, rbuf, BYTES_PER_BLOCK, BYTES_PER_BLOCK));
+        assert(!memcmp(rbuf + 7, wbuf, 10));
+        assert(!memcmp(rbuf + 17, wbuf + BYTES_PER_BLOCK + 17 - TEST_OFF,
+                       BYTES_PER_BLOCK - 17));
+        assert(ni.size == TEST_OFF + TEST_LEN);
+
+        /* the range must be within the direct blocks */
+        assert(numbfs_pwrite_inode_range(&ni, wbuf, BYTES_PER_BLOCK, sizeof(wbuf)) == -E2BIG);
+
+        /* out of space in the middle of the range, the blocks taken are given back */
+        blks = malloc(sbi.free_blocks * sizeof(*blks));
+        assert(blks);
+        for (nr = 0; sbi.free_blocks > 2; nr++)
+                assert(!numbfs_alloc_block(&sbi, &blks[nr]));
+        assert(numbfs_pwrite_inode_range(&ni, wbuf, 6 * BYTES_PER_BLOCK,
+                                         4 * BYTES_PER_BLOCK) == -ENOMEM);
+        assert(sbi.free_blocks == 2 && ni.size == TEST_OFF + TEST_LEN);
+        for (i = 6; i < NUMBFS_NUM_DATA_ENTRY; i++)
+                assert(ni.data[i] == NUMBFS_HOLE);
+        assert(!numbfs_free_blocks(&sbi, blks, nr));
+        free(blks);
+#undef TEST_OFF
+#undef TEST_LEN
+}
+
+static void test_fiemap(void)
+{
+        struct numbfs_inode_info ni;
+        struct numbfs_map maps[NUMBFS_NUM_DATA_ENTRY];
+        char buf[BYTES_PER_BLOCK];
+
+        ni.sbi = &sbi;
+        ni.nid = TEST_NUM_INODES / 4 + 1;
+        assert(!numbfs_get_inode(&sbi, &ni));
+
+        memset(buf, 0x5a, BYTES_PER_BLOCK);
+        /* | hole | data | data | hole | data | */
+        assert(!numbfs_pwrite_inode_range(&ni, buf, BYTES_PER_BLOCK, BYTES_PER_BLOCK));
+        assert(!numbfs_pwrite_inode_range(&ni, buf, 2 * BYTES_PER_BLOCK, BYTES_PER_BLOCK));
+        assert(!numbfs_pwrite_inode_range(&ni, buf, 4 * BYTES_PER_BLOCK, 10));
+
+        assert(numbfs_inode_fiemap(&ni, 0, maps, NUMBFS_NUM_DATA_ENTRY) == 2);
+        assert(maps[0].lblk == 1 && maps[0].len == 2 && !maps[0].flags);
+        assert(maps[0].pblk == numbfs_data_blk(&sbi, ni.data[1]));
+        assert(maps[1].lblk == 4 && maps[1].len == 1);
+        assert(maps[1].flags & NUMBFS_MAP_LAST);
+        assert(numbfs_inode_fiemap(&ni, 0, maps, 1) == 1 && !maps[0].flags);
+
+        assert(numbfs_seek_data(&ni, 0) == BYTES_PER_BLOCK);
+        assert(numbfs_seek_data(&ni, BYTES_PER_BLOCK + 3) == BYTES_PER_BLOCK + 3);
+        assert(numbfs_seek_hole(&ni, BYTES_PER_BLOCK) == 3 * BYTES_PER_BLOCK);
+        assert(numbfs_seek_data(&ni, 3 * BYTES_PER_BLOCK) == 4 * BYTES_PER_BLOCK);
+        assert(numbfs_seek_hole(&ni, 4 * BYTES_PER_BLOCK) == ni.size);
+        assert(numbfs_seek_data(&ni, ni.size) == -ENXIO);
+}
+
 static int numbfs_block_count(void)
 {
         int cnt = 0, i, byte, bit;
@@ -153,6 +250,49 @@ static int numbfs_block_count(void)
         return cnt;
 }
 
+static void test_truncate(void)
+{
+        struct numbfs_inode_info ni;
+        char wbuf[BYTES_PER_BLOCK * 5], rbuf[BYTES_PER_BLOCK * 5];
+        char zero[BYTES_PER_BLOCK * 5];
+        int free_blocks, i;
+
+        ni.sbi = &sbi;
+        ni.nid = TEST_NUM_INODES / 4 + 2;
+        assert(!numbfs_get_inode(&sbi, &ni));
+
+        memset(wbuf, 0x3c, sizeof(wbuf));
+        memset(zero, 0, sizeof(zero));
+        assert(!numbfs_pwrite_inode_range(&ni, wbuf, 0, sizeof(wbuf)));
+        free_blocks = sbi.free_blocks;
+
+        /* block 2 is released, blocks 1 and 3 are partially zeroed */
+        assert(!numbfs_punch_hole(&ni, BYTES_PER_BLOCK + 100, 2 * BYTES_PER_BLOCK - 50));
+        assert(sbi.free_blocks == free_blocks + 1);
+        assert(ni.data[2] == NUMBFS_HOLE);
+        assert(ni.size == (int)sizeof(wbuf));
+        assert(!numbfs_pread_inode_range(&ni, rbuf, 0, sizeof(rbuf)));
+        assert(!memcmp(rbuf, wbuf, BYTES_PER_BLOCK + 100));
+        assert(!memcmp(rbuf + BYTES_PER_BLOCK + 100, zero, 2 * BYTES_PER_BLOCK - 50));
+        assert(!memcmp(rbuf + 3 * BYTES_PER_BLOCK + 50, wbuf, 2 * BYTES_PER_BLOCK - 50));
+
+        /* blocks 3 and 4 are released at once */
+        assert(!numbfs_truncate_inode(&ni, BYTES_PER_BLOCK + 10));
+        assert(sbi.free_blocks == free_blocks + 3);
+        for (i = 2; i < NUMBFS_NUM_DATA_ENTRY; i++)
+                assert(ni.data[i] == NUMBFS_HOLE);
+
+        /* extend again, the truncated bytes must read as zeros */
+        assert(!numbfs_truncate_inode(&ni, sizeof(rbuf)));
+        assert(!numbfs_pread_inode_range(&ni, rbuf, 0, sizeof(rbuf)));
+        assert(!memcmp(rbuf, wbuf, BYTES_PER_BLOCK + 10));
+        assert(!memcmp(rbuf + BYTES_PER_BLOCK + 10, zero, sizeof(rbuf) - BYTES_PER_BLOCK - 10));
+
+        assert(!numbfs_truncate_inode(&ni, 0));
+        assert(sbi.free_blocks == free_blocks + 5);
+        assert(numbfs_block_count() == sbi.free_blocks);
+}
+
 static void test_block_management(void)
 {
 #define TEST_TIMES (BYTES_PER_BLOCK * 2 + 1)
@@ -252,10 +392,1758 @@ static void test_timestamps(void)
 
 }
 
-int main() {
+static void test_refcount(void)
+{
+        struct numbfs_inode_info a, b;
+        char wbuf[BYTES_PER_BLOCK], rbuf[BYTES_PER_BLOCK];
+        int free_blocks, blk, blks[2], *many, i;
+
+        a.sbi = b.sbi = &sbi;
+        a.nid = TEST_NUM_INODES / 4 + 3;
+        b.nid = TEST_NUM_INODES / 4 + 4;
+        assert(!numbfs_get_inode(&sbi, &a));
+        assert(!numbfs_get_inode(&sbi, &b));
+
+        memset(wbuf, 0x11, BYTES_PER_BLOCK);
+        assert(!numbfs_pwrite_inode_range(&a, wbuf, 0, BYTES_PER_BLOCK));
+
+        assert(numbfs_share_blocks(&sbi, &a.data[0], 1) == -EOPNOTSUPP);
+        assert(!numbfs_enable_refcount(&sbi));
+        assert(sbi.feature & NUMBFS_FEATURE_REFCOUNT);
+        free_blocks = sbi.free_blocks;
+
+        /* let inode b share the block of inode a */
+        blk = a.data[0];
+        assert(!numbfs_share_blocks(&sbi, &blk, 1));
+        assert(numbfs_get_refcount(&sbi, a.data[0]) == 2);
+        b.data[0] = a.data[0];
+        b.size = BYTES_PER_BLOCK;
+        assert(!numbfs_dump_inode(&b));
+
+        /* writing to a shared block copies it first */
+        memset(wbuf, 0x22, 10);
+        assert(!numbfs_pwrite_inode_range(&b, wbuf, 0, 10));
+        assert(b.data[0] != a.data[0]);
+        assert(sbi.free_blocks == free_blocks - 1);
+        assert(numbfs_get_refcount(&sbi, a.data[0]) == 1);
+        assert(!numbfs_pread_inode_range(&a, rbuf, 0, BYTES_PER_BLOCK));
+        memset(wbuf, 0x11, BYTES_PER_BLOCK);
+        assert(!memcmp(rbuf, wbuf, BYTES_PER_BLOCK));
+        assert(!numbfs_pread_inode_range(&b, rbuf, 0, BYTES_PER_BLOCK));
+        memset(wbuf, 0x22, 10);
+        assert(!memcmp(rbuf, wbuf, BYTES_PER_BLOCK));
+
+        /* a shared block is released by its last owner only */
+        blk = a.data[0];
+        assert(!numbfs_share_blocks(&sbi, &blk, 1));
+        assert(!numbfs_free_block(&sbi, a.data[0]));
+        assert(sbi.free_blocks == free_blocks - 1);
+        assert(!numbfs_truncate_inode(&a, 0));
+        assert(!numbfs_truncate_inode(&b, 0));
+        assert(sbi.free_blocks == free_blocks + 1);
+        assert(numbfs_block_count() == sbi.free_blocks);
+
+        /* truncating or punching a shared block copies it first */
+        memset(wbuf, 0x33, BYTES_PER_BLOCK);
+        assert(!numbfs_pwrite_inode_range(&a, wbuf, 0, BYTES_PER_BLOCK));
+        assert(!numbfs_pwrite_inode_range(&a, wbuf, BYTES_PER_BLOCK, BYTES_PER_BLOCK));
+        free_blocks = sbi.free_blocks;
+        memcpy(blks, a.data, sizeof(blks));
+        assert(!numbfs_share_blocks(&sbi, blks, 2));
+        memcpy(b.data, a.data, sizeof(blks));
+        b.size = a.size;
+        assert(!numbfs_dump_inode(&b));
+
+        assert(!numbfs_truncate_inode(&a, 700));
+        assert(a.data[1] != b.data[1] && a.data[0] == b.data[0]);
+        assert(!numbfs_punch_hole(&b, 100, 100));
+        assert(a.data[0] != b.data[0]);
+        assert(sbi.free_blocks == free_blocks - 2);
+        assert(!numbfs_get_inode(&sbi, &a));
+        assert(!numbfs_get_inode(&sbi, &b));
+
+        assert(!numbfs_pread_inode_range(&a, rbuf, 0, BYTES_PER_BLOCK));
+        assert(!memcmp(rbuf, wbuf, BYTES_PER_BLOCK));
+        assert(!numbfs_pread_inode_range(&a, rbuf, BYTES_PER_BLOCK, 700 - BYTES_PER_BLOCK));
+        assert(!memcmp(rbuf, wbuf, 700 - BYTES_PER_BLOCK));
+        assert(!numbfs_pread_inode_range(&b, rbuf, BYTES_PER_BLOCK, BYTES_PER_BLOCK));
+        assert(!memcmp(rbuf, wbuf, BYTES_PER_BLOCK));
+        assert(!numbfs_pread_inode_range(&b, rbuf, 0, BYTES_PER_BLOCK));
+        memset(wbuf + 100, 0, 100);
+        assert(!memcmp(rbuf, wbuf, BYTES_PER_BLOCK));
+
+        assert(!numbfs_truncate_inode(&a, 0));
+        assert(!numbfs_truncate_inode(&b, 0));
+        assert(numbfs_block_count() == sbi.free_blocks);
+
+        /* a refcount overflow leaves the whole table untouched */
+        free_blocks = sbi.free_blocks;
+        many = malloc((NUMBFS_REFCOUNT_MAX + 1) * sizeof(int));
+        assert(many);
+        for (i = 0; i <= (int)NUMBFS_REFCOUNTS_PER_BLOCK; i++)
+                assert(!numbfs_alloc_block(&sbi, &many[i]));
+        /* in two different refcount table blocks */
+        blks[0] = many[0];
+        blks[1] = many[NUMBFS_REFCOUNTS_PER_BLOCK];
+        assert(blks[0] / NUMBFS_REFCOUNTS_PER_BLOCK != blks[1] / NUMBFS_REFCOUNTS_PER_BLOCK);
+        assert(!numbfs_free_blocks(&sbi, many + 1, NUMBFS_REFCOUNTS_PER_BLOCK - 1));
+        for (i = 0; i < NUMBFS_REFCOUNT_MAX - 1; i++)
+                many[i] = blks[1];
+        assert(!numbfs_share_blocks(&sbi, many, NUMBFS_REFCOUNT_MAX - 1));
+        assert(numbfs_get_refcount(&sbi, blks[1]) == NUMBFS_REFCOUNT_MAX);
+
+        for (i = 0; i < NUMBFS_REFCOUNT_MAX; i++)
+                many[i] = blks[1];
+        many[i] = blks[0];
+        assert(numbfs_share_blocks(&sbi, many, NUMBFS_REFCOUNT_MAX + 1) == -EMLINK);
+        assert(numbfs_get_refcount(&sbi, blks[0]) == 1);
+        assert(numbfs_get_refcount(&sbi, blks[1]) == NUMBFS_REFCOUNT_MAX);
+
+        for (i = 0; i < NUMBFS_REFCOUNT_MAX; i++)
+                many[i] = blks[1];
+        assert(!numbfs_free_blocks(&sbi, many, NUMBFS_REFCOUNT_MAX));
+        assert(!numbfs_free_block(&sbi, blks[0]));
+        assert(sbi.free_blocks == free_blocks);
+        free(many);
+}
+
+static void test_dir_index(void)
+{
+#define TEST_ENTRIES    60
+        struct numbfs_inode_info dir;
+        struct numbfs_dirent de;
+        char name[NUMBFS_MAX_PATH_LEN];
+        int i, nid, pos;
+
+        /* a tiny index so that the buckets overflow */
+        assert(!numbfs_enable_dindex(&sbi, 2));
+        assert(sbi.feature & NUMBFS_FEATURE_DIR_INDEX);
+
+        dir.sbi = &sbi;
+        dir.nid = numbfs_empty_dir(&sbi, NUMBFS_ROOT_NID);
+        assert(dir.nid >= 0);
+        assert(!numbfs_get_inode(&sbi, &dir));
+
+        for (i = 0; i < TEST_ENTRIES; i++) {
+                memset(&de, 0, sizeof(de));
+                de.name_len = sprintf(de.name, "file-%d", i);
+                de.ino = cpu_to_le16(100 + i);
+                de.type = DT_REG;
+                pos = dir.size;
+                assert(!numbfs_pwrite_inode_range(&dir, (char*)&de, pos, sizeof(de)));
+                assert(!numbfs_dindex_insert(&dir, de.name, de.name_len, 100 + i, pos));
+        }
+
+        for (i = 0; i < TEST_ENTRIES; i++) {
+                sprintf(name, "file-%d", i);
+                assert(!numbfs_dindex_lookup(&dir, name, strlen(name), &nid, &pos, NULL));
+                assert(nid == 100 + i);
+                assert(pos == (i + 2) * (int)sizeof(de));
+        }
+        assert(numbfs_dindex_lookup(&dir, "file-", 5, &nid, &pos, NULL) == -ENOENT);
+
+        /* deleted entries are skipped but do not end a probe */
+        for (i = 0; i < TEST_ENTRIES; i += 2) {
+                sprintf(name, "file-%d", i);
+                assert(!numbfs_dindex_delete(&dir, name, strlen(name)));
+                assert(numbfs_dindex_lookup(&dir, name, strlen(name), &nid, &pos, NULL) == -ENOENT);
+        }
+        for (i = 1; i < TEST_ENTRIES; i += 2) {
+                sprintf(name, "file-%d", i);
+                assert(!numbfs_dindex_lookup(&dir, name, strlen(name), &nid, &pos, NULL));
+                assert(nid == 100 + i);
+        }
+#undef TEST_ENTRIES
+}
+
+/* swap the tiny index of test_dir_index() for one with room to spare */
+static void resize_dir_index(int nblocks)
+{
+        int blks[16], i;
+
+        assert(sbi.dindex_blocks <= 16);
+        for (i = 0; i < sbi.dindex_blocks; i++)
+                blks[i] = sbi.dindex_start + i;
+        assert(!numbfs_free_blocks(&sbi, blks, sbi.dindex_blocks));
+        sbi.feature &= ~NUMBFS_FEATURE_DIR_INDEX;
+
+        assert(!numbfs_enable_dindex(&sbi, nblocks));
+        assert(sbi.dindex_blocks == nblocks);
+}
+
+static void test_dir_ops(void)
+{
+#define TEST_ENTRIES    40
+        struct numbfs_inode_info dir;
+        char name[NUMBFS_MAX_PATH_LEN];
+        int i, nid, type, size;
+
+        dir.sbi = &sbi;
+        dir.nid = numbfs_empty_dir(&sbi, NUMBFS_ROOT_NID);
+        assert(dir.nid >= 0);
+        assert(!numbfs_get_inode(&sbi, &dir));
+
+        for (i = 0; i < TEST_ENTRIES; i++) {
+                sprintf(name, "entry-%d", i);
+                assert(!numbfs_dir_add(&dir, name, strlen(name), 200 + i,
+                                       i % 2 ? DT_DIR : DT_REG));
+        }
+        assert(numbfs_dir_add(&dir, "entry-3", 7, 1, DT_REG) == -EEXIST);
+        size = dir.size;
+
+        assert(!numbfs_dir_lookup(&dir, ".", 1, &nid, &type));
+        assert(nid == dir.nid && type == DT_DIR);
+        assert(!numbfs_dir_lookup(&dir, "..", 2, &nid, &type));
+        assert(nid == NUMBFS_ROOT_NID);
+
+        /* the removed slots are reused before the directory grows */
+        assert(!numbfs_dir_remove(&dir, "entry-5", 7));
+        assert(!numbfs_dir_remove(&dir, "entry-9", 7));
+        assert(numbfs_dir_remove(&dir, "entry-9", 7) == -ENOENT);
+        assert(numbfs_dir_lookup(&dir, "entry-5", 7, &nid, &type) == -ENOENT);
+        assert(!numbfs_dir_add(&dir, "again-1", 7, 300, DT_REG));
+        assert(!numbfs_dir_add(&dir, "again-2", 7, 301, DT_REG));
+        assert(dir.size == size);
+        assert(!numbfs_dir_add(&dir, "again-3", 7, 302, DT_REG));
+        assert(dir.size == size + (int)sizeof(struct numbfs_dirent));
+
+        /* the same answers without the dentry cache */
+        for (i = 0; i < 2; i++) {
+                assert(!numbfs_dir_lookup(&dir, "entry-7", 7, &nid, &type));
+                assert(nid == 207 && type == DT_DIR);
+                assert(!numbfs_dir_lookup(&dir, "again-2", 7, &nid, &type));
+                assert(nid == 301 && type == DT_REG);
+                assert(numbfs_dir_lookup(&dir, "entry-9", 7, &nid, &type) == -ENOENT);
+                numbfs_drop_caches(&sbi);
+        }
+#undef TEST_ENTRIES
+}
+
+static void test_lookup_path(void)
+{
+        struct numbfs_inode_info dir;
+        int a, b, c, nid, i;
+
+        dir.sbi = &sbi;
+        dir.nid = NUMBFS_ROOT_NID;
+        a = numbfs_empty_dir(&sbi, dir.nid);
+        assert(a >= 0);
+        assert(!numbfs_get_inode(&sbi, &dir));
+        assert(!numbfs_dir_add(&dir, "a", 1, a, DT_DIR));
+
+        dir.nid = a;
+        b = numbfs_empty_dir(&sbi, dir.nid);
+        assert(b >= 0);
+        assert(!numbfs_get_inode(&sbi, &dir));
+        assert(!numbfs_dir_add(&dir, "b", 1, b, DT_DIR));
+
+        dir.nid = b;
+        c = numbfs_empty_dir(&sbi, dir.nid);
+        assert(c >= 0);
+        assert(!numbfs_get_inode(&sbi, &dir));
+        assert(!numbfs_dir_add(&dir, "c", 1, c, DT_DIR));
+
+        /* the second round is served by the path cache */
+        for (i = 0; i < 2; i++) {
+                assert(!numbfs_lookup_path(&sbi, "/a/b/c", &nid) && nid == c);
+                assert(!numbfs_lookup_path(&sbi, "a//b/./c/", &nid) && nid == c);
+                assert(!numbfs_lookup_path(&sbi, "/a/b", &nid) && nid == b);
+                assert(!numbfs_lookup_path(&sbi, "/a/b/c/..", &nid) && nid == b);
+                assert(!numbfs_lookup_path(&sbi, "/", &nid) && nid == NUMBFS_ROOT_NID);
+                assert(numbfs_lookup_path(&sbi, "/a/x/c", &nid) == -ENOENT);
+        }
+
+        /* removing an entry invalidates the cached paths through it */
+        assert(!numbfs_dir_remove(&dir, "c", 1));
+        assert(numbfs_lookup_path(&sbi, "/a/b/c", &nid) == -ENOENT);
+        assert(!numbfs_lookup_path(&sbi, "/a/b", &nid) && nid == b);
+}
+
+static void test_dir_compact(void)
+{
+#define TEST_ENTRIES    15
+        struct numbfs_inode_info dir;
+        struct numbfs_dirent de[TEST_ENTRIES + 2];
+        char name[NUMBFS_MAX_PATH_LEN];
+        int i, nid, type, free_blocks;
+
+        dir.sbi = &sbi;
+        dir.nid = numbfs_empty_dir(&sbi, NUMBFS_ROOT_NID);
+        assert(dir.nid >= 0);
+        assert(!numbfs_get_inode(&sbi, &dir));
+
+        /* inode numbers in descending order */
+        for (i = 0; i < TEST_ENTRIES; i++) {
+                sprintf(name, "compact-%d", i);
+                assert(!numbfs_dir_add(&dir, name, strlen(name), 500 - i, DT_REG));
+        }
+        for (i = 0; i < TEST_ENTRIES; i++) {
+                if (i % 3 == 0)
+                        continue;
+                sprintf(name, "compact-%d", i);
+                assert(!numbfs_dir_remove(&dir, name, strlen(name)));
+        }
+
+        free_blocks = sbi.free_blocks;
+        assert(!numbfs_dir_compact(&dir, true));
+        assert(dir.size == (2 + TEST_ENTRIES / 3) * (int)sizeof(struct numbfs_dirent));
+        assert(sbi.free_blocks == free_blocks + 2);
+
+        assert(!numbfs_pread_inode_range(&dir, (char*)de, 0, dir.size));
+        for (i = 3; i < dir.size / (int)sizeof(struct numbfs_dirent); i++)
+                assert(le16_to_cpu(de[i - 1].ino) < le16_to_cpu(de[i].ino));
+
+        for (i = 0; i < 2; i++) {
+                assert(!numbfs_dir_lookup(&dir, "compact-3", 9, &nid, &type));
+                assert(nid == 497);
+                assert(numbfs_dir_lookup(&dir, "compact-4", 9, &nid, &type) == -ENOENT);
+                numbfs_drop_caches(&sbi);
+        }
+
+        /* a dense directory is left alone */
+        assert(!numbfs_dir_compact(&dir, true));
+        assert(dir.size == (2 + TEST_ENTRIES / 3) * (int)sizeof(struct numbfs_dirent));
+#undef TEST_ENTRIES
+}
+
+static void test_readdir(void)
+{
+#define TEST_ENTRIES    20
+        struct numbfs_inode_info dir, sub, *ni;
+        struct numbfs_readdir_ctx ctx;
+        struct numbfs_dirent *de;
+        char name[NUMBFS_MAX_PATH_LEN];
+        int i, nid, last, cnt, nids[TEST_ENTRIES];
+
+        dir.sbi = &sbi;
+        dir.nid = numbfs_empty_dir(&sbi, NUMBFS_ROOT_NID);
+        assert(dir.nid >= 0);
+        assert(!numbfs_get_inode(&sbi, &dir));
+
+        /* the entries are added in descending inode order */
+        for (i = 0; i < TEST_ENTRIES; i++) {
+                nids[i] = numbfs_empty_dir(&sbi, dir.nid);
+                assert(nids[i] > 0);
+        }
+        for (i = TEST_ENTRIES - 1; i >= 0; i--) {
+                sprintf(name, "sub-%d", i);
+                assert(!numbfs_dir_add(&dir, name, strlen(name), nids[i], DT_DIR));
+        }
+        assert(!numbfs_dir_remove(&dir, "sub-4", 5));
+
+        /* on-disk order */
+        assert(!numbfs_opendir(&ctx, &dir, 0));
+        for (cnt = 0; numbfs_readdir(&ctx, &de, &ni); cnt++)
+                assert(de->name_len && !ni);
+        assert(cnt == TEST_ENTRIES + 1);
+        numbfs_closedir(&ctx);
+
+        assert(!numbfs_opendir(&ctx, &dir, NUMBFS_READDIR_SORT | NUMBFS_READDIR_PLUS));
+        for (cnt = 0, last = -1; numbfs_readdir(&ctx, &de, &ni); cnt++) {
+                nid = le16_to_cpu(de->ino);
+                if (cnt == 0)
+                        assert(!strcmp(de->name, ".") && nid == dir.nid);
+                else if (cnt == 1)
+                        assert(!strcmp(de->name, "..") && nid == NUMBFS_ROOT_NID);
+                else
+                        assert(nid > last);
+                if (cnt >= 2)
+                        last = nid;
+
+                /* the prefetched inode matches a plain read */
+                assert(ni && ni->nid == nid);
+                sub.nid = nid;
+                assert(!numbfs_get_inode(&sbi, &sub));
+                assert(S_ISDIR(ni->mode) && ni->mode == sub.mode);
+                assert(ni->size == sub.size && ni->nlink == sub.nlink);
+                assert(!memcmp(ni->data, sub.data, sizeof(sub.data)));
+        }
+        assert(cnt == TEST_ENTRIES + 1);
+        numbfs_closedir(&ctx);
+#undef TEST_ENTRIES
+}
+
+static void test_xattr(void)
+{
+        struct numbfs_inode_info ni;
+        char name[NUMBFS_XATTR_MAXNAME + 1], value[NUMBFS_XATTR_MAXVALUE];
+        char list[BYTES_PER_BLOCK], buf[BYTES_PER_BLOCK];
+        struct numbfs_xattr_entry *xe;
+        int bad[] = { 200, 0 };
+        int i, nid, size, type;
+
+        nid = numbfs_empty_dir(&sbi, NUMBFS_ROOT_NID);
+        assert(nid >= 0);
+
+        ni.nid = nid;
+        ni.sbi = &sbi;
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(!ni.xattr_count);
+
+        /* fill all the slots in one batch */
+        for (i = 0; i < (int)NUMBFS_XATTR_MAX_ENTRY; i++) {
+                snprintf(name, sizeof(name), "label-%u", (unsigned)i);
+                snprintf(value, sizeof(value), "value-%d", i);
+                assert(!numbfs_setxattr(&ni, NUMBFS_XATTR_INDEX_USER, name,
+                                        value, strlen(value), NUMBFS_XATTR_CREATE));
+        }
+        assert(numbfs_setxattr(&ni, NUMBFS_XATTR_INDEX_TRUSTED, "x", "y", 1, 0) == -ENOSPC);
+        assert(numbfs_setxattr(&ni, NUMBFS_XATTR_INDEX_USER, "label-0", "v", 1,
+                               NUMBFS_XATTR_CREATE) == -EEXIST);
+        assert(!numbfs_xattr_flush(&ni));
+
+        /* everything comes back from the disk */
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(ni.xattr_count == (int)NUMBFS_XATTR_MAX_ENTRY);
+        for (i = 0; i < (int)NUMBFS_XATTR_MAX_ENTRY; i++) {
+                snprintf(name, sizeof(name), "label-%u", (unsigned)i);
+                size = numbfs_getxattr(&ni, NUMBFS_XATTR_INDEX_USER, name, value, sizeof(value));
+                assert(size == (int)strlen("value-0") && !memcmp(value, "value-", 6));
+                assert(value[6] == '0' + i);
+        }
+        assert(numbfs_getxattr(&ni, NUMBFS_XATTR_INDEX_TRUSTED, "label-0", value,
+                               sizeof(value)) == -ENODATA);
+        assert(numbfs_getxattr(&ni, NUMBFS_XATTR_INDEX_USER, "label-0", value, 2) == -ERANGE);
+
+        assert(!numbfs_removexattr(&ni, NUMBFS_XATTR_INDEX_USER, "label-3"));
+        assert(numbfs_removexattr(&ni, NUMBFS_XATTR_INDEX_USER, "label-3") == -ENODATA);
+        assert(numbfs_setxattr(&ni, NUMBFS_XATTR_INDEX_USER, "label-3", "v", 1,
+                               NUMBFS_XATTR_REPLACE) == -ENODATA);
+        assert(!numbfs_setxattr(&ni, NUMBFS_XATTR_INDEX_TRUSTED, "secret", "s", 1, 0));
+        assert(!numbfs_setxattr(&ni, NUMBFS_XATTR_INDEX_USER, "label-1", "new", 3,
+                                NUMBFS_XATTR_REPLACE));
+        assert(!numbfs_xattr_flush(&ni));
+
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(ni.xattr_count == (int)NUMBFS_XATTR_MAX_ENTRY);
+        assert(numbfs_getxattr(&ni, NUMBFS_XATTR_INDEX_USER, "label-1", NULL, 0) == 3);
+        assert(numbfs_getxattr(&ni, NUMBFS_XATTR_INDEX_USER, "label-3", NULL, 0) == -ENODATA);
+
+        size = numbfs_listxattr(&ni, NULL, 0);
+        assert(size > 0 && size == numbfs_listxattr(&ni, list, sizeof(list)));
+        assert(numbfs_listxattr(&ni, list, 4) == -ERANGE);
+        for (i = 0; i < size; i += strlen(list + i) + 1)
+                assert(!strncmp(list + i, "user.label-", 11) ||
+                       !strcmp(list + i, "trusted.secret"));
+        assert(!numbfs_xattr_flush(&ni));
+
+        /* an unknown name prefix on disk, out of the table or a hole in it */
+        assert(!numbfs_read_block(&sbi, buf, numbfs_data_blk(&sbi, ni.xattr_start)));
+        xe = (struct numbfs_xattr_entry*)(buf + NUMBFS_XATTR_ENTRY_START);
+        type = xe->e_type;
+        for (i = 0; i < (int)ARRAY_SIZE(bad); i++) {
+                xe->e_type = bad[i];
+                assert(!numbfs_write_block(&sbi, buf, numbfs_data_blk(&sbi, ni.xattr_start)));
+                assert(!numbfs_get_inode(&sbi, &ni));
+                assert(numbfs_listxattr(&ni, NULL, 0) == -EFSCORRUPTED);
+                assert(!numbfs_xattr_flush(&ni));
+        }
+        xe->e_type = type;
+        assert(!numbfs_write_block(&sbi, buf, numbfs_data_blk(&sbi, ni.xattr_start)));
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(numbfs_listxattr(&ni, NULL, 0) == size);
+        assert(!numbfs_xattr_flush(&ni));
+}
+
+static void test_tstable(void)
+{
+        struct numbfs_inode_info old, ni;
+        struct numbfs_timestamps nt, ont;
+        int nid, free_blocks;
+
+        old.nid = numbfs_empty_dir(&sbi, NUMBFS_ROOT_NID);
+        assert(old.nid >= 0);
+        old.sbi = &sbi;
+        assert(!numbfs_get_inode(&sbi, &old));
+        assert(!numbfs_get_timestamps(&old, &ont));
+
+        /* the timestamps of the existing inodes are carried over */
+        assert(!numbfs_enable_tstable(&sbi));
+        assert(sbi.feature & NUMBFS_FEATURE_TSTABLE);
+        assert(!numbfs_get_timestamps(&old, &nt));
+        assert(!memcmp(&nt, &ont, sizeof(nt)));
+
+        /* and the xattr blocks that only held them are gone */
+        assert(!numbfs_get_inode(&sbi, &old));
+        assert(old.xattr_start == NUMBFS_HOLE);
+        assert(!numbfs_get_timestamps(&old, &nt));
+        assert(!memcmp(&nt, &ont, sizeof(nt)));
+        assert(numbfs_block_count() == sbi.free_blocks);
+
+        /* a new directory costs one block less */
+        free_blocks = sbi.free_blocks;
+        nid = numbfs_empty_dir(&sbi, NUMBFS_ROOT_NID);
+        assert(nid >= 0);
+        assert(sbi.free_blocks == free_blocks - 1);
+
+        ni.nid = nid;
+        ni.sbi = &sbi;
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(ni.xattr_start == NUMBFS_HOLE);
+        assert(!numbfs_get_timestamps(&ni, &nt));
+        assert(dis(le64_to_cpu(nt.t_mtime), time(NULL)) < 3);
+
+        nt.t_atime = cpu_to_le64(12345);
+        assert(!numbfs_set_timestamps(&ni, &nt));
+        assert(!numbfs_get_timestamps(&ni, &ont));
+        assert(le64_to_cpu(ont.t_atime) == 12345);
+
+        /* the xattr block comes and goes with the xattrs */
+        assert(numbfs_getxattr(&ni, NUMBFS_XATTR_INDEX_USER, "a", NULL, 0) == -ENODATA);
+        assert(!numbfs_setxattr(&ni, NUMBFS_XATTR_INDEX_USER, "a", "b", 1, 0));
+        assert(!numbfs_xattr_flush(&ni));
+        assert(ni.xattr_start != NUMBFS_HOLE);
+        assert(sbi.free_blocks == free_blocks - 2);
+
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(numbfs_getxattr(&ni, NUMBFS_XATTR_INDEX_USER, "a", NULL, 0) == 1);
+        assert(!numbfs_removexattr(&ni, NUMBFS_XATTR_INDEX_USER, "a"));
+        assert(!numbfs_xattr_flush(&ni));
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(ni.xattr_start == NUMBFS_HOLE && !ni.xattr_count);
+        assert(sbi.free_blocks == free_blocks - 1);
+        assert(!numbfs_get_timestamps(&ni, &ont));
+        assert(le64_to_cpu(ont.t_atime) == 12345);
+}
+
+static void test_xattr_share(void)
+{
+#define TEST_INODES     3
+        struct numbfs_inode_info ni[TEST_INODES];
+        int i, free_blocks, shared;
+
+        for (i = 0; i < TEST_INODES; i++) {
+                ni[i].nid = numbfs_empty_dir(&sbi, NUMBFS_ROOT_NID);
+                assert(ni[i].nid >= 0);
+                ni[i].sbi = &sbi;
+                assert(!numbfs_get_inode(&sbi, &ni[i]));
+        }
+
+        /* the same labels in different orders */
+        free_blocks = sbi.free_blocks;
+        for (i = 0; i < TEST_INODES; i++) {
+                if (i % 2) {
+                        assert(!numbfs_setxattr(&ni[i], NUMBFS_XATTR_INDEX_USER, "owner", "team", 4, 0));
+                        assert(!numbfs_setxattr(&ni[i], NUMBFS_XATTR_INDEX_TRUSTED, "label", "blue", 4, 0));
+                } else {
+                        assert(!numbfs_setxattr(&ni[i], NUMBFS_XATTR_INDEX_TRUSTED, "label", "blue", 4, 0));
+                        assert(!numbfs_setxattr(&ni[i], NUMBFS_XATTR_INDEX_USER, "owner", "team", 4, 0));
+                }
+                assert(!numbfs_xattr_flush(&ni[i]));
+        }
+        shared = ni[0].xattr_start;
+        for (i = 1; i < TEST_INODES; i++)
+                assert(ni[i].xattr_start == shared);
+        assert(sbi.free_blocks == free_blocks - 1);
+
+        /* copy on write */
+        assert(!numbfs_setxattr(&ni[1], NUMBFS_XATTR_INDEX_USER, "owner", "me", 2, 0));
+        assert(!numbfs_xattr_flush(&ni[1]));
+        assert(ni[1].xattr_start != shared);
+        assert(sbi.free_blocks == free_blocks - 2);
+        assert(numbfs_getxattr(&ni[0], NUMBFS_XATTR_INDEX_USER, "owner", NULL, 0) == 4);
+        assert(numbfs_getxattr(&ni[1], NUMBFS_XATTR_INDEX_USER, "owner", NULL, 0) == 2);
+        assert(!numbfs_xattr_flush(&ni[0]));
+        assert(!numbfs_xattr_flush(&ni[1]));
+
+        /* changed back, the block is shared again and the copy is freed */
+        assert(!numbfs_setxattr(&ni[1], NUMBFS_XATTR_INDEX_USER, "owner", "team", 4, 0));
+        assert(!numbfs_xattr_flush(&ni[1]));
+        assert(ni[1].xattr_start == shared);
+        assert(sbi.free_blocks == free_blocks - 1);
+
+        /* the shared block goes with its last user */
+        for (i = 0; i < TEST_INODES; i++) {
+                assert(!numbfs_get_inode(&sbi, &ni[i]));
+                assert(ni[i].xattr_count == 2);
+                assert(!numbfs_removexattr(&ni[i], NUMBFS_XATTR_INDEX_USER, "owner"));
+                assert(!numbfs_removexattr(&ni[i], NUMBFS_XATTR_INDEX_TRUSTED, "label"));
+                assert(!numbfs_xattr_flush(&ni[i]));
+                assert(ni[i].xattr_start == NUMBFS_HOLE);
+                assert(sbi.free_blocks == free_blocks - (i == TEST_INODES - 1 ? 0 : 1));
+        }
+#undef TEST_INODES
+}
+
+static void test_bitmap_weight(void)
+{
+        unsigned char map[1000];
+        long long expect;
+        int kernel, i, len;
+
+        srand(1);
+        for (i = 0; i < (int)sizeof(map); i++)
+                map[i] = rand();
+
+        for (kernel = 0; kernel < NUMBFS_WEIGHT_MAX; kernel++) {
+                if (!numbfs_bitmap_kernel_supported(kernel)) {
+                        assert(numbfs_bitmap_set_kernel(kernel) == -EOPNOTSUPP);
+                        continue;
+                }
+                assert(numbfs_bitmap_set_kernel(kernel) == kernel);
+                /* lengths not aligned to any vector width, and unaligned starts */
+                for (len = 0; len < (int)sizeof(map) - 3; len += 37) {
+                        expect = 0;
+                        for (i = 0; i < len; i++)
+                                expect += __builtin_popcount(map[i + 3]);
+                        assert(numbfs_bitmap_weight(map + 3, len) == expect);
+                }
+        }
+        memset(map, 0xff, sizeof(map));
+        assert(numbfs_bitmap_set_kernel(-1) >= NUMBFS_WEIGHT_GENERIC);
+        assert(numbfs_bitmap_weight(map, sizeof(map)) == sizeof(map) * BITS_PER_BYTE);
+}
+
+static void test_zero_blocks(void)
+{
+        char buf[BYTES_PER_BLOCK], zero[BYTES_PER_BLOCK];
+        int i, blk, blks[3];
+
+        assert(!numbfs_alloc_extent(&sbi, 3, &blk));
+        memset(buf, 0x5a, sizeof(buf));
+        memset(zero, 0, sizeof(zero));
+        for (i = 0; i < 3; i++)
+                assert(!numbfs_write_block(&sbi, buf, numbfs_data_blk(&sbi, blk) + i));
+
+        /* only the middle block is zeroed */
+        assert(!numbfs_zero_blocks(&sbi, numbfs_data_blk(&sbi, blk) + 1, 1));
+        assert(!numbfs_read_block(&sbi, buf, numbfs_data_blk(&sbi, blk)));
+        assert(buf[0] == 0x5a && buf[BYTES_PER_BLOCK - 1] == 0x5a);
+        assert(!numbfs_read_block(&sbi, buf, numbfs_data_blk(&sbi, blk) + 1));
+        assert(!memcmp(buf, zero, sizeof(buf)));
+        assert(!numbfs_read_block(&sbi, buf, numbfs_data_blk(&sbi, blk) + 2));
+        assert(buf[0] == 0x5a);
+
+        assert(!numbfs_zero_blocks(&sbi, numbfs_data_blk(&sbi, blk), 3));
+        for (i = 0; i < 3; i++) {
+                assert(!numbfs_read_block(&sbi, buf, numbfs_data_blk(&sbi, blk) + i));
+                assert(!memcmp(buf, zero, sizeof(buf)));
+                blks[i] = blk + i;
+        }
+        assert(!numbfs_free_blocks(&sbi, blks, 3));
+}
+
+static void test_sparse(void)
+{
+        char buf[BYTES_PER_BLOCK], zero[BYTES_PER_BLOCK];
+        int i, blk, blks[4];
+
+        assert(!numbfs_alloc_extent(&sbi, 4, &blk));
+        memset(buf, 0x5a, sizeof(buf));
+        memset(zero, 0, sizeof(zero));
+        for (i = 0; i < 4; i++)
+                assert(!numbfs_write_block(&sbi, buf, numbfs_data_blk(&sbi, blk) + i));
+
+        /* zero blocks become holes over the old content */
+        sbi.sparse = true;
+        assert(!numbfs_write_block(&sbi, zero, numbfs_data_blk(&sbi, blk)));
+        assert(!numbfs_zero_blocks(&sbi, numbfs_data_blk(&sbi, blk) + 2, 2));
+        sbi.sparse = false;
+
+        for (i = 0; i < 4; i++) {
+                assert(!numbfs_read_block(&sbi, buf, numbfs_data_blk(&sbi, blk) + i));
+                assert(!memcmp(buf, zero, sizeof(buf)) == (i != 1));
+                blks[i] = blk + i;
+        }
+        assert(!numbfs_free_blocks(&sbi, blks, 4));
+}
+
+static void test_lazy_itable(void)
+{
+        int last = sbi.bbitmap_start - sbi.inode_start - 1;
+        int nid = last * NUMBFS_NODES_PER_BLOCK;
+        struct numbfs_inode_info ni, dir, *pi;
+        struct numbfs_readdir_ctx ctx;
+        struct numbfs_dirent *de;
+        char buf[BYTES_PER_BLOCK];
+        int i;
+
+        /* the last inode table block was never written */
+        memset(buf, 0x5a, sizeof(buf));
+        assert(!numbfs_write_block(&sbi, buf, sbi.inode_start + last));
+        sbi.feature |= NUMBFS_FEATURE_LAZY_ITABLE;
+        sbi.itable_init = last;
+
+        ni.nid = nid + 1;
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(!ni.mode && !ni.size && !ni.nlink);
+        for (i = 0; i < NUMBFS_NUM_DATA_ENTRY; i++)
+                assert(ni.data[i] == NUMBFS_HOLE);
+
+        /* so does readdirplus, and it rejects inodes out of the table */
+        dir.sbi = &sbi;
+        dir.nid = numbfs_empty_dir(&sbi, NUMBFS_ROOT_NID);
+        assert(dir.nid >= 0);
+        assert(!numbfs_get_inode(&sbi, &dir));
+        assert(!numbfs_dir_add(&dir, "lazy", 4, nid + 1, DT_REG));
+        assert(!numbfs_opendir(&ctx, &dir, NUMBFS_READDIR_PLUS));
+        while (numbfs_readdir(&ctx, &de, &pi)) {
+                if (strcmp(de->name, "lazy"))
+                        continue;
+                assert(pi->nid == nid + 1 && !pi->mode && !pi->nlink);
+                assert(!memcmp(pi->data, ni.data, sizeof(ni.data)));
+        }
+        numbfs_closedir(&ctx);
+
+        assert(!numbfs_dir_add(&dir, "bad", 3, sbi.total_inodes, DT_REG));
+        assert(numbfs_opendir(&ctx, &dir, NUMBFS_READDIR_PLUS) == -EFSCORRUPTED);
+        assert(!numbfs_dir_remove(&dir, "bad", 3));
+        assert(!numbfs_dir_remove(&dir, "lazy", 4));
+
+        /* writing an inode initializes its block */
+        ni.mode = S_IFREG | 0644;
+        ni.nlink = 1;
+        assert(!numbfs_dump_inode(&ni));
+        assert(sbi.itable_init == last + 1);
+
+        ni.nid = nid;
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(!ni.mode && ni.data[0] == NUMBFS_HOLE);
+        ni.nid = nid + 1;
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(ni.mode == (S_IFREG | 0644) && ni.nlink == 1);
+
+        sbi.feature &= ~NUMBFS_FEATURE_LAZY_ITABLE;
+}
+
+static void test_stage(void)
+{
+        char buf[BYTES_PER_BLOCK], zero[BYTES_PER_BLOCK], run[3 * BYTES_PER_BLOCK];
+        int i, blk, blks[3];
+
+        assert(!numbfs_alloc_extent(&sbi, 3, &blk));
+        assert(!numbfs_zero_blocks(&sbi, numbfs_data_blk(&sbi, blk), 3));
+        memset(buf, 0x5a, sizeof(buf));
+        memset(zero, 0, sizeof(zero));
+
+        /* the staged writes are read back, but the device is untouched */
+        assert(!numbfs_stage_begin(&sbi));
+        assert(numbfs_stage_begin(&sbi) == -EBUSY);
+        for (i = 0; i < 3; i++)
+                assert(!numbfs_write_block(&sbi, buf, numbfs_data_blk(&sbi, blk) + i));
+        assert(!numbfs_zero_blocks(&sbi, numbfs_data_blk(&sbi, blk) + 1, 1));
+        assert(!numbfs_read_blocks(&sbi, run, numbfs_data_blk(&sbi, blk), 3));
+        assert(run[0] == 0x5a && run[3 * BYTES_PER_BLOCK - 1] == 0x5a);
+        assert(!memcmp(run + BYTES_PER_BLOCK, zero, sizeof(zero)));
+        assert(pread(sbi.fd, run, BYTES_PER_BLOCK,
+                     (off_t)numbfs_data_blk(&sbi, blk) * BYTES_PER_BLOCK) == BYTES_PER_BLOCK);
+        assert(!memcmp(run, zero, sizeof(zero)));
+
+        assert(!numbfs_stage_flush(&sbi));
+        for (i = 0; i < 3; i++) {
+                assert(pread(sbi.fd, run, BYTES_PER_BLOCK,
+                             (off_t)(numbfs_data_blk(&sbi, blk) + i) * BYTES_PER_BLOCK) ==
+                       BYTES_PER_BLOCK);
+                assert(!memcmp(run, i == 1 ? zero : buf, sizeof(buf)));
+                blks[i] = blk + i;
+        }
+        assert(!numbfs_free_blocks(&sbi, blks, 3));
+}
+
+static void test_populate(void)
+{
+        const char *root = "./numbfs_test_dir_xxx";
+        char path[256], data[3000], buf[3000];
+        struct numbfs_inode_info ni;
+        int i, fd, nid, type;
+
+        /* a host tree: f, d/g (two blocks and a bit), d/h linked to f */
+        for (i = 0; i < (int)sizeof(data); i++)
+                data[i] = i * 7;
+        assert(!mkdir(root, 0755));
+        sprintf(path, "%s/d", root);
+        assert(!mkdir(path, 0700));
+        sprintf(path, "%s/f", root);
+        fd = open(path, O_WRONLY | O_CREAT, 0600);
+        assert(fd >= 0 && write(fd, "numbfs", 6) == 6);
+        close(fd);
+        sprintf(buf, "%s/d/h", root);
+        assert(!link(path, buf));
+        sprintf(path, "%s/d/g", root);
+        fd = open(path, O_WRONLY | O_CREAT, 0644);
+        assert(fd >= 0 && write(fd, data, 1100) == 1100);
+        close(fd);
+
+        assert(!numbfs_populate_dir(&sbi, root, 2));
+        numbfs_drop_caches(&sbi);
+
+        assert(!numbfs_lookup_path(&sbi, "/d/g", &nid));
+        ni.nid = nid;
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(S_ISREG(ni.mode) && (ni.mode & 0777) == 0644 && ni.size == 1100);
+        assert(ni.data[1] == ni.data[0] + 1 && ni.data[2] == ni.data[0] + 2);
+        assert(!numbfs_pread_inode_range(&ni, buf, 0, ni.size));
+        assert(!memcmp(buf, data, ni.size));
+
+        assert(!numbfs_lookup_path(&sbi, "/d", &nid));
+        ni.nid = nid;
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(S_ISDIR(ni.mode) && (ni.mode & 0777) == 0700 && ni.nlink == 2);
+        assert(!numbfs_dir_lookup(&ni, "h", 1, &nid, &type));
+        assert(type == DT_REG);
+
+        /* the hard link shares the inode */
+        ni.nid = nid;
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(ni.nlink == 2 && ni.size == 6);
+        assert(!numbfs_pread_inode_range(&ni, buf, 0, ni.size));
+        assert(!memcmp(buf, "numbfs", 6));
+        assert(!numbfs_lookup_path(&sbi, "/f", &i));
+        assert(i == nid);
+
+        sprintf(path, "%s/d/g", root);
+        assert(!unlink(path));
+        sprintf(path, "%s/d/h", root);
+        assert(!unlink(path));
+        sprintf(path, "%s/d", root);
+        assert(!rmdir(path));
+        sprintf(path, "%s/f", root);
+        assert(!unlink(path));
+        assert(!rmdir(root));
+}
+
+static void test_cpio_entry(int fd, const char *name, int ino, int mode,
+                            int nlink, const char *data, int size)
+{
+        char hdr[111], pad[4] = {0};
+        int namesize = strlen(name) + 1;
+
+        sprintf(hdr, "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+                ino, mode, 0, 0, nlink, 1000, size, 0, 0, 0, 0, namesize, 0);
+        assert(write(fd, hdr, 110) == 110);
+        assert(write(fd, name, namesize) == namesize);
+        assert(write(fd, pad, round_up(110 + namesize, 4) - 110 - namesize) >= 0);
+        assert(write(fd, data, size) == size);
+        assert(write(fd, pad, round_up(size, 4) - size) >= 0);
+}
+
+static void test_tar_checksum(char *hdr)
+{
+        int i, sum = 0;
+
+        memset(hdr + 148, ' ', 8);
+        for (i = 0; i < BYTES_PER_BLOCK; i++)
+                sum += (unsigned char)hdr[i];
+        sprintf(hdr + 148, "%06o", sum);
+}
+
+static void test_tar_entry(int fd, const char *name, char type,
+                           const char *data, int size)
+{
+        char hdr[BYTES_PER_BLOCK], pad[BYTES_PER_BLOCK] = {0};
+
+        memset(hdr, 0, sizeof(hdr));
+        strcpy(hdr, name);
+        sprintf(hdr + 100, "%07o", type == '5' ? 0750 : 0640);
+        sprintf(hdr + 108, "%07o", 7);
+        sprintf(hdr + 116, "%07o", 8);
+        sprintf(hdr + 124, "%011o", type == '0' || type == 'x' ? size : 0);
+        sprintf(hdr + 136, "%011o", 2000);
+        hdr[156] = type;
+        if (type == '1')
+                strcpy(hdr + 157, data);
+        memcpy(hdr + 257, "ustar", 6);
+        memcpy(hdr + 263, "00", 2);
+        test_tar_checksum(hdr);
+
+        assert(write(fd, hdr, sizeof(hdr)) == sizeof(hdr));
+        if ((type != '0' && type != 'x') || !data)
+                return;
+        assert(write(fd, data, size) == size);
+        assert(write(fd, pad, round_up(size, BYTES_PER_BLOCK) - size) >= 0);
+}
+
+static void test_archive(void)
+{
+        const char *filename = "./numbfs_test_archive_xxx";
+        char zero[BYTES_PER_BLOCK * 2] = {0}, data[2000], buf[2000];
+        struct numbfs_inode_info ni;
+        int i, fd, nid;
+
+        for (i = 0; i < (int)sizeof(data); i++)
+                data[i] = i * 13;
+
+        /* cpio: missing parents, a symlink, and the data with the last link */
+        fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0);
+        test_cpio_entry(fd, "./x/y/one", 42, S_IFREG | 0600, 2, NULL, 0);
+        test_cpio_entry(fd, "x/two", 42, S_IFREG | 0600, 2, data, 1500);
+        test_cpio_entry(fd, "x/sym", 43, S_IFLNK | 0777, 1, "y/one", 5);
+        test_cpio_entry(fd, "TRAILER!!!", 0, 0, 1, NULL, 0);
+        assert(lseek(fd, 0, SEEK_SET) == 0);
+        assert(!numbfs_populate_archive(&sbi, fd));
+        close(fd);
+        numbfs_drop_caches(&sbi);
+
+        assert(!numbfs_lookup_path(&sbi, "/x/y/one", &nid));
+        assert(!numbfs_lookup_path(&sbi, "/x/two", &i));
+        assert(i == nid);
+        ni.nid = nid;
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(S_ISREG(ni.mode) && ni.nlink == 2 && ni.size == 1500);
+        assert(!numbfs_pread_inode_range(&ni, buf, 0, ni.size));
+        assert(!memcmp(buf, data, ni.size));
+
+        assert(!numbfs_lookup_path(&sbi, "/x/sym", &nid));
+        ni.nid = nid;
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(S_ISLNK(ni.mode) && ni.size == 5);
+        assert(!numbfs_pread_inode_range(&ni, buf, 0, ni.size));
+        assert(!memcmp(buf, "y/one", 5));
+
+        assert(!numbfs_lookup_path(&sbi, "/x", &nid));
+        ni.nid = nid;
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(S_ISDIR(ni.mode) && (ni.mode & 0777) == 0755 && ni.nlink == 3);
+
+        /* tar: merge into the existing directory, a hard link by name */
+        fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0);
+        test_tar_entry(fd, "x/", '5', NULL, 0);
+        test_tar_entry(fd, "x/t", '0', data, 600);
+        test_tar_entry(fd, "x/y/u", '1', "x/t", 0);
+        assert(write(fd, zero, sizeof(zero)) == sizeof(zero));
+        assert(lseek(fd, 0, SEEK_SET) == 0);
+        assert(!numbfs_populate_archive(&sbi, fd));
+        close(fd);
+        numbfs_drop_caches(&sbi);
+
+        assert(!numbfs_lookup_path(&sbi, "/x", &nid));
+        ni.nid = nid;
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert((ni.mode & 0777) == 0750 && ni.uid == 7 && ni.gid == 8);
+
+        assert(!numbfs_lookup_path(&sbi, "/x/y/u", &nid));
+        ni.nid = nid;
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(S_ISREG(ni.mode) && ni.nlink == 2 && ni.size == 600);
+        assert(ni.data[1] == ni.data[0] + 1);
+        assert(!numbfs_pread_inode_range(&ni, buf, 0, ni.size));
+        assert(!memcmp(buf, data, ni.size));
+
+        /* tar: a pax header renames the next entry */
+        fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0);
+        test_tar_entry(fd, "pax", 'x', "14 path=x/pax\n", 14);
+        test_tar_entry(fd, "ignored", '0', data, 10);
+        assert(write(fd, zero, sizeof(zero)) == sizeof(zero));
+        assert(lseek(fd, 0, SEEK_SET) == 0);
+        assert(!numbfs_populate_archive(&sbi, fd));
+        close(fd);
+        numbfs_drop_caches(&sbi);
+        assert(!numbfs_lookup_path(&sbi, "/x/pax", &nid));
+        assert(numbfs_lookup_path(&sbi, "/ignored", &nid) == -ENOENT);
+
+        /* tar: a pax record too short to hold "<key>=\n" */
+        fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0);
+        test_tar_entry(fd, "pax", 'x', "2 ", 2);
+        test_tar_entry(fd, "bad", '0', data, 10);
+        assert(write(fd, zero, sizeof(zero)) == sizeof(zero));
+        assert(lseek(fd, 0, SEEK_SET) == 0);
+        assert(numbfs_populate_archive(&sbi, fd) == -EINVAL);
+        close(fd);
+
+        /* tar: base-256 sizes that are negative or overflow */
+        for (i = 0; i < 2; i++) {
+                fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+                assert(fd >= 0);
+                test_tar_entry(fd, "././@LongLink", 'L', NULL, 0);
+                assert(write(fd, zero, sizeof(zero)) == sizeof(zero));
+                assert(pread(fd, buf, BYTES_PER_BLOCK, 0) == BYTES_PER_BLOCK);
+                memset(buf + 124, 0xff, 12);
+                if (!i)
+                        buf[124] = (char)0x80;
+                test_tar_checksum(buf);
+                assert(pwrite(fd, buf, BYTES_PER_BLOCK, 0) == BYTES_PER_BLOCK);
+                assert(lseek(fd, 0, SEEK_SET) == 0);
+                assert(numbfs_populate_archive(&sbi, fd) == -EINVAL);
+                close(fd);
+        }
+
+        /* tar: an oversized pax header is refused before it is read */
+        fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0);
+        test_tar_entry(fd, "pax", 'x', NULL, 1 << 30);
+        assert(write(fd, zero, sizeof(zero)) == sizeof(zero));
+        assert(lseek(fd, 0, SEEK_SET) == 0);
+        assert(numbfs_populate_archive(&sbi, fd) == -EINVAL);
+        close(fd);
+        numbfs_drop_caches(&sbi);
+
+        assert(remove(filename) == 0);
+}
+
+/* run @argv with the standard output going to @out, return the exit status */
+static int test_run(const char *out, const char **argv)
+{
+        int fd, status;
+        pid_t pid;
+
+        pid = fork();
+        assert(pid >= 0);
+        if (!pid) {
+                fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0)
+                        _exit(127);
+                execv(argv[0], (char**)argv);
+                _exit(127);
+        }
+        assert(waitpid(pid, &status, 0) == pid);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* format a new @size bytes image at @path, @opts ends with NULL */
+static void test_mkfs(const char *path, off_t size, const char **opts)
+{
+        const char *argv[16] = { mkfs_tool };
+        int fd, i;
+
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0 && !ftruncate(fd, size));
+        close(fd);
+
+        for (i = 0; opts && opts[i]; i++)
+                argv[i + 1] = opts[i];
+        argv[i + 1] = path;
+        assert(!test_run("/dev/null", argv));
+}
+
+static void test_open_image(const char *path, struct numbfs_superblock_info *isbi)
+{
+        int fd = open(path, O_RDWR);
+
+        assert(fd >= 0);
+        memset(isbi, 0, sizeof(*isbi));
+        assert(!numbfs_get_superblock(isbi, fd));
+}
+
+static void test_close_image(struct numbfs_superblock_info *isbi)
+{
+        numbfs_drop_caches(isbi);
+        close(isbi->fd);
+}
+
+static void test_mkfs_jobs(void)
+{
+        const char *root = "./numbfs_test_jobs_xxx";
+        const char *images[2] = { "./numbfs_test_jobs_1", "./numbfs_test_jobs_4" };
+        const char *opts[][4] = {
+                { "--num_inodes=65536", "--root-dir=./numbfs_test_jobs_xxx", "--jobs=1", NULL },
+                { "--num_inodes=65536", "--root-dir=./numbfs_test_jobs_xxx", "--jobs=4", NULL },
+        };
+        struct numbfs_superblock_info isbi[2];
+        struct numbfs_check_result res;
+        char path[256], buf[2][BYTES_PER_BLOCK];
+        int i, fd;
+
+        assert(!mkdir(root, 0755));
+        sprintf(path, "%s/d", root);
+        assert(!mkdir(path, 0755));
+        sprintf(path, "%s/d/f", root);
+        fd = open(path, O_WRONLY | O_CREAT, 0644);
+        memset(buf[0], 0x5a, sizeof(buf[0]));
+        assert(fd >= 0 && write(fd, buf[0], sizeof(buf[0])) == sizeof(buf[0]));
+        close(fd);
+
+        /* the inode table takes a whole region of the layout writer */
+        for (i = 0; i < 2; i++) {
+                test_mkfs(images[i], 32 << 20, opts[i]);
+                test_open_image(images[i], &isbi[i]);
+                assert(!numbfs_check(&isbi[i], NULL, &res));
+                assert(!res.nr_problems && res.files == 1 && res.dirs == 3);
+                numbfs_check_release(&res);
+        }
+
+        /* the same metadata, only the timestamps in the data zone differ */
+        assert(isbi[0].data_start == isbi[1].data_start);
+        for (i = 0; i < isbi[0].data_start; i++) {
+                assert(!numbfs_read_block(&isbi[0], buf[0], i));
+                assert(!numbfs_read_block(&isbi[1], buf[1], i));
+                assert(!memcmp(buf[0], buf[1], BYTES_PER_BLOCK));
+        }
+
+        for (i = 0; i < 2; i++) {
+                test_close_image(&isbi[i]);
+                assert(!remove(images[i]));
+        }
+        sprintf(path, "%s/d/f", root);
+        assert(!unlink(path));
+        sprintf(path, "%s/d", root);
+        assert(!rmdir(path));
+        assert(!rmdir(root));
+}
+
+static bool test_check_find(struct numbfs_check_result *res, int type,
+                            int nid, int blk, long long expect, long long found)
+{
+        struct numbfs_check_problem *p;
+        int i;
+
+        for (i = 0; i < res->nr_problems; i++) {
+                p = &res->problems[i];
+                if (p->type == type && p->nid == nid && p->blk == blk &&
+                    p->expect == expect && p->found == found)
+                        return true;
+        }
+        return false;
+}
+
+static void test_check_image(struct numbfs_superblock_info *isbi)
+{
+        struct numbfs_check_cfg cfg = {
+                .jobs = 4,
+        };
+        struct numbfs_check_result res, jres;
+        struct numbfs_inode_info root, ni;
+        char buf[BYTES_PER_BLOCK];
+        int i, nid, blk, bmap;
+
+        /* a freshly made image is clean */
+        assert(!numbfs_check(isbi, NULL, &res));
+        assert(!res.nr_problems && res.dirs == 2 && !res.files);
+        numbfs_check_release(&res);
+
+        /* a file with one block in the root directory */
+        root.nid = NUMBFS_ROOT_NID;
+        assert(!numbfs_get_inode(isbi, &root));
+        nid = numbfs_empty_inode(isbi, S_IFREG | 0644);
+        assert(nid > 0);
+        assert(!numbfs_dir_add(&root, "chk", 3, nid, DT_REG));
+        ni.nid = nid;
+        assert(!numbfs_get_inode(isbi, &ni));
+        memset(buf, 0x5a, sizeof(buf));
+        assert(!numbfs_pwrite_inode_range(&ni, buf, 0, sizeof(buf)));
+        assert(!numbfs_get_inode(isbi, &ni));
+        blk = ni.data[0];
+
+        assert(!numbfs_check(isbi, NULL, &res));
+        assert(!res.nr_problems && res.files == 1);
+        numbfs_check_release(&res);
+
+        /* a bad link count, a leaked block and a dangling dirent */
+        ni.nlink = 3;
+        assert(!numbfs_dump_inode(&ni));
+        bmap = numbfs_bmap_blk(isbi->bbitmap_start, blk);
+        assert(!numbfs_read_block(isbi, buf, bmap));
+        buf[numbfs_bmap_byte(blk)] &= ~(1 << numbfs_bmap_bit(blk));
+        assert(!numbfs_write_block(isbi, buf, bmap));
+        isbi->free_blocks++;
+        assert(!numbfs_dir_add(&root, "dangling", 8, isbi->total_inodes - 1, DT_REG));
+
+        assert(!numbfs_check(isbi, NULL, &res));
+        assert(res.nr_problems == 3);
+        assert(test_check_find(&res, NUMBFS_CHECK_NLINK, nid, -1, 1, 3));
+        assert(test_check_find(&res, NUMBFS_CHECK_BBITMAP, -1, blk, 1, 0));
+        for (i = 0; i < res.nr_problems; i++)
+                if (res.problems[i].type == NUMBFS_CHECK_DIRENT)
+                        break;
+        assert(i < res.nr_problems && res.problems[i].nid == NUMBFS_ROOT_NID &&
+               res.problems[i].found == isbi->total_inodes - 1);
+
+        /* the same problems in the same order with several jobs */
+        assert(!numbfs_check(isbi, &cfg, &jres));
+        assert(jres.nr_problems == res.nr_problems && jres.blocks == res.blocks &&
+               jres.files == res.files && jres.dirs == res.dirs);
+        for (i = 0; i < res.nr_problems; i++)
+                assert(jres.problems[i].type == res.problems[i].type &&
+                       jres.problems[i].nid == res.problems[i].nid &&
+                       jres.problems[i].blk == res.problems[i].blk &&
+                       jres.problems[i].expect == res.problems[i].expect &&
+                       jres.problems[i].found == res.problems[i].found);
+        numbfs_check_release(&jres);
+
+        /* and with the data zone checked in windows of the smallest budget */
+        cfg.max_mem = numbfs_check_min_mem(isbi);
+        assert(!numbfs_check(isbi, &cfg, &jres));
+        assert(jres.passes == DIV_ROUND_UP(isbi->data_blocks, (int)NUMBFS_BLOCKS_PER_BLOCK));
+        assert(jres.passes > 1);
+        assert(jres.nr_problems == res.nr_problems && jres.blocks == res.blocks);
+        for (i = 0; i < res.nr_problems; i++)
+                assert(jres.problems[i].type == res.problems[i].type &&
+                       jres.problems[i].nid == res.problems[i].nid &&
+                       jres.problems[i].blk == res.problems[i].blk &&
+                       jres.problems[i].expect == res.problems[i].expect &&
+                       jres.problems[i].found == res.problems[i].found);
+        numbfs_check_release(&jres);
+        cfg.max_mem--;
+        assert(numbfs_check(isbi, &cfg, &jres) == -ENOMEM);
+        numbfs_check_release(&res);
+
+        /* clean again once undone */
+        assert(!numbfs_dir_remove(&root, "dangling", 8));
+        buf[numbfs_bmap_byte(blk)] |= 1 << numbfs_bmap_bit(blk);
+        assert(!numbfs_write_block(isbi, buf, bmap));
+        isbi->free_blocks--;
+        ni.nlink = 1;
+        assert(!numbfs_dump_inode(&ni));
+
+        assert(!numbfs_check(isbi, NULL, &res));
+        assert(!res.nr_problems);
+        numbfs_check_release(&res);
+}
+
+static void test_check(void)
+{
+        const char *image = "./numbfs_test_check_xxx";
+        const char *opts[][4] = {
+                { NULL },
+                { "--dir-index", "--ts-table", "--lazy-itable", NULL },
+        };
+        struct numbfs_check_cfg cfg = {
+                .jobs = 4,
+        };
+        struct numbfs_superblock_info isbi;
+        struct numbfs_check_result res;
+        struct numbfs_inode_info root, ni[2];
+        struct numbfs_xattr_header *xh;
+        char buf[BYTES_PER_BLOCK];
+        int i, blk;
+
+        for (i = 0; i < (int)ARRAY_SIZE(opts); i++) {
+                test_mkfs(image, FILE_SIZE, opts[i]);
+                test_open_image(image, &isbi);
+                test_check_image(&isbi);
+                test_close_image(&isbi);
+        }
+
+        /* an xattr block shared by two files counts its owners in its header */
+        test_mkfs(image, FILE_SIZE, opts[1]);
+        test_open_image(image, &isbi);
+        root.nid = NUMBFS_ROOT_NID;
+        assert(!numbfs_get_inode(&isbi, &root));
+        for (i = 0; i < 2; i++) {
+                ni[i].nid = numbfs_empty_inode(&isbi, S_IFREG | 0644);
+                assert(ni[i].nid > 0);
+                assert(!numbfs_dir_add(&root, i ? "b" : "a", 1, ni[i].nid, DT_REG));
+                assert(!numbfs_get_inode(&isbi, &ni[i]));
+                assert(!numbfs_setxattr(&ni[i], NUMBFS_XATTR_INDEX_USER, "k", "v", 1, 0));
+                assert(!numbfs_xattr_flush(&ni[i]));
+        }
+        assert(ni[0].xattr_start == ni[1].xattr_start);
+        assert(!numbfs_put_superblock(&isbi));
+        assert(!numbfs_check(&isbi, NULL, &res));
+        assert(!res.nr_problems);
+        numbfs_check_release(&res);
+        assert(!numbfs_check(&isbi, &cfg, &res));
+        assert(!res.nr_problems);
+        numbfs_check_release(&res);
+
+        /* a valid header recording one owner is rewritten by the repair */
+        blk = numbfs_data_blk(&isbi, ni[0].xattr_start);
+        assert(!numbfs_read_block(&isbi, buf, blk));
+        xh = (struct numbfs_xattr_header*)buf;
+        xh->h_refcount = cpu_to_le32(1);
+        assert(!numbfs_write_block(&isbi, buf, blk));
+        cfg.repair = true;
+        assert(!numbfs_check(&isbi, &cfg, &res));
+        assert(res.nr_problems == 1 && res.nr_fixed == 1);
+        assert(test_check_find(&res, NUMBFS_CHECK_REFCOUNT, -1, ni[0].xattr_start, 2, 1));
+        numbfs_check_release(&res);
+        assert(!numbfs_check(&isbi, NULL, &res));
+        assert(!res.nr_problems);
+        numbfs_check_release(&res);
+
+        /* one without the magic can't be trusted */
+        assert(!numbfs_read_block(&isbi, buf, blk));
+        xh->h_magic = 0;
+        assert(!numbfs_write_block(&isbi, buf, blk));
+        assert(!numbfs_check(&isbi, &cfg, &res));
+        assert(res.nr_problems == 1 && !res.nr_fixed);
+        assert(test_check_find(&res, NUMBFS_CHECK_REFCOUNT, -1, ni[0].xattr_start, 2, -1));
+        numbfs_check_release(&res);
+
+        test_close_image(&isbi);
+        assert(!remove(image));
+}
+
+static void test_check_repair(void)
+{
+        struct numbfs_check_cfg cfg = {
+                .jobs = 2,
+                .repair = true,
+                .dry_run = true,
+        };
+        struct numbfs_check_result res;
+        struct numbfs_inode_info root, ni;
+        char buf[BYTES_PER_BLOCK];
+        int i, nid, type, blk, bmap, before, fixed, diffs;
+
+        root.nid = NUMBFS_ROOT_NID;
+        assert(!numbfs_get_inode(&sbi, &root));
+        nid = numbfs_empty_inode(&sbi, S_IFREG | 0644);
+        assert(nid > 0);
+        assert(!numbfs_dir_add(&root, "fix", 3, nid, DT_REG));
+        ni.nid = nid;
+        assert(!numbfs_get_inode(&sbi, &ni));
+        memset(buf, 0x5a, sizeof(buf));
+        assert(!numbfs_pwrite_inode_range(&ni, buf, 0, 100));
+        assert(!numbfs_get_inode(&sbi, &ni));
+        blk = ni.data[0];
+
+        /* a bad link count, a leaked block and a dangling dirent */
+        ni.nlink = 5;
+        assert(!numbfs_dump_inode(&ni));
+        bmap = numbfs_bmap_blk(sbi.bbitmap_start, blk);
+        assert(!numbfs_read_block(&sbi, buf, bmap));
+        buf[numbfs_bmap_byte(blk)] &= ~(1 << numbfs_bmap_bit(blk));
+        assert(!numbfs_write_block(&sbi, buf, bmap));
+        assert(!numbfs_dir_add(&root, "dangling", 8, sbi.total_inodes - 1, DT_REG));
+
+        /* a dry run changes nothing */
+        assert(!numbfs_check(&sbi, &cfg, &res));
+        before = res.nr_problems;
+        assert(res.nr_fixed > 0 && res.nr_diffs > 0);
+        assert(test_check_find(&res, NUMBFS_CHECK_NLINK, nid, -1, 1, 5));
+        for (i = 0; i < res.nr_problems; i++)
+                if (res.problems[i].type == NUMBFS_CHECK_NLINK)
+                        assert(res.problems[i].fixed);
+        numbfs_check_release(&res);
+        assert(!numbfs_check(&sbi, NULL, &res));
+        assert(res.nr_problems == before);
+        numbfs_check_release(&res);
+
+        /* the same changes when fixed window by window */
+        cfg.max_mem = numbfs_check_min_mem(&sbi);
+        assert(!numbfs_check(&sbi, &cfg, &res));
+        assert(res.passes > 1 && res.nr_problems == before);
+        fixed = res.nr_fixed;
+        diffs = res.nr_diffs;
+        numbfs_check_release(&res);
+        cfg.max_mem = 0;
+        assert(!numbfs_check(&sbi, &cfg, &res));
+        assert(res.nr_fixed == fixed && res.nr_diffs == diffs);
+        numbfs_check_release(&res);
+
+        /*
+         * only the problems the repair can't fix are left, the orphans stay
+         * as this image has no lost+found
+         */
+        cfg.max_mem = numbfs_check_min_mem(&sbi);
+        cfg.dry_run = false;
+        assert(!numbfs_check(&sbi, &cfg, &res));
+        before = res.nr_problems - res.nr_fixed;
+        numbfs_check_release(&res);
+        assert(!numbfs_check(&sbi, NULL, &res));
+        assert(res.nr_problems <= before);
+        for (i = 0; i < res.nr_problems; i++)
+                assert(res.problems[i].type != NUMBFS_CHECK_NLINK &&
+                       res.problems[i].type != NUMBFS_CHECK_DIRENT &&
+                       res.problems[i].type != NUMBFS_CHECK_BBITMAP &&
+                       res.problems[i].type != NUMBFS_CHECK_FREE_INODES &&
+                       res.problems[i].type != NUMBFS_CHECK_FREE_BLOCKS);
+        numbfs_check_release(&res);
+
+        assert(!numbfs_get_inode(&sbi, &ni));
+        assert(ni.nlink == 1 && ni.data[0] == blk);
+        assert(!numbfs_read_block(&sbi, buf, bmap));
+        assert(buf[numbfs_bmap_byte(blk)] & (1 << numbfs_bmap_bit(blk)));
+        assert(!numbfs_get_inode(&sbi, &root));
+        assert(numbfs_dir_lookup(&root, "dangling", 8, &i, &type) == -ENOENT);
+        assert(!numbfs_dir_lookup(&root, "fix", 3, &i, &type) && i == nid);
+}
+
+static void test_check_refcount(void)
+{
+        const char *image = "./numbfs_test_refcount_xxx";
+        const char *argv[] = { fsck_tool, "--repair", image, NULL };
+        struct numbfs_check_cfg cfg = {
+                .repair = true,
+        };
+        struct numbfs_check_result res;
+        struct numbfs_superblock_info isbi;
+        struct numbfs_inode_info root, ni[2];
+        char buf[BYTES_PER_BLOCK];
+        int i, blk;
+
+        test_mkfs(image, FILE_SIZE, NULL);
+        test_open_image(image, &isbi);
+
+        /* two files cross-linked to the block of the first one */
+        root.nid = NUMBFS_ROOT_NID;
+        assert(!numbfs_get_inode(&isbi, &root));
+        memset(buf, 0x5a, sizeof(buf));
+        for (i = 0; i < 2; i++) {
+                ni[i].nid = numbfs_empty_inode(&isbi, S_IFREG | 0644);
+                assert(ni[i].nid > 0);
+                assert(!numbfs_dir_add(&root, i ? "b" : "a", 1, ni[i].nid, DT_REG));
+                assert(!numbfs_get_inode(&isbi, &ni[i]));
+                assert(!numbfs_pwrite_inode_range(&ni[i], buf, 0, sizeof(buf)));
+        }
+        blk = ni[1].data[0];
+        ni[1].data[0] = ni[0].data[0];
+        assert(!numbfs_dump_inode(&ni[1]));
+        assert(!numbfs_free_block(&isbi, blk));
+        assert(!numbfs_put_superblock(&isbi));
+
+        /* nothing can count the owners without the refcount table */
+        assert(!numbfs_check(&isbi, &cfg, &res));
+        assert(res.nr_problems == 1 && !res.nr_fixed);
+        assert(test_check_find(&res, NUMBFS_CHECK_REFCOUNT, -1, ni[0].data[0], 2, 1));
+        numbfs_check_release(&res);
+        assert(test_run("/dev/null", argv));
+
+        /* with it, the repair records both owners */
+        assert(!numbfs_enable_refcount(&isbi));
+        assert(!numbfs_put_superblock(&isbi));
+        assert(!numbfs_check(&isbi, &cfg, &res));
+        assert(res.nr_problems == 1 && res.nr_fixed == 1);
+        numbfs_check_release(&res);
+        assert(!numbfs_check(&isbi, NULL, &res));
+        assert(!res.nr_problems);
+        numbfs_check_release(&res);
+        assert(numbfs_get_refcount(&isbi, ni[0].data[0]) == 2);
+        assert(!test_run("/dev/null", argv));
+        test_close_image(&isbi);
+
+        /* a zeroed orphan claiming the block of a file, without the table */
+        test_mkfs(image, FILE_SIZE, NULL);
+        test_open_image(image, &isbi);
+        root.nid = NUMBFS_ROOT_NID;
+        assert(!numbfs_get_inode(&isbi, &root));
+        ni[0].nid = numbfs_empty_inode(&isbi, S_IFREG | 0644);
+        assert(ni[0].nid > 0 && !numbfs_dir_add(&root, "a", 1, ni[0].nid, DT_REG));
+        assert(!numbfs_get_inode(&isbi, &ni[0]));
+        assert(!numbfs_pwrite_inode_range(&ni[0], buf, 0, sizeof(buf)));
+        ni[1].nid = numbfs_empty_inode(&isbi, S_IFREG | 0644);
+        assert(ni[1].nid > 0);
+        assert(!numbfs_get_inode(&isbi, &ni[1]));
+        ni[1].mode = 0;
+        ni[1].size = 0;
+        ni[1].data[0] = ni[0].data[0];
+        assert(!numbfs_dump_inode(&ni[1]));
+        assert(!numbfs_put_superblock(&isbi));
+
+        /* dropping it leaves the block to its owner, all is fixed */
+        assert(!numbfs_check(&isbi, NULL, &res));
+        assert(test_check_find(&res, NUMBFS_CHECK_REFCOUNT, -1, ni[0].data[0], 2, 1));
+        numbfs_check_release(&res);
+        test_close_image(&isbi);
+        assert(!test_run("/dev/null", argv));
+        test_open_image(image, &isbi);
+        assert(!numbfs_check(&isbi, NULL, &res));
+        assert(!res.nr_problems);
+        numbfs_check_release(&res);
+        assert(!numbfs_get_inode(&isbi, &ni[0]));
+        assert(!numbfs_pread_inode_range(&ni[0], buf, 0, sizeof(buf)));
+        for (i = 0; i < (int)sizeof(buf); i++)
+                assert(buf[i] == 0x5a);
+
+        test_close_image(&isbi);
+        assert(!remove(image));
+}
+
+static void test_check_orphans(void)
+{
+        const char *image = "./numbfs_test_orphans_xxx";
+        const char *opts[][2] = {
+                { NULL },
+                { "--dir-index", NULL },
+        };
+        struct numbfs_check_cfg cfg = {
+                .repair = true,
+        };
+        struct numbfs_check_result res;
+        struct numbfs_superblock_info isbi;
+        struct numbfs_inode_info root, dir, ni;
+        char buf[BYTES_PER_BLOCK], path[64];
+        int i, k, type, lf, d, s, f, g, z;
+
+        memset(buf, 0x5a, sizeof(buf));
+        for (k = 0; k < (int)ARRAY_SIZE(opts); k++) {
+                test_mkfs(image, FILE_SIZE, opts[k]);
+                test_open_image(image, &isbi);
+                assert(!numbfs_lookup_path(&isbi, "/lost+found", &lf));
+
+                /* a subtree cut from the root: /d/s and /d/f */
+                root.nid = NUMBFS_ROOT_NID;
+                assert(!numbfs_get_inode(&isbi, &root));
+                d = numbfs_empty_dir(&isbi, NUMBFS_ROOT_NID);
+                assert(d > 0 && !numbfs_dir_add(&root, "d", 1, d, DT_DIR));
+                root.nlink++;
+                assert(!numbfs_dump_inode(&root));
+                dir.nid = d;
+                assert(!numbfs_get_inode(&isbi, &dir));
+                s = numbfs_empty_dir(&isbi, d);
+                assert(s > 0 && !numbfs_dir_add(&dir, "s", 1, s, DT_DIR));
+                dir.nlink++;
+                assert(!numbfs_dump_inode(&dir));
+                f = numbfs_empty_inode(&isbi, S_IFREG | 0644);
+                assert(f > 0 && !numbfs_dir_add(&dir, "f", 1, f, DT_REG));
+                ni.nid = f;
+                assert(!numbfs_get_inode(&isbi, &ni));
+                assert(!numbfs_pwrite_inode_range(&ni, buf, 0, sizeof(buf)));
+                assert(!numbfs_put_superblock(&isbi));
+                assert(!numbfs_check(&isbi, NULL, &res));
+                assert(!res.nr_problems);
+                numbfs_check_release(&res);
+
+                /* a file with two links and no dirent, and a zeroed inode */
+                g = numbfs_empty_inode(&isbi, S_IFREG | 0644);
+                assert(g > 0);
+                ni.nid = g;
+                assert(!numbfs_get_inode(&isbi, &ni));
+                assert(!numbfs_pwrite_inode_range(&ni, buf, 0, 100));
+                ni.nlink = 2;
+                assert(!numbfs_dump_inode(&ni));
+                z = numbfs_empty_inode(&isbi, S_IFREG | 0644);
+                assert(z > 0);
+                ni.nid = z;
+                assert(!numbfs_get_inode(&isbi, &ni));
+                assert(!numbfs_pwrite_inode_range(&ni, buf, 0, 100));
+                ni.mode = 0;
+                assert(!numbfs_dump_inode(&ni));
+                assert(!numbfs_put_superblock(&isbi));
+
+                /* only the top of the lost subtree is an orphan */
+                assert(!numbfs_dir_remove(&root, "d", 1));
+                root.nlink--;
+                assert(!numbfs_dump_inode(&root));
+                assert(!numbfs_check(&isbi, NULL, &res));
+                assert(test_check_find(&res, NUMBFS_CHECK_ORPHAN, d, -1, 0, 0));
+                for (i = 0; i < res.nr_problems; i++)
+                        assert(res.problems[i].type != NUMBFS_CHECK_DOT &&
+                               res.problems[i].nid != s && res.problems[i].nid != f);
+                numbfs_check_release(&res);
+
+                /* the zeroed inode is freed, the others go to lost+found */
+                assert(!numbfs_check(&isbi, &cfg, &res));
+                assert(test_check_find(&res, NUMBFS_CHECK_ORPHAN, d, -1, 0, 0));
+                assert(test_check_find(&res, NUMBFS_CHECK_ORPHAN, g, -1, 0, 0));
+                assert(test_check_find(&res, NUMBFS_CHECK_ORPHAN, z, -1, 0, 0));
+                for (i = 0; i < res.nr_problems; i++)
+                        assert(res.problems[i].type == NUMBFS_CHECK_MODE ||
+                               res.problems[i].fixed);
+                numbfs_check_release(&res);
+                assert(!numbfs_check(&isbi, NULL, &res));
+                assert(!res.nr_problems);
+                numbfs_check_release(&res);
+
+                sprintf(path, "/lost+found/#%d/f", d);
+                assert(!numbfs_lookup_path(&isbi, path, &i) && i == f);
+                ni.nid = f;
+                assert(!numbfs_get_inode(&isbi, &ni));
+                assert(!numbfs_pread_inode_range(&ni, path, 0, sizeof(path)));
+                assert(!memcmp(path, buf, sizeof(path)));
+                assert(!numbfs_get_inode(&isbi, &dir));
+                assert(!numbfs_dir_lookup(&dir, "..", 2, &i, &type) && i == lf);
+                assert(dir.nlink == 3);
+
+                sprintf(path, "/lost+found/#%d", g);
+                assert(!numbfs_lookup_path(&isbi, path, &i) && i == g);
+                ni.nid = g;
+                assert(!numbfs_get_inode(&isbi, &ni));
+                assert(ni.nlink == 1 && ni.size == 100);
+                sprintf(path, "/lost+found/#%d", z);
+                assert(numbfs_lookup_path(&isbi, path, &i) == -ENOENT);
+                ni.nid = lf;
+                assert(!numbfs_get_inode(&isbi, &ni));
+                assert(ni.nlink == 3);
+
+                test_close_image(&isbi);
+        }
+        assert(!remove(image));
+}
+
+static void test_check_lazy(void)
+{
+        const char *image = "./numbfs_test_lazy_xxx";
+        const char *opts[] = { "--lazy-itable", NULL };
+        struct numbfs_check_cfg cfg = {
+                .repair = true,
+        };
+        struct numbfs_check_result res;
+        struct numbfs_superblock_info isbi;
+        char buf[BYTES_PER_BLOCK];
+        int nid, bmap;
+
+        test_mkfs(image, 4 << 20, opts);
+        test_open_image(image, &isbi);
+
+        /* an inode allocated past the initialized part of the inode table */
+        nid = isbi.total_inodes - 1;
+        assert(nid / (int)NUMBFS_NODES_PER_BLOCK >= isbi.itable_init);
+        bmap = numbfs_bmap_blk(isbi.ibitmap_start, nid);
+        assert(!numbfs_read_block(&isbi, buf, bmap));
+        buf[numbfs_bmap_byte(nid)] |= 1 << numbfs_bmap_bit(nid);
+        assert(!numbfs_write_block(&isbi, buf, bmap));
+        isbi.free_inodes--;
+        assert(!numbfs_put_superblock(&isbi));
+
+        /* it owns no blocks, only its bit is cleared */
+        assert(!numbfs_check(&isbi, &cfg, &res));
+        assert(res.nr_problems == 1 && res.nr_fixed == 1);
+        assert(test_check_find(&res, NUMBFS_CHECK_IBITMAP, nid, -1, 0, 1));
+        numbfs_check_release(&res);
+        assert(!numbfs_check(&isbi, NULL, &res));
+        assert(!res.nr_problems);
+        numbfs_check_release(&res);
+        assert(!numbfs_read_block(&isbi, buf, bmap));
+        assert(!(buf[numbfs_bmap_byte(nid)] & (1 << numbfs_bmap_bit(nid))));
+
+        test_close_image(&isbi);
+        assert(!remove(image));
+}
+
+static const char *test_json_value(const char *p);
+
+static const char *test_json_space(const char *p)
+{
+        while (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')
+                p++;
+        return p;
+}
+
+/* a string of valid UTF-8 and escapes */
+static const char *test_json_string(const char *p)
+{
+        const unsigned char *s = (const unsigned char*)p;
+        int i, n;
+
+        if (*s++ != '"')
+                return NULL;
+        while (*s != '"') {
+                if (*s < 0x20)
+                        return NULL;
+                if (*s == '\\') {
+                        s++;
+                        if (*s == 'u') {
+                                for (i = 1; i <= 4; i++)
+                                        if (!isxdigit(s[i]))
+                                                return NULL;
+                                s += 5;
+                        } else if (*s && strchr("\"\\/bfnrt", *s)) {
+                                s++;
+                        } else {
+                                return NULL;
+                        }
+                        continue;
+                }
+
+                n = *s < 0x80 ? 0 : *s >= 0xc2 && *s <= 0xdf ? 1 :
+                    *s >= 0xe0 && *s <= 0xef ? 2 : *s >= 0xf0 && *s <= 0xf4 ? 3 : -1;
+                if (n < 0)
+                        return NULL;
+                for (s++; n; n--, s++)
+                        if ((*s & 0xc0) != 0x80)
+                                return NULL;
+        }
+        return (const char*)s + 1;
+}
+
+/* the members of an object with '}' or the elements of an array with ']' */
+static const char *test_json_members(const char *p, char end)
+{
+        p = test_json_space(p + 1);
+        if (*p == end)
+                return p + 1;
+        for (;;) {
+                if (end == '}') {
+                        p = test_json_string(test_json_space(p));
+                        if (!p)
+                                return NULL;
+                        p = test_json_space(p);
+                        if (*p++ != ':')
+                                return NULL;
+                }
+                p = test_json_value(p);
+                if (!p)
+                        return NULL;
+                p = test_json_space(p);
+                if (*p == end)
+                        return p + 1;
+                if (*p++ != ',')
+                        return NULL;
+        }
+}
+
+/* skip a JSON value, NULL if it is malformed */
+static const char *test_json_value(const char *p)
+{
+        p = test_json_space(p);
+        switch (*p) {
+        case '{':
+                return test_json_members(p, '}');
+        case '[':
+                return test_json_members(p, ']');
+        case '"':
+                return test_json_string(p);
+        }
+        if (!strncmp(p, "true", 4) || !strncmp(p, "null", 4))
+                return p + 4;
+        if (!strncmp(p, "false", 5))
+                return p + 5;
+
+        if (*p == '-')
+                p++;
+        if (!isdigit(*p))
+                return NULL;
+        while (isdigit(*p))
+                p++;
+        return p;
+}
+
+static void test_fsck_json(void)
+{
+        const char *image = "./numbfs_test_json_xxx", *out = "./numbfs_test_json_out";
+        const char *argv[] = { fsck_tool, "--format=json", "--check", "--nid=0",
+                               image, NULL };
+        struct numbfs_superblock_info isbi;
+        struct numbfs_inode_info root;
+        char doc[16 * BYTES_PER_BLOCK];
+        const char *end;
+        int i, fd, len, nid;
+
+        test_mkfs(image, FILE_SIZE, NULL);
+        test_open_image(image, &isbi);
+
+        /* a binary value, a name filling its field and names that aren't UTF-8 */
+        root.nid = NUMBFS_ROOT_NID;
+        assert(!numbfs_get_inode(&isbi, &root));
+        assert(!numbfs_setxattr(&root, NUMBFS_XATTR_INDEX_USER, "0123456789abcdef",
+                                "a\0\x80\xff\"z", 6, 0));
+        assert(!numbfs_xattr_flush(&root));
+        for (i = 0; i < 2; i++) {
+                nid = numbfs_empty_inode(&isbi, S_IFREG | 0644);
+                assert(nid > 0);
+                assert(!numbfs_dir_add(&root, i ? "bad\xff\xc3" : "caf\xc3\xa9", 5,
+                                       nid, DT_REG));
+        }
+        assert(!numbfs_put_superblock(&isbi));
+        test_close_image(&isbi);
+
+        assert(!test_run(out, argv));
+        fd = open(out, O_RDONLY);
+        assert(fd >= 0);
+        len = read(fd, doc, sizeof(doc) - 1);
+        assert(len > 0 && len < (int)sizeof(doc) - 1);
+        doc[len] = '\0';
+        close(fd);
+
+        end = test_json_value(doc);
+        assert(end && !*test_json_space(end));
+        assert(strstr(doc, "\"name\": \"0123456789abcdef\""));
+        assert(strstr(doc, "\"value\": \"a\\u0000\\u0080\\u00ff\\\"z\""));
+        assert(strstr(doc, "\"name\": \"caf\xc3\xa9\""));
+        assert(strstr(doc, "\"name\": \"bad\\u00ff\\u00c3\""));
+        assert(strstr(doc, "\"nr_problems\": 0"));
+
+        assert(!remove(out));
+        assert(!remove(image));
+}
+
+int main(int argc, char **argv) {
         const char *filename = "./numbfs_test_file_xxx";
-        int fd = open(filename, O_RDWR | O_CREAT, 0644);
+        int fd;
+
+        if (argc != 3) {
+                fprintf(stderr, "Usage: %s MKFS FSCK\n", argv[0]);
+                return 1;
+        }
+        mkfs_tool = argv[1];
+        fsck_tool = argv[2];
 
+        fd = open(filename, O_RDWR | O_CREAT, 0644);
         assert(fd != -1);
         assert(ftruncate(fd, FILE_SIZE) != -1);
 
@@ -264,10 +2152,40 @@ int main() {
         /* do tests */
         test_hole();
         test_byte_rw();
+        test_range_rw();
+        test_fiemap();
         test_block_management();
+        test_bitmap_weight();
+        test_zero_blocks();
+        test_sparse();
+        test_stage();
+        test_truncate();
         test_inode_management();
         test_timestamps();
+        test_refcount();
+        test_dir_ops();
+        test_dir_index();
+        resize_dir_index(8);
+        /* again with the directory index */
+        test_dir_ops();
+        test_lookup_path();
+        test_dir_compact();
+        test_readdir();
+        test_xattr();
+        test_tstable();
+        test_xattr_share();
+        test_lazy_itable();
+        test_populate();
+        test_archive();
+        test_mkfs_jobs();
+        test_check();
+        test_check_repair();
+        test_check_refcount();
+        test_check_orphans();
+        test_check_lazy();
+        test_fsck_json();
 
+        numbfs_drop_caches(&sbi);
         close(fd);
         assert(remove(filename) == 0);
         return 0;
@@ -28,6 +28,26 @@
 
 #define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
 
+#define EFSCORRUPTED        EUCLEAN     /* the on-disk metadata is inconsistent */
+
+#define ARRAY_SIZE(arr)     (sizeof(arr) / sizeof((arr)[0]))
+
+#define NUMBFS_HASH_SEED    0xcbf29ce484222325ULL
+
+/* 64-bit FNV-1a hash, pass the previous result as @hash to continue */
+static inline unsigned long long numbfs_hash(unsigned long long hash,
+                                             const void *data, int len)
+{
+        const unsigned char *p = data;
+        int i;
+
+        for (i = 0; i < len; i++) {
+                hash ^= p[i];
+                hash *= 0x100000001b3ULL;
+        }
+        return hash;
+}
+
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 /*
  * The host byte order is the same as network byte order,